@@ -0,0 +1,122 @@
+#include "Autotune.h"
+#include <math.h>
+
+void InitAutotune(struct Autotune * autotune, float setpoint, float bias, float amplitude, float hysteresis, uint8_t cycles, float outputMin, float outputMax){
+	autotune->setpoint = setpoint;
+	autotune->amplitude = amplitude;
+	autotune->hysteresis = hysteresis;
+	autotune->outputMin = outputMin;
+	autotune->outputMax = outputMax;
+	autotune->cycles = (cycles > 0) ? cycles : 1;
+
+	autotune->state = AUTOTUNE_RUNNING;
+	autotune->bias = bias;
+	autotune->high = true;
+	autotune->time = 0.0f;
+	autotune->cycleStart = -1.0f;
+	autotune->switchTime = 0.0f;
+	autotune->lowTime = 0.0f;
+	autotune->maximum = -INFINITY;
+	autotune->minimum = INFINITY;
+	autotune->cycle = 0;
+
+	autotune->periodSum = 0.0f;
+	autotune->peakSum = 0.0f;
+
+	autotune->ultimateGain = 0.0f;
+	autotune->ultimatePeriod = 0.0f;
+}
+
+// A cycle from one switch to low to the next, dt the control period
+static void EndCycle(struct Autotune * autotune, float dt){
+	float period = autotune->time - autotune->cycleStart;
+	float highTime = period - autotune->lowTime;
+
+	// Average output of the cycle, it held the setpoint on average
+	autotune->bias += autotune->amplitude * (highTime - autotune->lowTime) / period;
+
+	autotune->cycle++;
+	if(autotune->cycle <= AUTOTUNE_SETTLING_CYCLES)
+		return;
+
+	autotune->periodSum += period;
+	autotune->peakSum += 0.5f * (autotune->maximum - autotune->minimum);
+
+	uint8_t measured = autotune->cycle - AUTOTUNE_SETTLING_CYCLES;
+	if(measured < autotune->cycles)
+		return;
+
+	float peak = autotune->peakSum / measured;
+	if(peak <= autotune->hysteresis){
+		autotune->state = AUTOTUNE_FAILED;
+		return;
+	}
+
+	autotune->ultimateGain = 4.0f * autotune->amplitude / (3.14159265f * sqrtf(peak * peak - autotune->hysteresis * autotune->hysteresis));
+	autotune->ultimatePeriod = autotune->periodSum / measured;
+	autotune->state = (autotune->ultimatePeriod >= AUTOTUNE_MIN_PERIOD_SAMPLES * dt) ? AUTOTUNE_DONE : AUTOTUNE_FAILED;
+}
+
+float UpdateAutotune(struct Autotune * autotune, float measurement, float dt){
+	if(autotune->state != AUTOTUNE_RUNNING)
+		return 0.0f;
+
+	autotune->time += dt;
+	if(autotune->time > AUTOTUNE_TIMEOUT){
+		autotune->state = AUTOTUNE_FAILED;
+		return 0.0f;
+	}
+
+	if(measurement > autotune->maximum)
+		autotune->maximum = measurement;
+	if(measurement < autotune->minimum)
+		autotune->minimum = measurement;
+
+	if(autotune->high && (measurement > autotune->setpoint + autotune->hysteresis)){
+		autotune->high = false;
+
+		if(autotune->cycleStart >= 0.0f){
+			EndCycle(autotune, dt);
+			if(autotune->state != AUTOTUNE_RUNNING)
+				return 0.0f;
+		}
+
+		autotune->cycleStart = autotune->time;
+		autotune->switchTime = autotune->time;
+		autotune->maximum = measurement;
+		autotune->minimum = measurement;
+	}
+	else if((autotune->high == false) && (measurement < autotune->setpoint - autotune->hysteresis)){
+		autotune->high = true;
+		autotune->lowTime = autotune->time - autotune->switchTime;
+		autotune->switchTime = autotune->time;
+	}
+
+	float out = autotune->high ? (autotune->bias + autotune->amplitude) : (autotune->bias - autotune->amplitude);
+	if(out > autotune->outputMax)
+		out = autotune->outputMax;
+	else if(out < autotune->outputMin)
+		out = autotune->outputMin;
+	return out;
+}
+
+void GetAutotuneGains(struct Autotune * autotune, uint8_t rule, float * kp, float * ki, float * kd){
+	float ku = autotune->ultimateGain;
+	float tu = autotune->ultimatePeriod;
+
+	*kd = 0.0f;
+
+	if(rule == AUTOTUNE_ZIEGLER_NICHOLS_PI){
+		*kp = 0.45f * ku;
+		*ki = *kp / (tu / 1.2f);
+	}
+	else if(rule == AUTOTUNE_ZIEGLER_NICHOLS_PID){
+		*kp = 0.6f * ku;
+		*ki = *kp / (0.5f * tu);
+		*kd = *kp * (0.125f * tu);
+	}
+	else{
+		*kp = ku / 3.2f;
+		*ki = *kp / (2.2f * tu);
+	}
+}
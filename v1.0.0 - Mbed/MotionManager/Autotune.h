@@ -0,0 +1,73 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Relay feedback autotune (Astrom-Hagglund)
+// The output switches to bias - amplitude when the measurement rises above
+// setpoint + hysteresis and back to bias + amplitude below setpoint - hysteresis.
+// The loop settles into a limit cycle at the ultimate period Tu, the peak to
+// peak measurement 2a of a cycle gives the ultimate gain
+//   Ku = 4 * amplitude / (pi * sqrt(a^2 - hysteresis^2))
+// The bias moves every cycle until the output is high and low equally long,
+// so it ends at the output that holds the setpoint.
+// The first cycles only settle the oscillation, Ku and Tu are averaged over
+// the following ones. A Tu of fewer than AUTOTUNE_MIN_PERIOD_SAMPLES control
+// periods is a limit cycle of the sampling delay rather than of the plant, the
+// experiment fails with Ku and Tu kept for a faster loop or a wider hysteresis.
+//
+// Gains are continuous (Ki in 1/s, Kd in s), from
+//   AUTOTUNE_TYREUS_LUYBEN_PI   Kp = Ku/3.2,  Ti = 2.2 Tu, little overshoot
+//   AUTOTUNE_ZIEGLER_NICHOLS_PI Kp = 0.45 Ku, Ti = Tu/1.2
+//   AUTOTUNE_ZIEGLER_NICHOLS_PID Kp = 0.6 Ku, Ti = Tu/2, Td = Tu/8
+
+#define AUTOTUNE_RUNNING                0
+#define AUTOTUNE_DONE                   1
+#define AUTOTUNE_FAILED                 2
+
+#define AUTOTUNE_TYREUS_LUYBEN_PI       0
+#define AUTOTUNE_ZIEGLER_NICHOLS_PI     1
+#define AUTOTUNE_ZIEGLER_NICHOLS_PID    2
+
+#define AUTOTUNE_SETTLING_CYCLES        2
+#define AUTOTUNE_MIN_PERIOD_SAMPLES     20      // Control periods per cycle
+#define AUTOTUNE_TIMEOUT                30.0f   // s for the whole experiment
+
+typedef struct Autotune
+{
+	float setpoint;
+	float amplitude;            // Output step above and below the bias
+	float hysteresis;           // Measurement units, above the noise
+	float outputMin;
+	float outputMax;
+	uint8_t cycles;             // Measured cycles after the settling ones
+
+	uint8_t state;
+	float bias;
+	bool high;                  // Output is bias + amplitude
+	float time;                 // s since the start
+	float cycleStart;           // s, last switch to low, negative before it
+	float switchTime;           // s, last switch
+	float lowTime;              // s the output was low in this cycle
+	float maximum;
+	float minimum;
+	uint8_t cycle;              // Completed cycles
+
+	float periodSum;
+	float peakSum;              // Of half the peak to peak measurement
+
+	float ultimateGain;
+	float ultimatePeriod;       // s
+} Autotune;
+
+// Starts the experiment, bias is the output expected to hold the setpoint
+void InitAutotune(struct Autotune * autotune, float setpoint, float bias, float amplitude, float hysteresis, uint8_t cycles, float outputMin, float outputMax);
+
+// Once per control period, returns the output, 0 once it is no longer running
+float UpdateAutotune(struct Autotune * autotune, float measurement, float dt);
+
+// Continuous gains for a rule from a finished experiment
+void GetAutotuneGains(struct Autotune * autotune, uint8_t rule, float * kp, float * ki, float * kd);
+
+#endif
@@ -0,0 +1,10 @@
+#include "Crc16.h"
+
+uint16_t UpdateCrc16(uint16_t crc, uint8_t byte){
+	crc = (uint8_t)(crc >> 8) | (crc << 8);
+	crc ^= byte;
+	crc ^= (uint8_t)(crc & 0xFF) >> 4;
+	crc ^= crc << 12;
+	crc ^= (crc & 0xFF) << 5;
+	return crc;
+}
@@ -0,0 +1,11 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include "stm32f3xx_hal.h"
+
+// CRC16-CCITT (XMODEM), polynomial 0x1021 from 0, bytewise without a table
+// Shared by the serial protocol frames and the flash store records
+
+uint16_t UpdateCrc16(uint16_t crc, uint8_t byte);
+
+#endif
@@ -0,0 +1,110 @@
+#include "DataLog.h"
+#include <string.h>
+#include <stddef.h>
+
+// Every layout must fit one sector
+typedef char DataLogHeaderSize[(sizeof(DataLogHeader) <= DATALOG_SECTOR_SIZE) ? 1 : -1];
+typedef char DataLogBlockSize[(sizeof(DataLogBlock) <= DATALOG_SECTOR_SIZE) ? 1 : -1];
+typedef char DataLogSectorSize[(sizeof(DataLogSector) == DATALOG_SECTOR_SIZE) ? 1 : -1];
+
+static void AddField(struct DataLogHeader * header, const char * name, uint8_t type, uint8_t offset, uint8_t size){
+	DataLogField * field = &header->fields[header->fieldCount++];
+
+	strncpy(field->name, name, DATALOG_NAME_SIZE - 1);
+	field->type = type;
+	field->offset = offset;
+	field->size = size;
+}
+
+void InitDataLog(struct DataLog * log, float sampleFrequency, float timeFrequency){
+	memset(log, 0, sizeof(*log));
+
+	DataLogHeader * header = &log->sectors[0].header;
+	memcpy(header->magic, "MMLG", 4);
+	header->version = DATALOG_VERSION;
+	header->sectorSize = DATALOG_SECTOR_SIZE;
+	header->sampleSize = sizeof(TelemetrySample);
+	header->samplesPerSector = DATALOG_SAMPLES_PER_SECTOR;
+	header->sampleFrequency = sampleFrequency;
+	header->timeFrequency = timeFrequency;
+
+	AddField(header, "time", DATALOG_UINT32, offsetof(TelemetrySample, time), 4);
+	AddField(header, "counts", DATALOG_INT16, offsetof(TelemetrySample, encoderDelta), 2);
+	AddField(header, "pwm", DATALOG_INT16, offsetof(TelemetrySample, pwm), 2);
+	AddField(header, "rpm", DATALOG_FLOAT, offsetof(TelemetrySample, rpm), 4);
+	AddField(header, "error", DATALOG_FLOAT, offsetof(TelemetrySample, error), 4);
+	AddField(header, "integral", DATALOG_FLOAT, offsetof(TelemetrySample, integral), 4);
+
+	// Header goes first, samples start in the other sector
+	log->full[0] = true;
+	log->fill = 1;
+	log->write = 0;
+}
+
+bool AddDataLogSetting(struct DataLog * log, const char * name, float value){
+	DataLogHeader * header = &log->sectors[0].header;
+
+	if(header->settingCount >= DATALOG_MAX_SETTINGS)
+		return false;
+
+	DataLogSetting * setting = &header->settings[header->settingCount++];
+	strncpy(setting->name, name, DATALOG_NAME_SIZE - 1);
+	setting->value = value;
+	return true;
+}
+
+bool AddDataLogSample(struct DataLog * log, const struct TelemetrySample * sample, uint32_t dropped){
+	uint8_t fill = log->fill;
+
+	// Card behind by a whole sector
+	if(log->full[fill]){
+		log->dropped++;
+		return false;
+	}
+
+	DataLogBlock * block = &log->sectors[fill].block;
+
+	// New block, started when its first sample arrives
+	if(block->count == 0){
+		memset(&log->sectors[fill], 0, DATALOG_SECTOR_SIZE);
+		block->sequence = log->sequence++;
+		block->dropped = dropped + log->dropped;
+	}
+
+	block->samples[block->count++] = *sample;
+
+	if(block->count >= DATALOG_SAMPLES_PER_SECTOR){
+		log->full[fill] = true;
+		log->fill = fill ^ 1;
+	}
+	return true;
+}
+
+void FlushDataLog(struct DataLog * log){
+	uint8_t fill = log->fill;
+
+	if((log->full[fill] == false) && (log->sectors[fill].block.count != 0)){
+		log->full[fill] = true;
+		log->fill = fill ^ 1;
+	}
+}
+
+DataLogSector * GetDataLogSector(struct DataLog * log){
+	return log->full[log->write] ? &log->sectors[log->write] : NULL;
+}
+
+uint8_t GetDataLogSectorCount(struct DataLog * log){
+	if(log->full[log->write] == false)
+		return 0;
+
+	return ((log->write == 0) && log->full[1]) ? 2 : 1;
+}
+
+void ReleaseDataLogSector(struct DataLog * log){
+	uint8_t write = log->write;
+
+	log->sectors[write].block.count = 0;
+	log->full[write] = false;
+	log->write = write ^ 1;
+	log->written++;
+}
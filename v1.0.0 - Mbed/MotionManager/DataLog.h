@@ -0,0 +1,119 @@
+#ifndef DATALOG_H
+#define DATALOG_H
+
+#include "stm32f3xx_hal.h"
+#include "Telemetry.h"
+#include <stdbool.h>
+
+// Run log of telemetry samples in 512 byte sectors for the SD card
+// The first sector is a header with the sample schema and a snapshot of the
+// settings, every following one a block of samples. Sectors are written whole,
+// so the FAT file system passes them to the card without another copy.
+//
+// Two sector buffers: samples fill one while the other waits for the card. If
+// the card is still busy with the other when one fills up, new samples are
+// dropped and counted, the producer never waits.
+//
+// File layout, little endian:
+//   Header   "MMLG", version, sector and sample size, samples per sector,
+//            sample frequency (Hz), time frequency (Hz of the time field),
+//            fields {name, type, offset, size}, settings {name, float value}
+//   Block    sequence (from 0), sample count, samples lost before the block
+//            (telemetry ring and log), samples (unused ones are 0)
+
+#define DATALOG_SECTOR_SIZE         512
+#define DATALOG_VERSION             1
+#define DATALOG_NAME_SIZE           12      // With the terminating 0
+#define DATALOG_MAX_FIELDS          6
+#define DATALOG_MAX_SETTINGS        24
+#define DATALOG_SAMPLES_PER_SECTOR  ((DATALOG_SECTOR_SIZE - 12) / sizeof(TelemetrySample))
+
+// Field types
+#define DATALOG_UINT32              0
+#define DATALOG_INT16               1
+#define DATALOG_FLOAT               2
+
+typedef struct DataLogField
+{
+	char name[DATALOG_NAME_SIZE];
+	uint8_t type;
+	uint8_t offset;             // Bytes from the start of a sample
+	uint8_t size;
+	uint8_t reserved;
+} DataLogField;
+
+typedef struct DataLogSetting
+{
+	char name[DATALOG_NAME_SIZE];
+	float value;
+} DataLogSetting;
+
+typedef struct DataLogHeader
+{
+	char magic[4];              // "MMLG"
+	uint16_t version;
+	uint16_t sectorSize;
+	uint16_t sampleSize;
+	uint8_t samplesPerSector;
+	uint8_t fieldCount;
+	uint8_t settingCount;
+	uint8_t reserved[3];
+	float sampleFrequency;      // Hz, control loop
+	float timeFrequency;        // Hz, ticks of the time field
+	DataLogField fields[DATALOG_MAX_FIELDS];
+	DataLogSetting settings[DATALOG_MAX_SETTINGS];
+} DataLogHeader;
+
+typedef struct DataLogBlock
+{
+	uint32_t sequence;
+	uint16_t count;
+	uint16_t reserved;
+	uint32_t dropped;
+	TelemetrySample samples[DATALOG_SAMPLES_PER_SECTOR];
+} DataLogBlock;
+
+typedef union DataLogSector
+{
+	uint8_t bytes[DATALOG_SECTOR_SIZE];
+	DataLogHeader header;
+	DataLogBlock block;
+} DataLogSector;
+
+typedef struct DataLog
+{
+	DataLogSector sectors[2];
+	bool full[2];               // Waiting for the card
+	uint8_t fill;               // Sector the samples go to
+	uint8_t write;              // Next sector to the card
+
+	uint32_t sequence;          // Of the next block
+	uint32_t dropped;           // Samples lost with both sectors full
+	uint32_t written;           // Sectors released after writing
+} DataLog;
+
+// Header with the sample schema in the first sector, ready to be written
+void InitDataLog(struct DataLog * log, float sampleFrequency, float timeFrequency);
+
+// Setting for the header snapshot, before the header is written
+// False if the header is full
+bool AddDataLogSetting(struct DataLog * log, const char * name, float value);
+
+// Sample to the filling sector, dropped is the count lost before the log
+// (telemetry ring) for the block header. False if both sectors are full.
+bool AddDataLogSample(struct DataLog * log, const struct TelemetrySample * sample, uint32_t dropped);
+
+// Partly filled sector ready to be written, at the end of a run
+void FlushDataLog(struct DataLog * log);
+
+// Next full sector in file order, NULL if none
+DataLogSector * GetDataLogSector(struct DataLog * log);
+
+// Full sectors from GetDataLogSector on that follow it in memory, 0 to 2
+// Written with one call, the card gets them as one multiple block write
+uint8_t GetDataLogSectorCount(struct DataLog * log);
+
+// Sector from GetDataLogSector written, it is free for samples again
+void ReleaseDataLogSector(struct DataLog * log);
+
+#endif
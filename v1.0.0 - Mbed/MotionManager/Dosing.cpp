@@ -0,0 +1,90 @@
+#include "Dosing.h"
+#include <math.h>
+
+void InitDosing(struct Dosing * dosing, float mlPerRev, float countsPerRev, float rpm, float deceleration, float creepRpm, float learning){
+	dosing->mlPerRev = mlPerRev;
+	dosing->mlPerCount = (countsPerRev > 0.0f) ? (mlPerRev / countsPerRev) : 0.0f;
+	dosing->rpm = rpm;
+	dosing->deceleration = deceleration;
+	dosing->creepRpm = fminf(creepRpm, rpm);
+	dosing->learning = learning;
+}
+
+bool StartDosing(struct Dosing * dosing, float target){
+	if(!(target > 0.0f) || !(dosing->mlPerCount > 0.0f) || DosingActive(dosing))
+		return false;
+
+	dosing->state = DOSING_RUNNING;
+	dosing->target = target;
+	dosing->counts = 0;
+	dosing->cutCounts = 0;
+	dosing->stillTime = 0.0f;
+	dosing->time = 0.0f;
+	dosing->aborted = false;
+	return true;
+}
+
+void ResetDosing(struct Dosing * dosing){
+	dosing->state = DOSING_IDLE;
+	dosing->counts = 0;
+	dosing->cutCounts = 0;
+	dosing->stillTime = 0.0f;
+	dosing->time = 0.0f;
+	dosing->aborted = false;
+}
+
+void AbortDosing(struct Dosing * dosing, bool immediate){
+	if(DosingActive(dosing) == false)
+		return;
+
+	if(dosing->state == DOSING_RUNNING)
+		dosing->cutCounts = dosing->counts;
+	dosing->state = immediate ? DOSING_ABORTED : DOSING_COASTING;
+	dosing->aborted = true;
+}
+
+float UpdateDosing(struct Dosing * dosing, int16_t counts, float dt){
+	if(DosingActive(dosing) == false)
+		return 0.0f;
+
+	dosing->counts += counts;
+	dosing->time += dt;
+	float volume = (float)dosing->counts * dosing->mlPerCount;
+
+	if(dosing->state == DOSING_COASTING){
+		dosing->stillTime = (counts == 0) ? (dosing->stillTime + dt) : 0.0f;
+		if(dosing->stillTime < DOSING_STOP_TIME)
+			return 0.0f;
+
+		// Stands, its overrun past the cut point for the next dose
+		dosing->state = dosing->aborted ? DOSING_ABORTED : DOSING_DONE;
+		if(dosing->aborted == false){
+			float coast = volume - (dosing->target - dosing->coastVolume);
+			dosing->coastVolume += dosing->learning * (coast - dosing->coastVolume);
+			if(dosing->coastVolume < 0.0f)
+				dosing->coastVolume = 0.0f;
+		}
+		return 0.0f;
+	}
+
+	// Cut where the coast makes up the rest
+	float left = dosing->target - dosing->coastVolume - volume;
+	if(left <= 0.0f){
+		dosing->state = DOSING_COASTING;
+		dosing->cutCounts = dosing->counts;
+		return 0.0f;
+	}
+
+	// Braking at deceleration reaches the creep speed at the cut
+	float creep = dosing->creepRpm;
+	float braking = sqrtf(creep * creep + 120.0f * dosing->deceleration * left / dosing->mlPerRev);
+	return fminf(dosing->rpm, braking);
+}
+
+float GetDosedVolume(struct Dosing * dosing){
+	return (float)dosing->counts * dosing->mlPerCount;
+}
+
+bool DosingActive(struct Dosing * dosing){
+	return (dosing->state == DOSING_RUNNING) || (dosing->state == DOSING_COASTING);
+}
@@ -0,0 +1,72 @@
+#ifndef DOSING_H
+#define DOSING_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Batch dosing by pump displacement
+// The volume is counted from the motor encoder, counts * ml per rev / counts
+// per rev, so it does not drift like an integrated flow rate estimate. A dose
+// runs the RPM loop at the dosing speed and brakes on the curve that arrives
+// at the creep speed where the motor is cut:
+//   reference = min(rpm, sqrt(creepRpm^2 + 120 * deceleration * revs left))
+// (RPM, RPM/s and motor revs, braking at deceleration over the revs left ends
+// at creepRpm). The cut comes with the coast volume left and the dose is done
+// when no counts came for DOSING_STOP_TIME. The coast volume is what a dose
+// delivers past target - coast volume: the rest of the control period the cut
+// is found in and the run down. Each dose moves it towards its own by the
+// learning factor, so the next one stops closer to its target.
+
+#define DOSING_IDLE                 0
+#define DOSING_RUNNING              1       // RPM loop on the dosing reference
+#define DOSING_COASTING             2       // Motor off, running down
+#define DOSING_DONE                 3
+#define DOSING_ABORTED              4
+
+#define DOSING_STOP_TIME            0.1f    // s without encoder counts
+
+typedef struct Dosing
+{
+	float mlPerRev;             // Displacement, calibrated
+	float mlPerCount;
+	float rpm;                  // Dosing speed
+	float deceleration;         // RPM/s
+	float creepRpm;             // Last part before the cut
+	float learning;             // 0 to 1, share of the last coast taken over
+
+	float coastVolume;          // ml, expected after the cut
+
+	uint8_t state;
+	float target;               // ml
+	int32_t counts;             // Since the start, backward negative
+	int32_t cutCounts;          // At the cut
+	float stillTime;            // s without counts
+	float time;                 // s since the start
+	bool aborted;               // Ends as DOSING_ABORTED, no learning
+} Dosing;
+
+// Settings, the coast volume and the last dose are kept
+void InitDosing(struct Dosing * dosing, float mlPerRev, float countsPerRev, float rpm, float deceleration, float creepRpm, float learning);
+
+// New dose of target ml from the next control period
+// False for a target of 0 or less, without a displacement, or while one runs
+bool StartDosing(struct Dosing * dosing, float target);
+
+// No dose, nothing delivered, the coast volume is kept
+void ResetDosing(struct Dosing * dosing);
+
+// Motor off at once, the volume counts on until the pump stands, or if
+// immediate the dose ends now, running or coasting. No learning from it.
+void AbortDosing(struct Dosing * dosing, bool immediate);
+
+// One control period of dt seconds with the encoder counts since the last,
+// returns the reference RPM, 0 unless running
+float UpdateDosing(struct Dosing * dosing, int16_t counts, float dt);
+
+// ml delivered by the current or last dose
+float GetDosedVolume(struct Dosing * dosing);
+
+// Dose running or coasting
+bool DosingActive(struct Dosing * dosing);
+
+#endif
@@ -0,0 +1,50 @@
+#include "FixedPointPI.h"
+
+static int32_t Saturate(int64_t value){
+	if(value > INT32_MAX)
+		return INT32_MAX;
+	if(value < INT32_MIN)
+		return INT32_MIN;
+	return (int32_t)value;
+}
+
+static int32_t FloatToFixed(float value, uint8_t q){
+	float scaled = value * (float)(1UL << q);
+
+	if(scaled >= 2147483647.0f)
+		return INT32_MAX;
+	if(scaled <= -2147483648.0f)
+		return INT32_MIN;
+	return (int32_t)scaled;
+}
+
+int32_t FloatToQ16(float value){
+	return FloatToFixed(value, FIXED_POINT_PI_Q);
+}
+
+void InitFixedPointPI(struct FixedPointPI * pi, float kp, float ki, float integralMin, float integralMax){
+	pi->kp = FloatToFixed(kp, FIXED_POINT_PI_GAIN_Q);
+	pi->ki = FloatToFixed(ki, FIXED_POINT_PI_GAIN_Q);
+	pi->integralMin = FloatToQ16(integralMin);
+	pi->integralMax = FloatToQ16(integralMax);
+	ResetFixedPointPI(pi);
+}
+
+void ResetFixedPointPI(struct FixedPointPI * pi){
+	pi->integral = 0;
+}
+
+// Q24 x Q16 products are 64 bit (SMULL), shifted back to Q16
+int32_t UpdateFixedPointPI(struct FixedPointPI * pi, int32_t error){
+	int64_t integral = (int64_t)pi->integral + (((int64_t)pi->ki * error) >> FIXED_POINT_PI_GAIN_Q);
+
+	if(integral > pi->integralMax)
+		integral = pi->integralMax;
+	else if(integral < pi->integralMin)
+		integral = pi->integralMin;
+	pi->integral = (int32_t)integral;
+
+	int64_t out = (((int64_t)pi->kp * error) >> FIXED_POINT_PI_GAIN_Q) + integral;
+
+	return Saturate(out) >> FIXED_POINT_PI_Q;
+}
@@ -0,0 +1,35 @@
+#ifndef FIXEDPOINTPI_H
+#define FIXEDPOINTPI_H
+
+#include "stm32f3xx_hal.h"
+
+// PI controller in fixed point, same form as the float loop in main.cpp
+//   integral = clamp(integral + Ki * error, integralMin, integralMax)
+//   out = Kp * error + integral
+// Error, integral and output are Q16 (16 fractional bits, +-32767).
+// Gains are Q24 (up to +-127), so Ki per tick at 2kHz keeps 4 digits.
+// CMSIS-DSP arm_pid_q31 is incremental and can not clamp the integral.
+
+#define FIXED_POINT_PI_Q        16
+#define FIXED_POINT_PI_GAIN_Q   24
+
+typedef struct FixedPointPI
+{
+	int32_t kp;             // Q24
+	int32_t ki;             // Q24, per control period
+	int32_t integral;       // Q16
+	int32_t integralMin;    // Q16
+	int32_t integralMax;    // Q16
+} FixedPointPI;
+
+void InitFixedPointPI(struct FixedPointPI * pi, float kp, float ki, float integralMin, float integralMax);
+
+void ResetFixedPointPI(struct FixedPointPI * pi);
+
+// One control period, error in Q16, returns the output rounded down to an integer
+int32_t UpdateFixedPointPI(struct FixedPointPI * pi, int32_t error);
+
+// Saturating float to Q16 conversion
+int32_t FloatToQ16(float value);
+
+#endif
@@ -0,0 +1,246 @@
+#include "FlashStore.h"
+#include "Crc16.h"
+#include <string.h>
+
+#define FLASH_STORE_MAGIC           0x534D  // "MS"
+
+static uint16_t ReadHalfWord(uintptr_t address){
+	return *(const volatile uint16_t *)address;
+}
+
+static bool ProgramHalfWord(uintptr_t address, uint16_t data){
+	return HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, data) == HAL_OK;
+}
+
+// CRC16 of half words, low byte first
+static uint16_t Crc16(const uint16_t * words, uint8_t count){
+	uint16_t crc = 0;
+	for(uint8_t i = 0; i < count; i++){
+		crc = UpdateCrc16(crc, words[i] & 0xFF);
+		crc = UpdateCrc16(crc, words[i] >> 8);
+	}
+	return crc;
+}
+
+static uintptr_t RecordAddress(struct FlashStore * store, uint8_t page, uint32_t record){
+	return store->pages[page] + FLASH_STORE_HEADER_SIZE + record * FLASH_STORE_RECORD_SIZE;
+}
+
+static bool ReadHeader(struct FlashStore * store, uint8_t page, uint16_t * sequence){
+	uint16_t words[4];
+	for(uint8_t i = 0; i < 4; i++)
+		words[i] = ReadHalfWord(store->pages[page] + i * 2);
+
+	*sequence = words[1];
+	return (words[0] == FLASH_STORE_MAGIC) && (words[3] == Crc16(words, 3));
+}
+
+static bool WriteHeader(struct FlashStore * store, uint8_t page, uint16_t sequence){
+	uint16_t words[4] = { FLASH_STORE_MAGIC, sequence, 0xFFFF, 0 };
+	words[3] = Crc16(words, 3);
+
+	uintptr_t address = store->pages[page];
+	return ProgramHalfWord(address, words[0]) && ProgramHalfWord(address + 2, words[1])
+	       && ProgramHalfWord(address + 6, words[3]);
+}
+
+static bool RecordFree(struct FlashStore * store, uint8_t page, uint32_t record){
+	uintptr_t address = RecordAddress(store, page, record);
+	for(uint8_t i = 0; i < 4; i++){
+		if(ReadHalfWord(address + i * 2) != 0xFFFF)
+			return false;
+	}
+	return true;
+}
+
+static bool ReadRecord(struct FlashStore * store, uint8_t page, uint32_t record, uint16_t * key, float * value){
+	uintptr_t address = RecordAddress(store, page, record);
+	uint16_t words[4];
+	for(uint8_t i = 0; i < 4; i++)
+		words[i] = ReadHalfWord(address + i * 2);
+
+	if((words[0] == FLASH_STORE_FREE_KEY) || (words[3] != Crc16(words, 3)))
+		return false;
+
+	uint32_t bits = words[1] | ((uint32_t)words[2] << 16);
+	*key = words[0];
+	memcpy(value, &bits, sizeof(bits));
+	return true;
+}
+
+static bool ProgramRecord(struct FlashStore * store, uint8_t page, uint32_t record, uint16_t key, float value){
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	uint16_t words[4] = { key, (uint16_t)bits, (uint16_t)(bits >> 16), 0 };
+	words[3] = Crc16(words, 3);
+
+	// CRC last, a record cut short never passes
+	uintptr_t address = RecordAddress(store, page, record);
+	for(uint8_t i = 0; i < 4; i++){
+		if(ProgramHalfWord(address + i * 2, words[i]) == false)
+			return false;
+	}
+	return true;
+}
+
+static bool PageErased(struct FlashStore * store, uint8_t page){
+	uint32_t size = FLASH_STORE_HEADER_SIZE + store->records * FLASH_STORE_RECORD_SIZE;
+	for(uint32_t offset = 0; offset < size; offset += 2){
+		if(ReadHalfWord(store->pages[page] + offset) != 0xFFFF)
+			return false;
+	}
+	return true;
+}
+
+static bool ErasePage(struct FlashStore * store, uint8_t page){
+	if(PageErased(store, page))
+		return true;
+
+	FLASH_EraseInitTypeDef erase;
+	uint32_t error = 0;
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = store->pages[page];
+	erase.NbPages = 1;
+
+	store->erases++;
+	return HAL_FLASHEx_Erase(&erase, &error) == HAL_OK;
+}
+
+void InitFlashStore(struct FlashStore * store, uintptr_t page0, uintptr_t page1, uint32_t pageSize){
+	store->pages[0] = page0;
+	store->pages[1] = page1;
+	store->records = (pageSize - FLASH_STORE_HEADER_SIZE) / FLASH_STORE_RECORD_SIZE;
+	store->active = FLASH_STORE_NONE;
+	store->sequence = 0;
+	store->end = 0;
+	store->writes = 0;
+	store->erases = 0;
+	store->corrupt = 0;
+
+	uint16_t sequence[2];
+	bool valid[2];
+	for(uint8_t page = 0; page < 2; page++)
+		valid[page] = ReadHeader(store, page, &sequence[page]);
+
+	if(valid[0] && valid[1])
+		store->active = ((int16_t)(sequence[1] - sequence[0]) > 0) ? 1 : 0;
+	else if(valid[0] || valid[1])
+		store->active = valid[0] ? 0 : 1;
+	else
+		return;
+
+	store->sequence = sequence[store->active];
+
+	// Copy of a compaction cut short, or the old page if only its erase was
+	uint8_t other = store->active ^ 1;
+	if(PageErased(store, other) == false){
+		HAL_FLASH_Unlock();
+		ErasePage(store, other);
+		HAL_FLASH_Lock();
+	}
+
+	while((store->end < store->records) && (RecordFree(store, store->active, store->end) == false)){
+		uint16_t key;
+		float value;
+		if(ReadRecord(store, store->active, store->end, &key, &value) == false)
+			store->corrupt++;
+		store->end++;
+	}
+}
+
+bool ReadFlashRecord(struct FlashStore * store, uint16_t key, float * value){
+	if(store->active == FLASH_STORE_NONE)
+		return false;
+
+	for(uint32_t record = store->end; record-- != 0;){
+		uint16_t recordKey;
+		if(ReadRecord(store, store->active, record, &recordKey, value) && (recordKey == key))
+			return true;
+	}
+	return false;
+}
+
+bool WriteFlashRecord(struct FlashStore * store, uint16_t key, float value){
+	float last;
+	if(ReadFlashRecord(store, key, &last) && (memcmp(&last, &value, sizeof(value)) == 0))
+		return true;
+
+	if((store->active != FLASH_STORE_NONE) && (store->end >= store->records))
+		return false;
+
+	HAL_FLASH_Unlock();
+
+	// First write, page 0 becomes the store
+	bool written = true;
+	if(store->active == FLASH_STORE_NONE){
+		written = ErasePage(store, 0) && WriteHeader(store, 0, 0);
+		if(written){
+			store->active = 0;
+			store->sequence = 0;
+			store->end = 0;
+		}
+	}
+
+	if(written){
+		written = ProgramRecord(store, store->active, store->end, key, value);
+		store->end++;
+		store->writes++;
+	}
+
+	HAL_FLASH_Lock();
+	return written;
+}
+
+bool CompactFlashStore(struct FlashStore * store){
+	if(store->active == FLASH_STORE_NONE)
+		return true;
+
+	uint8_t from = store->active;
+	uint8_t to = from ^ 1;
+	uint32_t copied = 0;
+
+	HAL_FLASH_Unlock();
+	bool done = ErasePage(store, to);
+
+	for(uint32_t record = 0; done && (record < store->end); record++){
+		uint16_t key;
+		float value;
+		if(ReadRecord(store, from, record, &key, &value) == false)
+			continue;
+
+		// Only the last record of a key
+		bool last = true;
+		for(uint32_t later = record + 1; later < store->end; later++){
+			uint16_t laterKey;
+			float laterValue;
+			if(ReadRecord(store, from, later, &laterKey, &laterValue) && (laterKey == key)){
+				last = false;
+				break;
+			}
+		}
+
+		if(last)
+			done = ProgramRecord(store, to, copied++, key, value);
+	}
+
+	// Valid once complete, then the old page goes
+	uint16_t sequence = store->sequence + 1;
+	done = done && WriteHeader(store, to, sequence);
+	if(done){
+		store->active = to;
+		store->sequence = sequence;
+		store->end = copied;
+		store->writes += copied;
+		done = ErasePage(store, from);
+	}
+
+	HAL_FLASH_Lock();
+	return done;
+}
+
+uint32_t FreeFlashRecords(struct FlashStore * store){
+	if(store->active == FLASH_STORE_NONE)
+		return store->records;
+	return store->records - store->end;
+}
@@ -0,0 +1,62 @@
+#ifndef FLASHSTORE_H
+#define FLASHSTORE_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Key/value store in two pages of the internal flash
+// Records are appended to the active page, the last one of a key counts. A
+// full page is compacted into the other one (the last record of every key),
+// then erased, so the pages take turns and each erase frees the page for
+// about 250 writes.
+//
+// Every record and page header carries a CRC16. A record cut short by a
+// power loss fails it and is skipped, a compaction cut short leaves the old
+// page in use with a newer copy that is not marked valid yet.
+//
+// Programming a half word stalls code running from flash for about 50us, a
+// page erase for 20 to 40ms, interrupts included. Compact only while no
+// control loop runs.
+//
+// Layout, little endian half words:
+//   Header   magic "MS", sequence (newer page is higher), 0xFFFF, CRC16
+//   Record   key, value (float, low half word first), CRC16
+
+#define FLASH_STORE_HEADER_SIZE     8
+#define FLASH_STORE_RECORD_SIZE     8
+#define FLASH_STORE_NONE            0xFF    // No page in use yet
+#define FLASH_STORE_FREE_KEY        0xFFFF  // Erased flash, not a key
+
+typedef struct FlashStore
+{
+	uintptr_t pages[2];         // Page start addresses
+	uint32_t records;           // Per page
+
+	uint8_t active;             // Page with the records
+	uint16_t sequence;          // Of the active page
+	uint32_t end;               // First free record of the active page
+
+	// Statistics
+	uint32_t writes;
+	uint32_t erases;
+	uint32_t corrupt;           // Records with a bad CRC found
+} FlashStore;
+
+// Finds the page in use and the end of its records, a compaction cut short
+// is undone (erases the unfinished page)
+void InitFlashStore(struct FlashStore * store, uintptr_t page0, uintptr_t page1, uint32_t pageSize);
+
+// Last value of the key, false if none
+bool ReadFlashRecord(struct FlashStore * store, uint16_t key, float * value);
+
+// Appends the value if it differs from the last one of the key
+// False if the page is full (compact first) or programming failed
+bool WriteFlashRecord(struct FlashStore * store, uint16_t key, float value);
+
+// Last record of every key to the other page, the full one is erased
+// False if the flash could not be programmed or erased
+bool CompactFlashStore(struct FlashStore * store);
+
+uint32_t FreeFlashRecords(struct FlashStore * store);
+
+#endif
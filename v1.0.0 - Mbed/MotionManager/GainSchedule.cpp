@@ -0,0 +1,47 @@
+#include "GainSchedule.h"
+#include <math.h>
+
+void ClearGainSchedule(struct GainSchedule * schedule){
+	schedule->count = 0;
+}
+
+bool AddGainSchedulePoint(struct GainSchedule * schedule, float rpm, float kp, float ki, float kd){
+	if(schedule->count >= GAIN_SCHEDULE_POINTS)
+		return false;
+	if((schedule->count > 0) && (rpm <= schedule->rpm[schedule->count - 1]))
+		return false;
+
+	uint8_t i = schedule->count++;
+	schedule->rpm[i] = rpm;
+	schedule->kp[i] = kp;
+	schedule->ki[i] = ki;
+	schedule->kd[i] = kd;
+	return true;
+}
+
+bool GetScheduledGains(struct GainSchedule * schedule, float rpm, float * kp, float * ki, float * kd){
+	uint8_t count = schedule->count;
+	if(count == 0)
+		return false;
+
+	float speed = fabsf(rpm);
+
+	// First point above the speed, the last one holds beyond it
+	uint8_t i = 0;
+	while((i < count) && (schedule->rpm[i] <= speed))
+		i++;
+
+	if((i == 0) || (i == count)){
+		uint8_t held = (i == 0) ? 0 : count - 1;
+		*kp = schedule->kp[held];
+		*ki = schedule->ki[held];
+		*kd = schedule->kd[held];
+		return true;
+	}
+
+	float t = (speed - schedule->rpm[i - 1]) / (schedule->rpm[i] - schedule->rpm[i - 1]);
+	*kp = schedule->kp[i - 1] + t * (schedule->kp[i] - schedule->kp[i - 1]);
+	*ki = schedule->ki[i - 1] + t * (schedule->ki[i] - schedule->ki[i - 1]);
+	*kd = schedule->kd[i - 1] + t * (schedule->kd[i] - schedule->kd[i - 1]);
+	return true;
+}
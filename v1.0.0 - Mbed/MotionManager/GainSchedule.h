@@ -0,0 +1,31 @@
+#ifndef GAINSCHEDULE_H
+#define GAINSCHEDULE_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// PID gains over the RPM range
+// Points are in ascending RPM order, gains between two points are linearly
+// interpolated and held beyond the first and the last one. Reverse RPMs use
+// the gains of their speed.
+
+#define GAIN_SCHEDULE_POINTS    8
+
+typedef struct GainSchedule
+{
+	float rpm[GAIN_SCHEDULE_POINTS];
+	float kp[GAIN_SCHEDULE_POINTS];
+	float ki[GAIN_SCHEDULE_POINTS];
+	float kd[GAIN_SCHEDULE_POINTS];
+	uint8_t count;
+} GainSchedule;
+
+void ClearGainSchedule(struct GainSchedule * schedule);
+
+// False if full or not above the last point's RPM
+bool AddGainSchedulePoint(struct GainSchedule * schedule, float rpm, float kp, float ki, float kd);
+
+// False without points, the gains are then unchanged
+bool GetScheduledGains(struct GainSchedule * schedule, float rpm, float * kp, float * ki, float * kd);
+
+#endif
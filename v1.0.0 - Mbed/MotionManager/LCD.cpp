@@ -1,70 +1,162 @@
 #include "LCD.h"
 #include "mbed.h"
 
-void InitLcdSPI(struct LCD * lcd, SPI_HandleTypeDef * spi){
+void InitLcdSPI(struct LCD * lcd, SPI_HandleTypeDef * spi, TIM_HandleTypeDef * timer, struct SpiBus * bus, uint8_t busDevice){
 	lcd->SPI = spi;
+	lcd->timer = timer;
+	lcd->bus = bus;
+	lcd->busDevice = busDevice;
+	
+	lcd->queueHead = 0;
+	lcd->queueTail = 0;
+	lcd->queueHighWater = 0;
+	lcd->queueBusy = false;
+	
+	memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+	memset(lcd->ddramDirty, 0, sizeof(lcd->ddramDirty));
+	lcd->gdramVertical = 0;
+	lcd->gdramByte = 0;
+	lcd->ddramByte = 0;
+	lcd->graphicsMode = false;
+	
+	// GDRAM content is random after power up
+	memset(lcd->gdram, 0, sizeof(lcd->gdram));
+	InvalidateDisplay(lcd);
 }
 
 void SpiWrite(SPI_HandleTypeDef * spi, uint8_t txData){
 	HAL_SPI_Transmit(spi, &txData, sizeof(uint8_t), 100);
 }
 
-void WriteInstruction(struct LCD * lcd, uint8_t Command)
-{
+/* Command Queue **************************************************************/
+
+// Send the frame at the tail of the queue
+static void StartNextFrame(struct LCD * lcd){
+	lcd->queueBusy = true;
+	HAL_SPI_Transmit_DMA(lcd->SPI, lcd->queue[lcd->queueTail], 3);
+}
+
+// Encode a serial frame into the queue and start the engine if it is idle
+// If the SD card has the bus the engine starts once it is granted
+// Waits for a free slot if the queue is full
+static void QueueFrame(struct LCD * lcd, uint8_t syncBitString, uint8_t data){
+	uint16_t next = (lcd->queueHead + 1) & (LCD_QUEUE_SIZE - 1);
+	
+	// Queue full, the engine frees one slot per 72us
+	while(next == lcd->queueTail);
+	
+	uint8_t * frame = lcd->queue[lcd->queueHead];
+	
 	// Synchronizing Bit string
-	// 1 1 1 1 1 0 0 0
-	uint8_t syncBitString = 0xf8;
-	SpiWrite(lcd->SPI, syncBitString);
-	//HAL_SPI_Transmit(&hspi1, &syncBitString, sizeof(uint8_t), 100);
+	// 1 1 1 1 1 RW RS 0
+	frame[0] = syncBitString;
 	
 	// High Data
 	// D7 D6 D5 D4 0 0 0 0
-	uint8_t highData = (Command & 0xf0);
-	SpiWrite(lcd->SPI, highData);
-	//HAL_SPI_Transmit(&hspi1, &highData, sizeof(highData), 100);
+	frame[1] = (data & 0xf0);
 	
 	//Low Data
 	// D3 D2 D1 D0 0 0 0 0
-	uint8_t lowData = Command << 4;
-	SpiWrite(lcd->SPI, lowData);
-	//HAL_SPI_Transmit(&hspi1, &lowData, sizeof(lowData), 100);
+	frame[2] = data << 4;
+	
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	
+	lcd->queueHead = next;
+	
+	uint16_t depth = GetLcdQueueDepth(lcd);
+	if(depth > lcd->queueHighWater)
+		lcd->queueHighWater = depth;
+	
+	if(lcd->queueBusy == false){
+		lcd->queueBusy = true;
+		if(RequestSpiBus(lcd->bus, lcd->busDevice))
+			StartNextFrame(lcd);
+	}
+	
+	__set_PRIMASK(primask);
+}
+
+// DMA finished shifting out the frame, wait for its execution time
+void LcdSpiTxComplete(struct LCD * lcd){
+	uint8_t * frame = lcd->queue[lcd->queueTail];
+	uint16_t executionTime;
 	
 	// Display Clear Execution Time
 	// 1.6ms - 1600us
-	if(Command == DISPLAY_CLEAR){
-		wait_us(1600);
+	if((frame[0] == 0xf8) && ((frame[1] | (frame[2] >> 4)) == DISPLAY_CLEAR)){
+		executionTime = 1600;
 	}
 	// Execution Time of Other Commands
 	// 72us
 	else
 	{
-		wait_us(72);
+		executionTime = 72;
+	}
+	
+	// One-pulse timer, 1 tick per us
+	__HAL_TIM_SET_AUTORELOAD(lcd->timer, executionTime - 1);
+	__HAL_TIM_SET_COUNTER(lcd->timer, 0);
+	__HAL_TIM_CLEAR_FLAG(lcd->timer, TIM_FLAG_UPDATE);
+	__HAL_TIM_ENABLE_IT(lcd->timer, TIM_IT_UPDATE);
+	__HAL_TIM_ENABLE(lcd->timer);
+}
+
+// Execution time of the frame passed, send the next one
+// Frames are whole transactions, a waiting device gets the bus between two
+void LcdTimerElapsed(struct LCD * lcd){
+	__HAL_TIM_DISABLE_IT(lcd->timer, TIM_IT_UPDATE);
+	
+	lcd->queueTail = (lcd->queueTail + 1) & (LCD_QUEUE_SIZE - 1);
+	
+	if(lcd->queueTail == lcd->queueHead){
+		lcd->queueBusy = false;
+		ReleaseSpiBus(lcd->bus, lcd->busDevice);
+	}
+	else if(SpiBusContended(lcd->bus)){
+		ReleaseSpiBus(lcd->bus, lcd->busDevice);
+		// Queued behind it, LcdBusGranted carries on
+		if(RequestSpiBus(lcd->bus, lcd->busDevice))
+			StartNextFrame(lcd);
+	}
+	else
+		StartNextFrame(lcd);
+}
+
+void LcdBusGranted(struct LCD * lcd){
+	if(lcd->queueTail != lcd->queueHead)
+		StartNextFrame(lcd);
+	else{
+		lcd->queueBusy = false;
+		ReleaseSpiBus(lcd->bus, lcd->busDevice);
 	}
 }
 
+uint16_t GetLcdQueueDepth(struct LCD * lcd){
+	return (lcd->queueHead - lcd->queueTail) & (LCD_QUEUE_SIZE - 1);
+}
+
+uint16_t GetLcdQueueHighWater(struct LCD * lcd){
+	return lcd->queueHighWater;
+}
+
+// Block until every queued frame is sent and executed
+void WaitLcdIdle(struct LCD * lcd){
+	while(lcd->queueBusy);
+}
+
+void WriteInstruction(struct LCD * lcd, uint8_t Command)
+{
+	// Synchronizing Bit string
+	// 1 1 1 1 1 0 0 0
+	QueueFrame(lcd, 0xf8, Command);
+}
+
 void WriteRam(struct LCD * lcd, uint8_t data)
 {
 	// Synchronizing Bit string or RS high
 	// 1 1 1 1 1 0 0 0 | 0 0 0 0 0 0 1 0 = 0xfa
-	uint8_t syncBitString = (0xf8 | 0x02);
-	SpiWrite(lcd->SPI, syncBitString);
-	//HAL_SPI_Transmit(lcd->SPI, &syncBitString, sizeof(uint8_t), 100);
-	
-	// High Data
-	// D7 D6 D5 D4 0 0 0 0
-	uint8_t highData = (data & 0xf0);
-	SpiWrite(lcd->SPI, highData);
-	//HAL_SPI_Transmit(&hspi1, &highData, sizeof(highData), 100);
-	
-	//Low Data
-	// D3 D2 D1 D0 0 0 0 0
-	uint8_t lowData = data << 4;
-	SpiWrite(lcd->SPI, lowData);
-	//HAL_SPI_Transmit(&hspi1, &lowData, sizeof(lowData), 100);
-	
-	// Execution Time
-	// 72us
-	wait_us(72);
+	QueueFrame(lcd, (0xf8 | 0x02), data);
 }
 
 void InitDisplay(struct LCD * lcd){
@@ -76,6 +168,7 @@ void InitDisplay(struct LCD * lcd){
 	// RS RW DB7 DB6 DB5 DB4 DB3 DB2 DB1 DB0
 	//  0  0   0   0   1  DL   X  RE   0   0
 	WriteInstruction(lcd, FUNCTION_SET | DATA_LENGTH_DL);
+	WaitLcdIdle(lcd);
 	
 	// Wait 100ms
 	wait_us(100);
@@ -85,6 +178,7 @@ void InitDisplay(struct LCD * lcd){
 	// RS RW DB7 DB6 DB5 DB4 DB3 DB2 DB1 DB0
 	//  0  0   0   0   1  DL   X  RE   0   0
 	WriteInstruction(lcd, FUNCTION_SET | DATA_LENGTH_DL);
+	WaitLcdIdle(lcd);
 	
 	//Wait 37us
 	wait_us(37);
@@ -93,12 +187,14 @@ void InitDisplay(struct LCD * lcd){
 	// RS RW DB7 DB6 DB5 DB4 DB3 DB2 DB1 DB0
 	//  0  0   0   0   0   0   1   D   C   B
 	WriteInstruction(lcd, DISPLAY_CONTROL | DISPLAY_ON_D);
+	WaitLcdIdle(lcd);
 	
 	// Wait 100us
 	wait_us(100);
 	
 	// Display Clear
 	WriteInstruction(lcd, 0x01);
+	WaitLcdIdle(lcd);
 	
 	// Wait 10ms
 	wait_ms(10);
@@ -107,61 +203,197 @@ void InitDisplay(struct LCD * lcd){
 	// RS RW DB7 DB6 DB5 DB4 DB3 DB2 DB1 DB0
 	//  0  0   0   0   0   0   0   1 I/D   S
 	WriteInstruction(lcd, ENTRY_MODE_SET | INCREASE_DECREASE_ID);
+	
+	// Display Clear filled DDRAM with spaces, GDRAM is left untouched
+	memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+	memset(lcd->ddramDirty, 0, sizeof(lcd->ddramDirty));
+	lcd->ddramByte = 0;
+	lcd->graphicsMode = false;
+	InvalidateDisplay(lcd);
 }
 
 void SetGraphicsMode(struct LCD * lcd) {
 	WriteInstruction(lcd, EXTENDED_FUNCTION_SET | DATA_LENGTH_DL);
 	WriteInstruction(lcd, EXTENDED_FUNCTION_SET | DATA_LENGTH_DL | EXTENDED_INSTRUCTION_RE); //RE=1 (Extended funtion set)
 	WriteInstruction(lcd, EXTENDED_FUNCTION_SET | DATA_LENGTH_DL | EXTENDED_INSTRUCTION_RE | GRAPHIC_ON_G);
+	lcd->graphicsMode = true;
 }
 
 void SetTextMode(struct LCD * lcd){
 	// RE=0 (Basic funtion set)
 	WriteInstruction(lcd, FUNCTION_SET | DATA_LENGTH_DL);
+	lcd->graphicsMode = false;
 }
 
+// Fill text row cache with spaces, only the changed cells are sent on flush
+// instead of a 1.6ms DISPLAY_CLEAR
 void ClearScreen(struct LCD * lcd){
-	WriteInstruction(lcd, FUNCTION_SET | DATA_LENGTH_DL); // RE=0 (Basic funtion set)
-	WriteInstruction(lcd, DISPLAY_CLEAR);
+	for (uint8_t address = 0; address < 32; address++) {
+		SetDDRAMAddress(lcd, address);
+		WriteDDRAM(lcd, ' ');
+		WriteDDRAM(lcd, ' ');
+	}
+	lcd->ddramByte = 0;
 }
 
 void ReturnHome(struct LCD * lcd){
 	WriteInstruction(lcd, FUNCTION_SET | DATA_LENGTH_DL); //RE=0 (Basic funtion set)
 	WriteInstruction(lcd, RETURN_HOME);
+	lcd->graphicsMode = false;
+	lcd->ddramByte = 0;
 }
 
 void Standby(struct LCD * lcd){
 	WriteInstruction(lcd, EXTENDED_FUNCTION_SET | DATA_LENGTH_DL | EXTENDED_INSTRUCTION_RE); //RE=1 (Extended funtion set)
 	WriteInstruction(lcd, STANDBY);
+	lcd->graphicsMode = true;
+}
+
+/* Shadow Framebuffer *********************************************************/
+
+// DDRAM address bits [4:3] to text row
+// 0x80 -> Row 0, 0x88 -> Row 2, 0x90 -> Row 1, 0x98 -> Row 3
+static const uint8_t ddramRow[4] = {0, 2, 1, 3};
+
+// Set GDRAM address counter of the shadow framebuffer
+// vertical: 0-31, horizontal: 0-15 (8-15 is the lower half of the screen)
+void SetGDRAMAddress(struct LCD * lcd, uint8_t vertical, uint8_t horizontal){
+	lcd->gdramVertical = vertical & 0x1F;
+	lcd->gdramByte = (horizontal & 0x0F) << 1;
 }
 
+// Write a byte to the shadow framebuffer and advance the address counter
+void WriteGDRAM(struct LCD * lcd, uint8_t data){
+	uint8_t horizontal = lcd->gdramByte >> 1;
+	uint8_t row = lcd->gdramVertical + ((horizontal & 0x08) ? 32 : 0);
+	uint8_t column = ((horizontal & 0x07) << 1) | (lcd->gdramByte & 0x01);
+	
+	if (lcd->gdram[row][column] != data) {
+		lcd->gdram[row][column] = data;
+		lcd->gdramDirty[row] |= (1 << (column >> 1));
+	}
+	
+	// Horizontal address wraps around on the same line
+	lcd->gdramByte = (lcd->gdramByte + 1) & 0x1F;
+}
+
+// Set DDRAM address counter of the text row cache, address: 0-31
+void SetDDRAMAddress(struct LCD * lcd, uint8_t address){
+	lcd->ddramByte = (address & 0x1F) << 1;
+}
+
+// Write a character to the text row cache and advance the address counter
+void WriteDDRAM(struct LCD * lcd, uint8_t data){
+	// Out of the visible DDRAM
+	if (lcd->ddramByte >= 64)
+		return;
+	
+	uint8_t address = lcd->ddramByte >> 1;
+	uint8_t row = ddramRow[address >> 3];
+	uint8_t column = ((address & 0x07) << 1) | (lcd->ddramByte & 0x01);
+	
+	if (lcd->ddram[row][column] != data) {
+		lcd->ddram[row][column] = data;
+		lcd->ddramDirty[row] |= (1 << (column >> 1));
+	}
+	
+	lcd->ddramByte++;
+}
+
+// Panel content is unknown, resend the whole framebuffer on next flush
+void InvalidateDisplay(struct LCD * lcd){
+	memset(lcd->gdramDirty, 0xFF, sizeof(lcd->gdramDirty));
+}
+
+// Send the changed GDRAM words and DDRAM cells to the panel
+// Consecutive words share one address instruction, since the address counter
+// increases after every 16-bit write
+void FlushDisplay(struct LCD * lcd){
+	// Graphics
+	for (uint8_t row = 0; row < LCD_HEIGHT; row++) {
+		uint8_t dirty = lcd->gdramDirty[row];
+		if (dirty == 0)
+			continue;
+		
+		if (lcd->graphicsMode == false)
+			SetGraphicsMode(lcd);
+		
+		uint8_t vertical = row & 0x1F;
+		uint8_t page = (row & 0x20) ? 0x08 : 0x00;
+		bool addressed = false;
+		
+		for (uint8_t word = 0; word < 8; word++) {
+			if ((dirty & (1 << word)) == 0) {
+				addressed = false;
+				continue;
+			}
+			if (addressed == false) {
+				WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | vertical);
+				WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | page | word);
+				addressed = true;
+			}
+			WriteRam(lcd, lcd->gdram[row][word << 1]);
+			WriteRam(lcd, lcd->gdram[row][(word << 1) | 0x01]);
+		}
+		lcd->gdramDirty[row] = 0;
+	}
+	
+	// Text
+	for (uint8_t address = 0; address < 32; address += 8) {
+		uint8_t row = ddramRow[address >> 3];
+		uint8_t dirty = lcd->ddramDirty[row];
+		if (dirty == 0)
+			continue;
+		
+		if (lcd->graphicsMode == true)
+			SetTextMode(lcd);
+		
+		bool addressed = false;
+		
+		for (uint8_t cell = 0; cell < 8; cell++) {
+			if ((dirty & (1 << cell)) == 0) {
+				addressed = false;
+				continue;
+			}
+			if (addressed == false) {
+				WriteInstruction(lcd, SET_DDRAM_ADDRESS | address | cell);
+				addressed = true;
+			}
+			WriteRam(lcd, lcd->ddram[row][cell << 1]);
+			WriteRam(lcd, lcd->ddram[row][(cell << 1) | 0x01]);
+		}
+		lcd->ddramDirty[row] = 0;
+	}
+}
+
+
 // Text
 void DisplayStringLeftAlligned(struct LCD * lcd, int Row, int Column, unsigned char *ptr, int length)
 {
 	switch (Row){
 		case 0:
-			WriteInstruction(lcd, 0x80 | (Column/2));
+			SetDDRAMAddress(lcd, 0x00 | (Column/2));
 			break;
 		case 1:
-			WriteInstruction(lcd, 0x90 | (Column/2));
+			SetDDRAMAddress(lcd, 0x10 | (Column/2));
 			break;
 		case 2:
-			WriteInstruction(lcd, 0x88 | (Column/2));
+			SetDDRAMAddress(lcd, 0x08 | (Column/2));
 			break;
 		case 3:
-			WriteInstruction(lcd, 0x98 | (Column/2));
+			SetDDRAMAddress(lcd, 0x18 | (Column/2));
 			break;
 		default:
-			WriteInstruction(lcd, 0x80);
+			SetDDRAMAddress(lcd, 0x00);
 			break;
 			
 	}
 
 	if (Column%2!=0)
-		WriteRam(lcd, ' ');
+		WriteDDRAM(lcd, ' ');
 
 	for (int i=0; i<length; i++) {
-		WriteRam(lcd, (unsigned int)ptr[i]);
+		WriteDDRAM(lcd, ptr[i]);
 	}
 }
 
@@ -172,28 +404,28 @@ void DisplayStringRightAlligned(struct LCD * lcd, int Row, int Column, unsigned
 		
 		switch (Row){
 		case 0:
-			WriteInstruction(lcd, 0x80 | (Column)/2);
+			SetDDRAMAddress(lcd, 0x00 | (Column/2));
 			break;
 		case 1:
-			WriteInstruction(lcd, 0x90 | (Column/2));
+			SetDDRAMAddress(lcd, 0x10 | (Column/2));
 			break;
 		case 2:
-			WriteInstruction(lcd, 0x88 | (Column/2));
+			SetDDRAMAddress(lcd, 0x08 | (Column/2));
 			break;
 		case 3:
-			WriteInstruction(lcd, 0x98 | (Column/2));
+			SetDDRAMAddress(lcd, 0x18 | (Column/2));
 			break;
 		default:
-			WriteInstruction(lcd, 0x80);
+			SetDDRAMAddress(lcd, 0x00);
 			break;
 			
 	}
 
 	if (Column%2!=0)
-		WriteRam(lcd, ' ');
+		WriteDDRAM(lcd, ' ');
 
 	for (int i=0; i<length; i++) {
-		WriteRam(lcd, (unsigned int)ptr[i]);
+		WriteDDRAM(lcd, ptr[i]);
 	}
 }
 
@@ -203,19 +435,19 @@ void DisplayChar(struct LCD * lcd, int Row, int Column, unsigned char inpChr){
  
 	switch (Row) {
 			case 0:
-					Column =0x80 | (Column/2); // SET_DDRAM_ADDRESS
+					Column =0x00 | (Column/2); // DDRAM address
 					break;
 			case 1:
-					Column =0x90 | (Column/2);
+					Column =0x10 | (Column/2);
 					break;
 			case 2:
-					Column =0x88 | (Column/2);
+					Column =0x08 | (Column/2);
 					break;
 			case 3:
-					Column =0x98 | (Column/2);
+					Column =0x18 | (Column/2);
 					break;
 			default:
-					Column=0x80;
+					Column=0x00;
 					break;
 	}
 	
@@ -224,12 +456,12 @@ void DisplayChar(struct LCD * lcd, int Row, int Column, unsigned char inpChr){
 			i=1;
 	}
 	
-	WriteInstruction(lcd, (unsigned int)Column);
+	SetDDRAMAddress(lcd, Column);
 
 	if (i==1) {
-			WriteRam(lcd, ' ');
+			WriteDDRAM(lcd, ' ');
 	}
-	WriteRam(lcd, (unsigned int)inpChr);
+	WriteDDRAM(lcd, inpChr);
 }
 
 // Graphics
@@ -238,14 +470,13 @@ void FillGDRAM(struct LCD * lcd, unsigned char * bitmap){
  
 	for ( i = 0 ; i < 2 ; i++ ) {
 			for ( j = 0 ; j < 32 ; j++ ) {
-					WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | j) ;
 					if ( i == 0 ) {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS) ;
+							SetGDRAMAddress(lcd, j, 0x00) ;
 					} else {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x08) ;
+							SetGDRAMAddress(lcd, j, 0x08) ;
 					}
 					for ( k = 0 ; k < 16 ; k++ ) {
-							WriteRam(lcd, *bitmap++ ) ;
+							WriteGDRAM(lcd, *bitmap++ ) ;
 					}
 			}
 	}
@@ -257,11 +488,10 @@ void FillGDRAM_Turned(struct LCD * lcd, unsigned char * bitmap){
 
 	for ( i = 0 ; i < 2 ; i++ ) { //upper and lower page
 			for ( j = 0 ; j < 32 ; j++ ) { //32 lines per page
-					WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | j) ;
 					if ( i == 0 ) {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS) ;
+							SetGDRAMAddress(lcd, j, 0x00) ;
 					} else {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x08) ;
+							SetGDRAMAddress(lcd, j, 0x08) ;
 					}
 					mask=1<<(j%8); // extract bitnumber
 					//printf("mask: %d\r\n",mask);
@@ -274,7 +504,7 @@ void FillGDRAM_Turned(struct LCD * lcd, unsigned char * bitmap){
 											data|=(128>>m);
 									}
 							}
-							WriteRam(lcd, data) ;
+							WriteGDRAM(lcd, data) ;
 					}
 			}
 	}
@@ -285,14 +515,13 @@ void ClearGDRAM(struct LCD * lcd){
  
 	for ( i = 0 ; i < 2 ; i++ ) {
 			for ( j = 0 ; j < 32 ; j++ ) {
-					WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | j) ;
 					if ( i == 0 ) {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS) ;
+							SetGDRAMAddress(lcd, j, 0x00) ;
 					} else {
-							WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x08) ;
+							SetGDRAMAddress(lcd, j, 0x08) ;
 					}
 					for ( k = 0 ; k < 16 ; k++ ) {
-							WriteRam(lcd, 0);
+							WriteGDRAM(lcd, 0);
 					}
 			}
 	}
@@ -300,122 +529,105 @@ void ClearGDRAM(struct LCD * lcd){
 
 void DivideHorizontal(struct LCD * lcd){
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 31 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 31, x);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | (x | 0x88));
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 0, x | 0x08);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 	}
 }
 
 void DivideVertical(struct LCD * lcd){
 	for (uint8_t y = 0; y < 32; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
-
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03 | 0x88);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
+
+		SetGDRAMAddress(lcd, y, 0x03 | 0x08);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 }
 
 void DivideQuadrant(struct LCD * lcd){
 	for (uint8_t y = 0; y < 31; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 	for (uint8_t y = 1; y < 32; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03 | 0x88);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03 | 0x08);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 31 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 31, x);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | (x | 0x88));
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 0, x | 0x08);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 	}
 }
 
 void DivideT(struct LCD * lcd){
 	for (uint8_t y = 1; y < 32; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03 | 0x88);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03 | 0x08);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 31 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 31, x);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | (x | 0x88));
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 0, x | 0x08);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 	}
 }
 
 void DivideInverseT(struct LCD * lcd){
 	for (uint8_t y = 0; y < 31; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 31 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 31, x);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | (x | 0x88));
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 0, x | 0x08);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 	}
 }
 
 void DivideHalfInverseT(struct LCD * lcd){
 	for (uint8_t y = 16; y < 31; y++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03);
-		WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x01);
-		WriteRam(lcd, 0x80);
+		SetGDRAMAddress(lcd, y, 0x03);
+		WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x01);
+		WriteGDRAM(lcd, 0x80);
 	}
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 31 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 31, x);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0 );
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | (x | 0x88));
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, 0, x | 0x08);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFF);
 	}
 }
 
@@ -423,34 +635,30 @@ void HighlightTopLeftText(LCD * lcd){
 	// Top Left Highlight
 	for(uint8_t y = 0; y < 16; y++){
 		for (uint8_t x = 0; x < 3; x++) {
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-			WriteRam(lcd, 0xFF);
-			WriteRam(lcd, 0xFF);
+			SetGDRAMAddress(lcd, y, x);
+			WriteGDRAM(lcd, 0xFF);
+			WriteGDRAM(lcd, 0xFF);
 		}
 	}
 	for(uint8_t y = 0; y < 16; y++){
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x03);
-		WriteRam(lcd, 0xFF);
-		WriteRam(lcd, 0xFE);
+		SetGDRAMAddress(lcd, y, 0x03);
+		WriteGDRAM(lcd, 0xFF);
+		WriteGDRAM(lcd, 0xFE);
 	}
 }
 
 void HighlightTopRightText(LCD * lcd){
 	// Top Right Highlight
 	for(uint8_t y = 0; y < 16; y++){
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 0x04);
-		WriteRam(lcd, 0x7F);
-		WriteRam(lcd, 0xFF);
+		SetGDRAMAddress(lcd, y, 0x04);
+		WriteGDRAM(lcd, 0x7F);
+		WriteGDRAM(lcd, 0xFF);
 	}
 	for(uint8_t y = 0; y < 16; y++){
 		for (uint8_t x = 5; x < 8; x++) {
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x);
-			WriteRam(lcd, 0xFF);
-			WriteRam(lcd, 0xFF);
+			SetGDRAMAddress(lcd, y, x);
+			WriteGDRAM(lcd, 0xFF);
+			WriteGDRAM(lcd, 0xFF);
 		}
 	}
 }
@@ -458,10 +666,9 @@ void HighlightTopRightText(LCD * lcd){
 void HighlightBottomText(LCD * lcd){
 	for(uint8_t y = 0; y < 16; y++){
 		for (uint8_t x = 0; x < 8; x++) {
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-			WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | x | 0x88);
-			WriteRam(lcd, 0xFF);
-			WriteRam(lcd, 0xFF);
+			SetGDRAMAddress(lcd, y, x | 0x08);
+			WriteGDRAM(lcd, 0xFF);
+			WriteGDRAM(lcd, 0xFF);
 		}
 	}
 }
@@ -470,36 +677,32 @@ void HighlightMenuItem(LCD * lcd, uint8_t idx, bool fill){
 	idx &= 0x03;
 	
 	uint8_t y = idx * 16;
-	uint8_t x_addr = 0x80;
+	uint8_t x_addr = 0x00;
 	
 	// adjust coordinates and address
 	if (y >= 32) {
 		y -= 32;
-		x_addr = 0x88; // Page 2
+		x_addr = 0x08; // Page 2
 	}
 
 	for (uint8_t x = 0; x < 8; x++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-		WriteInstruction(lcd, x_addr | x);
-		fill ? WriteRam(lcd, 0xFF) : WriteRam(lcd, 0x00);
-		fill ? WriteRam(lcd, 0xFF) : WriteRam(lcd, 0x00);
+		SetGDRAMAddress(lcd, y, x_addr | x);
+		fill ? WriteGDRAM(lcd, 0xFF) : WriteGDRAM(lcd, 0x00);
+		fill ? WriteGDRAM(lcd, 0xFF) : WriteGDRAM(lcd, 0x00);
 		
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y + 15);
-		WriteInstruction(lcd, x_addr | x);
-		fill ? WriteRam(lcd, 0xFF) : WriteRam(lcd, 0x00);
-		fill ? WriteRam(lcd, 0xFF) : WriteRam(lcd, 0x00);
+		SetGDRAMAddress(lcd, y + 15, x_addr | x);
+		fill ? WriteGDRAM(lcd, 0xFF) : WriteGDRAM(lcd, 0x00);
+		fill ? WriteGDRAM(lcd, 0xFF) : WriteGDRAM(lcd, 0x00);
 	}
 	
 	for (uint8_t y1 = y + 1; y1 < y + 15; y1++) {
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y1);
-		WriteInstruction(lcd, x_addr);
-		fill ? WriteRam(lcd, 0x80) : WriteRam(lcd, 0x00);
-		WriteRam(lcd, 0x00);
+		SetGDRAMAddress(lcd, y1, x_addr);
+		fill ? WriteGDRAM(lcd, 0x80) : WriteGDRAM(lcd, 0x00);
+		WriteGDRAM(lcd, 0x00);
 		
-		WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y1);
-		WriteInstruction(lcd, x_addr + 7);
-		WriteRam(lcd, 0x00);
-		fill ? WriteRam(lcd, 0x01) : WriteRam(lcd, 0x00);
+		SetGDRAMAddress(lcd, y1, x_addr + 7);
+		WriteGDRAM(lcd, 0x00);
+		fill ? WriteGDRAM(lcd, 0x01) : WriteGDRAM(lcd, 0x00);
 	}
 }
 
@@ -2,6 +2,7 @@
 #define LCD_H
 
 #include "stm32f3xx_hal.h"
+#include "SpiBus.h"
 #include <stdbool.h>
 
 // Instruction Set 1: (RE=0: Basic Instruction)
@@ -53,15 +54,70 @@
  
 #define BUSY_FLAG_BF            0x80
 
+// Panel Geometry
+#define LCD_WIDTH               128
+#define LCD_HEIGHT              64
+#define LCD_GDRAM_ROW_BYTES     (LCD_WIDTH / 8)  // 16 bytes, 8 GDRAM words per pixel row
+#define LCD_TEXT_ROWS           4
+#define LCD_TEXT_COLUMNS        16               // 8 DDRAM cells of 2 characters per text row
+
+// Serial frames (sync, high data, low data) waiting for the DMA, power of two
+#define LCD_QUEUE_SIZE          256
+
 typedef struct LCD
 {
 	SPI_HandleTypeDef * SPI;
+	// 1MHz one-pulse timer pacing the execution time of each frame
+	TIM_HandleTypeDef * timer;
+	// SPI bus shared with the SD card, held while the queue is not empty
+	struct SpiBus * bus;
+	uint8_t busDevice;
+	
+	// Command queue, frames are sent by DMA from the tail
+	uint8_t queue[LCD_QUEUE_SIZE][3];
+	volatile uint16_t queueHead;
+	volatile uint16_t queueTail;
+	uint16_t queueHighWater;
+	volatile bool queueBusy;
+	
+	// Shadow framebuffer, [pixel row][byte], MSB is the leftmost pixel
+	// Drawing calls only update it, FlushDisplay sends the differences to the panel
+	uint8_t gdram[LCD_HEIGHT][LCD_GDRAM_ROW_BYTES];
+	// One bit per 16-bit GDRAM word that is not on the panel yet
+	uint8_t gdramDirty[LCD_HEIGHT];
+	
+	// Text row cache, [text row][column]
+	uint8_t ddram[LCD_TEXT_ROWS][LCD_TEXT_COLUMNS];
+	// One bit per 2-character DDRAM cell that is not on the panel yet
+	uint8_t ddramDirty[LCD_TEXT_ROWS];
+	
+	// Address counters of the shadow RAMs, in bytes
+	uint8_t gdramVertical;
+	uint8_t gdramByte;
+	uint8_t ddramByte;
+	
+	// Instruction set the panel is in (RE=1 and G=1 after SetGraphicsMode)
+	bool graphicsMode;
 } LCD;
 
-void InitLcdSPI(struct LCD * lcd, SPI_HandleTypeDef * spi);
+void InitLcdSPI(struct LCD * lcd, SPI_HandleTypeDef * spi, TIM_HandleTypeDef * timer, struct SpiBus * bus, uint8_t busDevice);
 
 void SpiWrite(SPI_HandleTypeDef * spi, uint8_t txData);
 
+// Command Queue
+void LcdSpiTxComplete(struct LCD * lcd);
+
+void LcdTimerElapsed(struct LCD * lcd);
+
+// Granted callback of the bus device, carries on with the queue
+void LcdBusGranted(struct LCD * lcd);
+
+uint16_t GetLcdQueueDepth(struct LCD * lcd);
+
+uint16_t GetLcdQueueHighWater(struct LCD * lcd);
+
+void WaitLcdIdle(struct LCD * lcd);
+
 void WriteInstruction(struct LCD * lcd, uint8_t Command);
 
 void WriteRam(struct LCD * lcd, uint8_t data);
@@ -78,6 +134,19 @@ void ReturnHome(struct LCD * lcd);
 
 void Standby(struct LCD * lcd);
 
+// Shadow Framebuffer
+void SetGDRAMAddress(struct LCD * lcd, uint8_t vertical, uint8_t horizontal);
+
+void WriteGDRAM(struct LCD * lcd, uint8_t data);
+
+void SetDDRAMAddress(struct LCD * lcd, uint8_t address);
+
+void WriteDDRAM(struct LCD * lcd, uint8_t data);
+
+void InvalidateDisplay(struct LCD * lcd);
+
+void FlushDisplay(struct LCD * lcd);
+
 // Text
 void DisplayStringLeftAlligned(struct LCD * lcd, int Row, int Column, unsigned char *ptr, int length);
 
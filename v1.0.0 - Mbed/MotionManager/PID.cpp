@@ -0,0 +1,61 @@
+#include "PID.h"
+
+static float Clamp(float value, float minimum, float maximum){
+	if(value > maximum)
+		return maximum;
+	if(value < minimum)
+		return minimum;
+	return value;
+}
+
+void InitPID(struct PID * pid, float kp, float ki, float kd, float integralMin, float integralMax, float outputMin, float outputMax){
+	pid->kp = kp;
+	pid->ki = ki;
+	pid->kd = kd;
+	pid->integralMin = integralMin;
+	pid->integralMax = integralMax;
+	pid->outputMin = outputMin;
+	pid->outputMax = outputMax;
+	SetPIDTuning(pid, 1.0f, 0.0f, 0.0f);
+	ResetPID(pid);
+}
+
+void SetPIDTuning(struct PID * pid, float setpointWeight, float trackingGain, float derivativeSmoothing){
+	pid->setpointWeight = setpointWeight;
+	pid->trackingGain = trackingGain;
+	pid->derivativeSmoothing = Clamp(derivativeSmoothing, 0.0f, 1.0f);
+}
+
+void SetPIDGains(struct PID * pid, float kp, float ki, float kd){
+	pid->kp = kp;
+	pid->ki = ki;
+	pid->kd = kd;
+}
+
+void ResetPID(struct PID * pid){
+	pid->integral = 0.0f;
+	pid->derivative = 0.0f;
+	pid->lastMeasurement = 0.0f;
+	pid->hasMeasurement = false;
+}
+
+float UpdatePID(struct PID * pid, float setpoint, float measurement, float feedForward){
+	float error = setpoint - measurement;
+
+	pid->integral = Clamp(pid->integral + pid->ki * error, pid->integralMin, pid->integralMax);
+
+	// First sample has no slope
+	float slope = pid->hasMeasurement ? (measurement - pid->lastMeasurement) : 0.0f;
+	pid->lastMeasurement = measurement;
+	pid->hasMeasurement = true;
+	pid->derivative = pid->derivativeSmoothing * pid->derivative - (1.0f - pid->derivativeSmoothing) * pid->kd * slope;
+
+	float proportional = pid->kp * (pid->setpointWeight * setpoint - measurement);
+	float v = proportional + pid->integral + pid->derivative + feedForward;
+	float out = Clamp(v, pid->outputMin, pid->outputMax);
+
+	if(pid->trackingGain != 0.0f)
+		pid->integral = Clamp(pid->integral + pid->trackingGain * (out - v), pid->integralMin, pid->integralMax);
+
+	return out;
+}
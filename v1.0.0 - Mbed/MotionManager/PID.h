@@ -0,0 +1,51 @@
+#ifndef PID_H
+#define PID_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// PID controller, one update per control period
+//   integral = clamp(integral + Ki * error, integralMin, integralMax)
+//   derivative = low pass of -Kd * (measurement - lastMeasurement)
+//   v = Kp * (setpointWeight * setpoint - measurement) + integral + derivative + feedForward
+//   out = clamp(v, outputMin, outputMax)
+//   integral += trackingGain * (out - v)
+// The derivative is on the measurement, setpoint steps do not kick it.
+// Back-calculation bleeds the integral while the output saturates, so it does
+// not wind up to integralMin/integralMax on large steps.
+// Gains are per control period.
+
+typedef struct PID
+{
+	float kp;
+	float ki;
+	float kd;
+	float setpointWeight;       // 0 to 1, of the setpoint in the proportional term
+	float trackingGain;         // Back-calculation, 0 disables it
+	float derivativeSmoothing;  // 0 to 1, derivative low pass, 0 is unfiltered
+
+	float integralMin;
+	float integralMax;
+	float outputMin;
+	float outputMax;
+
+	float integral;
+	float derivative;
+	float lastMeasurement;
+	bool hasMeasurement;
+} PID;
+
+void InitPID(struct PID * pid, float kp, float ki, float kd, float integralMin, float integralMax, float outputMin, float outputMax);
+
+// Setpoint weight, back-calculation gain and derivative smoothing
+void SetPIDTuning(struct PID * pid, float setpointWeight, float trackingGain, float derivativeSmoothing);
+
+// New gains, the integral is kept so the output does not jump
+void SetPIDGains(struct PID * pid, float kp, float ki, float kd);
+
+void ResetPID(struct PID * pid);
+
+// One control period, returns the saturated output
+float UpdatePID(struct PID * pid, float setpoint, float measurement, float feedForward);
+
+#endif
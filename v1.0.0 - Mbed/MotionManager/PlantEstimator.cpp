@@ -0,0 +1,89 @@
+#include "PlantEstimator.h"
+#include <math.h>
+
+void InitPlantEstimator(struct PlantEstimator * estimator, float forgetting, float period, float outputScale, float inputScale){
+	estimator->forgetting = forgetting;
+	estimator->period = period;
+	estimator->outputScale = outputScale;
+	estimator->inputScale = inputScale;
+	estimator->inverseOutputScale = 1.0f / outputScale;
+	estimator->inverseInputScale = 1.0f / inputScale;
+	estimator->inverseForgetting = 1.0f / forgetting;
+	ResetPlantEstimator(estimator);
+}
+
+void ResetPlantEstimator(struct PlantEstimator * estimator){
+	// A slow plant with no gain until the first samples
+	estimator->theta[0] = 0.5f;
+	estimator->theta[1] = 0.0f;
+	estimator->theta[2] = 0.0f;
+
+	for(uint8_t i = 0; i < 3; i++)
+		for(uint8_t j = 0; j < 3; j++)
+			estimator->covariance[i][j] = (i == j) ? PLANT_ESTIMATOR_COVARIANCE : 0.0f;
+
+	estimator->lastOutput = 0.0f;
+	estimator->lastInput = 0.0f;
+	estimator->hasSample = false;
+
+	estimator->valid = false;
+	estimator->gain = 0.0f;
+	estimator->timeConstant = 0.0f;
+}
+
+// Gain and time constant of the current estimate
+static void Interpret(struct PlantEstimator * estimator){
+	float a = estimator->theta[0];
+	float b = estimator->theta[1] * estimator->outputScale / estimator->inputScale;
+
+	estimator->valid = (a > 0.0f) && (a < 1.0f) && (b > 0.0f);
+	if(estimator->valid == false)
+		return;
+
+	estimator->gain = b / (1.0f - a);
+	estimator->timeConstant = -estimator->period / logf(a);
+}
+
+void UpdatePlantEstimator(struct PlantEstimator * estimator, float output, float input){
+	float y = output * estimator->inverseOutputScale;
+	float u = input * estimator->inverseInputScale;
+
+	float phi[3] = { estimator->lastOutput, estimator->lastInput, 1.0f };
+	float error = y - (estimator->theta[0] * phi[0] + estimator->theta[1] * phi[1] + estimator->theta[2]);
+
+	if(estimator->hasSample && (fabsf(error) > PLANT_ESTIMATOR_DEAD_ZONE)){
+		float (*p)[3] = estimator->covariance;
+
+		// P * phi, P is symmetric
+		float pPhi[3];
+		float denominator = estimator->forgetting;
+		for(uint8_t i = 0; i < 3; i++){
+			pPhi[i] = p[i][0] * phi[0] + p[i][1] * phi[1] + p[i][2] * phi[2];
+			denominator += phi[i] * pPhi[i];
+		}
+
+		// theta += K * error, P = (P - K * phi' * P) / forgetting with K = P * phi / denominator
+		float inverseDenominator = 1.0f / denominator;
+		float trace = 0.0f;
+		for(uint8_t i = 0; i < 3; i++){
+			float k = pPhi[i] * inverseDenominator;
+			estimator->theta[i] += k * error;
+			for(uint8_t j = 0; j < 3; j++)
+				p[i][j] = (p[i][j] - k * pPhi[j]) * estimator->inverseForgetting;
+			trace += p[i][i];
+		}
+
+		if(trace > PLANT_ESTIMATOR_MAX_TRACE){
+			float scale = PLANT_ESTIMATOR_MAX_TRACE / trace;
+			for(uint8_t i = 0; i < 3; i++)
+				for(uint8_t j = 0; j < 3; j++)
+					p[i][j] *= scale;
+		}
+
+		Interpret(estimator);
+	}
+
+	estimator->lastOutput = y;
+	estimator->lastInput = u;
+	estimator->hasSample = true;
+}
@@ -0,0 +1,56 @@
+#ifndef PLANTESTIMATOR_H
+#define PLANTESTIMATOR_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Recursive least squares identification of the pump as a first order plant
+//   y[k] = a * y[k-1] + b * u[k-1] + c
+// y is the measured RPM, u the PWM applied over the last period and c takes
+// the load and friction. Every control period the prediction error moves the
+// estimate, older samples fade by the forgetting factor (0.98 to 0.999).
+// From the estimate
+//   gain = b / (1 - a)                 RPM per PWM
+//   timeConstant = -period / ln(a)     s
+// are valid while 0 < a < 1 and b > 0.
+// y and u are scaled to about 1 so the covariance stays well conditioned.
+// Predictions within the dead zone do not update the estimate, at a constant
+// speed there is nothing to learn and the estimate would drift on the noise.
+// The covariance trace is bounded for the same reason.
+
+#define PLANT_ESTIMATOR_COVARIANCE      100.0f  // Initial covariance diagonal
+#define PLANT_ESTIMATOR_MAX_TRACE       1000.0f
+#define PLANT_ESTIMATOR_DEAD_ZONE       0.001f  // Of outputScale
+
+typedef struct PlantEstimator
+{
+	float forgetting;
+	float period;               // s
+	float outputScale;          // RPM of a scaled 1
+	float inputScale;           // PWM of a scaled 1
+
+	// Reciprocals, the update runs without divisions but one
+	float inverseOutputScale;
+	float inverseInputScale;
+	float inverseForgetting;
+
+	float theta[3];             // a, b, c in scaled units
+	float covariance[3][3];
+	float lastOutput;           // Scaled
+	float lastInput;            // Scaled
+	bool hasSample;
+
+	bool valid;
+	float gain;                 // RPM per PWM
+	float timeConstant;         // s
+} PlantEstimator;
+
+void InitPlantEstimator(struct PlantEstimator * estimator, float forgetting, float period, float outputScale, float inputScale);
+
+// Forget everything learned, as after a boot
+void ResetPlantEstimator(struct PlantEstimator * estimator);
+
+// Once per control period with the RPM now and the PWM applied from now on
+void UpdatePlantEstimator(struct PlantEstimator * estimator, float output, float input);
+
+#endif
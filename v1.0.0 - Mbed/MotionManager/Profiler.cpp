@@ -0,0 +1,107 @@
+#include "Profiler.h"
+
+// Each site is only updated from one interrupt or from the main loop
+static ProfileStats profile[PROFILE_SITE_COUNT];
+
+static const char * siteNames[PROFILE_TASK] = {
+    "control",
+    "control latency",
+    "blink isr",
+    "refresh isr",
+    "lcd timer isr",
+    "lcd dma isr",
+    "serial dma isr",
+    "exti"
+};
+
+void InitProfiler(void){
+    // Trace enable, required for the DWT
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    for(uint8_t i = 0; i < PROFILE_SITE_COUNT; i++)
+        profile[i].name = (i < PROFILE_TASK) ? siteNames[i] : NULL;
+
+    ResetProfile();
+}
+
+void ResetProfile(void){
+    for(uint8_t i = 0; i < PROFILE_SITE_COUNT; i++){
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+
+        profile[i].count = 0;
+        profile[i].min = 0xFFFFFFFF;
+        profile[i].max = 0;
+        profile[i].sum = 0;
+        for(uint8_t j = 0; j < PROFILER_HISTOGRAM_BINS; j++)
+            profile[i].histogram[j] = 0;
+
+        __set_PRIMASK(primask);
+    }
+}
+
+void SetProfileSiteName(uint8_t site, const char * name){
+    if(site < PROFILE_SITE_COUNT)
+        profile[site].name = name;
+}
+
+void ProfileRecord(uint8_t site, uint32_t cycles){
+    ProfileStats * stats = &profile[site];
+
+    stats->count++;
+    stats->sum += cycles;
+    if(cycles < stats->min)
+        stats->min = cycles;
+    if(cycles > stats->max)
+        stats->max = cycles;
+
+    // log2 bins
+    int32_t bin = (31 - (int32_t)__CLZ(cycles | 1)) - PROFILER_HISTOGRAM_SHIFT;
+    if(bin < 0)
+        bin = 0;
+    else if(bin >= PROFILER_HISTOGRAM_BINS)
+        bin = PROFILER_HISTOGRAM_BINS - 1;
+
+    if(stats->histogram[bin] != 0xFFFF)
+        stats->histogram[bin]++;
+}
+
+void GetProfileStats(uint8_t site, ProfileStats * stats){
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    *stats = profile[site];
+
+    __set_PRIMASK(primask);
+}
+
+void DumpProfile(FILE * fp){
+    fprintf(fp, "# cycles at %lu Hz\n", (unsigned long)SystemCoreClock);
+
+    // Header, histogram columns are the lower bound of each bin
+    fprintf(fp, "site,count,min,max,mean");
+    fprintf(fp, ",0");
+    for(uint8_t j = 1; j < PROFILER_HISTOGRAM_BINS; j++)
+        fprintf(fp, ",%lu", 1UL << (j + PROFILER_HISTOGRAM_SHIFT));
+    fprintf(fp, "\n");
+
+    for(uint8_t i = 0; i < PROFILE_SITE_COUNT; i++){
+        ProfileStats stats;
+        GetProfileStats(i, &stats);
+
+        if(stats.name == NULL)
+            continue;
+
+        uint32_t mean = (stats.count != 0) ? (uint32_t)(stats.sum / stats.count) : 0;
+        uint32_t min = (stats.count != 0) ? stats.min : 0;
+
+        fprintf(fp, "%s,%lu,%lu,%lu,%lu", stats.name, (unsigned long)stats.count,
+                (unsigned long)min, (unsigned long)stats.max, (unsigned long)mean);
+        for(uint8_t j = 0; j < PROFILER_HISTOGRAM_BINS; j++)
+            fprintf(fp, ",%u", (unsigned int)stats.histogram[j]);
+        fprintf(fp, "\n");
+    }
+}
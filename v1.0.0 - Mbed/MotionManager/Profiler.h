@@ -0,0 +1,74 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stm32f3xx_hal.h"
+#include <stdio.h>
+
+// Execution time profiler on the DWT cycle counter
+// Every site keeps count, min, max, sum and a log2 histogram of cycles
+// Times of a site include any higher priority interrupt that preempted it
+
+#define PROFILER_TASK_SITES         8   // SCHEDULER_MAX_TASKS
+#define PROFILER_HISTOGRAM_BINS     16
+// Bin 0 holds everything below 2^(PROFILER_HISTOGRAM_SHIFT + 1) cycles
+// The last bin holds everything from 2^(PROFILER_HISTOGRAM_SHIFT + BINS - 1) cycles
+#define PROFILER_HISTOGRAM_SHIFT    6
+
+enum ProfileSite{
+    PROFILE_CONTROL,            // TIM3 RPM and PID loop
+    PROFILE_CONTROL_LATENCY,    // TIM3 CH2 compare to ISR entry
+    PROFILE_BLINK,              // TIM15 underline blink
+    PROFILE_REFRESH,            // TIM17 screen refresh
+    PROFILE_LCD_TIMER,          // TIM7 LCD command pacing
+    PROFILE_LCD_DMA,            // DMA1 Channel3 SPI1 TX
+    PROFILE_SERIAL_DMA,         // DMA1 Channel7 USART2 TX
+    PROFILE_EXTI,               // Knob and buttons
+    PROFILE_TASK,               // First scheduler task, one site per task id
+    PROFILE_SITE_COUNT = PROFILE_TASK + PROFILER_TASK_SITES
+};
+
+typedef struct ProfileStats
+{
+    const char * name;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint16_t histogram[PROFILER_HISTOGRAM_BINS];
+} ProfileStats;
+
+// Enable the DWT cycle counter and clear all sites
+void InitProfiler(void);
+
+void ResetProfile(void);
+
+void SetProfileSiteName(uint8_t site, const char * name);
+
+// Add a measurement in cycles
+void ProfileRecord(uint8_t site, uint32_t cycles);
+
+// Copy a site, consistent against the interrupt that updates it
+void GetProfileStats(uint8_t site, ProfileStats * stats);
+
+// Write all sites as CSV, fp can be stdout (serial) or a file on the SD card
+void DumpProfile(FILE * fp);
+
+__STATIC_INLINE uint32_t ProfileStart(void)
+{
+    return DWT->CYCCNT;
+}
+
+__STATIC_INLINE void ProfileStop(uint8_t site, uint32_t start)
+{
+    ProfileRecord(site, DWT->CYCCNT - start);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,115 @@
+#include "Protocol.h"
+#include "Crc16.h"
+
+void InitProtocolDecoder(struct ProtocolDecoder * decoder, uint8_t * buffer, uint16_t size){
+	decoder->buffer = buffer;
+	decoder->size = size;
+	decoder->length = 0;
+	decoder->overflow = false;
+	decoder->type = 0;
+	decoder->payload = buffer;
+	decoder->payloadLength = 0;
+	decoder->frames = 0;
+	decoder->bad = 0;
+}
+
+// COBS back to the data in place, the data is never longer
+// False if a code points past the end
+static bool Unstuff(uint8_t * buffer, uint16_t length, uint16_t * decoded){
+	uint16_t in = 0;
+	uint16_t out = 0;
+
+	while(in < length){
+		uint8_t code = buffer[in++];
+		if((in + code - 1) > length)
+			return false;
+
+		for(uint8_t i = 1; i < code; i++)
+			buffer[out++] = buffer[in++];
+
+		// A full block has no 0 after it, nor has the last one
+		if((code != 0xFF) && (in < length))
+			buffer[out++] = 0;
+	}
+
+	*decoded = out;
+	return true;
+}
+
+bool DecodeProtocol(struct ProtocolDecoder * decoder, uint8_t byte){
+	if(byte != 0){
+		if(decoder->length < decoder->size)
+			decoder->buffer[decoder->length++] = byte;
+		else
+			decoder->overflow = true;
+		return false;
+	}
+
+	// Delimiter, empty frames are the gap between two
+	uint16_t length = decoder->length;
+	bool overflow = decoder->overflow;
+	decoder->length = 0;
+	decoder->overflow = false;
+
+	if((length == 0) && (overflow == false))
+		return false;
+
+	uint16_t decoded;
+	if(overflow || (Unstuff(decoder->buffer, length, &decoded) == false) || (decoded < 3)){
+		decoder->bad++;
+		return false;
+	}
+
+	uint16_t crc = 0;
+	for(uint16_t i = 0; i < decoded - 2; i++)
+		crc = UpdateCrc16(crc, decoder->buffer[i]);
+
+	if(crc != (decoder->buffer[decoded - 2] | (decoder->buffer[decoded - 1] << 8))){
+		decoder->bad++;
+		return false;
+	}
+
+	decoder->type = decoder->buffer[0];
+	decoder->payload = &decoder->buffer[1];
+	decoder->payloadLength = decoded - 3;
+	decoder->frames++;
+	return true;
+}
+
+uint16_t EncodeProtocol(uint8_t type, const uint8_t * payload, uint16_t length, uint8_t * frame){
+	if(length > PROTOCOL_MAX_PAYLOAD)
+		return 0;
+
+	uint16_t crc = UpdateCrc16(0, type);
+	for(uint16_t i = 0; i < length; i++)
+		crc = UpdateCrc16(crc, payload[i]);
+
+	// COBS, every 0 becomes the distance to the next one in a code byte
+	// The data fits one block, so the codes never reach 0xFF
+	uint16_t size = 0;
+	frame[size++] = 0;
+	uint16_t code = size++;
+	frame[code] = 1;
+
+	for(uint16_t i = 0; i < length + 3; i++){
+		uint8_t byte;
+		if(i == 0)
+			byte = type;
+		else if(i <= length)
+			byte = payload[i - 1];
+		else
+			byte = (i == length + 1) ? (crc & 0xFF) : (crc >> 8);
+
+		if(byte == 0){
+			code = size++;
+			frame[code] = 1;
+		}
+		else{
+			frame[size++] = byte;
+			frame[code]++;
+		}
+	}
+
+	frame[size++] = 0;
+	return size;
+}
@@ -0,0 +1,80 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Binary frames on the serial port
+// A frame is a type byte, its payload and a CRC16 (CCITT XMODEM over type and
+// payload, low byte first), COBS encoded so it holds no 0, and a 0 before and
+// after it. A receiver in the middle of a frame or of text on the port loses
+// only that one, the next 0 starts over. Multi byte values are little endian,
+// floats are IEEE 754 singles.
+//
+// Commands are answered with their type | PROTOCOL_REPLY, a status byte and
+// the values below. Telemetry frames come unasked while streaming is on.
+
+#define PROTOCOL_MAX_DATA           254     // Type, payload and CRC, one COBS code byte
+#define PROTOCOL_MAX_PAYLOAD        (PROTOCOL_MAX_DATA - 3)
+#define PROTOCOL_FRAME_SIZE(payload) ((payload) + 6)   // Encoded with both delimiters
+
+// Commands, payload -> reply values
+#define PROTOCOL_SET_RPM            0x01    // float RPM, in RPM Control
+#define PROTOCOL_SET_FLOW_RATE      0x02    // float ml/min, in Flow Control
+#define PROTOCOL_SET_VOLTAGE        0x03    // float V, in Voltage Control
+#define PROTOCOL_START              0x04    // uint8 mode, from the control selection menu
+#define PROTOCOL_STOP               0x05    // Back to the control selection menu
+#define PROTOCOL_READ_PARAMETER     0x06    // uint8 key -> float value
+#define PROTOCOL_WRITE_PARAMETER    0x07    // uint8 key, float value
+#define PROTOCOL_STREAM             0x08    // uint8 on
+#define PROTOCOL_RELOAD             0x09    // -> text, SD card settings
+#define PROTOCOL_STATUS             0x0A    // -> uint8 mode, float refRpm, rpm, refFlowRate, voltage, int16 pwm
+#define PROTOCOL_DOSE               0x0B    // float ml, in Batch Dosing, 0 aborts
+#define PROTOCOL_DOSE_STATUS        0x0C    // -> uint8 state (DOSING_ in Dosing.h), float target, volume, coastVolume, time
+
+#define PROTOCOL_REPLY              0x80
+#define PROTOCOL_TELEMETRY          0xC0    // uint32 dropped, TelemetrySample (20 bytes) each
+
+// Modes of START and STATUS, the control selection menu items
+#define PROTOCOL_RPM_CONTROL        0
+#define PROTOCOL_FLOW_CONTROL       1
+#define PROTOCOL_VOLTAGE_CONTROL    2
+#define PROTOCOL_BATCH_DOSING       3
+#define PROTOCOL_AUTOTUNE           4       // STATUS only
+#define PROTOCOL_NO_CONTROL         0xFF
+
+// Reply status
+#define PROTOCOL_OK                 0
+#define PROTOCOL_UNKNOWN            1       // Command type
+#define PROTOCOL_BAD_LENGTH         2       // Payload size
+#define PROTOCOL_BAD_VALUE          3       // Out of range or unknown key
+#define PROTOCOL_REFUSED            4       // Not in this mode, or settings that do not fit together
+
+typedef struct ProtocolDecoder
+{
+	uint8_t * buffer;
+	uint16_t size;
+	uint16_t length;
+	bool overflow;              // Frame longer than the buffer, skipped
+
+	// Last frame, valid until the next byte
+	uint8_t type;
+	const uint8_t * payload;
+	uint16_t payloadLength;
+
+	// Statistics
+	uint32_t frames;
+	uint32_t bad;               // Failed COBS or CRC, or too long
+} ProtocolDecoder;
+
+// Frames up to size - 1 data bytes are decoded in buffer
+void InitProtocolDecoder(struct ProtocolDecoder * decoder, uint8_t * buffer, uint16_t size);
+
+// Next received byte, true when it completes a good frame
+bool DecodeProtocol(struct ProtocolDecoder * decoder, uint8_t byte);
+
+// Frame of PROTOCOL_FRAME_SIZE(length) bytes at most, returns its size
+// 0 if the payload is longer than PROTOCOL_MAX_PAYLOAD
+uint16_t EncodeProtocol(uint8_t type, const uint8_t * payload, uint16_t length, uint8_t * frame);
+
+#endif
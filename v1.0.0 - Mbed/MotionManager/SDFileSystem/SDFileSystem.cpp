@@ -52,18 +52,20 @@
  * card always responds to commands, data blocks and errors.
  *
  * The protocol supports a CRC, but by default it is off (except for the
- * first reset CMD0, where the CRC can just be pre-calculated, and CMD8)
- * I'll leave the CRC off I think!
+ * first reset CMD0 and CMD8). Commands always carry their CRC7. With SD_CRC
+ * set, CRC_ON_OFF (CMD59) turns the check on after initialisation and data
+ * blocks carry and are checked against their CRC16 too.
  *
  * Standard capacity cards have variable data block sizes, whereas High
  * Capacity cards fix the size of data block to 512 bytes. I'll therefore
  * just always use the Standard Capacity cards with a block size of 512 bytes.
  * This is set with CMD16.
  *
- * You can read and write single blocks (CMD17, CMD25) or multiple blocks
- * (CMD18, CMD25). For simplicity, I'll just use single block accesses. When
- * the card gets a read command, it responds with a response token, and then
- * a data token or an error.
+ * You can read and write single blocks (CMD17, CMD24) or multiple blocks
+ * (CMD18, CMD25). Single block commands are used for one sector, multiple
+ * block ones whenever the file system asks for more, which saves a command
+ * and a busy wait per sector. When the card gets a read command, it responds
+ * with a response token, and then a data token or an error.
  *
  * SPI Command Format
  * ------------------
@@ -73,7 +75,7 @@
  * | 01 | cmd[5:0] | arg[31:24] | arg[23:16] | arg[15:8] | arg[7:0] | crc[6:0] | 1 |
  * +---------------+------------+------------+-----------+----------+--------------+
  *
- * As I'm not using CRC, I can fix that byte to what is needed for CMD0 (0x95)
+ * The CRC7 covers the first 5 bytes, it is 0x95 for CMD0.
  *
  * All Application Specific commands shall be preceded with APP_CMD (CMD55).
  *
@@ -111,6 +113,29 @@
  * +------+---------+---------+- -  - -+---------+-----------+----------+
  * | 0xFE | data[0] | data[1] |        | data[n] | crc[15:8] | crc[7:0] |
  * +------+---------+---------+- -  - -+---------+-----------+----------+
+ *
+ * Multiple Block Read and Write
+ * -----------------------------
+ *
+ * After CMD18 the card sends data blocks (0xFE token) one after another until
+ * it gets STOP_TRANSMISSION (CMD12). CMD12 is followed by a stuff byte, then
+ * its R1b response.
+ *
+ * CMD25 is preceded by SET_WR_BLK_ERASE_COUNT (ACMD23) with the number of
+ * blocks, so the card can erase them ahead of the data. Every block starts with
+ * the 0xFC token and is acknowledged with a data response token and a busy
+ * signal, the 0xFD stop token ends the transfer, followed by another busy
+ * signal. Chip select stays low for the whole transfer.
+ *
+ * Clock and DMA
+ * -------------
+ *
+ * Cards are initialised at 250kHz. Data transfers then run at the card's
+ * TRAN_SPEED from the CSD, at most 25MHz in SPI mode, and the mbed SPI takes
+ * the highest prescaler setting below it (16MHz from the 64MHz APB2 of the
+ * F303K8). Commands, tokens and busy waits go byte by byte, the 512 byte data
+ * of a block is moved by DMA while the CPU sleeps until the completion
+ * interrupt.
  */
 #include "SDFileSystem.h"
 #include "mbed_debug.h"
@@ -119,13 +144,144 @@
 
 #define SD_DBG             0
 
+// 1 checks the CRC16 of every data block (CMD59), costs about 50us per block
+#ifndef SD_CRC
+#define SD_CRC             0
+#endif
+
+// SPI mode limit of default speed cards
+#define SD_MAX_SCK         25000000
+
+// SPI1 RX and TX are DMA1 channels 2 and 3, the F303K8 has no other SPI
+#if defined(TARGET_STM32F3)
+#define SD_DMA             1
+#else
+#define SD_DMA             0
+#endif
+
+#define SD_BLOCK_SIZE      512
+
 SDFileSystem::SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name) :
     FATFileSystem(name), _spi(mosi, miso, sclk), _cs(cs), _is_initialized(0) {
     _cs = 1;
 
-    // Set default to 100kHz for initialisation and 1MHz for data transfer
+    // Set default to 250kHz for initialisation, data transfer at the
+    // card's TRAN_SPEED up to 25MHz
     _init_sck = 250000;
-    _transfer_sck = 1000000;
+    _transfer_sck = SD_MAX_SCK;
+}
+
+// CRC7 of a command, shifted with the end bit
+static uint8_t crc7(const uint8_t *data, int length) {
+    uint8_t crc = 0;
+    for (int i = 0; i < length; i++) {
+        uint8_t d = data[i];
+        for (int j = 0; j < 8; j++) {
+            crc <<= 1;
+            if ((d ^ crc) & 0x80) {
+                crc ^= 0x09;
+            }
+            d <<= 1;
+        }
+    }
+    return (crc << 1) | 1;
+}
+
+// CRC16-CCITT (XMODEM) of a data block, byte at a time without a table
+static uint16_t crc16(const uint8_t *data, uint32_t length) {
+    uint16_t crc = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        crc = (uint8_t)(crc >> 8) | (crc << 8);
+        crc ^= data[i];
+        crc ^= (uint8_t)(crc & 0xFF) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xFF) << 5;
+    }
+    return crc;
+}
+
+// Command, argument and CRC7
+void SDFileSystem::_send_command(int cmd, int arg) {
+    uint8_t frame[5] = {
+        (uint8_t)(0x40 | cmd), (uint8_t)(arg >> 24), (uint8_t)(arg >> 16), (uint8_t)(arg >> 8), (uint8_t)arg
+    };
+    for (int i = 0; i < 5; i++) {
+        _spi.write(frame[i]);
+    }
+    _spi.write(crc7(frame, 5));
+}
+
+#if SD_DMA
+static volatile bool dma_done = false;
+static const uint8_t dma_fill = 0xFF;
+static uint8_t dma_sink;
+
+// Completion callback, RX is the last to finish
+static void dma_complete() {
+    DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    dma_done = true;
+}
+#endif
+
+// Block data through SPI while cs is low, tx NULL sends 0xFF, rx NULL drops
+// what comes back
+void SDFileSystem::_transfer(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+#if SD_DMA
+    if (length == SD_BLOCK_SIZE) {
+        DMA_Channel_TypeDef *rxChannel = DMA1_Channel2;
+        DMA_Channel_TypeDef *txChannel = DMA1_Channel3;
+
+        // Channel 3 also serves the LCD through the HAL, its setup is kept
+        uint32_t txSetup = txChannel->CCR & ~DMA_CCR_EN;
+
+        RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+        rxChannel->CCR = 0;
+        txChannel->CCR = 0;
+        DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+
+        rxChannel->CPAR = (uint32_t)&SPI1->DR;
+        rxChannel->CMAR = (uint32_t)((rx != NULL) ? rx : &dma_sink);
+        rxChannel->CNDTR = length;
+        txChannel->CPAR = (uint32_t)&SPI1->DR;
+        txChannel->CMAR = (uint32_t)((tx != NULL) ? tx : &dma_fill);
+        txChannel->CNDTR = length;
+
+        dma_done = false;
+        NVIC_SetVector(DMA1_Channel2_IRQn, (uint32_t)dma_complete);
+        NVIC_SetPriority(DMA1_Channel2_IRQn, 1);
+        NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+
+        // RX first, so no received byte is missed (RM0316 SPI DMA)
+        rxChannel->CCR = ((rx != NULL) ? DMA_CCR_MINC : 0) | DMA_CCR_PL_1 | DMA_CCR_TCIE | DMA_CCR_EN;
+        SPI1->CR2 |= SPI_CR2_RXDMAEN;
+        txChannel->CCR = ((tx != NULL) ? DMA_CCR_MINC : 0) | DMA_CCR_DIR | DMA_CCR_EN;
+        SPI1->CR2 |= SPI_CR2_TXDMAEN;
+
+        // Sleep until the completion callback, interrupts are only held off
+        // between the check and WFI so the wake up is not missed
+        __disable_irq();
+        while (!dma_done) {
+            __WFI();
+            __enable_irq();
+            __disable_irq();
+        }
+        __enable_irq();
+
+        SPI1->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+        txChannel->CCR = 0;
+        DMA1->IFCR = DMA_IFCR_CGIF3;
+        txChannel->CCR = txSetup;
+        return;
+    }
+#endif
+
+    for (uint32_t i = 0; i < length; i++) {
+        int response = _spi.write((tx != NULL) ? tx[i] : 0xFF);
+        if (rx != NULL) {
+            rx[i] = response;
+        }
+    }
 }
 
 #define R1_IDLE_STATE           (1 << 0)
@@ -210,6 +366,13 @@ int SDFileSystem::disk_initialize() {
         return 1;
     }
     debug_if(SD_DBG, "init card = %d\n", _is_initialized);
+
+    // CRC check of commands and data blocks (CMD59)
+    if (SD_CRC && (_cmd(59, 1) != 0)) {
+        debug("CRC on timed out\n");
+        return 1;
+    }
+
     _sectors = _sd_sectors();
 
     // Set block length to 512 (CMD16)
@@ -223,23 +386,58 @@ int SDFileSystem::disk_initialize() {
     return 0;
 }
 
+int SDFileSystem::disk_resume() {
+    if (!_is_initialized) {
+        return 1;
+    }
+    
+    // Reconfigures the SPI peripheral with this object's format and clock
+    _spi.frequency(_transfer_sck);
+    return 0;
+}
+
 int SDFileSystem::disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
     if (!_is_initialized) {
         return -1;
     }
     
-    for (uint32_t b = block_number; b < block_number + count; b++) {
+    if (count == 1) {
         // set write address for single block (CMD24)
-        if (_cmd(24, b * cdv) != 0) {
+        if (_cmd(24, block_number * cdv) != 0) {
             return 1;
         }
         
         // send the data block
-        _write(buffer, 512);
+        return _write(buffer, 512);
+    }
+    
+    // pre-erase the blocks (ACMD23), only a hint to the card
+    _cmd(55, 0);
+    _cmd(23, count);
+    
+    // set write address for multiple blocks (CMD25), cs stays low
+    if (_cmdx(25, block_number * cdv) != 0) {
+        return 1;
+    }
+    _spi.write(0xFF);
+    
+    int result = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (_write_block(0xFC, buffer, 512) != 0) {
+            result = 1;
+            break;
+        }
         buffer += 512;
     }
     
-    return 0;
+    // stop token, then wait for the card to program the last block
+    _spi.write(0xFD);
+    _spi.write(0xFF);
+    while (_spi.write(0xFF) == 0);
+    
+    _cs = 1;
+    _spi.write(0xFF);
+    return result;
 }
 
 int SDFileSystem::disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
@@ -247,18 +445,31 @@ int SDFileSystem::disk_read(uint8_t* buffer, uint32_t block_number, uint32_t cou
         return -1;
     }
     
-    for (uint32_t b = block_number; b < block_number + count; b++) {
+    if (count == 1) {
         // set read address for single block (CMD17)
-        if (_cmd(17, b * cdv) != 0) {
+        if (_cmd(17, block_number * cdv) != 0) {
             return 1;
         }
         
         // receive the data
-        _read(buffer, 512);
+        return _read(buffer, 512);
+    }
+    
+    // set read address for multiple blocks (CMD18), cs stays low
+    if (_cmdx(18, block_number * cdv) != 0) {
+        return 1;
+    }
+    
+    int result = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (_read_block(buffer, 512) != 0) {
+            result = 1;
+            break;
+        }
         buffer += 512;
     }
-
-    return 0;
+    
+    return (_stop_transmission() == 0) ? result : 1;
 }
 
 int SDFileSystem::disk_status() {
@@ -279,12 +490,7 @@ int SDFileSystem::_cmd(int cmd, int arg) {
     _cs = 0;
 
     // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_command(cmd, arg);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
@@ -303,12 +509,7 @@ int SDFileSystem::_cmdx(int cmd, int arg) {
     _cs = 0;
 
     // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_command(cmd, arg);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
@@ -328,12 +529,7 @@ int SDFileSystem::_cmd58() {
     int arg = 0;
 
     // send a command
-    _spi.write(0x40 | 58);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_command(58, arg);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
@@ -382,52 +578,87 @@ int SDFileSystem::_cmd8() {
     return -1; // timeout
 }
 
-int SDFileSystem::_read(uint8_t *buffer, uint32_t length) {
-    _cs = 0;
+// CMD12, ends a multiple block read, cs is still low from the transfer
+int SDFileSystem::_stop_transmission() {
+    _send_command(12, 0);
 
-    // read until start byte (0xFF)
-    while (_spi.write(0xFF) != 0xFE);
+    // stuff byte, the card may still be sending data
+    _spi.write(0xFF);
 
-    // read data
-    for (uint32_t i = 0; i < length; i++) {
-        buffer[i] = _spi.write(0xFF);
+    // wait for the response (response[7] == 0), then for the busy signal
+    int response = -1;
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        response = _spi.write(0xFF);
+        if (!(response & 0x80)) {
+            while (_spi.write(0xFF) == 0);
+            break;
+        }
     }
-    _spi.write(0xFF); // checksum
-    _spi.write(0xFF);
 
     _cs = 1;
     _spi.write(0xFF);
+    return (response == 0) ? 0 : 1;
+}
+
+// One data block, cs already low
+int SDFileSystem::_read_block(uint8_t *buffer, uint32_t length) {
+    // read until start byte (0xFE)
+    while (_spi.write(0xFF) != 0xFE);
+
+    // read data
+    _transfer(NULL, buffer, length);
+
+    // checksum
+    uint16_t crc = _spi.write(0xFF) << 8;
+    crc |= _spi.write(0xFF);
+    if (SD_CRC && (crc != crc16(buffer, length))) {
+        debug("Data CRC error\n");
+        return 1;
+    }
     return 0;
 }
 
-int SDFileSystem::_write(const uint8_t*buffer, uint32_t length) {
+int SDFileSystem::_read(uint8_t *buffer, uint32_t length) {
     _cs = 0;
 
+    int result = _read_block(buffer, length);
+
+    _cs = 1;
+    _spi.write(0xFF);
+    return result;
+}
+
+// One data block after the start token, cs already low
+int SDFileSystem::_write_block(uint8_t token, const uint8_t *buffer, uint32_t length) {
     // indicate start of block
-    _spi.write(0xFE);
+    _spi.write(token);
 
     // write the data
-    for (uint32_t i = 0; i < length; i++) {
-        _spi.write(buffer[i]);
-    }
+    _transfer(buffer, NULL, length);
 
-    // write the checksum
-    _spi.write(0xFF);
-    _spi.write(0xFF);
+    // write the checksum, ignored by the card unless CRC is on
+    uint16_t crc = SD_CRC ? crc16(buffer, length) : 0xFFFF;
+    _spi.write(crc >> 8);
+    _spi.write(crc & 0xFF);
 
     // check the response token
     if ((_spi.write(0xFF) & 0x1F) != 0x05) {
-        _cs = 1;
-        _spi.write(0xFF);
         return 1;
     }
 
     // wait for write to finish
     while (_spi.write(0xFF) == 0);
+    return 0;
+}
+
+int SDFileSystem::_write(const uint8_t*buffer, uint32_t length) {
+    _cs = 0;
+
+    int result = _write_block(0xFE, buffer, length);
 
     _cs = 1;
     _spi.write(0xFF);
-    return 0;
+    return result;
 }
 
 static uint32_t ext_bits(unsigned char *data, int msb, int lsb) {
@@ -461,6 +692,19 @@ uint32_t SDFileSystem::_sd_sectors() {
         return 0;
     }
 
+    // Maximum transfer rate (TRAN_SPEED) : csd[103:96], time value x10 and
+    // rate unit, lowers the transfer clock below the SPI mode limit
+    static const uint8_t tran_values[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    static const uint32_t tran_units[4] = { 10000, 100000, 1000000, 10000000 };
+    uint32_t tran_speed = ext_bits(csd, 103, 96);
+    if ((tran_speed & 0x7) < 4) {
+        uint32_t hz = tran_values[(tran_speed >> 3) & 0xF] * tran_units[tran_speed & 0x7];
+        if ((hz != 0) && (hz < _transfer_sck)) {
+            _transfer_sck = hz;
+        }
+    }
+    debug_if(SD_DBG, "\n\rTRAN_SPEED: 0x%02x, transfer clock %d\n\r", tran_speed, _transfer_sck);
+
     // csd_structure : csd[127:126]
     // c_size        : csd[73:62]
     // c_size_mult   : csd[49:47]
@@ -53,6 +53,8 @@ public:
      */
     SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name);
     virtual int disk_initialize();
+    // Sets SPI up for an initialised card again, after another device used the bus
+    virtual int disk_resume();
     virtual int disk_status();
     virtual int disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
     virtual int disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
@@ -61,6 +63,7 @@ public:
 
 protected:
 
+    void _send_command(int cmd, int arg);
     int _cmd(int cmd, int arg);
     int _cmdx(int cmd, int arg);
     int _cmd8();
@@ -69,8 +72,13 @@ protected:
     int initialise_card_v1();
     int initialise_card_v2();
 
+    int _stop_transmission();
+
     int _read(uint8_t * buffer, uint32_t length);
     int _write(const uint8_t *buffer, uint32_t length);
+    int _read_block(uint8_t * buffer, uint32_t length);
+    int _write_block(uint8_t token, const uint8_t *buffer, uint32_t length);
+    void _transfer(const uint8_t *tx, uint8_t *rx, uint32_t length);
     uint32_t _sd_sectors();
     uint32_t _sectors;
 
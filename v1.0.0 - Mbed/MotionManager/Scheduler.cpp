@@ -0,0 +1,104 @@
+#include "Scheduler.h"
+#include "Profiler.h"
+#include "main.h"
+
+#if PROFILER_TASK_SITES < SCHEDULER_MAX_TASKS
+#error "Profiler needs a site for every scheduler task"
+#endif
+
+void InitScheduler(struct Scheduler * scheduler){
+	scheduler->taskCount = 0;
+}
+
+// Register a task, returns its id
+// Periodic tasks start enabled, event driven tasks are always enabled
+uint8_t AddTask(struct Scheduler * scheduler, const char * name, TaskFunction function, uint8_t priority, uint32_t period, uint32_t deadline){
+	if(scheduler->taskCount >= SCHEDULER_MAX_TASKS)
+		_Error_Handler(__FILE__, __LINE__);
+
+	uint8_t id = scheduler->taskCount++;
+	Task * task = &scheduler->tasks[id];
+
+	task->function = function;
+	task->priority = priority;
+	task->period = period;
+	task->deadline = deadline;
+	task->enabled = true;
+	task->pending = false;
+	task->release = 0;
+	task->nextRelease = HAL_GetTick() + period;
+	task->runs = 0;
+	task->missedDeadlines = 0;
+	task->maxLateness = 0;
+
+	SetProfileSiteName(PROFILE_TASK + id, name);
+
+	return id;
+}
+
+// Mark a task ready, safe to call from interrupts
+void PostTask(struct Scheduler * scheduler, uint8_t id){
+	Task * task = &scheduler->tasks[id];
+
+	if(task->pending == false){
+		task->release = HAL_GetTick();
+		task->pending = true;
+	}
+}
+
+void EnableTask(struct Scheduler * scheduler, uint8_t id){
+	Task * task = &scheduler->tasks[id];
+
+	task->nextRelease = HAL_GetTick() + task->period;
+	task->enabled = true;
+}
+
+void DisableTask(struct Scheduler * scheduler, uint8_t id){
+	Task * task = &scheduler->tasks[id];
+
+	task->enabled = false;
+	task->pending = false;
+}
+
+// Release due periodic tasks and run the ready task with the highest priority
+void RunScheduler(struct Scheduler * scheduler){
+	uint32_t now = HAL_GetTick();
+	Task * next = NULL;
+
+	for(uint8_t i = 0; i < scheduler->taskCount; i++){
+		Task * task = &scheduler->tasks[i];
+
+		if(task->enabled == false)
+			continue;
+
+		if((task->period != 0) && ((int32_t)(now - task->nextRelease) >= 0)){
+			PostTask(scheduler, i);
+			task->release = task->nextRelease;
+			task->nextRelease += task->period;
+
+			// Fell behind more than a period, skip the missed releases
+			if((int32_t)(now - task->nextRelease) >= 0)
+				task->nextRelease = now + task->period;
+		}
+
+		if(task->pending && ((next == NULL) || (task->priority < next->priority)))
+			next = task;
+	}
+
+	if(next == NULL)
+		return;
+
+	next->pending = false;
+
+	uint32_t lateness = now - next->release;
+	if(lateness > next->maxLateness)
+		next->maxLateness = lateness;
+	if(lateness > next->deadline)
+		next->missedDeadlines++;
+
+	next->runs++;
+
+	uint32_t start = ProfileStart();
+	next->function();
+	ProfileStop(PROFILE_TASK + (next - scheduler->tasks), start);
+}
@@ -0,0 +1,54 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Cooperative main loop scheduler
+// Interrupts only post tasks, RunScheduler executes the ready task with the
+// highest priority (0 is the highest) to completion
+
+#define SCHEDULER_MAX_TASKS     8
+
+typedef void (*TaskFunction)(void);
+
+typedef struct Task
+{
+	TaskFunction function;
+	uint8_t priority;
+
+	// Release period in ms, 0 for event driven tasks
+	uint32_t period;
+	// Time allowed between release and start of execution in ms
+	uint32_t deadline;
+
+	bool enabled;
+	volatile bool pending;
+	uint32_t release;
+	uint32_t nextRelease;
+
+	// Statistics
+	uint32_t runs;
+	uint32_t missedDeadlines;
+	uint32_t maxLateness;
+} Task;
+
+typedef struct Scheduler
+{
+	Task tasks[SCHEDULER_MAX_TASKS];
+	uint8_t taskCount;
+} Scheduler;
+
+void InitScheduler(struct Scheduler * scheduler);
+
+uint8_t AddTask(struct Scheduler * scheduler, const char * name, TaskFunction function, uint8_t priority, uint32_t period, uint32_t deadline);
+
+void PostTask(struct Scheduler * scheduler, uint8_t id);
+
+void EnableTask(struct Scheduler * scheduler, uint8_t id);
+
+void DisableTask(struct Scheduler * scheduler, uint8_t id);
+
+void RunScheduler(struct Scheduler * scheduler);
+
+#endif
@@ -0,0 +1,307 @@
+#include "Settings.h"
+#include <stdio.h>
+#include <string.h>
+
+// Significant digits kept, more do not change a float
+#define SETTINGS_DIGITS         17
+#define SETTINGS_MAX_EXPONENT   38
+
+void InitSettings(struct Settings * settings, SettingsCallback callback, void * context){
+	settings->callback = callback;
+	settings->context = context;
+	settings->length = 0;
+	settings->overflow = false;
+	settings->section[0] = '\0';
+}
+
+static bool IsSpace(char c){
+	return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static bool IsDigit(char c){
+	return (c >= '0') && (c <= '9');
+}
+
+// Leading and trailing spaces off, in place
+static char * Trim(char * text){
+	while(IsSpace(*text))
+		text++;
+
+	char * end = text + strlen(text);
+	while((end > text) && IsSpace(end[-1]))
+		end--;
+	*end = '\0';
+	return text;
+}
+
+static double PowerOfTen(uint8_t exponent){
+	double power = 1.0;
+	while(exponent-- != 0)
+		power *= 10.0;
+	return power;
+}
+
+bool ParseSettingsNumber(const char * text, float * value){
+	while(IsSpace(*text))
+		text++;
+
+	bool negative = (*text == '-');
+	if((*text == '-') || (*text == '+'))
+		text++;
+
+	uint64_t mantissa = 0;
+	uint8_t digits = 0;
+	int16_t exponent = 0;
+	bool any = false;
+
+	for(; IsDigit(*text); text++){
+		any = true;
+		if(digits < SETTINGS_DIGITS){
+			mantissa = mantissa * 10 + (*text - '0');
+			if(mantissa != 0)
+				digits++;
+		}
+		else
+			exponent++;
+	}
+
+	if(*text == '.'){
+		for(text++; IsDigit(*text); text++){
+			any = true;
+			if(digits < SETTINGS_DIGITS){
+				mantissa = mantissa * 10 + (*text - '0');
+				if(mantissa != 0)
+					digits++;
+				exponent--;
+			}
+		}
+	}
+
+	if(any == false)
+		return false;
+
+	if((*text == 'e') || (*text == 'E')){
+		text++;
+		bool negativeExponent = (*text == '-');
+		if((*text == '-') || (*text == '+'))
+			text++;
+		if(IsDigit(*text) == false)
+			return false;
+
+		int16_t written = 0;
+		for(; IsDigit(*text); text++){
+			if(written < 1000)
+				written = written * 10 + (*text - '0');
+		}
+		exponent += negativeExponent ? -written : written;
+	}
+
+	while(IsSpace(*text))
+		text++;
+	if(*text != '\0')
+		return false;
+
+	// In double, the powers of ten up to 10^22 are exact and the mantissa
+	// needs no rounding, so the result is rounded to float as scanf would
+	double result = (double)mantissa;
+	if(mantissa == 0)
+		exponent = 0;
+	if((exponent + digits) > (SETTINGS_MAX_EXPONENT + 1))
+		return false;
+	if(exponent < 0){
+		if((exponent + digits) < -SETTINGS_MAX_EXPONENT)
+			result = 0.0;
+		else if(exponent < -SETTINGS_MAX_EXPONENT){
+			result /= PowerOfTen(SETTINGS_MAX_EXPONENT);
+			result /= PowerOfTen(-exponent - SETTINGS_MAX_EXPONENT);
+		}
+		else
+			result /= PowerOfTen(-exponent);
+	}
+	else
+		result *= PowerOfTen(exponent);
+
+	*value = (float)(negative ? -result : result);
+	return true;
+}
+
+static void ParseLine(struct Settings * settings){
+	settings->line[settings->length] = '\0';
+
+	char * comment = strchr(settings->line, '#');
+	if(comment != NULL)
+		*comment = '\0';
+
+	char * line = Trim(settings->line);
+
+	if(*line == '['){
+		char * end = strchr(line, ']');
+		if(end == NULL)
+			return;
+		*end = '\0';
+
+		line = Trim(line + 1);
+		strncpy(settings->section, line, SETTINGS_NAME_SIZE - 1);
+		settings->section[SETTINGS_NAME_SIZE - 1] = '\0';
+		return;
+	}
+
+	char * equals = strchr(line, '=');
+	if(equals == NULL)
+		return;
+	*equals = '\0';
+
+	char * key = Trim(line);
+	char * text = equals + 1;
+	float values[SETTINGS_MAX_VALUES];
+	uint8_t count = 0;
+
+	// Comma separated values, a bad one makes the whole line bad
+	bool bad = settings->overflow;
+	while(bad == false){
+		char * comma = strchr(text, ',');
+		if(comma != NULL)
+			*comma = '\0';
+
+		if((count >= SETTINGS_MAX_VALUES) || (ParseSettingsNumber(text, &values[count]) == false))
+			bad = true;
+		else
+			count++;
+
+		if(comma == NULL)
+			break;
+		text = comma + 1;
+	}
+
+	settings->callback(settings->context, settings->section, key, values, bad ? 0 : count);
+}
+
+void ParseSettings(struct Settings * settings, const char * data, uint32_t size){
+	for(uint32_t i = 0; i < size; i++){
+		char c = data[i];
+
+		if(c == '\n'){
+			ParseLine(settings);
+			settings->length = 0;
+			settings->overflow = false;
+		}
+		else if(settings->length < (SETTINGS_LINE_SIZE - 1))
+			settings->line[settings->length++] = c;
+		else
+			settings->overflow = true;
+	}
+}
+
+void FinishSettings(struct Settings * settings){
+	if(settings->length != 0)
+		ParseLine(settings);
+
+	settings->length = 0;
+	settings->overflow = false;
+}
+
+void InitSettingsEditor(struct SettingsEditor * editor, const char * section, const char * const * keys, const float * values, uint8_t count, SettingsOutput output, void * context){
+	editor->output = output;
+	editor->context = context;
+	editor->section = section;
+	editor->keys = keys;
+	editor->values = values;
+	editor->count = (count > 8) ? 8 : count;
+	editor->written = 0;
+	editor->inSection = false;
+	editor->length = 0;
+	editor->overflow = false;
+}
+
+static void WriteSetting(struct SettingsEditor * editor, uint8_t index, const char * end){
+	char text[SETTINGS_LINE_SIZE];
+	int length = snprintf(text, sizeof(text), "%s = %.7g%s", editor->keys[index], (double)editor->values[index], end);
+	editor->output(editor->context, text, (uint32_t)length);
+	editor->written |= (uint8_t)(1 << index);
+}
+
+// Line in the buffer without its line break, newline if it had one
+static void EditLine(struct SettingsEditor * editor, bool newline){
+	char copy[SETTINGS_LINE_SIZE];
+	memcpy(copy, editor->line, editor->length);
+	copy[editor->length] = '\0';
+
+	char * comment = strchr(copy, '#');
+	if(comment != NULL)
+		*comment = '\0';
+	char * line = Trim(copy);
+
+	if(*line == '['){
+		char * end = strchr(line, ']');
+		if(end != NULL){
+			*end = '\0';
+			editor->inSection = (strcmp(Trim(line + 1), editor->section) == 0);
+		}
+	}
+	else if(editor->inSection && (strchr(line, '=') != NULL)){
+		*strchr(line, '=') = '\0';
+		char * key = Trim(line);
+
+		for(uint8_t i = 0; i < editor->count; i++){
+			if(strcmp(key, editor->keys[i]) == 0){
+				bool crlf = (editor->length != 0) && (editor->line[editor->length - 1] == '\r');
+				WriteSetting(editor, i, newline ? (crlf ? "\r\n" : "\n") : "");
+				return;
+			}
+		}
+	}
+
+	editor->output(editor->context, editor->line, editor->length);
+	if(newline)
+		editor->output(editor->context, "\n", 1);
+}
+
+void EditSettings(struct SettingsEditor * editor, const char * data, uint32_t size){
+	uint32_t i = 0;
+	while(i < size){
+		// Rest of a long line as it is
+		if(editor->overflow){
+			const char * newline = (const char *)memchr(&data[i], '\n', size - i);
+			uint32_t length = (newline != NULL) ? (uint32_t)(newline - &data[i]) + 1 : (size - i);
+			editor->output(editor->context, &data[i], length);
+			editor->overflow = (newline == NULL);
+			i += length;
+			continue;
+		}
+
+		char c = data[i++];
+		if(c == '\n'){
+			EditLine(editor, true);
+			editor->length = 0;
+		}
+		else if(editor->length < (SETTINGS_LINE_SIZE - 1))
+			editor->line[editor->length++] = c;
+		else{
+			editor->output(editor->context, editor->line, editor->length);
+			editor->output(editor->context, &c, 1);
+			editor->length = 0;
+			editor->overflow = true;
+		}
+	}
+}
+
+void FinishSettingsEditor(struct SettingsEditor * editor){
+	// Last line without a line break
+	bool newline = (editor->length == 0) && (editor->overflow == false);
+	if(editor->length != 0)
+		EditLine(editor, false);
+	editor->length = 0;
+	editor->overflow = false;
+
+	uint8_t all = (uint8_t)((1 << editor->count) - 1);
+	if(editor->written == all)
+		return;
+
+	char text[SETTINGS_NAME_SIZE + 4];
+	int length = snprintf(text, sizeof(text), "%s[%s]\n", newline ? "\n" : "\n\n", editor->section);
+	editor->output(editor->context, text, (uint32_t)length);
+	for(uint8_t i = 0; i < editor->count; i++){
+		if((editor->written & (1 << i)) == 0)
+			WriteSetting(editor, i, "\n");
+	}
+}
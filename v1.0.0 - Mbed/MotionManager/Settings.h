@@ -0,0 +1,79 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Reader of the settings file, sections of key = value lines
+//   # comment
+//   [section]
+//   key = value, value ...
+// The file is fed in chunks as it comes from the card, a line may span two
+// chunks. Each setting line goes to the callback with its section and values,
+// the callback checks and stores them. No heap and no stdio, the numbers go
+// through ParseSettingsNumber() instead of scanf.
+// A line too long for the buffer, with a value that is not a number or with
+// too many values is passed with no values, a line without "=" is ignored.
+
+#define SETTINGS_LINE_SIZE      64
+#define SETTINGS_NAME_SIZE      24      // Section, with the terminating 0
+#define SETTINGS_MAX_VALUES     4
+
+typedef void (*SettingsCallback)(void * context, const char * section, const char * key, const float * values, uint8_t count);
+
+typedef struct Settings
+{
+	SettingsCallback callback;
+	void * context;
+
+	char line[SETTINGS_LINE_SIZE];
+	uint8_t length;
+	bool overflow;              // Line longer than the buffer, the rest is skipped
+	char section[SETTINGS_NAME_SIZE];
+} Settings;
+
+void InitSettings(struct Settings * settings, SettingsCallback callback, void * context);
+
+// Next chunk of the file
+void ParseSettings(struct Settings * settings, const char * data, uint32_t size);
+
+// End of the file, a last line without a line break is passed on
+void FinishSettings(struct Settings * settings);
+
+// Writer of an edited copy of the settings file, fed in chunks as the reader
+// The lines of the keys in the section get their new value, comments on them
+// are dropped, every other line is copied as it is. Keys not found are added
+// in a new section at the end. Values are written with 7 significant digits,
+// all a float has.
+typedef void (*SettingsOutput)(void * context, const char * data, uint32_t size);
+
+typedef struct SettingsEditor
+{
+	SettingsOutput output;
+	void * context;
+	const char * section;
+	const char * const * keys;
+	const float * values;
+	uint8_t count;
+
+	uint8_t written;            // Bit per key
+	bool inSection;
+	char line[SETTINGS_LINE_SIZE];
+	uint8_t length;
+	bool overflow;              // Line longer than the buffer, copied through
+} SettingsEditor;
+
+// Up to 8 keys, the arrays are used until FinishSettingsEditor()
+void InitSettingsEditor(struct SettingsEditor * editor, const char * section, const char * const * keys, const float * values, uint8_t count, SettingsOutput output, void * context);
+
+// Next chunk of the file
+void EditSettings(struct SettingsEditor * editor, const char * data, uint32_t size);
+
+// End of the file, the keys not found are added
+void FinishSettingsEditor(struct SettingsEditor * editor);
+
+// Decimal number with an optional sign, fraction and exponent, surrounding
+// spaces allowed. False if there is anything else.
+bool ParseSettingsNumber(const char * text, float * value);
+
+#endif
@@ -0,0 +1,113 @@
+#include "SpiBus.h"
+
+void InitSpiBus(struct SpiBus * bus){
+	bus->deviceCount = 0;
+	bus->owner = SPI_BUS_FREE;
+	bus->configured = SPI_BUS_FREE;
+	bus->queueHead = 0;
+	bus->queueCount = 0;
+}
+
+uint8_t AddSpiDevice(struct SpiBus * bus, SpiBusCallback configure, SpiSelectCallback select, SpiBusCallback granted){
+	uint8_t id = bus->deviceCount++;
+	SpiDevice * device = &bus->devices[id];
+
+	device->configure = configure;
+	device->select = select;
+	device->granted = granted;
+	device->grants = 0;
+	device->waits = 0;
+	return id;
+}
+
+// Peripheral set up for the new owner, outside of the critical sections
+static void SetUp(struct SpiBus * bus, uint8_t id){
+	SpiDevice * device = &bus->devices[id];
+
+	device->grants++;
+	if(bus->configured != id){
+		if(device->configure != NULL)
+			device->configure();
+		bus->configured = id;
+	}
+	if(device->select != NULL)
+		device->select(true);
+}
+
+static bool IsQueued(struct SpiBus * bus, uint8_t id){
+	for(uint8_t i = 0; i < bus->queueCount; i++){
+		if(bus->queue[(bus->queueHead + i) % SPI_BUS_MAX_DEVICES] == id)
+			return true;
+	}
+	return false;
+}
+
+bool RequestSpiBus(struct SpiBus * bus, uint8_t device){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if(bus->owner == device){
+		__set_PRIMASK(primask);
+		return true;
+	}
+
+	if(bus->owner != SPI_BUS_FREE){
+		if(IsQueued(bus, device) == false){
+			bus->queue[(bus->queueHead + bus->queueCount) % SPI_BUS_MAX_DEVICES] = device;
+			bus->queueCount++;
+			bus->devices[device].waits++;
+		}
+		__set_PRIMASK(primask);
+		return false;
+	}
+
+	bus->owner = device;
+	__set_PRIMASK(primask);
+
+	SetUp(bus, device);
+	return true;
+}
+
+void AcquireSpiBus(struct SpiBus * bus, uint8_t device){
+	if(RequestSpiBus(bus, device))
+		return;
+
+	// The owner's release hands it over, from an interrupt for the LCD
+	while(bus->owner != device);
+}
+
+void ReleaseSpiBus(struct SpiBus * bus, uint8_t device){
+	if(bus->owner != device)
+		return;
+
+	if(bus->devices[device].select != NULL)
+		bus->devices[device].select(false);
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint8_t next = SPI_BUS_FREE;
+	if(bus->queueCount != 0){
+		next = bus->queue[bus->queueHead];
+		bus->queueHead = (bus->queueHead + 1) % SPI_BUS_MAX_DEVICES;
+		bus->queueCount--;
+	}
+	else
+		bus->owner = SPI_BUS_FREE;
+
+	__set_PRIMASK(primask);
+
+	if(next == SPI_BUS_FREE)
+		return;
+
+	// A waiting device only sees the bus as its own once it is set up
+	SetUp(bus, next);
+	bus->owner = next;
+
+	if(bus->devices[next].granted != NULL)
+		bus->devices[next].granted();
+}
+
+bool SpiBusContended(struct SpiBus * bus){
+	return (bus->queueCount != 0);
+}
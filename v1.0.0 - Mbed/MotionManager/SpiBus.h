@@ -0,0 +1,67 @@
+#ifndef SPIBUS_H
+#define SPIBUS_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Arbiter of a SPI peripheral shared by several devices (SPI1: LCD, SD card)
+// One device owns the bus at a time. A device that finds it taken is queued
+// and gets it in request order when the owner releases it.
+// Devices driven from interrupts (the LCD command queue) request without
+// waiting and carry on in their granted callback, the others wait in
+// AcquireSpiBus. Long users release between transactions while
+// SpiBusContended, so no device starves.
+// On a change of owner the configure callback sets the peripheral up for the
+// new device (mode, clock) and select drives its chip select. Both run in the
+// context of the request or of the release that hands the bus over.
+
+#define SPI_BUS_MAX_DEVICES     4
+#define SPI_BUS_FREE            0xFF
+
+typedef void (*SpiBusCallback)(void);
+typedef void (*SpiSelectCallback)(bool selected);
+
+typedef struct SpiDevice
+{
+	SpiBusCallback configure;   // NULL if the driver sets the peripheral up itself
+	SpiSelectCallback select;   // NULL if the driver drives its chip select
+	SpiBusCallback granted;     // Queued request got the bus, NULL for waiting users
+
+	// Statistics
+	uint32_t grants;
+	uint32_t waits;             // Requests that had to queue
+} SpiDevice;
+
+typedef struct SpiBus
+{
+	SpiDevice devices[SPI_BUS_MAX_DEVICES];
+	uint8_t deviceCount;
+
+	volatile uint8_t owner;     // SPI_BUS_FREE if nobody holds it
+	uint8_t configured;         // Device the peripheral is set up for
+
+	// Waiting devices in request order
+	uint8_t queue[SPI_BUS_MAX_DEVICES];
+	uint8_t queueHead;
+	volatile uint8_t queueCount;
+} SpiBus;
+
+void InitSpiBus(struct SpiBus * bus);
+
+// Returns the device id
+uint8_t AddSpiDevice(struct SpiBus * bus, SpiBusCallback configure, SpiSelectCallback select, SpiBusCallback granted);
+
+// True if the device owns the bus now, else it is queued and its granted
+// callback runs once it gets the bus
+bool RequestSpiBus(struct SpiBus * bus, uint8_t device);
+
+// Returns once the device owns the bus, main loop only
+void AcquireSpiBus(struct SpiBus * bus, uint8_t device);
+
+// Deselects the device and hands the bus to the next one waiting
+void ReleaseSpiBus(struct SpiBus * bus, uint8_t device);
+
+// Another device is waiting for the bus
+bool SpiBusContended(struct SpiBus * bus);
+
+#endif
@@ -0,0 +1,66 @@
+#include "Tachometer.h"
+#include <math.h>
+
+void InitTachometer(struct Tachometer * tachometer, float countsPerRev, float tickFrequency, uint16_t now){
+	tachometer->countsPerRev = countsPerRev;
+	tachometer->tickFrequency = tickFrequency;
+	tachometer->rpmPerCountPerTick = 60.0f * tickFrequency / countsPerRev;
+	tachometer->timeoutTicks = (uint32_t)(TACHOMETER_TIMEOUT * tickFrequency);
+	tachometer->time = 0;
+	tachometer->sampleTime = now;
+	ResetTachometer(tachometer);
+}
+
+void ResetTachometer(struct Tachometer * tachometer){
+	tachometer->hasEdge = false;
+	tachometer->edgeCount = 0;
+	tachometer->edgeTime = tachometer->time;
+	tachometer->rpm = 0.0f;
+}
+
+// Ticks to RPM for the given counts
+static float CountsToRpm(struct Tachometer * tachometer, float counts, uint32_t ticks){
+	return tachometer->rpmPerCountPerTick * counts / (float)ticks;
+}
+
+float UpdateTachometer(struct Tachometer * tachometer, uint16_t now, bool captured, int16_t edgeCount, uint16_t edgeTime){
+	tachometer->time += (uint16_t)(now - tachometer->sampleTime);
+	tachometer->sampleTime = now;
+
+	uint32_t timeout = tachometer->timeoutTicks;
+
+	if(captured){
+		// Captures are at most one counter wrap old
+		uint32_t time = tachometer->time - (uint16_t)(now - edgeTime);
+		uint32_t ticks = time - tachometer->edgeTime;
+
+		// After a stop the first edge only starts the next measurement
+		if(tachometer->hasEdge && (ticks != 0) && (ticks < timeout)){
+			// Counts wrap with the 16 bit encoder timer
+			int16_t counts = edgeCount - tachometer->edgeCount;
+			tachometer->rpm = CountsToRpm(tachometer, (float)counts, ticks);
+		}
+		else
+			tachometer->rpm = 0.0f;
+
+		tachometer->hasEdge = true;
+		tachometer->edgeCount = edgeCount;
+		tachometer->edgeTime = time;
+	}
+	else if(tachometer->hasEdge){
+		uint32_t ticks = tachometer->time - tachometer->edgeTime;
+
+		// Slowing down, the next edge is at least this far away
+		if(ticks >= timeout){
+			tachometer->hasEdge = false;
+			tachometer->rpm = 0.0f;
+		}
+		else{
+			float limit = CountsToRpm(tachometer, TACHOMETER_EDGE_COUNTS, ticks);
+			if(fabsf(tachometer->rpm) > limit)
+				tachometer->rpm = copysignf(limit, tachometer->rpm);
+		}
+	}
+
+	return tachometer->rpm;
+}
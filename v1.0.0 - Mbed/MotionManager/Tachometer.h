@@ -0,0 +1,46 @@
+#ifndef TACHOMETER_H
+#define TACHOMETER_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Encoder speed from counts and edge timestamps (M/T method)
+// TIM1 latches its count on every rising edge of encoder channel A and TIM3
+// captures the time of the same edge. The speed is the counts between the last
+// timestamped edges of two samples over the time between those edges, so the
+// resolution no longer depends on the control period.
+// Without a new edge the speed is limited to one edge since the last one.
+// Timestamps are a free running 16 bit counter, samples must be less than a
+// counter wrap apart.
+
+#define TACHOMETER_EDGE_COUNTS      4       // Quadrature counts between rising edges of A
+#define TACHOMETER_TIMEOUT          0.5f    // s without an edge before the speed is 0
+
+typedef struct Tachometer
+{
+	float countsPerRev;         // Quadrature counts per revolution
+	float tickFrequency;        // Hz of the timestamp counter
+
+	// Folded by InitTachometer, the update only multiplies and divides by ticks
+	float rpmPerCountPerTick;   // 60 * tickFrequency / countsPerRev
+	uint32_t timeoutTicks;
+
+	bool hasEdge;
+	int16_t edgeCount;          // Encoder count at the last timestamped edge
+	uint32_t edgeTime;          // Ticks of the last timestamped edge
+	uint32_t time;              // Ticks at the last sample, extended to 32 bits
+	uint16_t sampleTime;        // Counter at the last sample
+
+	float rpm;
+} Tachometer;
+
+void InitTachometer(struct Tachometer * tachometer, float countsPerRev, float tickFrequency, uint16_t now);
+
+// Forget the last edge, speed is 0
+void ResetTachometer(struct Tachometer * tachometer);
+
+// Once per control period with the counter now and, if there was an edge since
+// the last call, its count and capture. Returns RPM.
+float UpdateTachometer(struct Tachometer * tachometer, uint16_t now, bool captured, int16_t edgeCount, uint16_t edgeTime);
+
+#endif
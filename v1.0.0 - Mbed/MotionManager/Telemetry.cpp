@@ -0,0 +1,47 @@
+#include "Telemetry.h"
+
+#if (TELEMETRY_SIZE & (TELEMETRY_SIZE - 1)) != 0
+#error "TELEMETRY_SIZE must be a power of two"
+#endif
+
+void InitTelemetry(struct TelemetryRing * ring){
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+}
+
+bool PushTelemetry(struct TelemetryRing * ring, const struct TelemetrySample * sample){
+	uint32_t head = ring->head;
+
+	if((head - ring->tail) >= TELEMETRY_SIZE){
+		ring->dropped++;
+		return false;
+	}
+
+	ring->samples[head & (TELEMETRY_SIZE - 1)] = *sample;
+
+	// Record written before the consumer can see it
+	__DMB();
+	ring->head = head + 1;
+	return true;
+}
+
+bool PopTelemetry(struct TelemetryRing * ring, struct TelemetrySample * sample){
+	uint32_t tail = ring->tail;
+
+	if(ring->head == tail)
+		return false;
+
+	// Head read before the record it published
+	__DMB();
+	*sample = ring->samples[tail & (TELEMETRY_SIZE - 1)];
+
+	// Record read before the producer can overwrite it
+	__DMB();
+	ring->tail = tail + 1;
+	return true;
+}
+
+uint32_t GetTelemetryCount(struct TelemetryRing * ring){
+	return ring->head - ring->tail;
+}
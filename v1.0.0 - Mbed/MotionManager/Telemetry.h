@@ -0,0 +1,46 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Control loop samples from the TIM3 interrupt to the main loop
+// Lock free for a single producer (the interrupt) and a single consumer (a
+// main loop task): only the producer writes head and only the consumer writes
+// tail. Both run freely and wrap with the power of two size, head - tail is the
+// fill level. Word stores are atomic on the Cortex-M4, the barrier orders the
+// record before the index that hands it over.
+// A full ring drops the new sample and counts it, the interrupt never waits.
+
+#define TELEMETRY_SIZE      64      // Samples, power of two
+
+typedef struct TelemetrySample
+{
+	uint32_t time;          // us, TIM3 extended to 32 bits
+	int16_t encoderDelta;   // Counts since the last sample
+	int16_t pwm;            // Signed, negative is backward
+	float rpm;              // Filtered, as seen by the controller
+	float error;            // Reference - rpm
+	float integral;         // PWM
+} TelemetrySample;
+
+typedef struct TelemetryRing
+{
+	TelemetrySample samples[TELEMETRY_SIZE];
+	volatile uint32_t head;     // Producer
+	volatile uint32_t tail;     // Consumer
+	volatile uint32_t dropped;  // Producer
+} TelemetryRing;
+
+void InitTelemetry(struct TelemetryRing * ring);
+
+// Producer, false if full
+bool PushTelemetry(struct TelemetryRing * ring, const struct TelemetrySample * sample);
+
+// Consumer, false if empty
+bool PopTelemetry(struct TelemetryRing * ring, struct TelemetrySample * sample);
+
+// Samples waiting, exact for the consumer, a lower bound for the producer
+uint32_t GetTelemetryCount(struct TelemetryRing * ring);
+
+#endif
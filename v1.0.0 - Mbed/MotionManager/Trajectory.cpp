@@ -0,0 +1,110 @@
+#include "Trajectory.h"
+#include <math.h>
+
+static float Clamp(float value, float minimum, float maximum){
+	if(value > maximum)
+		return maximum;
+	if(value < minimum)
+		return minimum;
+	return value;
+}
+
+void InitTrajectory(struct Trajectory * trajectory, uint8_t profile, float maxRate, float maxRateChange){
+	// Limits of 0 would never reach the target
+	if((maxRate <= 0.0f) && (profile != TRAJECTORY_STEP))
+		profile = TRAJECTORY_STEP;
+	if((maxRateChange <= 0.0f) && (profile == TRAJECTORY_SCURVE))
+		profile = TRAJECTORY_RAMP;
+
+	trajectory->profile = profile;
+	trajectory->maxRate = maxRate;
+	trajectory->maxRateChange = maxRateChange;
+	ResetTrajectory(trajectory, 0.0f);
+}
+
+void ResetTrajectory(struct Trajectory * trajectory, float position){
+	trajectory->position = position;
+	trajectory->rate = 0.0f;
+}
+
+float UpdateTrajectory(struct Trajectory * trajectory, float target, float dt){
+	float error = target - trajectory->position;
+
+	switch(trajectory->profile){
+		case TRAJECTORY_RAMP:{
+			float step = trajectory->maxRate * dt;
+			float change = Clamp(error, -step, step);
+			trajectory->position += change;
+			trajectory->rate = change / dt;
+			break;
+		}
+		case TRAJECTORY_SCURVE:{
+			// Fastest rate that still stops on the target, v^2 = 2 * a * distance
+			float braking = sqrtf(2.0f * trajectory->maxRateChange * fabsf(error));
+			float desired = copysignf(fminf(trajectory->maxRate, braking), error);
+			float step = trajectory->maxRateChange * dt;
+
+			trajectory->rate += Clamp(desired - trajectory->rate, -step, step);
+			trajectory->position += trajectory->rate * dt;
+
+			// Arrived or passed the target in this period
+			float remaining = target - trajectory->position;
+			if((remaining * error <= 0.0f) || ((fabsf(remaining) <= step * dt) && (fabsf(trajectory->rate) <= step))){
+				trajectory->position = target;
+				trajectory->rate = 0.0f;
+			}
+			break;
+		}
+		default:
+			trajectory->position = target;
+			trajectory->rate = 0.0f;
+			break;
+	}
+
+	return trajectory->position;
+}
+
+void ClearTrajectoryProgram(struct TrajectoryProgram * program){
+	program->count = 0;
+	StopTrajectoryProgram(program);
+}
+
+bool AddTrajectoryProgramStep(struct TrajectoryProgram * program, float target, float duration){
+	if(program->count >= TRAJECTORY_PROGRAM_STEPS)
+		return false;
+
+	program->target[program->count] = target;
+	program->duration[program->count] = duration;
+	program->count++;
+	return true;
+}
+
+bool StartTrajectoryProgram(struct TrajectoryProgram * program){
+	program->index = 0;
+	program->time = 0.0f;
+	program->running = (program->count != 0);
+	return program->running;
+}
+
+void StopTrajectoryProgram(struct TrajectoryProgram * program){
+	program->running = false;
+}
+
+bool UpdateTrajectoryProgram(struct TrajectoryProgram * program, float dt, float * target){
+	if(program->running == false)
+		return false;
+
+	*target = program->target[program->index];
+
+	program->time += dt;
+	if(program->time >= program->duration[program->index]){
+		program->time -= program->duration[program->index];
+		program->index++;
+
+		// Last target holds
+		if(program->index >= program->count)
+			program->running = false;
+	}
+
+	return true;
+}
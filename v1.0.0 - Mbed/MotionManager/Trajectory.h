@@ -0,0 +1,67 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "stm32f3xx_hal.h"
+#include <stdbool.h>
+
+// Setpoint trajectory between the knob and the controller
+// The reference moves to the target as
+//   TRAJECTORY_STEP     at once, as before
+//   TRAJECTORY_RAMP     at maxRate
+//   TRAJECTORY_SCURVE   at maxRate, the rate itself changing by at most
+//                       maxRateChange per second (jerk limited for a speed)
+// The S-curve starts braking early enough to stop on the target.
+//
+// A program is a list of targets, each held for its duration from the time it
+// is set, ramps included. The last target holds after the program ends.
+
+#define TRAJECTORY_STEP             0
+#define TRAJECTORY_RAMP             1
+#define TRAJECTORY_SCURVE           2
+
+#define TRAJECTORY_PROGRAM_STEPS    16
+
+typedef struct Trajectory
+{
+	uint8_t profile;
+	float maxRate;              // Units per second
+	float maxRateChange;        // Units per second^2, S-curve only
+
+	float position;             // Reference
+	float rate;                 // Units per second
+} Trajectory;
+
+typedef struct TrajectoryProgram
+{
+	float target[TRAJECTORY_PROGRAM_STEPS];
+	float duration[TRAJECTORY_PROGRAM_STEPS];   // s
+	uint8_t count;
+
+	uint8_t index;
+	float time;                 // s since the current step was set
+	bool running;
+} TrajectoryProgram;
+
+void InitTrajectory(struct Trajectory * trajectory, uint8_t profile, float maxRate, float maxRateChange);
+
+// Reference to position, at rest
+void ResetTrajectory(struct Trajectory * trajectory, float position);
+
+// One control period of dt seconds towards target, returns the reference
+float UpdateTrajectory(struct Trajectory * trajectory, float target, float dt);
+
+void ClearTrajectoryProgram(struct TrajectoryProgram * program);
+
+// False if the program is full
+bool AddTrajectoryProgramStep(struct TrajectoryProgram * program, float target, float duration);
+
+// Starts from the first step, false for an empty program
+bool StartTrajectoryProgram(struct TrajectoryProgram * program);
+
+void StopTrajectoryProgram(struct TrajectoryProgram * program);
+
+// One control period of dt seconds. Writes the target of the current step,
+// returns false once the program is stopped or over.
+bool UpdateTrajectoryProgram(struct TrajectoryProgram * program, float dt, float * target);
+
+#endif
@@ -1,12 +1,50 @@
 #include "mbed.h"
 #include "main.h"
 #include "LCD.h"
+#include "Scheduler.h"
+#include "Profiler.h"
+#include "Tachometer.h"
+#include "FixedPointPI.h"
+#include "PID.h"
+#include "Trajectory.h"
+#include "Autotune.h"
+#include "Dosing.h"
+#include "GainSchedule.h"
+#include "PlantEstimator.h"
+#include "Telemetry.h"
+#include "DataLog.h"
+#include "SpiBus.h"
+#include "Settings.h"
+#include "FlashStore.h"
+#include "Protocol.h"
 #include "SDFileSystem.h"
+#include "ff.h"
 #include "logo.h"
+#include <stddef.h>
 
 // DEBUG
 //Serial pc(SERIAL_TX, SERIAL_RX);
 
+// Binary commands and telemetry on the ST-LINK virtual COM port, see
+// Protocol.h and serialTaskFunction()
+// pc sets up USART2, the protocol moves its data by DMA in both directions.
+// printf output goes to the same port between the frames.
+RawSerial pc(SERIAL_TX, SERIAL_RX);
+#define serialBaud 460800
+#define serialReceiveSize 64 //Circular receive DMA, bytes
+#define serialCommandSize 16 //Longest command frame, encoded
+#define serialStreamSamples 12 //Telemetry samples per frame
+uint8_t serialReceive[serialReceiveSize];
+uint16_t serialReceiveTail = 0;
+uint8_t serialCommand[serialCommandSize];
+ProtocolDecoder serialDecoder;
+uint8_t serialFrame[PROTOCOL_FRAME_SIZE(PROTOCOL_MAX_PAYLOAD)]; //Transmit DMA
+volatile bool serialTransmitting = false;
+bool serialStreaming = false;
+uint8_t serialStream[4 + serialStreamSamples * sizeof(TelemetrySample)]; //Dropped count, samples
+uint8_t serialStreamCount = 0;
+uint32_t serialStreamDropped = 0; //Samples that found the frame full
+
 /* Private variables ---------------------------------------------------------*/
 SPI_HandleTypeDef hspi1;
 TIM_HandleTypeDef htim1;
@@ -14,13 +52,20 @@ TIM_HandleTypeDef htim3;
 TIM_HandleTypeDef htim15;
 TIM_HandleTypeDef htim16;
 TIM_HandleTypeDef htim17;
+TIM_HandleTypeDef htim7;
+DMA_HandleTypeDef hdma_spi1_tx;
+DMA_HandleTypeDef hdma_usart2_tx;
+DMA_HandleTypeDef hdma_usart2_rx;
 
 // mosi, miso, sclk, cs
 SDFileSystem sd(PA_7, PA_6, PA_5, PA_3, "sd");
 
 /* Private variables ---------------------------------------------------------*/
 #define encodingType 4.0f //Quadrature Encoding
-#define RPMCalculationFreq 100.0f
+#define gainTuningFrequency 100.0f //[PID] gains and alpha are per period at this rate
+#define timestampFrequency 1000000.0f //TIM3 - 64Mhz / 64
+#define minLoopFrequency 20.0f //Control period fits the 16 bit TIM3 counter
+#define maxLoopFrequency 2000.0f
 
 #define pwmResolution 2048
 
@@ -28,37 +73,103 @@ SDFileSystem sd(PA_7, PA_6, PA_5, PA_3, "sd");
 
 LCD * lcd;
 
+// SPI1 - LCD and SD card take turns, see SpiBus.h
+SpiBus spiBus;
+uint8_t lcdBusDevice;
+uint8_t sdBusDevice;
+
+// Main loop tasks
+Scheduler scheduler;
+uint8_t uiTask;
+uint8_t renderTask;
+uint8_t blinkTask;
+uint8_t autotuneTask;
+uint8_t telemetryTask;
+uint8_t logTask;
+uint8_t serialTask;
+uint8_t parameterTask;
+
 /*******************************************************************************
-    RPM Resolution per encoder tick
-        (Encoder tick/sec) to RPM
+    RPM Calculation (M/T method)
+        TIM1 latches the encoder count on each rising edge of channel A,
+        TIM3 input capture latches the time of the same edge (TIM1 TRGO)
 
-                        60sec * (Frequency of RPM calculation timer)
-    RPM_res_per_tick = ----------------------------------------------
-                        Encoder Resolution * Encoder Reading Mode(x4)
+                        60sec * (Encoder count between edges)
+    motorRPM = ---------------------------------------------------------------
+                (Time between edges) * Encoder Resolution * Encoder Reading Mode(x4)
 *******************************************************************************/
-#define RPM_res_per_tick (60.0f * RPMCalculationFreq) / (encoderPulsePerRev * encodingType)
-
-// RPM Calculation
-volatile int16_t prevEncoderCount = 0;
+Tachometer tachometer;
 volatile float motorRPM = 0.0f;
 
 //Moving Average for RPM smoothing
 volatile float averagedMotorRpm = 0.0f;
-volatile float alpha = 0.128f;
+float alpha = 0.128f;
 
 // Voltage Control
 volatile float voltage = 0.0f;
 
-// PI Control
-volatile float Kp = 0.02f;
-volatile float Ki = 0.01f;
-volatile float Kd = 0.0f;
-volatile float integral = 0.0f;
-volatile float integralMin = -2048.0f;
-volatile float integralMax = 2048.0f;
+// PID Control
+// Gains are only written on boot, the control interrupt uses the loop* copies
+float Kp = 0.02f;
+float Ki = 0.01f;
+float Kd = 0.0f;
+float integralMin = -2048.0f;
+float integralMax = 2048.0f;
+float setpointWeight = 1.0f;
+float trackingGain = 0.02f;
+float derivativeCutoff = 0.0f; //Hz, 0 is unfiltered
+
+// Feed-forward - Quadratic Function PWM versus RPM
+float feedForwardA = 0.0f, feedForwardB = 0.0f, feedForwardC = 0.0f;
+float accelerationFeedForward = 0.0f; //PWM per RPM/s of the reference
+
+// Control Loop
+// TIM3 counts freely at 1Mhz, CH2 compares every controlPeriod ticks
+float loopFrequency = 100.0f;
+uint16_t controlPeriod = 10000;
+bool fixedPointControl = false;
+bool controlLoopRunning = false;
+
+// Ki, Kd and alpha scaled to the loop frequency
+float loopPeriod = 0.01f; //s
+float loopKi = 0.01f;
+float loopAlpha = 0.128f;
+float loopTuningPeriods = 1.0f; //gainTuningFrequency periods per loop period
+PID pid;
+FixedPointPI fixedPointPI;
+
+// Gain Schedule - [gainSchedule] points replace the [PID] gains by RPM
+GainSchedule gainSchedule;
+
+// Plant Estimator - RLS of the pump next to the PID
+// With adaptiveTimeConstant the PI gains follow the estimate (lambda tuning)
+float estimatorForgetting = 0.99f;
+float adaptiveTimeConstant = 0.0f; //s, closed loop, 0 only identifies
+#define adaptiveGainRange 4.0f
+PlantEstimator plantEstimator;
 
 volatile float refRpm = 0.0f;
 
+// Trajectory - Reference RPM and voltage move to the knob's value
+uint8_t trajectoryProfile = TRAJECTORY_STEP;
+float rpmRate = 2000.0f;            //RPM/s
+float rpmRateChange = 20000.0f;     //RPM/s^2
+float voltageRate = 5.0f;           //V/s
+float voltageRateChange = 50.0f;    //V/s^2
+Trajectory rpmTrajectory;
+Trajectory voltageTrajectory;
+TrajectoryProgram rpmProgram;
+TrajectoryProgram voltageProgram;
+
+// Autotune - Relay experiment around autotuneRpm, the gains go to [PID]
+float autotuneRpm = 3000.0f;
+float autotuneAmplitude = 200.0f;   //PWM above and below the bias
+float autotuneHysteresis = 20.0f;   //RPM
+uint8_t autotuneCycles = 4;
+uint8_t autotuneRule = AUTOTUNE_TYREUS_LUYBEN_PI;
+const char * autotuneResult = "";
+Autotune autotune;
+
 // Encoder
 float encoderPulsePerRev = 100.0f;
 
@@ -72,6 +183,25 @@ float refRpmLowerThreshold = 0.0f;
 float refRpmUpperThreshold = 10000.0f;
 float refRpmResolution = 100.0f;
 
+// Flow
+volatile float refFlowRate = 0.0f;
+float refFlowRateLowerThreshold = 0.0f;
+float refFlowRateUpperThreshold = 400.0f;
+float refFlowRateResolution = 5.0f;
+
+// Batch Dosing - Volume from the encoder in the control interrupt, see Dosing.h
+// The knob sets the dose, select starts it, back aborts it
+float dosingMlPerRev = 0.048f;      //MZR-7223 displacement, calibrate
+float dosingRpm = 3000.0f;
+float dosingDeceleration = 5000.0f; //RPM/s
+float dosingCreepRpm = 300.0f;
+float dosingLearning = 0.5f;
+volatile float refVolume = 0.0f;    //ml
+float refVolumeLowerThreshold = 0.0f;
+float refVolumeUpperThreshold = 100.0f;
+float refVolumeResolution = 0.5f;
+Dosing dosing;
+
 //Flow Rate
 //volatile float flowRate = 0.0f;
 // Flow Rate versus Voltage
@@ -79,14 +209,198 @@ float refRpmResolution = 100.0f;
 // FR = f(V) = A*V^2 + B*V + C
 float A = 0.0f, B = 0.0f, C = 0.0f;
 
+// Flow Rate versus RPM, used instead of the voltage function if on the SD card
+// FR = f(RPM) = rpmA*RPM^2 + rpmB*RPM + rpmC
+bool flowRateVersusRpm = false;
+float rpmA = 0.0f, rpmB = 0.0f, rpmC = 0.0f;
+
+// Telemetry - One sample per control interrupt, drained by the telemetry task
+// into telemetrySink, nothing keeps them without a sink
+TelemetryRing telemetry;
+uint16_t telemetryEncoderCount = 0;
+void (*telemetrySink)(const TelemetrySample * sample) = NULL;
+
+// Data Log - Telemetry of every control page run to /sd/motionManager/logs/,
+// one runNNNN.bin per run, see DataLog.h. Off with [log] enabled = 0.
+// The telemetry task fills the sectors, the log task writes them
+#define logSyncSectors 64 //File size on the card updated every 32kB
+DataLog dataLog;
+FILE * logFile = NULL;
+uint16_t logRun = 0; //Last run number on the card
+bool dataLogEnabled = true;
+bool dataLogRunning = false; //Samples go to dataLog
+bool dataLogStopping = false; //Last sectors and close pending
+
+// Parameter Store - Settings and the last setpoints in the two top flash pages,
+// see FlashStore.h. Settings loaded from the SD card are written to it, on
+// boot without a card or usable settings.txt the last ones come from it.
+// The parameter task writes the changes, page erases wait for the control
+// loop to stop. A setpoint is written once it has held for setpointHoldTime
+// or the control loop stops, each write programs flash under the control
+// interrupt and a host streaming setpoints would fill the page.
+#define parameterPage0 (FLASH_BASE + 0xF000) //Kept out of the image, see stm32f303x8.sct
+#define parameterPage1 (FLASH_BASE + 0xF800)
+#define parameterSetpointKey 0x0100 //refRpm, refFlowRate, voltage, refVolume, dosing coast volume
+#define parameterScheduleKey 0x0200 //Point count, then rpm, Kp, Ki, Kd per point
+#define parameterRpmProgramKey 0x0300 //Step count, then target, duration per step
+#define parameterVoltageProgramKey 0x0400
+FlashStore parameterStore;
+bool parameterMirror = false; //Settings from the SD card not in flash yet
+bool parameterPending = false; //Writes left until the control loop stops
+#define setpointHoldTime 5000 //ms
+volatile bool setpointChanged = false; //Saved setpoints not in flash yet
+volatile uint32_t setpointTime = 0; //HAL_GetTick() of the last change
+bool flashConfiguration = false; //Settings in use came from flash
+float savedRefRpm = 0.0f; //Last set with the knob, where it starts
+float savedRefFlowRate = 0.0f;
+float savedVoltage = 0.0f;
+float savedRefVolume = 0.0f;
+
+// Settings
+// The SD card's settings.txt is read into a staged copy, checked and swapped
+// in whole by applyConfiguration(), on boot and on a reload without a power
+// cycle. A key missing from the file or out of its range keeps the setting in
+// use, the compiled in default on boot.
+#define settingsPath "0:/motionManager/settings.txt" //FatFs drive 0 is the card
+#define settingsChunkSize 64 //Bytes per f_read, the FIL object holds the sector
+#define settingsCopyPath "0:/motionManager/settings.tmp" //Edited settings.txt before it replaces the file
+
+typedef struct Configuration
+{
+    float A, B, C;                                              //[flowRateVersusVoltage]
+    bool flowRateVersusRpm;                                     //[flowRateVersusRpm]
+    float rpmA, rpmB, rpmC;
+    float Kp, Ki, Kd, integralMin, integralMax, alpha;          //[PID]
+    float setpointWeight, trackingGain, derivativeCutoff;       //[PIDTuning]
+    float feedForwardA, feedForwardB, feedForwardC;             //[pwmVersusRpm]
+    float accelerationFeedForward;
+    float voltageResolution, voltageUpperThreshold;             //[voltage]
+    float refRpmResolution, refRpmUpperThreshold;               //[RPM]
+    float refFlowRateResolution, refFlowRateUpperThreshold;     //[flow]
+    float encoderPulsePerRev;                                   //[encoder]
+    float loopFrequency;                                        //[controlLoop]
+    bool fixedPointControl;
+    uint8_t trajectoryProfile;                                  //[trajectory]
+    float rpmRate, rpmRateChange, voltageRate, voltageRateChange;
+    GainSchedule gainSchedule;                                  //[gainSchedule]
+    float estimatorForgetting, adaptiveTimeConstant;            //[plantEstimator]
+    float autotuneRpm, autotuneAmplitude, autotuneHysteresis;   //[autotune]
+    uint8_t autotuneCycles, autotuneRule;
+    bool dataLogEnabled;                                        //[log]
+    float dosingMlPerRev, dosingRpm, dosingDeceleration;        //[dosing]
+    float dosingCreepRpm, dosingLearning;
+    float refVolumeResolution, refVolumeUpperThreshold;
+    TrajectoryProgram rpmProgram, voltageProgram;               //[rpmProgram], [voltageProgram]
+} Configuration;
+
+// Keys of settings.txt with one value, stored at offset in Configuration
+// The index is the key in the parameter store, new keys go to the end
+#define settingFloat 0
+#define settingBool 1 //0 or 1
+#define settingByte 2
+
+typedef struct SettingKey
+{
+    const char * section;
+    const char * key;
+    uint16_t offset;
+    uint8_t type;
+    float min, max;
+} SettingKey;
+
+#define settingKey(section, key, field, type, min, max) { section, key, offsetof(Configuration, field), type, min, max }
+#define anyValue 1.0e9f
+
+const SettingKey settingKeys[] = {
+    settingKey("flowRateVersusVoltage", "A", A, settingFloat, -anyValue, anyValue),
+    settingKey("flowRateVersusVoltage", "B", B, settingFloat, -anyValue, anyValue),
+    settingKey("flowRateVersusVoltage", "C", C, settingFloat, -anyValue, anyValue),
+    settingKey("flowRateVersusRpm", "A", rpmA, settingFloat, -anyValue, anyValue),
+    settingKey("flowRateVersusRpm", "B", rpmB, settingFloat, -anyValue, anyValue),
+    settingKey("flowRateVersusRpm", "C", rpmC, settingFloat, -anyValue, anyValue),
+    settingKey("PID", "Kp", Kp, settingFloat, 0.0f, 1000.0f),
+    settingKey("PID", "Ki", Ki, settingFloat, 0.0f, 1000.0f),
+    settingKey("PID", "Kd", Kd, settingFloat, 0.0f, 1000.0f),
+    settingKey("PID", "integralMin", integralMin, settingFloat, -anyValue, anyValue),
+    settingKey("PID", "integralMax", integralMax, settingFloat, -anyValue, anyValue),
+    settingKey("PID", "alpha", alpha, settingFloat, 0.001f, 1.0f),
+    settingKey("PIDTuning", "setpointWeight", setpointWeight, settingFloat, 0.0f, 1.0f),
+    settingKey("PIDTuning", "trackingGain", trackingGain, settingFloat, 0.0f, 1000.0f),
+    settingKey("PIDTuning", "derivativeCutoff", derivativeCutoff, settingFloat, 0.0f, 10000.0f),
+    settingKey("pwmVersusRpm", "A", feedForwardA, settingFloat, -anyValue, anyValue),
+    settingKey("pwmVersusRpm", "B", feedForwardB, settingFloat, -anyValue, anyValue),
+    settingKey("pwmVersusRpm", "C", feedForwardC, settingFloat, -anyValue, anyValue),
+    settingKey("pwmVersusRpm", "D", accelerationFeedForward, settingFloat, -anyValue, anyValue),
+    settingKey("voltage", "voltageResolution", voltageResolution, settingFloat, 0.001f, 100.0f),
+    settingKey("voltage", "voltageUpperThreshold", voltageUpperThreshold, settingFloat, 0.1f, 100.0f),
+    settingKey("RPM", "refRpmResolution", refRpmResolution, settingFloat, 0.1f, 100000.0f),
+    settingKey("RPM", "refRpmUpperThreshold", refRpmUpperThreshold, settingFloat, 1.0f, 100000.0f),
+    settingKey("flow", "refFlowRateResolution", refFlowRateResolution, settingFloat, 0.001f, 100000.0f),
+    settingKey("flow", "refFlowRateUpperThreshold", refFlowRateUpperThreshold, settingFloat, 0.001f, 100000.0f),
+    settingKey("encoder", "encoderPulsePerRev", encoderPulsePerRev, settingFloat, 1.0f, 100000.0f),
+    settingKey("controlLoop", "loopFrequency", loopFrequency, settingFloat, minLoopFrequency, maxLoopFrequency),
+    settingKey("controlLoop", "fixedPoint", fixedPointControl, settingBool, 0.0f, 1.0f),
+    settingKey("trajectory", "profile", trajectoryProfile, settingByte, TRAJECTORY_STEP, TRAJECTORY_SCURVE),
+    settingKey("trajectory", "rpmRate", rpmRate, settingFloat, 0.001f, anyValue),
+    settingKey("trajectory", "rpmRateChange", rpmRateChange, settingFloat, 0.001f, anyValue),
+    settingKey("trajectory", "voltageRate", voltageRate, settingFloat, 0.001f, anyValue),
+    settingKey("trajectory", "voltageRateChange", voltageRateChange, settingFloat, 0.001f, anyValue),
+    settingKey("plantEstimator", "forgettingFactor", estimatorForgetting, settingFloat, 0.5f, 1.0f),
+    settingKey("plantEstimator", "adaptiveTimeConstant", adaptiveTimeConstant, settingFloat, 0.0f, 100.0f),
+    settingKey("autotune", "autotuneRpm", autotuneRpm, settingFloat, 0.0f, 100000.0f),
+    settingKey("autotune", "amplitude", autotuneAmplitude, settingFloat, 1.0f, pwmResolution),
+    settingKey("autotune", "hysteresis", autotuneHysteresis, settingFloat, 0.0f, 100000.0f),
+    settingKey("autotune", "cycles", autotuneCycles, settingByte, 1.0f, 255.0f),
+    settingKey("autotune", "rule", autotuneRule, settingByte, AUTOTUNE_TYREUS_LUYBEN_PI, AUTOTUNE_ZIEGLER_NICHOLS_PID),
+    settingKey("log", "enabled", dataLogEnabled, settingBool, 0.0f, 1.0f),
+    settingKey("dosing", "mlPerRev", dosingMlPerRev, settingFloat, 0.000001f, 1000.0f),
+    settingKey("dosing", "rpm", dosingRpm, settingFloat, 1.0f, 100000.0f),
+    settingKey("dosing", "deceleration", dosingDeceleration, settingFloat, 1.0f, anyValue),
+    settingKey("dosing", "creepRpm", dosingCreepRpm, settingFloat, 0.0f, 100000.0f),
+    settingKey("dosing", "learning", dosingLearning, settingFloat, 0.0f, 1.0f),
+    settingKey("dosing", "volumeResolution", refVolumeResolution, settingFloat, 0.001f, 100000.0f),
+    settingKey("dosing", "volumeUpperThreshold", refVolumeUpperThreshold, settingFloat, 0.001f, 100000.0f)
+};
+#define settingKeyCount (sizeof(settingKeys) / sizeof(settingKeys[0]))
+
+// State of one read of settings.txt
+typedef struct SettingsRead
+{
+    Configuration * configuration;
+    bool gainSchedule, rpmProgram, voltageProgram; //List cleared by its first line
+    bool bad; //A line was not used, configurationResult names it
+} SettingsRead;
+
+// Outcome of the last load for the Reload Settings page and the serial port
+char configurationResult[17] = "";
+
+// Scale Factors
+// Derived from the SD card settings by computeScaleFactors() whenever they are
+// loaded, the control interrupt and the screen multiply instead of dividing on
+// every call
+typedef struct ScaleFactors
+{
+    float voltsToPwm;       // pwmResolution / voltageUpperThreshold
+    float pwmToVolts;       // voltageUpperThreshold / pwmResolution
+    float flowPerPwm[3];    // Flow Rate versus Voltage in PWM counts, FR = (a*PWM + b)*PWM + c
+} ScaleFactors;
+ScaleFactors scale;
+
 //Display Selection
 volatile float displayedRefRpm = 0.0f;
+volatile float displayedRefFlowRate = 0.0f;
 volatile float displayedVoltage = 0.0f;
+volatile float displayedRefVolume = 0.0f;
 
 // Rotary Knob
 volatile uint8_t prevState = 0;
 volatile int16_t cycleCount = 0;
 
+// Knob and button events, consumed by the UI task
+volatile int8_t knobSteps = 0;
+volatile bool selectPressed = false;
+volatile bool backPressed = false;
+
 //Debouncing
 uint32_t currentMillis = 0;
 uint32_t prevMillis = 0;
@@ -119,22 +433,53 @@ enum menu{
     Logo,
     ControlSelection,
     RpmControl,
+    FlowControl,
     VoltageControl,
-    About
+    PIDAutotune,
+    ReloadSettings,
+    About,
+    BatchDosing
 };
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_TIM1_Init(void);
 static void MX_TIM16_Init(void);
 static void MX_TIM3_Init(void);
 static void MX_SPI1_Init(void);
 static void MX_TIM17_Init(void);
 static void MX_TIM15_Init(void);
+static void MX_TIM7_Init(void);
+static void MX_USART2_Init(void);
 
 void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 
+void setControlLoop(void);
+void startControlLoop(void);
+void stopControlLoop(void);
+
+void uiTaskFunction(void);
+void renderTaskFunction(void);
+void blinkTaskFunction(void);
+void autotuneTaskFunction(void);
+void telemetryTaskFunction(void);
+void logTaskFunction(void);
+void serialTaskFunction(void);
+void parameterTaskFunction(void);
+void serialTransmitted(DMA_HandleTypeDef * hdma);
+void waitSerialTransmit(void);
+void streamTelemetry(const TelemetrySample * sample);
+void startDataLog(void);
+void stopDataLog(void);
+void benchmarkScaleFactors(FILE * fp);
+void lcdBusConfigure(void);
+void lcdBusSelect(bool selected);
+void lcdBusGranted(void);
+bool loadConfiguration(void);
+bool reloadConfiguration(void);
+
 enum menu menuSelection = Logo;
 
 void applyPWM(int16_t pwmValue){
@@ -171,6 +516,18 @@ void decreaseDisplayedRefRPM(void){
         displayedRefRpm -= refRpmResolution;
 }
 
+// Increase Displayed Reference Flow Rate
+void incrementDisplayedRefFlowRate(void){
+    if(displayedRefFlowRate < refFlowRateUpperThreshold)
+        displayedRefFlowRate += refFlowRateResolution;
+}
+
+// Decrease Displayed Reference Flow Rate
+void decreaseDisplayedRefFlowRate(void){
+    if(refFlowRateLowerThreshold < displayedRefFlowRate)
+        displayedRefFlowRate -= refFlowRateResolution;
+}
+
 // Increase Displayed Voltage
 void incrementDisplayedVoltage(void){
     if(displayedVoltage < voltageUpperThreshold)
@@ -183,6 +540,18 @@ void decreaseDisplayedVoltage(void){
         displayedVoltage -= voltageResolution;
 }
 
+// Increase Displayed Dose
+void incrementDisplayedRefVolume(void){
+    if(displayedRefVolume < refVolumeUpperThreshold)
+        displayedRefVolume += refVolumeResolution;
+}
+
+// Decrease Displayed Dose
+void decreaseDisplayedRefVolume(void){
+    if(refVolumeLowerThreshold < displayedRefVolume)
+        displayedRefVolume -= refVolumeResolution;
+}
+
 //Count the Digits before .
 uint8_t digitsInFloat(unsigned char * f){
     uint8_t i = 0;
@@ -193,10 +562,77 @@ uint8_t digitsInFloat(unsigned char * f){
     return digitCount;
 }
 
-//Calculate Flow Rate from Voltage - Quadratic Function
-float calculateFlowRate(float _volt){
-    float flowRate = (A * _volt * _volt) + (B * _volt) + C;
-    return flowRate;
+//Scale factors and folded coefficients of a voltage range and flow rate function
+void computeScaleFactors(float _voltageUpperThreshold, float _A, float _B, float _C, ScaleFactors * s){
+    s->voltsToPwm = (float)pwmResolution / _voltageUpperThreshold;
+    s->pwmToVolts = _voltageUpperThreshold / (float)pwmResolution;
+    
+    //Flow Rate vs Voltage with Voltage = PWM * pwmToVolts
+    s->flowPerPwm[0] = _A * s->pwmToVolts * s->pwmToVolts;
+    s->flowPerPwm[1] = _B * s->pwmToVolts;
+    s->flowPerPwm[2] = _C;
+}
+
+//Scale factors of the settings read from the SD card, with what folds in the
+//encoder resolution
+void commitConfiguration(const ScaleFactors * factors){
+    scale = *factors;
+    
+    //Encoder counts to ml, a running dose carries on with them
+    InitDosing(&dosing, dosingMlPerRev, encoderPulsePerRev * encodingType, dosingRpm, dosingDeceleration, dosingCreepRpm, dosingLearning);
+}
+
+//Flow Rate from the measured RPM if there is an RPM function, else from the PWM - Quadratic Functions
+float estimateFlowRate(void){
+    if(flowRateVersusRpm){
+        float _rpm = averagedMotorRpm;
+        return (rpmA * _rpm + rpmB) * _rpm + rpmC;
+    }
+    float _pwm = (float)pwm;
+    return (scale.flowPerPwm[0] * _pwm + scale.flowPerPwm[1]) * _pwm + scale.flowPerPwm[2];
+}
+
+//Smallest x >= 0 with a*x^2 + b*x + c = y, on the rising side of the curve
+float invertQuadratic(float a, float b, float c, float y){
+    float d = y - c;
+    if(d <= 0.0f)
+        return 0.0f;
+    
+    //Beyond the top of a falling curve, its peak
+    float discriminant = b * b + 4.0f * a * d;
+    if(discriminant < 0.0f)
+        return (b > 0.0f) ? (-b / (2.0f * a)) : 0.0f;
+    
+    //Same root as (-b + sqrt(discriminant)) / 2a, also for a = 0
+    float denominator = b + sqrtf(discriminant);
+    if(denominator <= 0.0f)
+        return 0.0f;
+    return 2.0f * d / denominator;
+}
+
+//Reference RPM for a Flow Rate - Inverse of the RPM function, else of the
+//voltage function followed by the feed-forward PWM versus RPM function
+float calculateRpmForFlowRate(float _flowRate){
+    float _rpm;
+    if(flowRateVersusRpm)
+        _rpm = invertQuadratic(rpmA, rpmB, rpmC, _flowRate);
+    else{
+        float _pwm = invertQuadratic(A, B, C, _flowRate) * scale.voltsToPwm;
+        _rpm = invertQuadratic(feedForwardA, feedForwardB, feedForwardC, _pwm);
+    }
+    
+    if(_rpm > refRpmUpperThreshold)
+        _rpm = refRpmUpperThreshold;
+    return _rpm;
+}
+
+//Calculate Feed-forward PWM from Reference RPM - Quadratic Function
+float calculateFeedForward(float _rpm){
+    if(_rpm == 0.0f)
+        return 0.0f;
+    float _speed = fabsf(_rpm);
+    float feedForward = (feedForwardA * _speed + feedForwardB) * _speed + feedForwardC;
+    return (_rpm > 0.0f) ? feedForward : -feedForward;
 }
 
 //Refresh Numbers on the screen
@@ -214,6 +650,12 @@ void refreshScreen(void){
         else if(selected == false)
             sprintf((char *)array, "%.1f", refRpm);
     }
+    else if(menuSelection == FlowControl){
+        if(selected == true)
+            sprintf((char *)array, "%.1f", displayedRefFlowRate);
+        else if(selected == false)
+            sprintf((char *)array, "%.1f", refFlowRate);
+    }
     else if(menuSelection == VoltageControl){
         if(selected == true){
             sprintf((char *)array, "%.1f", displayedVoltage);
@@ -237,95 +679,177 @@ void refreshScreen(void){
     free(rpmStr);
     
     //Calculate Flow Rate
-    float flowRate =0.0f;
-    if(menuSelection == RpmControl)
-        flowRate = calculateFlowRate(((float)pwm / ((float)pwmResolution)) * voltageUpperThreshold);
-    else if(menuSelection == VoltageControl)
-        flowRate = calculateFlowRate(voltage);
+    //Measured, the trajectory may still be on its way
+    float flowRate = estimateFlowRate();
         
     // Flow Rate
     unsigned char * flowRateStr = (unsigned char *)malloc(16);
     sprintf((char *)flowRateStr, "%.1f", flowRate);
     DisplayStringRightAlligned(lcd,3,7, flowRateStr, digitsInFloat(flowRateStr)+2);
     free(flowRateStr);
+    
+    FlushDisplay(lcd);
+}
+
+//Refresh the Autotune page - Setpoint, RPM and progress
+void refreshAutotuneScreen(void){
+    //Clear Second and Fourth Rows - Fill with Spaces
+    DisplayStringLeftAlligned(lcd,1,0, (unsigned char *)"                ", strlen("                "));
+    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)"                ", strlen("                "));
+    
+    char text[17];
+    
+    // Setpoint
+    sprintf(text, "%.1f", autotune.setpoint);
+    DisplayStringRightAlligned(lcd,1,6, (unsigned char *)text, digitsInFloat((unsigned char *)text)+2);
+    
+    // RPM
+    sprintf(text, "%.1f", averagedMotorRpm);
+    DisplayStringRightAlligned(lcd,1,15, (unsigned char *)text, digitsInFloat((unsigned char *)text)+2);
+    
+    // Progress, result once the autotune task has run
+    if(autotune.state == AUTOTUNE_RUNNING){
+        if(autotune.cycle < AUTOTUNE_SETTLING_CYCLES)
+            sprintf(text, "Settling");
+        else
+            sprintf(text, "Cycle %d/%d", autotune.cycle - AUTOTUNE_SETTLING_CYCLES + 1, autotune.cycles);
+    }
+    else
+        sprintf(text, "%s", autotuneResult);
+    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)text, strlen(text));
+    
+    FlushDisplay(lcd);
+}
+
+//Refresh the Batch Dosing page - Dose, delivered volume and state
+void refreshDosingScreen(void){
+    //Clear Second and Fourth Rows - Fill with Spaces
+    DisplayStringLeftAlligned(lcd,1,0, (unsigned char *)"                ", strlen("                "));
+    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)"                ", strlen("                "));
+    
+    char text[17];
+    
+    // Dose
+    sprintf(text, "%.1f", (selected == true) ? displayedRefVolume : refVolume);
+    DisplayStringRightAlligned(lcd,1,6, (unsigned char *)text, digitsInFloat((unsigned char *)text)+2);
+    
+    // Delivered, counts on while coasting
+    sprintf(text, "%.2f", GetDosedVolume(&dosing));
+    DisplayStringRightAlligned(lcd,1,15, (unsigned char *)text, digitsInFloat((unsigned char *)text)+3);
+    
+    // State
+    if(dosing.state == DOSING_RUNNING)
+        sprintf(text, "%.0f RPM", averagedMotorRpm);
+    else if(dosing.state == DOSING_COASTING)
+        sprintf(text, "Stopping");
+    else if(dosing.state == DOSING_DONE)
+        sprintf(text, "Done %.1fs", dosing.time);
+    else if(dosing.state == DOSING_ABORTED)
+        sprintf(text, "Aborted");
+    else
+        sprintf(text, "Ready");
+    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)text, strlen(text));
+    
+    FlushDisplay(lcd);
 }
 
 // Display underline of Ref RPM
 void underlineHighlight(void){
-    WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 29);
-    WriteInstruction(lcd, 0x80);
-    WriteRam(lcd, 0x7F);
-    WriteRam(lcd, 0xFF);
-    WriteRam(lcd, 0xFF);
-    WriteRam(lcd, 0xFF);
-    WriteRam(lcd, 0xFF);
-    WriteRam(lcd, 0xFF);
-    WriteRam(lcd, 0xFF);
+    SetGDRAMAddress(lcd, 29, 0);
+    WriteGDRAM(lcd, 0x7F);
+    WriteGDRAM(lcd, 0xFF);
+    WriteGDRAM(lcd, 0xFF);
+    WriteGDRAM(lcd, 0xFF);
+    WriteGDRAM(lcd, 0xFF);
+    WriteGDRAM(lcd, 0xFF);
+    WriteGDRAM(lcd, 0xFF);
 }
 
 // Hide underline of Ref RPM
 void underlineLowlight(void){
-    WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | 29);
-    WriteInstruction(lcd, 0x80);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
-    WriteRam(lcd, 0x00);
+    SetGDRAMAddress(lcd, 29, 0);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
+    WriteGDRAM(lcd, 0x00);
 }
 
 // Display Logo
 
 // Display ControlSelection
-uint8_t menuIndex = 0;
+// Control Selection - Three rows below the title, scrolls for the rest
+#define menuItemCount 7
+const char * menuItems[menuItemCount] = {"RPM Control", "Flow Control", "Voltage Control", "Batch Dosing", "PID Autotune", "Reload Settings", "About"};
+uint8_t menuIndex = 0;  //Selected item
+uint8_t menuTop = 0;    //Item on the first row
+
+//Menu items from menuTop on rows 1 to 3
+void displayMenuItems(void){
+    for(uint8_t row = 1; row < 4; row++){
+        const char * item = menuItems[menuTop + row - 1];
+        DisplayStringLeftAlligned(lcd,row,1, (unsigned char *)"               ", strlen("               "));
+        DisplayStringLeftAlligned(lcd,row,1, (unsigned char *)item, strlen(item));
+    }
+}
+
+//Move the highlight to an item, scroll if it is off the screen
+void selectMenuItem(uint8_t index){
+    HighlightMenuItem(lcd, menuIndex - menuTop + 1, false);
+    
+    menuIndex = index;
+    if(menuIndex < menuTop){
+        menuTop = menuIndex;
+        displayMenuItems();
+    }
+    else if(menuIndex > menuTop + 2){
+        menuTop = menuIndex - 2;
+        displayMenuItems();
+    }
+    
+    HighlightMenuItem(lcd, menuIndex - menuTop + 1, true);
+    FlushDisplay(lcd);
+}
 
 void menuControlSelection(void){
     menuSelection = ControlSelection;
     
-    SetTextMode(lcd);
     ClearScreen(lcd);
-    
-    SetGraphicsMode(lcd);
     ClearGDRAM(lcd);
     
     for(uint8_t y = 0; y < 15; y++){
         for (uint8_t x = 0; x < 8; x++) {
-            WriteInstruction(lcd, SET_GRAPHIC_RAM_ADDRESS | y);
-            WriteInstruction(lcd, 0x80 | x);
-            WriteRam(lcd, 0xFF);
-            WriteRam(lcd, 0xFF);
+            SetGDRAMAddress(lcd, y, x);
+            WriteGDRAM(lcd, 0xFF);
+            WriteGDRAM(lcd, 0xFF);
         }
     }
         
-    menuIndex = 1;
-    HighlightMenuItem(lcd,menuIndex,true);
-        
-    SetTextMode(lcd);
-    //ClearScreen(lcd);
+    menuIndex = 0;
+    menuTop = 0;
+    HighlightMenuItem(lcd,1,true);
     
     DisplayStringLeftAlligned(lcd,0,1, (unsigned char *)"MOTION MANAGER", strlen("MOTION MANAGER"));
-    DisplayStringLeftAlligned(lcd,1,1, (unsigned char *)"RPM Control", strlen("RPM Control"));
-    DisplayStringLeftAlligned(lcd,2,1, (unsigned char *)"Voltage Control", strlen("Voltage Control"));
-    DisplayStringLeftAlligned(lcd,3,1, (unsigned char *)"About", strlen("About"));
+    displayMenuItems();
+    
+    FlushDisplay(lcd);
 }
 
 void menuRpmControl(void){
-    SetTextMode(lcd);
     ClearScreen(lcd);
     
     //TIM1 - Encoder
     HAL_TIM_Encoder_Start(&htim1, TIM_CHANNEL_ALL);
     
-    //TIM3 - Velocity Calculation Interrupt
-    HAL_TIM_Base_Start_IT(&htim3);
+    //TIM3 - Encoder Edge Timestamps and Velocity Calculation Interrupt
+    startControlLoop();
     
     //TIM16 - PWM
     HAL_TIM_PWM_Start(&htim16, TIM_CHANNEL_1);
     
     // Topic Background
-    SetGraphicsMode(lcd);
     ClearGDRAM(lcd);
     
     DivideHalfInverseT(lcd);
@@ -334,32 +858,30 @@ void menuRpmControl(void){
     HighlightBottomText(lcd);
     
     // Topics
-    SetTextMode(lcd);
-    
     DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Ref RPM", strlen("Ref RPM"));
     DisplayStringLeftAlligned(lcd,0,9, (unsigned char *)"RPM", strlen("RPM"));
     DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"Flow Rate", strlen("Flow Rate"));
     DisplayStringRightAlligned(lcd,3,14, (unsigned char *)"ml/min", strlen("ml/min"));
     
+    FlushDisplay(lcd);
+    
     //TIM17 - Screen Refresh Rate - 64Mhz / 64000 / 99 = 10Hz
     HAL_TIM_Base_Start_IT(&htim17);
 }
 
-void menuVoltageControl(void){
-    SetTextMode(lcd);
+void menuFlowControl(void){
     ClearScreen(lcd);
     
     //TIM1 - Encoder
     HAL_TIM_Encoder_Start(&htim1, TIM_CHANNEL_ALL);
     
-    //TIM3 - Velocity Calculation Interrupt
-    HAL_TIM_Base_Start_IT(&htim3);
+    //TIM3 - Encoder Edge Timestamps and Velocity Calculation Interrupt
+    startControlLoop();
     
     //TIM16 - PWM
     HAL_TIM_PWM_Start(&htim16, TIM_CHANNEL_1);
     
     // Topic Background
-    SetGraphicsMode(lcd);
     ClearGDRAM(lcd);
     
     DivideHalfInverseT(lcd);
@@ -368,182 +890,800 @@ void menuVoltageControl(void){
     HighlightBottomText(lcd);
     
     // Topics
-    SetTextMode(lcd);
-    
-    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Voltage", strlen("Voltage"));
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Ref Flow", strlen("Ref Flow"));
     DisplayStringLeftAlligned(lcd,0,9, (unsigned char *)"RPM", strlen("RPM"));
     DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"Flow Rate", strlen("Flow Rate"));
     DisplayStringRightAlligned(lcd,3,14, (unsigned char *)"ml/min", strlen("ml/min"));
     
+    FlushDisplay(lcd);
+    
     //TIM17 - Screen Refresh Rate - 64Mhz / 64000 / 99 = 10Hz
     HAL_TIM_Base_Start_IT(&htim17);
 }
 
-void menuAbout(){
-    SetTextMode(lcd);
+void menuVoltageControl(void){
     ClearScreen(lcd);
     
-    SetGraphicsMode(lcd);
+    //TIM1 - Encoder
+    HAL_TIM_Encoder_Start(&htim1, TIM_CHANNEL_ALL);
+    
+    //TIM3 - Encoder Edge Timestamps and Velocity Calculation Interrupt
+    startControlLoop();
+    
+    //TIM16 - PWM
+    HAL_TIM_PWM_Start(&htim16, TIM_CHANNEL_1);
+    
+    // Topic Background
     ClearGDRAM(lcd);
     
-    SetTextMode(lcd);
-    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"info@", strlen("info@"));
-    DisplayStringLeftAlligned(lcd,1,0, (unsigned char *)"kopernikrobotics", strlen("KopernikRobotics"));
-    DisplayStringRightAlligned(lcd,2,15, (unsigned char *)".com", strlen(".com"));
-    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)"v1.0.0", strlen("v1.0.0"));
-}
-
-void setVoltage(){
-    pwm = (((float)voltage)/((float)voltageUpperThreshold)) * ((float)pwmResolution);
-    __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, (int)pwm);
+    DivideHalfInverseT(lcd);
+    HighlightTopLeftText(lcd);
+    HighlightTopRightText(lcd);
+    HighlightBottomText(lcd);
+    
+    // Topics
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Voltage", strlen("Voltage"));
+    DisplayStringLeftAlligned(lcd,0,9, (unsigned char *)"RPM", strlen("RPM"));
+    DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"Flow Rate", strlen("Flow Rate"));
+    DisplayStringRightAlligned(lcd,3,14, (unsigned char *)"ml/min", strlen("ml/min"));
+    
+    FlushDisplay(lcd);
+    
+    //TIM17 - Screen Refresh Rate - 64Mhz / 64000 / 99 = 10Hz
+    HAL_TIM_Base_Start_IT(&htim17);
 }
 
-/* MAIN ***********************************************************************/
-
-int main() {
-    HAL_Init();
+void menuPidAutotune(void){
+    ClearScreen(lcd);
     
-    MX_GPIO_Init();
-    MX_TIM1_Init();
-    MX_TIM16_Init();
-    MX_TIM3_Init();
-    MX_TIM17_Init();
-    MX_TIM15_Init();
+    //TIM1 - Encoder
+    HAL_TIM_Encoder_Start(&htim1, TIM_CHANNEL_ALL);
     
+    //Relay around the feed-forward PWM of the setpoint, never reversing
+    float bias = calculateFeedForward(autotuneRpm);
+    if(bias < autotuneAmplitude)
+        bias = autotuneAmplitude;
+    InitAutotune(&autotune, autotuneRpm, bias, autotuneAmplitude, autotuneHysteresis, autotuneCycles, 0.0f, (float)pwmResolution);
+    autotuneResult = "";
     
+    //TIM3 - Encoder Edge Timestamps and Velocity Calculation Interrupt
+    startControlLoop();
     
-    // Init SPI for LCD
-    MX_SPI1_Init();
+    //TIM16 - PWM
+    HAL_TIM_PWM_Start(&htim16, TIM_CHANNEL_1);
     
-    // LCD  
-    // For a minimal system with only one ST7920 and one MPU, only SCLK and SID pins are necessary.
-    // CS pin should pull to high.
-    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_4, GPIO_PIN_SET);
+    // Topic Background
+    ClearGDRAM(lcd);
     
-    lcd = (struct LCD *)malloc(sizeof(struct LCD));
+    DivideHalfInverseT(lcd);
+    HighlightTopLeftText(lcd);
+    HighlightTopRightText(lcd);
+    HighlightBottomText(lcd);
+    
+    // Topics
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Tune RPM", strlen("Tune RPM"));
+    DisplayStringLeftAlligned(lcd,0,9, (unsigned char *)"RPM", strlen("RPM"));
+    DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"PID Autotune", strlen("PID Autotune"));
+    
+    FlushDisplay(lcd);
+    
+    //TIM17 - Screen Refresh Rate - 64Mhz / 64000 / 99 = 10Hz
+    HAL_TIM_Base_Start_IT(&htim17);
+}
 
-    InitLcdSPI(lcd, &hspi1);
+void menuBatchDosing(void){
+    ClearScreen(lcd);
     
-    InitDisplay(lcd);
+    //TIM1 - Encoder
+    HAL_TIM_Encoder_Start(&htim1, TIM_CHANNEL_ALL);
     
+    //No dose shown from the last time on the page
+    ResetDosing(&dosing);
     
-    // Display Logo
-    SetGraphicsMode(lcd);
+    //TIM3 - Encoder Edge Timestamps and Velocity Calculation Interrupt
+    startControlLoop();
     
-    FillGDRAM(lcd, kopernik_pixel_logo);
+    //TIM16 - PWM
+    HAL_TIM_PWM_Start(&htim16, TIM_CHANNEL_1);
     
-    wait(2);
+    // Topic Background
+    ClearGDRAM(lcd);
+    
+    DivideHalfInverseT(lcd);
+    HighlightTopLeftText(lcd);
+    HighlightTopRightText(lcd);
+    HighlightBottomText(lcd);
+    
+    // Topics
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Dose ml", strlen("Dose ml"));
+    DisplayStringLeftAlligned(lcd,0,9, (unsigned char *)"Volume", strlen("Volume"));
+    DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"Batch Dosing", strlen("Batch Dosing"));
+    
+    FlushDisplay(lcd);
     
+    //TIM17 - Screen Refresh Rate - 64Mhz / 64000 / 99 = 10Hz
+    HAL_TIM_Base_Start_IT(&htim17);
+}
+
+// Settings from the SD card again, select reloads once more
+void menuReloadSettings(void){
+    ClearScreen(lcd);
     ClearGDRAM(lcd);
-    SetTextMode(lcd);
     
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"Reload Settings", strlen("Reload Settings"));
+    FlushDisplay(lcd);
     
-    // Deselect LCD
-    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_4, GPIO_PIN_RESET);
+    reloadConfiguration();
     
-    /* SD Card Begin End ******************************************************/
+    DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)"                ", strlen("                "));
+    DisplayStringLeftAlligned(lcd,2,0, (unsigned char *)configurationResult, strlen(configurationResult));
+    FlushDisplay(lcd);
+}
 
-    /* Read Quadratic Function Coefficients  **********************************/
-    FILE *fp = fopen("/sd/motionManager/flowRateVersusVoltage.csv", "r");
+void menuAbout(){
+    ClearScreen(lcd);
+    ClearGDRAM(lcd);
+    
+    DisplayStringLeftAlligned(lcd,0,0, (unsigned char *)"info@", strlen("info@"));
+    DisplayStringLeftAlligned(lcd,1,0, (unsigned char *)"kopernikrobotics", strlen("KopernikRobotics"));
+    DisplayStringRightAlligned(lcd,2,15, (unsigned char *)".com", strlen(".com"));
+    DisplayStringLeftAlligned(lcd,3,0, (unsigned char *)"v1.0.0", strlen("v1.0.0"));
     
-    // No folder
-    if(fp == NULL) {
-        //error("Could not open file for write\n");
+    FlushDisplay(lcd);
+}
+
+void setVoltage(float _volt){
+    pwm = _volt * scale.voltsToPwm;
+    __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, (int)pwm);
+}
+
+// Settings in use, the file is read over them
+void captureConfiguration(Configuration * c){
+    c->A = A; c->B = B; c->C = C;
+    c->flowRateVersusRpm = flowRateVersusRpm;
+    c->rpmA = rpmA; c->rpmB = rpmB; c->rpmC = rpmC;
+    c->Kp = Kp; c->Ki = Ki; c->Kd = Kd;
+    c->integralMin = integralMin; c->integralMax = integralMax;
+    c->alpha = alpha;
+    c->setpointWeight = setpointWeight; c->trackingGain = trackingGain; c->derivativeCutoff = derivativeCutoff;
+    c->feedForwardA = feedForwardA; c->feedForwardB = feedForwardB; c->feedForwardC = feedForwardC;
+    c->accelerationFeedForward = accelerationFeedForward;
+    c->voltageResolution = voltageResolution; c->voltageUpperThreshold = voltageUpperThreshold;
+    c->refRpmResolution = refRpmResolution; c->refRpmUpperThreshold = refRpmUpperThreshold;
+    c->refFlowRateResolution = refFlowRateResolution; c->refFlowRateUpperThreshold = refFlowRateUpperThreshold;
+    c->encoderPulsePerRev = encoderPulsePerRev;
+    c->loopFrequency = loopFrequency;
+    c->fixedPointControl = fixedPointControl;
+    c->trajectoryProfile = trajectoryProfile;
+    c->rpmRate = rpmRate; c->rpmRateChange = rpmRateChange;
+    c->voltageRate = voltageRate; c->voltageRateChange = voltageRateChange;
+    c->gainSchedule = gainSchedule;
+    c->estimatorForgetting = estimatorForgetting; c->adaptiveTimeConstant = adaptiveTimeConstant;
+    c->autotuneRpm = autotuneRpm; c->autotuneAmplitude = autotuneAmplitude; c->autotuneHysteresis = autotuneHysteresis;
+    c->autotuneCycles = autotuneCycles; c->autotuneRule = autotuneRule;
+    c->dataLogEnabled = dataLogEnabled;
+    c->dosingMlPerRev = dosingMlPerRev; c->dosingRpm = dosingRpm; c->dosingDeceleration = dosingDeceleration;
+    c->dosingCreepRpm = dosingCreepRpm; c->dosingLearning = dosingLearning;
+    c->refVolumeResolution = refVolumeResolution; c->refVolumeUpperThreshold = refVolumeUpperThreshold;
+    c->rpmProgram = rpmProgram;
+    c->voltageProgram = voltageProgram;
+}
+
+// Value of a settingKeys entry in the staged settings, as a float
+float getSettingValue(const Configuration * c, const SettingKey * setting){
+    const uint8_t * field = (const uint8_t *)c + setting->offset;
+    if(setting->type == settingFloat)
+        return *(const float *)field;
+    else if(setting->type == settingBool)
+        return *(const bool *)field ? 1.0f : 0.0f;
+    else
+        return (float)*field;
+}
+
+// Checked against its range before
+void setSettingValue(Configuration * c, const SettingKey * setting, float value){
+    uint8_t * field = (uint8_t *)c + setting->offset;
+    if(setting->type == settingFloat)
+        *(float *)field = value;
+    else if(setting->type == settingBool)
+        *(bool *)field = (value != 0.0f);
+    else
+        *field = (uint8_t)value;
+    
+    // The flow rate goes through RPM once its function is set
+    if(strcmp(setting->section, "flowRateVersusRpm") == 0)
+        c->flowRateVersusRpm = true;
+}
+
+// Line of settings.txt to the staged settings, from the settings parser
+// gainSchedule point = rpm,Kp,Ki,Kd and rpmProgram, voltageProgram
+// step = target,duration are lists, the others one value of settingKeys
+void readSetting(void * context, const char * section, const char * key, const float * values, uint8_t count){
+    SettingsRead * read = (SettingsRead *)context;
+    Configuration * c = read->configuration;
+    bool used = false;
+    
+    if((strcmp(section, "gainSchedule") == 0) && (strcmp(key, "point") == 0)){
+        if(read->gainSchedule == false)
+            ClearGainSchedule(&c->gainSchedule);
+        read->gainSchedule = true;
+        
+        // Ascending RPM, at most GAIN_SCHEDULE_POINTS
+        used = (count == 4) && AddGainSchedulePoint(&c->gainSchedule, values[0], values[1], values[2], values[3]);
+    }
+    else if(((strcmp(section, "rpmProgram") == 0) || (strcmp(section, "voltageProgram") == 0)) && (strcmp(key, "step") == 0)){
+        bool rpm = (section[0] == 'r');
+        TrajectoryProgram * program = rpm ? &c->rpmProgram : &c->voltageProgram;
+        bool * cleared = rpm ? &read->rpmProgram : &read->voltageProgram;
+        if(*cleared == false)
+            ClearTrajectoryProgram(program);
+        *cleared = true;
+        
+        // At most TRAJECTORY_PROGRAM_STEPS
+        used = (count == 2) && (values[1] >= 0.0f) && AddTrajectoryProgramStep(program, values[0], values[1]);
     }
     else{
-        // Quadratic function for "Flow Rate vs Voltage"
-        if(fscanf(fp, "%f,%f,%f\n", &A, &B, &C) == 3){
-            //printf("%f,%f,%f\n", A, B, C);
-        }
-        else
-            A = B = C = 0.0f;
+        for(uint8_t i = 0; i < settingKeyCount; i++){
+            const SettingKey * setting = &settingKeys[i];
+            if((strcmp(section, setting->section) != 0) || (strcmp(key, setting->key) != 0))
+                continue;
             
-        fclose(fp);
+            if((count != 1) || !(values[0] >= setting->min) || !(values[0] <= setting->max))
+                break;
+            
+            setSettingValue(c, setting, values[0]);
+            used = true;
+            break;
+        }
     }
     
-    /* Read PID Constants *****************************************************/
-    fp = fopen("/sd/motionManager/PID.csv", "r");
-    
-    // No folder
-    if(fp == NULL) {
-        //error("Could not open file for write\n");
+    // First unused line for the Reload Settings page, a typo shows up too
+    if((used == false) && (read->bad == false)){
+        read->bad = true;
+        snprintf(configurationResult, sizeof(configurationResult), "Bad %s", key);
     }
-    else{
-        // PID Constants
-        if(fscanf(fp, "%f,%f,%f,%f,%f,%f\n", &Kp, &Ki, &Kd, &integralMin, &integralMax,&alpha) == 6){
-            //printf("%f,%f,%f,%f,%f,%f\n", Kp, Ki, Kd, integralMin, integralMax,alpha);
-        }
-        fclose(fp);
+}
+
+// settings.txt over the staged settings, SPI1 must be set up for the card
+// Read through FatFs in chunks, no stdio buffer, heap or scanf
+// False without the file
+bool readConfiguration(Configuration * c){
+    SettingsRead read = { c, false, false, false, false };
+    Settings settings;
+    InitSettings(&settings, readSetting, &read);
+    
+    FIL file;
+    if(f_open(&file, settingsPath, FA_READ) != FR_OK)
+        return false;
+    
+    char chunk[settingsChunkSize];
+    UINT count;
+    while((f_read(&file, chunk, sizeof(chunk), &count) == FR_OK) && (count != 0))
+        ParseSettings(&settings, chunk, count);
+    FinishSettings(&settings);
+    
+    f_close(&file);
+    return true;
+}
+
+// Section with settings the firmware can not run with together, NULL if all
+// are usable. Each value is in its range from readSetting().
+const char * validateConfiguration(const Configuration * c){
+    if(!(c->integralMin <= c->integralMax))
+        return "PID";
+    return NULL;
+}
+
+// Gains for the operating point, bumpless as the PID sums Ki * error
+// Adaptive - lambda tuning of the identified first order plant
+//   Kp = timeConstant / (gain * adaptiveTimeConstant), Ki = Kp / timeConstant
+// within adaptiveGainRange of [PID], a poor estimate can not run away
+// else the gain schedule, else [PID] as set by setControlLoop()
+void scheduleGains(float reference){
+    float kp, ki, kd;
+    
+    if((adaptiveTimeConstant > 0.0f) && plantEstimator.valid){
+        kp = plantEstimator.timeConstant / (plantEstimator.gain * adaptiveTimeConstant);
+        ki = kp * loopPeriod / plantEstimator.timeConstant;
+        kp = fminf(fmaxf(kp, Kp / adaptiveGainRange), Kp * adaptiveGainRange);
+        ki = fminf(fmaxf(ki, loopKi / adaptiveGainRange), loopKi * adaptiveGainRange);
+        SetPIDGains(&pid, kp, ki, 0.0f);
     }
+    else if(GetScheduledGains(&gainSchedule, reference, &kp, &ki, &kd))
+        SetPIDGains(&pid, kp, ki * loopTuningPeriods, kd / loopTuningPeriods);
+}
+
+// Loop rate dependent values of a set of settings, worked out before the
+// control loop takes them up
+typedef struct LoopScaling
+{
+    float loopFrequency;    // Hz, a whole number of TIM3 ticks per period
+    uint16_t controlPeriod;
+    float loopPeriod;
+    float loopTuningPeriods;
+    float loopKi;
+    float loopAlpha;
+    float smoothing;        // Derivative smoothing for the loop frequency
+} LoopScaling;
+
+// Control period from the loop frequency, [PID] Ki, alpha rescaled from
+// gainTuningFrequency so the loop behaves the same at any rate
+void scaleControlLoop(float frequency, float _Ki, float _alpha, float cutoff, LoopScaling * s){
+    if(frequency < minLoopFrequency)
+        frequency = minLoopFrequency;
+    else if(frequency > maxLoopFrequency)
+        frequency = maxLoopFrequency;
+    
+    s->controlPeriod = (uint16_t)(timestampFrequency / frequency + 0.5f);
+    s->loopFrequency = timestampFrequency / (float)s->controlPeriod;
+    s->loopPeriod = 1.0f / s->loopFrequency;
+    
+    float tuningPeriods = gainTuningFrequency / s->loopFrequency;
+    s->loopTuningPeriods = tuningPeriods;
+    s->loopKi = _Ki * tuningPeriods;
+    s->loopAlpha = 1.0f - powf(1.0f - _alpha, tuningPeriods);
+    
+    s->smoothing = 0.0f;
+    if(cutoff > 0.0f)
+        s->smoothing = expf(-6.2831853f * cutoff / s->loopFrequency);
+}
+
+void useLoopScaling(const LoopScaling * s){
+    loopFrequency = s->loopFrequency;
+    controlPeriod = s->controlPeriod;
+    loopPeriod = s->loopPeriod;
+    loopTuningPeriods = s->loopTuningPeriods;
+    loopKi = s->loopKi;
+    loopAlpha = s->loopAlpha;
+}
+
+// Controllers, estimator and trajectories from the settings, Kd and the
+// tracking gain rescaled like Ki
+void setControlLoop(void){
+    LoopScaling scaling;
+    scaleControlLoop(loopFrequency, Ki, alpha, derivativeCutoff, &scaling);
+    useLoopScaling(&scaling);
+    float smoothing = scaling.smoothing;
+    float tuningPeriods = loopTuningPeriods;
+    
+    InitPID(&pid, Kp, loopKi, Kd / tuningPeriods, integralMin, integralMax, -pwmResolution, pwmResolution);
+    SetPIDTuning(&pid, setpointWeight, trackingGain * tuningPeriods, smoothing);
+    InitFixedPointPI(&fixedPointPI, Kp, loopKi, integralMin, integralMax);
+    InitPlantEstimator(&plantEstimator, estimatorForgetting, loopPeriod, refRpmUpperThreshold, (float)pwmResolution);
+    
+    InitTrajectory(&rpmTrajectory, trajectoryProfile, rpmRate, rpmRateChange);
+    InitTrajectory(&voltageTrajectory, trajectoryProfile, voltageRate, voltageRateChange);
+}
+
+// TIM3 from 0, first compare one control period later
+// A program on the SD card for the selected mode starts right away
+void startControlLoop(void){
+    setControlLoop();
+    
+    if(menuSelection == RpmControl)
+        StartTrajectoryProgram(&rpmProgram);
+    else if(menuSelection == VoltageControl)
+        StartTrajectoryProgram(&voltageProgram);
     
-    /* Read Voltage Settings **************************************************/
-    fp = fopen("/sd/motionManager/voltage.csv", "r");
+    __HAL_TIM_SET_COUNTER(&htim3, 0);
+    __HAL_TIM_SET_COMPARE(&htim3, TIM_CHANNEL_2, controlPeriod);
+    InitTachometer(&tachometer, encoderPulsePerRev * encodingType, timestampFrequency, 0);
+    telemetryEncoderCount = htim1.Instance->CNT;
     
-    // No folder
-    if(fp == NULL) {
-        //error("Could not open file for write\n");
-    }
-    else{
-        // PID Constants
-        if(fscanf(fp, "%f,%f\n", &voltageResolution, &voltageUpperThreshold) == 2){
-            //printf("%f,%f\n", voltageResolution, voltageUpperThreshold);
-        }
-        fclose(fp);
-    }
+    // Samples and drops counted per run
+    InitTelemetry(&telemetry);
+    startDataLog();
+    
+    controlLoopRunning = true;
+    HAL_TIM_IC_Start(&htim3, TIM_CHANNEL_1);
+    HAL_TIM_OC_Start_IT(&htim3, TIM_CHANNEL_2);
+}
+
+void stopControlLoop(void){
+    HAL_TIM_OC_Stop_IT(&htim3, TIM_CHANNEL_2);
+    HAL_TIM_IC_Stop(&htim3, TIM_CHANNEL_1);
+    controlLoopRunning = false;
     
-    /* Read RPM Settings ******************************************************/
+    StopTrajectoryProgram(&rpmProgram);
+    StopTrajectoryProgram(&voltageProgram);
     
-    fp = fopen("/sd/motionManager/RPM.csv", "r");
+    stopDataLog();
     
-    // No folder
-    if(fp == NULL) {
-        //error("Could not open file for write\n");
+    //Flash writes that waited for a page erase or a setpoint to hold
+    if(parameterPending || setpointChanged)
+        PostTask(&scheduler, parameterTask);
+}
+
+// New settings under a running control loop, with interrupts off
+// Takes up what applyConfiguration() worked out beforehand, an estimator of
+// NULL keeps the running one. Gains change bumplessly, the integral is kept
+// within the new limits and handed over if the controller changes. A new
+// encoder resolution resets the integral, it was built on a wrong RPM.
+// Trajectories keep their position.
+void retuneControlLoop(const LoopScaling * scaling, const FixedPointPI * pi, const PlantEstimator * estimator,
+                       bool encoderChanged, bool controllerChanged){
+    useLoopScaling(scaling);
+    
+    SetPIDGains(&pid, Kp, loopKi, Kd / loopTuningPeriods);
+    SetPIDTuning(&pid, setpointWeight, trackingGain * loopTuningPeriods, scaling->smoothing);
+    pid.integralMin = integralMin;
+    pid.integralMax = integralMax;
+    
+    //Integral of the controller that ran, for the one that runs next
+    bool wasFixedPoint = (fixedPointControl != controllerChanged);
+    float integral = wasFixedPoint ? (float)fixedPointPI.integral / 65536.0f : pid.integral;
+    integral = fminf(fmaxf(integral, integralMin), integralMax);
+    
+    fixedPointPI = *pi;
+    fixedPointPI.integral = FloatToQ16(integral);
+    pid.integral = integral;
+    
+    if(encoderChanged){
+        InitTachometer(&tachometer, encoderPulsePerRev * encodingType, timestampFrequency, htim3.Instance->CNT);
+        ResetPID(&pid);
+        ResetFixedPointPI(&fixedPointPI);
     }
-    else{
-        // PID Constants
-        if(fscanf(fp, "%f,%f\n", &refRpmResolution, &refRpmUpperThreshold) == 2){
-            //printf("%f,%f\n", refRpmResolution, refRpmUpperThreshold);
-        }
-        fclose(fp);
+    
+    if(estimator != NULL)
+        plantEstimator = *estimator;
+    
+    rpmTrajectory.profile = trajectoryProfile;
+    rpmTrajectory.maxRate = rpmRate;
+    rpmTrajectory.maxRateChange = rpmRateChange;
+    voltageTrajectory.profile = trajectoryProfile;
+    voltageTrajectory.maxRate = voltageRate;
+    voltageTrajectory.maxRateChange = voltageRateChange;
+    
+    //References within the new knob ranges
+    if(refRpm > refRpmUpperThreshold)
+        refRpm = displayedRefRpm = refRpmUpperThreshold;
+    if(voltage > voltageUpperThreshold)
+        voltage = displayedVoltage = voltageUpperThreshold;
+    if(refFlowRate > refFlowRateUpperThreshold)
+        refFlowRate = displayedRefFlowRate = refFlowRateUpperThreshold;
+}
+
+// Steps of a program from the card, a running one carries on with them from
+// its current step
+void applyProgram(TrajectoryProgram * program, const TrajectoryProgram * staged){
+    uint8_t index = program->index;
+    float time = program->time;
+    bool running = program->running;
+    
+    *program = *staged;
+    if(running && (index < program->count)){
+        program->index = index;
+        program->time = time;
+        program->running = true;
+    }
+}
+
+// Staged settings in use, all of them between two control ticks
+// Scale factors and controller values are worked out first with interrupts
+// on, only taking them up holds off the control interrupt
+void applyConfiguration(const Configuration * c){
+    bool encoderChanged = (c->encoderPulsePerRev != encoderPulsePerRev);
+    bool controllerChanged = (c->fixedPointControl != fixedPointControl);
+    bool estimatorChanged = (c->estimatorForgetting != estimatorForgetting) || (c->loopFrequency != loopFrequency)
+                            || (c->refRpmUpperThreshold != refRpmUpperThreshold);
+    
+    ScaleFactors factors;
+    computeScaleFactors(c->voltageUpperThreshold, c->A, c->B, c->C, &factors);
+    
+    LoopScaling scaling;
+    FixedPointPI pi;
+    PlantEstimator estimator;
+    if(controlLoopRunning){
+        scaleControlLoop(c->loopFrequency, c->Ki, c->alpha, c->derivativeCutoff, &scaling);
+        InitFixedPointPI(&pi, c->Kp, scaling.loopKi, c->integralMin, c->integralMax);
+        if(estimatorChanged)
+            InitPlantEstimator(&estimator, c->estimatorForgetting, scaling.loopPeriod, c->refRpmUpperThreshold, (float)pwmResolution);
     }
     
-    /* Read Encoder Settings **************************************************/
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    
+    A = c->A; B = c->B; C = c->C;
+    flowRateVersusRpm = c->flowRateVersusRpm;
+    rpmA = c->rpmA; rpmB = c->rpmB; rpmC = c->rpmC;
+    Kp = c->Kp; Ki = c->Ki; Kd = c->Kd;
+    integralMin = c->integralMin; integralMax = c->integralMax;
+    alpha = c->alpha;
+    setpointWeight = c->setpointWeight; trackingGain = c->trackingGain; derivativeCutoff = c->derivativeCutoff;
+    feedForwardA = c->feedForwardA; feedForwardB = c->feedForwardB; feedForwardC = c->feedForwardC;
+    accelerationFeedForward = c->accelerationFeedForward;
+    voltageResolution = c->voltageResolution; voltageUpperThreshold = c->voltageUpperThreshold;
+    refRpmResolution = c->refRpmResolution; refRpmUpperThreshold = c->refRpmUpperThreshold;
+    refFlowRateResolution = c->refFlowRateResolution; refFlowRateUpperThreshold = c->refFlowRateUpperThreshold;
+    encoderPulsePerRev = c->encoderPulsePerRev;
+    loopFrequency = c->loopFrequency;
+    fixedPointControl = c->fixedPointControl;
+    trajectoryProfile = c->trajectoryProfile;
+    rpmRate = c->rpmRate; rpmRateChange = c->rpmRateChange;
+    voltageRate = c->voltageRate; voltageRateChange = c->voltageRateChange;
+    gainSchedule = c->gainSchedule;
+    estimatorForgetting = c->estimatorForgetting; adaptiveTimeConstant = c->adaptiveTimeConstant;
+    autotuneRpm = c->autotuneRpm; autotuneAmplitude = c->autotuneAmplitude; autotuneHysteresis = c->autotuneHysteresis;
+    autotuneCycles = c->autotuneCycles; autotuneRule = c->autotuneRule;
+    dataLogEnabled = c->dataLogEnabled;
+    dosingMlPerRev = c->dosingMlPerRev; dosingRpm = c->dosingRpm; dosingDeceleration = c->dosingDeceleration;
+    dosingCreepRpm = c->dosingCreepRpm; dosingLearning = c->dosingLearning;
+    refVolumeResolution = c->refVolumeResolution; refVolumeUpperThreshold = c->refVolumeUpperThreshold;
+    applyProgram(&rpmProgram, &c->rpmProgram);
+    applyProgram(&voltageProgram, &c->voltageProgram);
+    
+    commitConfiguration(&factors);
+    
+    if(controlLoopRunning)
+        retuneControlLoop(&scaling, &pi, estimatorChanged ? &estimator : NULL, encoderChanged, controllerChanged);
+    
+    __set_PRIMASK(primask);
+    
+    //Flow Control reference RPM from the new flow rate functions, the knob
+    //and the serial port set it the same way
+    if(controlLoopRunning && (menuSelection == FlowControl) && (rpmProgram.running == false))
+        refRpm = calculateRpmForFlowRate(refFlowRate);
+}
+
+// SD card settings read, checked and applied, SPI1 must be set up for the card
+// A bad line keeps its setting as it is, a bad section every setting
+bool loadConfiguration(void){
+    Configuration configuration;
+    captureConfiguration(&configuration);
     
-    fp = fopen("/sd/motionManager/encoder.csv", "r");
+    configurationResult[0] = '\0';
+    if(readConfiguration(&configuration) == false){
+        snprintf(configurationResult, sizeof(configurationResult), "No settings.txt");
+        return false;
+    }
     
-    // No folder
-    if(fp == NULL) {
-        //error("Could not open file for write\n");
+    const char * section = validateConfiguration(&configuration);
+    if(section != NULL){
+        snprintf(configurationResult, sizeof(configurationResult), "Bad [%s]", section);
+        return false;
     }
-    else{
-        // PID Constants
-        if(fscanf(fp, "%f\n", &encoderPulsePerRev) == 1){
-            //printf("%f\n", encoderPulsePerRev);
-        }
-        fclose(fp);
-    }    
     
-    delete &sd;
+    applyConfiguration(&configuration);
+    if(configurationResult[0] == '\0')
+        snprintf(configurationResult, sizeof(configurationResult), "Loaded");
     
-    /* SD Card Read End *******************************************************/
+    // To flash by the parameter task
+    parameterMirror = true;
+    return true;
+}
+
+// List of the parameter store over the staged settings as settings.txt lines
+// of size values each, up to capacity of them
+void readFlashList(SettingsRead * read, const char * section, const char * key, uint16_t base, uint8_t size, uint8_t capacity){
+    float count;
+    if(!ReadFlashRecord(&parameterStore, base, &count) || !((count >= 0.0f) && (count <= capacity)))
+        return;
+    
+    for(uint16_t i = 0; i < (uint16_t)count; i++){
+        float values[4];
+        uint8_t found = 0;
+        for(uint8_t j = 0; j < size; j++)
+            found += ReadFlashRecord(&parameterStore, base + 1 + i * size + j, &values[j]);
+        readSetting(read, section, key, values, (found == size) ? size : 0);
+    }
+}
+
+// Parameter store over the staged settings, checked as the file
+// False if it has no settings
+bool readFlashConfiguration(Configuration * c){
+    SettingsRead read = { c, false, false, false, false };
+    bool found = false;
+    
+    for(uint8_t i = 0; i < settingKeyCount; i++){
+        float value;
+        if(ReadFlashRecord(&parameterStore, i, &value)){
+            readSetting(&read, settingKeys[i].section, settingKeys[i].key, &value, 1);
+            found = true;
+        }
+    }
     
-    MX_SPI1_Init();
+    readFlashList(&read, "gainSchedule", "point", parameterScheduleKey, 4, GAIN_SCHEDULE_POINTS);
+    readFlashList(&read, "rpmProgram", "step", parameterRpmProgramKey, 2, TRAJECTORY_PROGRAM_STEPS);
+    readFlashList(&read, "voltageProgram", "step", parameterVoltageProgramKey, 2, TRAJECTORY_PROGRAM_STEPS);
+    return found;
+}
+
+// Settings last loaded from the SD card, read in microseconds
+bool loadFlashConfiguration(void){
+    Configuration configuration;
+    captureConfiguration(&configuration);
     
-    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_4, GPIO_PIN_SET);
+    if(readFlashConfiguration(&configuration) == false)
+        return false;
+    if(validateConfiguration(&configuration) != NULL)
+        return false;
     
-    InitDisplay(lcd);
+    applyConfiguration(&configuration);
+    flashConfiguration = true;
+    return true;
+}
+
+// One value to the parameter store, compacted if full and no control loop runs
+// False if it has to wait
+bool writeParameter(uint16_t key, float value){
+    if(WriteFlashRecord(&parameterStore, key, value))
+        return true;
     
-    SetTextMode(lcd);
+    if(controlLoopRunning || (FreeFlashRecords(&parameterStore) != 0))
+        return false;
     
-    menuControlSelection();
+    return CompactFlashStore(&parameterStore) && WriteFlashRecord(&parameterStore, key, value);
+}
+
+// List of count entries, columns holds the array of each of their size values
+bool writeFlashList(uint16_t base, uint8_t count, const float * const * columns, uint8_t size){
+    if(writeParameter(base, (float)count) == false)
+        return false;
     
-    __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, 0);
+    for(uint8_t i = 0; i < count; i++){
+        for(uint8_t j = 0; j < size; j++){
+            if(writeParameter(base + 1 + i * size + j, columns[j][i]) == false)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Settings in use to the parameter store, only the values that changed
+bool writeFlashConfiguration(void){
+    Configuration c;
+    captureConfiguration(&c);
     
-    while(1) {
-        // Empty
+    for(uint8_t i = 0; i < settingKeyCount; i++){
+        if(writeParameter(i, getSettingValue(&c, &settingKeys[i])) == false)
+            return false;
     }
+    
+    const float * schedule[4] = { c.gainSchedule.rpm, c.gainSchedule.kp, c.gainSchedule.ki, c.gainSchedule.kd };
+    const float * rpmSteps[2] = { c.rpmProgram.target, c.rpmProgram.duration };
+    const float * voltageSteps[2] = { c.voltageProgram.target, c.voltageProgram.duration };
+    
+    return writeFlashList(parameterScheduleKey, c.gainSchedule.count, schedule, 4)
+           && writeFlashList(parameterRpmProgramKey, c.rpmProgram.count, rpmSteps, 2)
+           && writeFlashList(parameterVoltageProgramKey, c.voltageProgram.count, voltageSteps, 2);
 }
 
+// Last setpoints and settings loaded from the SD card to flash, posted by a
+// load and the control loop stopping with writes left, every second for
+// setpoints that have held for setpointHoldTime
+void parameterTaskFunction(void){
+    //Page full, the erase waits for the control loop to stop
+    if(parameterPending && controlLoopRunning)
+        return;
+    
+    //Taken before the values, a dose ending in between marks them again
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool setpointsDue = setpointChanged && ((controlLoopRunning == false) || ((HAL_GetTick() - setpointTime) >= setpointHoldTime));
+    if(setpointsDue)
+        setpointChanged = false;
+    __set_PRIMASK(primask);
+    
+    if((setpointsDue == false) && (parameterMirror == false) && (parameterPending == false))
+        return;
+    
+    bool done = writeParameter(parameterSetpointKey, savedRefRpm)
+                && writeParameter(parameterSetpointKey + 1, savedRefFlowRate)
+                && writeParameter(parameterSetpointKey + 2, savedVoltage)
+                && writeParameter(parameterSetpointKey + 3, savedRefVolume)
+                && writeParameter(parameterSetpointKey + 4, dosing.coastVolume);
+    
+    if(done && parameterMirror){
+        done = writeFlashConfiguration();
+        parameterMirror = !done;
+    }
+    
+    parameterPending = !done;
+}
+
+/* MAIN ***********************************************************************/
+
+// Peripherals, display, SD card settings and main loop tasks
+// Split from main() so the host simulation can boot the same firmware
+void initMotionManager(void) {
+    HAL_Init();
+    
+    // DWT cycle counter for ISR and task timing
+    InitProfiler();
+    
+    MX_GPIO_Init();
+    MX_DMA_Init();
+    MX_TIM1_Init();
+    MX_TIM16_Init();
+    MX_TIM3_Init();
+    MX_TIM17_Init();
+    MX_TIM15_Init();
+    MX_TIM7_Init();
+    MX_USART2_Init();
+    
+    
+    // SPI1 is set up for the LCD on its first frame
+    // The SD card driver sets it up itself, its CS is PA3
+    InitSpiBus(&spiBus);
+    lcdBusDevice = AddSpiDevice(&spiBus, lcdBusConfigure, lcdBusSelect, lcdBusGranted);
+    sdBusDevice = AddSpiDevice(&spiBus, NULL, NULL, NULL);
+    
+    lcd = (struct LCD *)malloc(sizeof(struct LCD));
+
+    InitLcdSPI(lcd, &hspi1, &htim7, &spiBus, lcdBusDevice);
+    
+    InitDisplay(lcd);
+    
+    
+    // Display Logo
+    FillGDRAM(lcd, kopernik_pixel_logo);
+    FlushDisplay(lcd);
+    
+    wait(2);
+    
+    ClearGDRAM(lcd);
+    FlushDisplay(lcd);
+    
+    AcquireSpiBus(&spiBus, sdBusDevice);
+    
+    /* SD Card Read ***********************************************************/
+    
+    // Compiled in settings stay for missing or bad keys. Without the file or
+    // with a bad section the last ones loaded come from flash, if none the
+    // compiled in ones stay.
+    InitFlashStore(&parameterStore, parameterPage0, parameterPage1, FLASH_PAGE_SIZE);
+    ReadFlashRecord(&parameterStore, parameterSetpointKey, &savedRefRpm);
+    ReadFlashRecord(&parameterStore, parameterSetpointKey + 1, &savedRefFlowRate);
+    ReadFlashRecord(&parameterStore, parameterSetpointKey + 2, &savedVoltage);
+    ReadFlashRecord(&parameterStore, parameterSetpointKey + 3, &savedRefVolume);
+    ReadFlashRecord(&parameterStore, parameterSetpointKey + 4, &dosing.coastVolume);
+    
+    if((loadConfiguration() == false) && (loadFlashConfiguration() == false)){
+        ScaleFactors factors;
+        computeScaleFactors(voltageUpperThreshold, A, B, C, &factors);
+        commitConfiguration(&factors);
+    }
+    
+    // The card stays mounted for later writes, see beginSdAccess()
+    
+    /* SD Card Read End *******************************************************/
+    
+    ReleaseSpiBus(&spiBus, sdBusDevice);
+    
+    InitDisplay(lcd);
+    
+    menuControlSelection();
+    
+    __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, 0);
+    
+    InitTelemetry(&telemetry);
+    
+    // Interrupts only post tasks, all LCD work runs here
+    // priority, period (0 = posted), deadline in ms
+    InitScheduler(&scheduler);
+    uiTask = AddTask(&scheduler, "ui task", uiTaskFunction, 0, 0, 50);
+    renderTask = AddTask(&scheduler, "render task", renderTaskFunction, 1, 0, 200);
+    blinkTask = AddTask(&scheduler, "blink task", blinkTaskFunction, 2, 0, 800);
+    autotuneTask = AddTask(&scheduler, "autotune task", autotuneTaskFunction, 3, 0, 1000);
+    telemetryTask = AddTask(&scheduler, "telemetry task", telemetryTaskFunction, 2, 10, 20);
+    logTask = AddTask(&scheduler, "log task", logTaskFunction, 3, 0, 100);
+    serialTask = AddTask(&scheduler, "serial task", serialTaskFunction, 3, 1, 10);
+    parameterTask = AddTask(&scheduler, "parameter task", parameterTaskFunction, 3, 1000, 1000);
+    
+    if(parameterMirror)
+        PostTask(&scheduler, parameterTask);
+}
+
+#ifndef SIMULATION
+int main() {
+    initMotionManager();
+    
+    while(1) {
+        RunScheduler(&scheduler);
+    }
+}
+#endif
+
 /******************************************************************************/
 
 /* SPI1 init function */
@@ -570,6 +1710,70 @@ static void MX_SPI1_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
+  /* SPI1 DMA Init */
+  /* SPI1_TX Init */
+  hdma_spi1_tx.Instance = DMA1_Channel3;
+  hdma_spi1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_spi1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi1_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_spi1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_spi1_tx.Init.Mode = DMA_NORMAL;
+  hdma_spi1_tx.Init.Priority = DMA_PRIORITY_LOW;
+  if (HAL_DMA_Init(&hdma_spi1_tx) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  // Linked here instead of HAL_SPI_MspInit, mbed SPI of the SD card calls
+  // HAL_SPI_MspInit with its own handle for the same peripheral
+  __HAL_LINKDMA(&hspi1,hdmatx,hdma_spi1_tx);
+
+}
+
+/* USART2 init function */
+// mbed's pc owns the UART and its interrupt, only the DMA requests are added
+// Receive runs circular for good, serialTaskFunction() follows its counter
+static void MX_USART2_Init(void)
+{
+
+  pc.baud(serialBaud);
+
+  /* USART2 DMA Init */
+  /* USART2_RX Init */
+  hdma_usart2_rx.Instance = DMA1_Channel6;
+  hdma_usart2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  hdma_usart2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_usart2_rx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_usart2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_usart2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_usart2_rx.Init.Mode = DMA_CIRCULAR;
+  hdma_usart2_rx.Init.Priority = DMA_PRIORITY_MEDIUM;
+  if (HAL_DMA_Init(&hdma_usart2_rx) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  /* USART2_TX Init */
+  hdma_usart2_tx.Instance = DMA1_Channel7;
+  hdma_usart2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_usart2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_usart2_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_usart2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_usart2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_usart2_tx.Init.Mode = DMA_NORMAL;
+  hdma_usart2_tx.Init.Priority = DMA_PRIORITY_LOW;
+  if (HAL_DMA_Init(&hdma_usart2_tx) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+  hdma_usart2_tx.XferCpltCallback = serialTransmitted;
+
+  InitProtocolDecoder(&serialDecoder, serialCommand, serialCommandSize);
+
+  USART2->CR3 |= USART_CR3_DMAR | USART_CR3_DMAT;
+  HAL_DMA_Start(&hdma_usart2_rx, (uintptr_t)&USART2->RDR, (uintptr_t)serialReceive, serialReceiveSize);
+
 }
 
 /* TIM1 init function */
@@ -600,7 +1804,8 @@ static void MX_TIM1_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
-  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  // TRGO pulses on every CCR1 capture (rising edge of channel A), TIM3 timestamps it
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_OC1;
   sMasterConfig.MasterOutputTrigger2 = TIM_TRGO2_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim1, &sMasterConfig) != HAL_OK)
@@ -616,11 +1821,15 @@ static void MX_TIM3_Init(void)
 
   TIM_ClockConfigTypeDef sClockSourceConfig;
   TIM_MasterConfigTypeDef sMasterConfig;
+  TIM_SlaveConfigTypeDef sSlaveConfig;
+  TIM_IC_InitTypeDef sConfigIC;
+  TIM_OC_InitTypeDef sConfigOC;
 
+  // 64Mhz / 64 = 1 tick per us, free running for edge timestamps
   htim3.Instance = TIM3;
   htim3.Init.Prescaler = 63;
   htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim3.Init.Period = 9999;
+  htim3.Init.Period = 65535;
   htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_Base_Init(&htim3) != HAL_OK)
@@ -641,6 +1850,62 @@ static void MX_TIM3_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
+  // Control loop - CH2 compare, moved by controlPeriod on every match
+  if (HAL_TIM_OC_Init(&htim3) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  sConfigOC.OCMode = TIM_OCMODE_TIMING;
+  sConfigOC.Pulse = 9999;
+  sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+  sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+  if (HAL_TIM_OC_ConfigChannel(&htim3, &sConfigOC, TIM_CHANNEL_2) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  // Encoder edge timestamps - CH1 captures TRC, ITR0 is TIM1 TRGO
+  if (HAL_TIM_IC_Init(&htim3) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_DISABLE;
+  sSlaveConfig.InputTrigger = TIM_TS_ITR0;
+  if (HAL_TIM_SlaveConfigSynchronization(&htim3, &sSlaveConfig) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  sConfigIC.ICPolarity = TIM_ICPOLARITY_RISING;
+  sConfigIC.ICSelection = TIM_ICSELECTION_TRC;
+  sConfigIC.ICPrescaler = TIM_ICPSC_DIV1;
+  sConfigIC.ICFilter = 0;
+  if (HAL_TIM_IC_ConfigChannel(&htim3, &sConfigIC, TIM_CHANNEL_1) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+}
+
+/* TIM7 init function */
+static void MX_TIM7_Init(void)
+{
+
+  // LCD command pacing - 64Mhz / 64 = 1 tick per us, one-pulse
+  htim7.Instance = TIM7;
+  htim7.Init.Prescaler = 63;
+  htim7.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim7.Init.Period = 71;
+  htim7.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim7) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  htim7.Instance->CR1 |= TIM_CR1_OPM;
+
 }
 
 /* TIM15 init function */
@@ -749,6 +2014,24 @@ static void MX_TIM17_Init(void)
 }
 
 
+/** 
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void) 
+{
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, 1, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+  /* DMA1_Channel7_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel7_IRQn, 2, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel7_IRQn);
+
+}
+
 /** Configure pins as 
         * Analog 
         * Input 
@@ -812,76 +2095,1115 @@ static void MX_GPIO_Init(void)
   HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
   /* EXTI interrupt init*/
-  HAL_NVIC_SetPriority(EXTI1_IRQn, 0, 0);
+  // Only posts UI events, below the control loop and the LCD command queue
+  HAL_NVIC_SetPriority(EXTI1_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(EXTI1_IRQn);
 
-  HAL_NVIC_SetPriority(EXTI4_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI4_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(EXTI4_IRQn);
 
-  HAL_NVIC_SetPriority(EXTI9_5_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI9_5_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 
-  HAL_NVIC_SetPriority(EXTI15_10_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI15_10_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
 
 }
 
 /* USER CODE BEGIN 4 */
 
-void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim){
+/* Tasks **********************************************************************/
 
-    // Motor Encoder
-    if(htim->Instance == TIM3){        
-        //RPM Calculation
-        int16_t encoderCount = htim1.Instance->CNT;
-        int16_t deltaEncoderCount = encoderCount - prevEncoderCount;
-        motorRPM = RPM_res_per_tick * (float)deltaEncoderCount;
-        prevEncoderCount = encoderCount;
+// Knob turned one step forward
+void knobForward(void){
+    if(menuSelection == RpmControl){
+        incrementDisplayedRefRPM();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == FlowControl){
+        incrementDisplayedRefFlowRate();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == VoltageControl){
+        incrementDisplayedVoltage();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == BatchDosing){
+        incrementDisplayedRefVolume();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == ControlSelection)
+    {
+        selectMenuItem((menuIndex + 1) % menuItemCount);
+    }
+}
+
+// Knob turned one step backward
+void knobBackward(void){
+    if(menuSelection == RpmControl){
+        decreaseDisplayedRefRPM();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == FlowControl){
+        decreaseDisplayedRefFlowRate();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == VoltageControl){
+        decreaseDisplayedVoltage();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == BatchDosing){
+        decreaseDisplayedRefVolume();
+        PostTask(&scheduler, renderTask);
+    }
+    
+    else if(menuSelection == ControlSelection)
+    {
+        selectMenuItem((menuIndex + menuItemCount - 1) % menuItemCount);
+    }
+}
+
+// Saved setpoints to flash once they hold, see parameterTaskFunction()
+void keepSetpoint(void){
+    setpointTime = HAL_GetTick();
+    setpointChanged = true;
+}
+
+// New setpoint from the knob or the serial port, an SD card program stops
+// Kept in flash as the knob's start after a power cycle
+void setRefRpm(float rpm){
+    StopTrajectoryProgram(&rpmProgram);
+    refRpm = displayedRefRpm = rpm;
+    savedRefRpm = rpm;
+    keepSetpoint();
+}
+
+void setRefFlowRate(float flowRate){
+    StopTrajectoryProgram(&rpmProgram);
+    refFlowRate = displayedRefFlowRate = flowRate;
+    refRpm = calculateRpmForFlowRate(flowRate);
+    savedRefFlowRate = flowRate;
+    keepSetpoint();
+}
+
+void setRefVoltage(float volts){
+    StopTrajectoryProgram(&voltageProgram);
+    voltage = displayedVoltage = volts;
+    savedVoltage = volts;
+    keepSetpoint();
+}
+
+// New dose from the knob or the serial port, false while one runs
+// The control interrupt updates the same dose
+bool startDose(float ml){
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool started = StartDosing(&dosing, ml);
+    __set_PRIMASK(primask);
+    if(started == false)
+        return false;
+    refVolume = displayedRefVolume = ml;
+    savedRefVolume = ml;
+    keepSetpoint();
+    PostTask(&scheduler, renderTask);
+    return true;
+}
+
+// Motor off, ended without waiting for the pump to stand if immediate
+void abortDose(bool immediate){
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    AbortDosing(&dosing, immediate);
+    __set_PRIMASK(primask);
+    PostTask(&scheduler, renderTask);
+}
+
+// Knob Select Button - PA11
+void selectButton(void){
+    if(menuSelection == ControlSelection){
+        switch (menuIndex){
+            case 0: //RPM Control
+                menuSelection = RpmControl;
+                menuRpmControl();
+                break;
+            case 1: //Flow Control
+                menuSelection = FlowControl;
+                menuFlowControl();
+                break;
+            case 2: //Voltage Control
+                menuSelection = VoltageControl;
+                menuVoltageControl();
+                break;
+            case 3: //Batch Dosing
+                menuSelection = BatchDosing;
+                menuBatchDosing();
+                break;
+            case 4: //PID Autotune
+                menuSelection = PIDAutotune;
+                menuPidAutotune();
+                break;
+            case 5: //Reload Settings
+                menuSelection = ReloadSettings;
+                menuReloadSettings();
+                break;
+            case 6: //About
+                menuSelection = About;
+                menuAbout();
+                break;
+        }
+    }
+    
+    else if(menuSelection == RpmControl){
+        // "Set Ref RPM" Selected
+        // First time selected (to set new rpm)
+        if(selected == false){
+            selected = true;
+            //From the last setpoint on a fresh start
+            displayedRefRpm = (refRpm != 0.0f) ? refRpm : fminf(savedRefRpm, refRpmUpperThreshold);
+            
+            // Start Highlighting
+            HAL_TIM_Base_Start_IT(&htim15);
+        }
         
-        //A little Moving Average for RPM since resolution is 15RPM
-        averagedMotorRpm = (alpha * motorRPM) + (1 - alpha) * averagedMotorRpm;
+        // Second time selected (new rpm set)
+        else if (selected == true){
+            selected = false;
+            setRefRpm(displayedRefRpm);
+            
+            // Stop Highlighting
+            HAL_TIM_Base_Stop_IT(&htim15);
+            underlineHighlighted = false;
+            underlineLowlight();
+            FlushDisplay(lcd);
+        }
+    }
+    
+    else if(menuSelection == FlowControl){
+        // "Set Ref Flow" Selected
+        // First time selected (to set new flow rate)
+        if(selected == false){
+            selected = true;
+            displayedRefFlowRate = (refFlowRate != 0.0f) ? refFlowRate : fminf(savedRefFlowRate, refFlowRateUpperThreshold);
+            
+            // Start Highlighting
+            HAL_TIM_Base_Start_IT(&htim15);
+        }
         
-        if(menuSelection == RpmControl){
-            //Simple PI Control Implementation
-            float rpmError = refRpm - averagedMotorRpm;
+        // Second time selected (new flow rate set)
+        else if (selected == true){
+            selected = false;
+            setRefFlowRate(displayedRefFlowRate);
             
-            //Compute Integral
-            integral = integral + Ki * rpmError;
+            // Stop Highlighting
+            HAL_TIM_Base_Stop_IT(&htim15);
+            underlineHighlighted = false;
+            underlineLowlight();
+            FlushDisplay(lcd);
+        }
+    }
+    
+    else if(menuSelection == VoltageControl){
+        // "Set Voltage" Selected
+        // First time selected (to set voltge)
+        if(selected == false){
+            selected = true;
+            displayedVoltage = (voltage != 0.0f) ? voltage : fminf(savedVoltage, voltageUpperThreshold);
             
-            //Compare Integral
-            if(integral > integralMax)
-                integral = integralMax;
-            else if(integral < integralMin)
-                integral = integralMin;
+            //Start Highlighting
+            HAL_TIM_Base_Start_IT(&htim15);
+        }
+        else if(selected == true){
+            selected = false;
+            setRefVoltage(displayedVoltage);
             
-            //Compute PI
-            float out = Kp * rpmError + integral;
-            applyPWM((int16_t)out);
+            //Stop Highlihting
+            HAL_TIM_Base_Stop_IT(&htim15);
+            underlineHighlighted = false;
+            underlineLowlight();
+            FlushDisplay(lcd);
         }
     }
     
-    if(htim->Instance == TIM15){
-        
-        SetGraphicsMode(lcd);
+    else if(menuSelection == BatchDosing){
+        // "Dose ml" Selected, not while a dose runs
+        if((selected == false) && (DosingActive(&dosing) == false)){
+            selected = true;
+            displayedRefVolume = (refVolume != 0.0f) ? refVolume : fminf(savedRefVolume, refVolumeUpperThreshold);
+            
+            // Start Highlighting
+            HAL_TIM_Base_Start_IT(&htim15);
+            PostTask(&scheduler, renderTask);
+        }
         
+        // Second time selected, dose it
+        else if(selected == true){
+            selected = false;
+            startDose(displayedRefVolume);
+            
+            // Stop Highlighting
+            HAL_TIM_Base_Stop_IT(&htim15);
+            underlineHighlighted = false;
+            underlineLowlight();
+            FlushDisplay(lcd);
+        }
+    }
+    
+    else if(menuSelection == ReloadSettings){
+        menuReloadSettings();
+    }
+    
+    else if (menuSelection == About){
+        // Print ISR and task timing over the serial port
+        waitSerialTransmit();
+        DumpProfile(stdout);
+        benchmarkScaleFactors(stdout);
+        printf("settings,%s%s\n", configurationResult, flashConfiguration ? ",from flash" : "");
+        printf("flash,writes,free,erases,corrupt\nparameters,%lu,%lu,%lu,%lu\n",
+               (unsigned long)parameterStore.writes, (unsigned long)FreeFlashRecords(&parameterStore),
+               (unsigned long)parameterStore.erases, (unsigned long)parameterStore.corrupt);
+        printf("telemetry dropped,%lu\n", (unsigned long)telemetry.dropped);
+        printf("log sectors,%lu\nlog dropped,%lu\n", (unsigned long)dataLog.written, (unsigned long)dataLog.dropped);
+        printf("spi bus,grants,waits\nlcd,%lu,%lu\nsd,%lu,%lu\n",
+               (unsigned long)spiBus.devices[lcdBusDevice].grants, (unsigned long)spiBus.devices[lcdBusDevice].waits,
+               (unsigned long)spiBus.devices[sdBusDevice].grants, (unsigned long)spiBus.devices[sdBusDevice].waits);
+    }
+}
+
+// Stop/Back Button - PF1
+void backButton(void){
+    if(menuSelection == ControlSelection){
+        __NOP;
+    }
+    else if((menuSelection == BatchDosing) && DosingActive(&dosing)){
+        //Motor off, the page stays until the pump stands, pressed again
+        //while it runs down the dose ends without waiting
+        abortDose(dosing.state == DOSING_COASTING);
+    }
+    else if((menuSelection == RpmControl) || (menuSelection == FlowControl) || (menuSelection == VoltageControl) || (menuSelection == PIDAutotune) || (menuSelection == BatchDosing)){
+        if(selected == true){
+            selected = false;
+            HAL_TIM_Base_Stop_IT(&htim15);
+            
+            // Exit selection
+            if(underlineHighlighted == true){
+                underlineHighlighted = false;
+                underlineLowlight();
+                FlushDisplay(lcd);
+            }
+        }
+        else if (selected == false){
+            //Stop RPM Control Loop
+            stopControlLoop();
+            //Stop Refreshing Page
+            HAL_TIM_Base_Stop_IT(&htim17);
+            menuSelection = ControlSelection;
+            menuControlSelection();
+            
+            // Zero Everthing
+            voltage = 0;
+            displayedVoltage = 0;
+            refRpm = 0;
+            displayedRefRpm = 0;
+            refFlowRate = 0;
+            displayedRefFlowRate = 0;
+            refVolume = 0;
+            displayedRefVolume = 0;
+            motorRPM = 0;
+            averagedMotorRpm = 0;
+            pwm = 0;
+            ResetPID(&pid);
+            ResetFixedPointPI(&fixedPointPI);
+            ResetTrajectory(&rpmTrajectory, 0.0f);
+            ResetTrajectory(&voltageTrajectory, 0.0f);
+            htim1.Instance->CNT = 0;    //Zero Encoder Count
+            
+            //TIM1 - Encoder
+            HAL_TIM_Encoder_Stop(&htim1, TIM_CHANNEL_ALL);
+            
+            // Set PWM to 0
+            __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, 0);
+            
+            //TIM16 - PWM
+            HAL_TIM_PWM_Stop(&htim16, TIM_CHANNEL_1);
+        }
+    }
+    else if((menuSelection == ReloadSettings) || (menuSelection == About)){
+        menuSelection = ControlSelection;
+        menuControlSelection();
+    }
+}
+
+// Knob and button events posted by EXTI
+void uiTaskFunction(void){
+    __disable_irq();
+    int8_t steps = knobSteps;
+    knobSteps = 0;
+    bool select = selectPressed;
+    selectPressed = false;
+    bool back = backPressed;
+    backPressed = false;
+    __enable_irq();
+    
+    for(; steps > 0; steps--)
+        knobForward();
+    for(; steps < 0; steps++)
+        knobBackward();
+    
+    if(select)
+        selectButton();
+    if(back)
+        backButton();
+}
+
+// Numbers on the control pages, posted by TIM17 and knob changes
+void renderTaskFunction(void){
+    if((menuSelection == RpmControl) || (menuSelection == FlowControl) || (menuSelection == VoltageControl))
+        refreshScreen();
+    else if(menuSelection == PIDAutotune)
+        refreshAutotuneScreen();
+    else if(menuSelection == BatchDosing)
+        refreshDosingScreen();
+}
+
+// Underline blink of the selected value, posted by TIM15
+void blinkTaskFunction(void){
+    if(selected == false)
+        return;
+    
+    if(underlineHighlighted == false){
         underlineHighlight();
+        underlineHighlighted = true;
+    }
+    else{
+        underlineLowlight();
+        underlineHighlighted = false;
+    }
+    
+    FlushDisplay(lcd);
+}
+
+// Control loop samples to the run log and the telemetry sink, every 10ms
+void telemetryTaskFunction(void){
+    TelemetrySample sample;
+    while(PopTelemetry(&telemetry, &sample)){
+        if(dataLogRunning)
+            AddDataLogSample(&dataLog, &sample, telemetry.dropped);
+        if(serialStreaming)
+            streamTelemetry(&sample);
+        if(telemetrySink != NULL)
+            telemetrySink(&sample);
+    }
+    
+    if(dataLogRunning && (GetDataLogSector(&dataLog) != NULL))
+        PostTask(&scheduler, logTask);
+}
+
+// Cycles of the per tick conversions dividing by the settings, as before
+// computeScaleFactors(), and with the folded scale factors
+// Volatile inputs keep the compiler from folding the divisions itself
+#define scaleBenchmarkRuns 256
+void benchmarkScaleFactors(FILE * fp){
+    volatile float input = 1234.5f;
+    volatile float frequency = timestampFrequency;
+    volatile uint32_t ticks = 1500;
+    volatile float sink;
+    float countsPerRev = encoderPulsePerRev * encodingType;
+    
+    uint32_t start = ProfileStart();
+    for(uint16_t i = 0; i < scaleBenchmarkRuns; i++){
+        float x = input;
+        //RPM from counts and ticks, timeout
+        sink = (60.0f * frequency * x) / (countsPerRev * (float)ticks);
+        sink = (float)(uint32_t)(TACHOMETER_TIMEOUT * frequency);
+        //Voltage to PWM, Flow Rate from PWM
+        sink = (x / voltageUpperThreshold) * (float)pwmResolution;
+        float volt = (x / (float)pwmResolution) * voltageUpperThreshold;
+        sink = (A * volt * volt) + (B * volt) + C;
+        //Feed-forward
+        sink = (feedForwardA * x * x) + (feedForwardB * x) + feedForwardC;
+    }
+    uint32_t divided = ProfileStart() - start;
+    
+    start = ProfileStart();
+    for(uint16_t i = 0; i < scaleBenchmarkRuns; i++){
+        float x = input;
+        sink = tachometer.rpmPerCountPerTick * x / (float)ticks;
+        sink = (float)tachometer.timeoutTicks;
+        sink = x * scale.voltsToPwm;
+        sink = (scale.flowPerPwm[0] * x + scale.flowPerPwm[1]) * x + scale.flowPerPwm[2];
+        sink = (feedForwardA * x + feedForwardB) * x + feedForwardC;
+    }
+    uint32_t folded = ProfileStart() - start;
+    (void)sink;
+    
+    fprintf(fp, "conversions,divided cycles,folded cycles,saved cycles\n");
+    fprintf(fp, "per tick,%lu,%lu,%ld\n", (unsigned long)(divided / scaleBenchmarkRuns),
+            (unsigned long)(folded / scaleBenchmarkRuns), ((long)divided - (long)folded) / scaleBenchmarkRuns);
+}
+
+// LCD device of the SPI bus
+// 1-line transmit at its own clock with the TX DMA, the SD card driver leaves
+// SPI1 in full duplex at the card's clock
+void lcdBusConfigure(void){
+    MX_SPI1_Init();
+}
+
+// LCD CS is active high
+void lcdBusSelect(bool selected){
+    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_4, selected ? GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+// Frames queued while the SD card had the bus
+void lcdBusGranted(void){
+    LcdBusGranted(lcd);
+}
+
+// SPI1 is shared, the card waits for the LCD's current frame at most
+// Returns false without a card
+bool beginSdAccess(void){
+    AcquireSpiBus(&spiBus, sdBusDevice);
+    
+    // Card and SPI1 set up again for the SD card
+    return (sd.disk_initialize() == 0);
+}
+
+// Same as beginSdAccess() for a card that is already set up, only SPI1 is
+// set up for it again, fast enough for every log sector
+bool resumeSdAccess(void){
+    AcquireSpiBus(&spiBus, sdBusDevice);
+    
+    return (sd.disk_resume() == 0);
+}
+
+// Also after a failed begin, LCD frames queued in the meantime go out from here
+void endSdAccess(void){
+    ReleaseSpiBus(&spiBus, sdBusDevice);
+}
+
+// SD card settings without a power cycle, from the menu or the serial port
+// The card may have been out for editing, the file system is mounted again
+// unless a run log is open on it. The control loop keeps running, telemetry
+// samples may be dropped while the files are read at high loop rates.
+bool reloadConfiguration(void){
+    bool loaded = false;
+    
+    if(beginSdAccess()){
+        if(logFile == NULL){
+            sd.unmount();
+            sd.mount();
+        }
+        loaded = loadConfiguration();
+    }
+    else
+        snprintf(configurationResult, sizeof(configurationResult), "No SD card");
+    
+    endSdAccess();
+    
+    //Kept in flash for boots without the card
+    if(loaded){
+        flashConfiguration = false;
+        PostTask(&scheduler, parameterTask);
+    }
+    return loaded;
+}
+
+// Frame to the transmit DMA, false while the last one is still going out
+bool sendSerialFrame(uint8_t type, const uint8_t * payload, uint16_t length){
+    if(serialTransmitting)
+        return false;
+    
+    uint16_t size = EncodeProtocol(type, payload, length, serialFrame);
+    serialTransmitting = true;
+    HAL_DMA_Start_IT(&hdma_usart2_tx, (uintptr_t)serialFrame, (uintptr_t)&USART2->TDR, size);
+    return true;
+}
+
+// Transmit DMA interrupt, the next frame can go
+void serialTransmitted(DMA_HandleTypeDef * hdma){
+    (void)hdma;
+    serialTransmitting = false;
+    PostTask(&scheduler, serialTask);
+}
+
+// printf output between two frames
+void waitSerialTransmit(void){
+    while(serialTransmitting)
+        __NOP();
+}
+
+// Samples collected so far as a telemetry frame, unless one is going out
+void sendTelemetryFrame(void){
+    if((serialStreamCount == 0) || serialTransmitting)
+        return;
+    
+    uint32_t dropped = telemetry.dropped + serialStreamDropped;
+    memcpy(serialStream, &dropped, sizeof(dropped));
+    sendSerialFrame(PROTOCOL_TELEMETRY, serialStream, 4 + serialStreamCount * sizeof(TelemetrySample));
+    serialStreamCount = 0;
+}
+
+// Telemetry sample to the next stream frame, from the telemetry task
+// Dropped while the frame is full and the last one still goes out
+void streamTelemetry(const TelemetrySample * sample){
+    if(serialStreamCount == serialStreamSamples)
+        sendTelemetryFrame();
+    if(serialStreamCount == serialStreamSamples){
+        serialStreamDropped++;
+        return;
+    }
+    
+    memcpy(&serialStream[4 + serialStreamCount * sizeof(TelemetrySample)], sample, sizeof(TelemetrySample));
+    serialStreamCount++;
+}
+
+// Command of the host, status and reply values to reply, which holds
+// PROTOCOL_MAX_PAYLOAD - 1 bytes
+// The same as the knob and buttons would do, in the same menu states
+uint8_t runSerialCommand(uint8_t type, const uint8_t * payload, uint8_t * reply, uint16_t * replyLength){
+    float value;
+    
+    switch(type){
+        case PROTOCOL_SET_RPM:
+            if(menuSelection != RpmControl)
+                return PROTOCOL_REFUSED;
+            memcpy(&value, payload, sizeof(value));
+            if(!((value >= 0.0f) && (value <= refRpmUpperThreshold)))
+                return PROTOCOL_BAD_VALUE;
+            setRefRpm(value);
+            PostTask(&scheduler, renderTask);
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_SET_FLOW_RATE:
+            if(menuSelection != FlowControl)
+                return PROTOCOL_REFUSED;
+            memcpy(&value, payload, sizeof(value));
+            if(!((value >= 0.0f) && (value <= refFlowRateUpperThreshold)))
+                return PROTOCOL_BAD_VALUE;
+            setRefFlowRate(value);
+            PostTask(&scheduler, renderTask);
+            return PROTOCOL_OK;
         
-        if(underlineHighlighted == false){
-            underlineHighlight();
-            underlineHighlighted = true;
+        case PROTOCOL_SET_VOLTAGE:
+            if(menuSelection != VoltageControl)
+                return PROTOCOL_REFUSED;
+            memcpy(&value, payload, sizeof(value));
+            if(!((value >= 0.0f) && (value <= voltageUpperThreshold)))
+                return PROTOCOL_BAD_VALUE;
+            setRefVoltage(value);
+            PostTask(&scheduler, renderTask);
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_START:
+            if(payload[0] > PROTOCOL_BATCH_DOSING)
+                return PROTOCOL_BAD_VALUE;
+            if(menuSelection != ControlSelection)
+                return PROTOCOL_REFUSED;
+            selectMenuItem(payload[0]);
+            selectButton();
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_STOP:
+            if((menuSelection != RpmControl) && (menuSelection != FlowControl) && (menuSelection != VoltageControl) && (menuSelection != PIDAutotune) && (menuSelection != BatchDosing))
+                return PROTOCOL_REFUSED;
+            // A dose ends without waiting, then out of a value being set first
+            if(menuSelection == BatchDosing)
+                abortDose(true);
+            if(selected)
+                backButton();
+            backButton();
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_DOSE:
+            if(menuSelection != BatchDosing)
+                return PROTOCOL_REFUSED;
+            memcpy(&value, payload, sizeof(value));
+            if(value == 0.0f){
+                abortDose(false);
+                return PROTOCOL_OK;
+            }
+            if(!((value > 0.0f) && (value <= refVolumeUpperThreshold)))
+                return PROTOCOL_BAD_VALUE;
+            return startDose(value) ? PROTOCOL_OK : PROTOCOL_REFUSED;
+        
+        case PROTOCOL_DOSE_STATUS:{
+            float values[4] = { dosing.target, GetDosedVolume(&dosing), dosing.coastVolume, dosing.time };
+            reply[0] = dosing.state;
+            memcpy(&reply[1], values, sizeof(values));
+            *replyLength = 1 + sizeof(values);
+            return PROTOCOL_OK;
         }
-        else{
-            underlineLowlight();
-            underlineHighlighted = false;
+        
+        case PROTOCOL_READ_PARAMETER:
+        case PROTOCOL_WRITE_PARAMETER:{
+            if(payload[0] >= settingKeyCount)
+                return PROTOCOL_BAD_VALUE;
+            
+            const SettingKey * setting = &settingKeys[payload[0]];
+            Configuration configuration;
+            captureConfiguration(&configuration);
+            
+            if(type == PROTOCOL_READ_PARAMETER){
+                value = getSettingValue(&configuration, setting);
+                memcpy(reply, &value, sizeof(value));
+                *replyLength = sizeof(value);
+                return PROTOCOL_OK;
+            }
+            
+            // Checked and swapped in as a reload, kept in flash
+            memcpy(&value, &payload[1], sizeof(value));
+            if(!((value >= setting->min) && (value <= setting->max)))
+                return PROTOCOL_BAD_VALUE;
+            setSettingValue(&configuration, setting, value);
+            if(validateConfiguration(&configuration) != NULL)
+                return PROTOCOL_REFUSED;
+            
+            applyConfiguration(&configuration);
+            parameterMirror = true;
+            PostTask(&scheduler, parameterTask);
+            return PROTOCOL_OK;
+        }
+        
+        case PROTOCOL_STREAM:
+            serialStreaming = (payload[0] != 0);
+            serialStreamCount = 0;
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_RELOAD:
+            reloadConfiguration();
+            *replyLength = strlen(configurationResult);
+            memcpy(reply, configurationResult, *replyLength);
+            return PROTOCOL_OK;
+        
+        case PROTOCOL_STATUS:{
+            uint8_t mode = PROTOCOL_NO_CONTROL;
+            if(menuSelection == RpmControl)
+                mode = PROTOCOL_RPM_CONTROL;
+            else if(menuSelection == FlowControl)
+                mode = PROTOCOL_FLOW_CONTROL;
+            else if(menuSelection == VoltageControl)
+                mode = PROTOCOL_VOLTAGE_CONTROL;
+            else if(menuSelection == BatchDosing)
+                mode = PROTOCOL_BATCH_DOSING;
+            else if(menuSelection == PIDAutotune)
+                mode = PROTOCOL_AUTOTUNE;
+            
+            float values[4] = { refRpm, averagedMotorRpm, refFlowRate, voltage };
+            int16_t pwmValue = (int16_t)pwm;
+            reply[0] = mode;
+            memcpy(&reply[1], values, sizeof(values));
+            memcpy(&reply[1 + sizeof(values)], &pwmValue, sizeof(pwmValue));
+            *replyLength = 1 + sizeof(values) + sizeof(pwmValue);
+            return PROTOCOL_OK;
         }
+    }
+    return PROTOCOL_UNKNOWN;
+}
+
+// Payload size of each command, -1 for unknown types
+int8_t serialCommandLength(uint8_t type){
+    switch(type){
+        case PROTOCOL_SET_RPM:
+        case PROTOCOL_SET_FLOW_RATE:
+        case PROTOCOL_SET_VOLTAGE:
+        case PROTOCOL_DOSE:
+            return 4;
+        case PROTOCOL_START:
+        case PROTOCOL_READ_PARAMETER:
+        case PROTOCOL_STREAM:
+            return 1;
+        case PROTOCOL_WRITE_PARAMETER:
+            return 5;
+        case PROTOCOL_STOP:
+        case PROTOCOL_RELOAD:
+        case PROTOCOL_STATUS:
+        case PROTOCOL_DOSE_STATUS:
+            return 0;
+    }
+    return -1;
+}
+
+// Serial port, every 1ms and after each transmit
+// Received bytes are taken from the circular DMA up to a command, whose reply
+// waits for the transmitter. Telemetry goes out when no reply does.
+void serialTaskFunction(void){
+    uint16_t head = serialReceiveSize - __HAL_DMA_GET_COUNTER(&hdma_usart2_rx);
+    
+    while((serialTransmitting == false) && (serialReceiveTail != head)){
+        uint8_t byte = serialReceive[serialReceiveTail];
+        serialReceiveTail = (serialReceiveTail + 1) % serialReceiveSize;
+        if(DecodeProtocol(&serialDecoder, byte) == false)
+            continue;
         
-        SetTextMode(lcd);
+        uint8_t type = serialDecoder.type;
+        uint8_t reply[1 + PROTOCOL_MAX_PAYLOAD]; //Status and the values of any reply
+        uint16_t replyLength = 0;
+        int8_t length = serialCommandLength(type);
+        
+        if(length < 0)
+            reply[0] = PROTOCOL_UNKNOWN;
+        else if(serialDecoder.payloadLength != (uint16_t)length)
+            reply[0] = PROTOCOL_BAD_LENGTH;
+        else
+            reply[0] = runSerialCommand(type, serialDecoder.payload, &reply[1], &replyLength);
+        
+        sendSerialFrame(type | PROTOCOL_REPLY, reply, 1 + replyLength);
+    }
+    
+    if(serialStreaming)
+        sendTelemetryFrame();
+}
+
+// Copy of settings.txt being written, failed on the first short write
+typedef struct SettingsCopy
+{
+    FIL file;
+    bool failed;
+} SettingsCopy;
+
+void writeSettingsCopy(void * context, const char * data, uint32_t size){
+    SettingsCopy * copy = (SettingsCopy *)context;
+    UINT written = 0;
+    if((copy->failed == false) && ((f_write(&copy->file, data, size, &written) != FR_OK) || (written != size)))
+        copy->failed = true;
+}
+
+// Kp, Ki and Kd of the [PID] section rewritten in settings.txt, the rest of
+// the file stays as it is. Edited into a copy that then replaces the file, if
+// that fails half way the settings are still in flash.
+// The card must be mounted
+bool writePidGains(void){
+    static const char * const keys[3] = { "Kp", "Ki", "Kd" };
+    float values[3] = { Kp, Ki, Kd };
+    
+    SettingsCopy copy;
+    copy.failed = false;
+    if(f_open(&copy.file, settingsCopyPath, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+        return false;
+    
+    SettingsEditor editor;
+    InitSettingsEditor(&editor, "PID", keys, values, 3, writeSettingsCopy, &copy);
+    
+    // Without settings.txt it gets only the gains
+    FIL file;
+    if(f_open(&file, settingsPath, FA_READ) == FR_OK){
+        char chunk[settingsChunkSize];
+        UINT count;
+        FRESULT result;
+        while(((result = f_read(&file, chunk, sizeof(chunk), &count)) == FR_OK) && (count != 0))
+            EditSettings(&editor, chunk, count);
+        copy.failed |= (result != FR_OK);
+        f_close(&file);
+    }
+    FinishSettingsEditor(&editor);
+    
+    copy.failed |= (f_close(&copy.file) != FR_OK);
+    if(copy.failed)
+        return false;
+    
+    FRESULT removed = f_unlink(settingsPath);
+    return ((removed == FR_OK) || (removed == FR_NO_FILE)) && (f_rename(settingsCopyPath, settingsPath) == FR_OK);
+}
+
+// Gains of a finished autotune to settings.txt, posted by the control interrupt
+// [PID] gains are per period at gainTuningFrequency, the autotune's continuous
+// A cycle too short for the loop frequency keeps the gains as they are
+void autotuneTaskFunction(void){
+    if(autotune.state != AUTOTUNE_DONE){
+        autotuneResult = (autotune.ultimatePeriod > 0.0f) ? "Loop too slow" : "Failed";
+        PostTask(&scheduler, renderTask);
+        return;
+    }
+    
+    float kp, ki, kd;
+    GetAutotuneGains(&autotune, autotuneRule, &kp, &ki, &kd);
+    
+    // Used from the next control page on
+    Kp = kp;
+    Ki = ki / gainTuningFrequency;
+    Kd = kd * gainTuningFrequency;
+    
+    // In flash even without a card
+    parameterMirror = true;
+    PostTask(&scheduler, parameterTask);
+    
+    autotuneResult = "Not saved";
+    if(beginSdAccess() && writePidGains())
+        autotuneResult = "Saved settings";
+    endSdAccess();
+    
+    PostTask(&scheduler, renderTask);
+}
+
+// Header of a new run log with the settings it runs with, called as the
+// control loop starts, the log task opens the file
+void startDataLog(void){
+    if(dataLogEnabled == false)
+        return;
+    
+    // Last run still closing
+    if(dataLogRunning)
+        logTaskFunction();
+    
+    InitDataLog(&dataLog, loopFrequency, timestampFrequency);
+    AddDataLogSetting(&dataLog, "mode", (float)menuSelection);
+    AddDataLogSetting(&dataLog, "encoderPPR", encoderPulsePerRev);
+    AddDataLogSetting(&dataLog, "encoding", encodingType);
+    AddDataLogSetting(&dataLog, "pwmMax", (float)pwmResolution);
+    AddDataLogSetting(&dataLog, "voltageMax", voltageUpperThreshold);
+    //[PID] gains, per period at gainHz
+    AddDataLogSetting(&dataLog, "gainHz", gainTuningFrequency);
+    AddDataLogSetting(&dataLog, "Kp", Kp);
+    AddDataLogSetting(&dataLog, "Ki", Ki);
+    AddDataLogSetting(&dataLog, "Kd", Kd);
+    AddDataLogSetting(&dataLog, "integralMin", integralMin);
+    AddDataLogSetting(&dataLog, "integralMax", integralMax);
+    AddDataLogSetting(&dataLog, "alpha", alpha);
+    AddDataLogSetting(&dataLog, "spWeight", setpointWeight);
+    AddDataLogSetting(&dataLog, "tracking", trackingGain);
+    AddDataLogSetting(&dataLog, "fixedPoint", fixedPointControl ? 1.0f : 0.0f);
+    AddDataLogSetting(&dataLog, "adaptiveTau", adaptiveTimeConstant);
+    AddDataLogSetting(&dataLog, "ffA", feedForwardA);
+    AddDataLogSetting(&dataLog, "ffB", feedForwardB);
+    AddDataLogSetting(&dataLog, "ffC", feedForwardC);
+    AddDataLogSetting(&dataLog, "ffAccel", accelerationFeedForward);
+    //Flow Rate function of the RPM or of the voltage
+    AddDataLogSetting(&dataLog, "flowVsRpm", flowRateVersusRpm ? 1.0f : 0.0f);
+    AddDataLogSetting(&dataLog, "flowA", flowRateVersusRpm ? rpmA : A);
+    AddDataLogSetting(&dataLog, "flowB", flowRateVersusRpm ? rpmB : B);
+    AddDataLogSetting(&dataLog, "flowC", flowRateVersusRpm ? rpmC : C);
+    
+    dataLogRunning = true;
+    dataLogStopping = false;
+    PostTask(&scheduler, logTask);
+}
+
+// Called as the control loop stops, the log task writes the rest and closes
+void stopDataLog(void){
+    if(dataLogRunning == false)
+        return;
+    
+    dataLogStopping = true;
+    PostTask(&scheduler, logTask);
+}
+
+// Next free run number in the logs folder, NULL without a card
+FILE * openDataLogFile(void){
+    char path[40];
+    
+    mkdir("/sd/motionManager/logs", 0777);
+    
+    for(uint16_t run = logRun + 1; run <= 9999; run++){
+        sprintf(path, "/sd/motionManager/logs/run%04u.bin", run);
+        
+        FILE * fp = fopen(path, "r");
+        if(fp != NULL){
+            fclose(fp);
+            continue;
+        }
+        
+        fp = fopen(path, "wb");
+        if(fp != NULL){
+            // Whole sectors go to the file system without a stdio copy
+            setvbuf(fp, NULL, _IONBF, 0);
+            logRun = run;
+        }
+        return fp;
+    }
+    return NULL;
+}
+
+// Full run log sectors to the card, posted by the telemetry task and at the
+// start and end of a run
+void logTaskFunction(void){
+    if(dataLogRunning == false)
+        return;
+    
+    if(dataLogStopping){
+        // Samples still in the ring, then the partly filled sector
+        telemetryTaskFunction();
+        FlushDataLog(&dataLog);
+    }
+    
+    bool ready = (logFile != NULL) ? resumeSdAccess() : beginSdAccess();
+    if(ready && (logFile == NULL))
+        logFile = openDataLogFile();
+    
+    if(ready && (logFile != NULL)){
+        uint8_t count;
+        while((count = GetDataLogSectorCount(&dataLog)) != 0){
+            uint32_t written = dataLog.written;
+            
+            // Card busy or full, the rest is tried again and new samples dropped
+            size_t done = fwrite(GetDataLogSector(&dataLog)->bytes, DATALOG_SECTOR_SIZE, count, logFile);
+            for(size_t i = 0; i < done; i++)
+                ReleaseDataLogSector(&dataLog);
+            
+            if((dataLog.written / logSyncSectors) != (written / logSyncSectors))
+                fflush(logFile);
+            if(done != count)
+                break;
+        }
+    }
+    
+    if(dataLogStopping && (logFile != NULL)){
+        fclose(logFile);
+        logFile = NULL;
+    }
+    
+    endSdAccess();
+    
+    // Run over, or no card to log to
+    if(logFile == NULL)
+        dataLogRunning = false;
+}
+
+/* Interrupts *****************************************************************/
+
+// RPM loop towards refRpm through the trajectory, one control period
+void controlRpm(float rpm, TelemetrySample * sample){
+    float reference = UpdateTrajectory(&rpmTrajectory, refRpm, loopPeriod);
+    
+    float feedForward = calculateFeedForward(reference) + accelerationFeedForward * rpmTrajectory.rate;
+    int32_t out;
+    
+    if(fixedPointControl){
+        //Fixed Point PI with Feed-forward
+        out = UpdateFixedPointPI(&fixedPointPI, FloatToQ16(reference - rpm)) + (int32_t)feedForward;
+    }
+    else{
+        //PID with Feed-forward, gains for the operating point
+        scheduleGains(reference);
+        out = (int32_t)UpdatePID(&pid, reference, rpm, feedForward);
+    }
+    
+    if(out > pwmResolution)
+        out = pwmResolution;
+    else if(out < -pwmResolution)
+        out = -pwmResolution;
+    applyPWM((int16_t)out);
+    
+    //Plant identification from what the PID sees and applies
+    UpdatePlantEstimator(&plantEstimator, rpm, (float)out);
+    
+    sample->error = reference - rpm;
+    sample->integral = fixedPointControl ? (float)fixedPointPI.integral / 65536.0f : pid.integral;
+}
+
+void HAL_TIM_OC_DelayElapsedCallback(TIM_HandleTypeDef *htim){
+
+    // Motor Encoder, TIM3 CH2 every controlPeriod
+    if(htim->Instance == TIM3){
+        __HAL_TIM_SET_COMPARE(&htim3, TIM_CHANNEL_2, (uint16_t)(htim3.Instance->CCR2 + controlPeriod));
+        
+        //RPM Calculation
+        //Last encoder edge, TIM3 CCR1 has its time and TIM1 CCR1 its count
+        //Read again if another edge is captured in between
+        bool captured = false;
+        uint16_t edgeTime = 0;
+        int16_t edgeCount = 0;
+        do{
+            if(__HAL_TIM_GET_FLAG(&htim3, TIM_FLAG_CC1)){
+                __HAL_TIM_CLEAR_FLAG(&htim3, TIM_FLAG_CC1);
+                edgeTime = htim3.Instance->CCR1;
+                edgeCount = htim1.Instance->CCR1;
+                captured = true;
+            }
+        } while(__HAL_TIM_GET_FLAG(&htim3, TIM_FLAG_CC1));
+        
+        motorRPM = UpdateTachometer(&tachometer, htim3.Instance->CNT, captured, edgeCount, edgeTime);
+        
+        //A little Moving Average for RPM
+        float rpm = (loopAlpha * motorRPM) + (1 - loopAlpha) * averagedMotorRpm;
+        averagedMotorRpm = rpm;
+        
+        //Telemetry, error and integral only in the RPM loop
+        uint16_t encoderCount = htim1.Instance->CNT;
+        TelemetrySample sample;
+        sample.time = tachometer.time;
+        sample.encoderDelta = (int16_t)(encoderCount - telemetryEncoderCount);
+        telemetryEncoderCount = encoderCount;
+        sample.rpm = rpm;
+        sample.error = 0.0f;
+        sample.integral = 0.0f;
+        
+        //Flow Control runs the RPM loop, refRpm is set from the flow rate
+        if((menuSelection == RpmControl) || (menuSelection == FlowControl)){
+            //Reference RPM from the program and the trajectory
+            float programRpm;
+            if(UpdateTrajectoryProgram(&rpmProgram, loopPeriod, &programRpm))
+                refRpm = programRpm;
+            controlRpm(rpm, &sample);
+        }
+        else if(menuSelection == BatchDosing){
+            //Volume from the encoder, the RPM loop runs until the cut
+            bool active = DosingActive(&dosing);
+            refRpm = UpdateDosing(&dosing, sample.encoderDelta, loopPeriod);
+            if(dosing.state == DOSING_RUNNING)
+                controlRpm(rpm, &sample);
+            else if(pwm != 0){
+                //Cut or abort, the next dose starts from standstill
+                applyPWM(0);
+                ResetPID(&pid);
+                ResetFixedPointPI(&fixedPointPI);
+                ResetTrajectory(&rpmTrajectory, 0.0f);
+            }
+            
+            //Pump stands, the learned coast volume to flash
+            if(active && (DosingActive(&dosing) == false)){
+                PostTask(&scheduler, renderTask);
+                keepSetpoint();
+            }
+        }
+        else if(menuSelection == VoltageControl){
+            //Applied voltage from the program and the trajectory
+            float programVoltage;
+            if(UpdateTrajectoryProgram(&voltageProgram, loopPeriod, &programVoltage))
+                voltage = programVoltage;
+            setVoltage(UpdateTrajectory(&voltageTrajectory, voltage, loopPeriod));
+        }
+        else if(menuSelection == PIDAutotune){
+            //Relay experiment, the autotune task saves the result
+            bool running = (autotune.state == AUTOTUNE_RUNNING);
+            applyPWM((int16_t)UpdateAutotune(&autotune, rpm, loopPeriod));
+            if(running && (autotune.state != AUTOTUNE_RUNNING))
+                PostTask(&scheduler, autotuneTask);
+        }
+        
+        //Backward sets the direction pin, pwm is the duty cycle
+        sample.pwm = (GPIOA->ODR & GPIO_PIN_10) ? -pwm : pwm;
+        PushTelemetry(&telemetry, &sample);
+    }
+}
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim){
+    
+    if(htim->Instance == TIM15){
+        PostTask(&scheduler, blinkTask);
     }
 
     if(htim->Instance == TIM17){
-        refreshScreen();
+        PostTask(&scheduler, renderTask);
     }
     
+    // LCD command execution time passed
+    if(htim->Instance == TIM7){
+        LcdTimerElapsed(lcd);
+    }
+    
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi){
+    // LCD command frame sent
+    if(hspi == &hspi1){
+        LcdSpiTxComplete(lcd);
+    }
 }
 
 /*
@@ -916,58 +3238,13 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin){
                 }
                 
                 if(state == 3) {
-                    if(cycleCount > 0) {
-                        //HAL_UART_Transmit(&huart2, (uint8_t *)"+++++\r\n", 3, HAL_MAX_DELAY);
-                        if(menuSelection == RpmControl)
-                            incrementDisplayedRefRPM();
-                        
-                        else if(menuSelection == VoltageControl)
-                            incrementDisplayedVoltage();
-                        
-                        else if(menuSelection == ControlSelection)
-                        {
-                            SetGraphicsMode(lcd);
-                            menuIndex++;
-                            menuIndex = (menuIndex%4);
-                            
-                            if(menuIndex == 0)
-                                    menuIndex++;
-                            
-                            if(menuIndex == 1)
-                                HighlightMenuItem(lcd, 3, false);
-                            else
-                                HighlightMenuItem(lcd, menuIndex - 1, false);
-                            HighlightMenuItem(lcd, menuIndex, true);
-                            //SetTextMode(lcd);
-                        }
-                        //count++;
-                        //direction = 1;
+                    if((cycleCount > 0) && (knobSteps < INT8_MAX)) {
+                        knobSteps++;
+                        PostTask(&scheduler, uiTask);
                     }
-                    else if(cycleCount < 0) {
-                        if(menuSelection == RpmControl)
-                            decreaseDisplayedRefRPM();
-                        
-                        else if(menuSelection == VoltageControl)
-                            decreaseDisplayedVoltage();
-                        
-                        else if(menuSelection == ControlSelection)
-                        {
-                            SetGraphicsMode(lcd);
-                            menuIndex--;
-                            menuIndex = (menuIndex%4);
-                            
-                            if(menuIndex == 0)
-                                    menuIndex = 3;
-                            
-                            if(menuIndex == 3)
-                                HighlightMenuItem(lcd, 1, false);
-                            else
-                                HighlightMenuItem(lcd, menuIndex + 1, false);
-                            HighlightMenuItem(lcd, menuIndex, true);
-                            //SetTextMode(lcd);
-                        }
-                        //count--;
-                        //direction = -1;
+                    else if((cycleCount < 0) && (knobSteps > INT8_MIN)) {
+                        knobSteps--;
+                        PostTask(&scheduler, uiTask);
                     }
                     cycleCount = 0;
                 }
@@ -977,136 +3254,18 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin){
         }
     }
         
-    // Knob Select Button - PA11
     currentMillis = HAL_GetTick();
     if(currentMillis - prevMillis > debounceMillis){
+        // Knob Select Button - PA11
         if(GPIO_Pin == GPIO_PIN_11){
-            if(menuSelection == ControlSelection){
-                switch (menuIndex){
-                    case 1: //RPM Control
-                        menuSelection = RpmControl;
-                        menuRpmControl();
-                        break;
-                    case 2: //Voltage Control
-                        menuSelection = VoltageControl;
-                        menuVoltageControl();
-                        break;
-                    case 3: //About
-                        menuSelection = About;
-                        menuAbout();
-                        break;
-                }
-            }
-            
-            else if(menuSelection == RpmControl){
-                // "Set Ref RPM" Selected
-                // First time selected (to set new rpm)
-                if(selected == false){
-                    selected = true;
-                    displayedRefRpm = refRpm;
-                    
-                    // Start Highlighting
-                    HAL_TIM_Base_Start_IT(&htim15);
-                }
-                
-                // Second time selected (new rpm set)
-                else if (selected == true){
-                    selected = false;
-                    refRpm = displayedRefRpm;
-                    
-                    // Stop Highlighting
-                    HAL_TIM_Base_Stop_IT(&htim15);
-                    SetGraphicsMode(lcd);
-                    underlineHighlighted = false;
-                    underlineLowlight();
-                    SetTextMode(lcd);
-                }
-            }
-            
-            else if(menuSelection == VoltageControl){
-                // "Set Voltage" Selected
-                // First time selected (to set voltge)
-                if(selected == false){
-                    selected = true;
-                    displayedVoltage = voltage;
-                    
-                    //Start Highlighting
-                    HAL_TIM_Base_Start_IT(&htim15);
-                }
-                else if(selected == true){
-                    selected = false;
-                    voltage = displayedVoltage;
-                    setVoltage();
-                    
-                    //Stop Highlihting
-                    HAL_TIM_Base_Stop_IT(&htim15);
-                    SetGraphicsMode(lcd);
-                    underlineHighlighted = false;
-                    underlineLowlight();
-                    SetTextMode(lcd);
-                }
-            }
-            
-            else if (menuSelection == About){
-                __NOP; //Knob does not do anything
-            }
+            selectPressed = true;
+            PostTask(&scheduler, uiTask);
         }
     
         // Stop/Back Button - PF1
         if(GPIO_Pin == GPIO_PIN_1){
-            if(menuSelection == ControlSelection){
-                __NOP;
-            }
-            else if((menuSelection == RpmControl) || (menuSelection == VoltageControl)){
-                if(selected == true){
-                    selected = false;
-                    HAL_TIM_Base_Stop_IT(&htim15);
-                    
-                    // Exit selection
-                    if(underlineHighlighted == true){
-                        SetGraphicsMode(lcd);
-                        underlineHighlighted = false;
-                        underlineLowlight();
-                        SetTextMode(lcd);
-                    }
-                }
-                else if (selected == false){
-                    //Stop RPM Control Loop
-                    HAL_TIM_Base_Stop_IT(&htim3);
-                    //Stop Refreshing Page
-                    HAL_TIM_Base_Stop_IT(&htim17);
-                    menuSelection = ControlSelection;
-                    menuControlSelection();
-                    
-                    // Zero Everthing
-                    voltage = 0;
-                    displayedVoltage = 0;
-                    refRpm = 0;
-                    displayedRefRpm = 0;
-                    motorRPM = 0;
-                    averagedMotorRpm = 0;
-                    pwm = 0;
-                    integral = 0;
-                    prevEncoderCount = 0;
-                    htim1.Instance->CNT = 0;    //Zero Encoder Count
-                    
-                    //TIM1 - Encoder
-                    HAL_TIM_Encoder_Stop(&htim1, TIM_CHANNEL_ALL);
-                    
-                    //TIM3 - Velocity Calculation Interrupt
-                    HAL_TIM_Base_Stop_IT(&htim3);
-                    
-                    // Set PWM to 0
-                    __HAL_TIM_SET_COMPARE(&htim16, TIM_CHANNEL_1, 0);
-                    
-                    //TIM16 - PWM
-                    HAL_TIM_PWM_Stop(&htim16, TIM_CHANNEL_1);
-                }
-            }
-            else if(menuSelection == About){
-                menuSelection = ControlSelection;
-                menuControlSelection();
-            }
+            backPressed = true;
+            PostTask(&scheduler, uiTask);
         }
         prevMillis = currentMillis;
     }
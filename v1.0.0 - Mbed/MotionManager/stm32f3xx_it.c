@@ -34,6 +34,7 @@
 #include "stm32f3xx_hal.h"
 #include "stm32f3xx.h"
 #include "stm32f3xx_it.h"
+#include "Profiler.h"
 
 /* USER CODE BEGIN 0 */
 
@@ -44,6 +45,9 @@ extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim3;
 extern TIM_HandleTypeDef htim15;
 extern TIM_HandleTypeDef htim17;
+extern TIM_HandleTypeDef htim7;
+extern DMA_HandleTypeDef hdma_spi1_tx;
+extern DMA_HandleTypeDef hdma_usart2_tx;
 
 /******************************************************************************/
 /*            Cortex-M4 Processor Interruption and Exception Handlers         */ 
@@ -77,11 +81,11 @@ void SysTick_Handler(void)
 void EXTI1_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI1_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END EXTI1_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_1);
   /* USER CODE BEGIN EXTI1_IRQn 1 */
-
+  ProfileStop(PROFILE_EXTI, start);
   /* USER CODE END EXTI1_IRQn 1 */
 }
 
@@ -91,25 +95,53 @@ void EXTI1_IRQHandler(void)
 void EXTI4_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI4_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END EXTI4_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_4);
   /* USER CODE BEGIN EXTI4_IRQn 1 */
-
+  ProfileStop(PROFILE_EXTI, start);
   /* USER CODE END EXTI4_IRQn 1 */
 }
 
+/**
+* @brief This function handles DMA1 channel3 global interrupt.
+*/
+void DMA1_Channel3_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel3_IRQn 0 */
+  uint32_t start = ProfileStart();
+  /* USER CODE END DMA1_Channel3_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_spi1_tx);
+  /* USER CODE BEGIN DMA1_Channel3_IRQn 1 */
+  ProfileStop(PROFILE_LCD_DMA, start);
+  /* USER CODE END DMA1_Channel3_IRQn 1 */
+}
+
+/**
+* @brief This function handles DMA1 channel7 global interrupt.
+*/
+void DMA1_Channel7_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel7_IRQn 0 */
+  uint32_t start = ProfileStart();
+  /* USER CODE END DMA1_Channel7_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart2_tx);
+  /* USER CODE BEGIN DMA1_Channel7_IRQn 1 */
+  ProfileStop(PROFILE_SERIAL_DMA, start);
+  /* USER CODE END DMA1_Channel7_IRQn 1 */
+}
+
 /**
 * @brief This function handles EXTI line[9:5] interrupts.
 */
 void EXTI9_5_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI9_5_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END EXTI9_5_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_5);
   /* USER CODE BEGIN EXTI9_5_IRQn 1 */
-
+  ProfileStop(PROFILE_EXTI, start);
   /* USER CODE END EXTI9_5_IRQn 1 */
 }
 
@@ -119,12 +151,12 @@ void EXTI9_5_IRQHandler(void)
 void TIM1_BRK_TIM15_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM1_BRK_TIM15_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END TIM1_BRK_TIM15_IRQn 0 */
   HAL_TIM_IRQHandler(&htim1);
   HAL_TIM_IRQHandler(&htim15);
   /* USER CODE BEGIN TIM1_BRK_TIM15_IRQn 1 */
-
+  ProfileStop(PROFILE_BLINK, start);
   /* USER CODE END TIM1_BRK_TIM15_IRQn 1 */
 }
 
@@ -134,12 +166,12 @@ void TIM1_BRK_TIM15_IRQHandler(void)
 void TIM1_TRG_COM_TIM17_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM1_TRG_COM_TIM17_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END TIM1_TRG_COM_TIM17_IRQn 0 */
   HAL_TIM_IRQHandler(&htim1);
   HAL_TIM_IRQHandler(&htim17);
   /* USER CODE BEGIN TIM1_TRG_COM_TIM17_IRQn 1 */
-
+  ProfileStop(PROFILE_REFRESH, start);
   /* USER CODE END TIM1_TRG_COM_TIM17_IRQn 1 */
 }
 
@@ -149,11 +181,13 @@ void TIM1_TRG_COM_TIM17_IRQHandler(void)
 void TIM3_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM3_IRQn 0 */
-
+  uint32_t start = ProfileStart();
+  // TIM3 counts from the CH2 compare, one count is (Prescaler + 1) cycles
+  ProfileRecord(PROFILE_CONTROL_LATENCY, (uint16_t)(htim3.Instance->CNT - htim3.Instance->CCR2) * (htim3.Init.Prescaler + 1));
   /* USER CODE END TIM3_IRQn 0 */
   HAL_TIM_IRQHandler(&htim3);
   /* USER CODE BEGIN TIM3_IRQn 1 */
-
+  ProfileStop(PROFILE_CONTROL, start);
   /* USER CODE END TIM3_IRQn 1 */
 }
 
@@ -163,14 +197,28 @@ void TIM3_IRQHandler(void)
 void EXTI15_10_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI15_10_IRQn 0 */
-
+  uint32_t start = ProfileStart();
   /* USER CODE END EXTI15_10_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_11);
   /* USER CODE BEGIN EXTI15_10_IRQn 1 */
-
+  ProfileStop(PROFILE_EXTI, start);
   /* USER CODE END EXTI15_10_IRQn 1 */
 }
 
+/**
+* @brief This function handles TIM7 global and DAC2 underrun error interrupts.
+*/
+void TIM7_DAC2_IRQHandler(void)
+{
+  /* USER CODE BEGIN TIM7_DAC2_IRQn 0 */
+  uint32_t start = ProfileStart();
+  /* USER CODE END TIM7_DAC2_IRQn 0 */
+  HAL_TIM_IRQHandler(&htim7);
+  /* USER CODE BEGIN TIM7_DAC2_IRQn 1 */
+  ProfileStop(PROFILE_LCD_TIMER, start);
+  /* USER CODE END TIM7_DAC2_IRQn 1 */
+}
+
 /* USER CODE BEGIN 1 */
 
 /* USER CODE END 1 */
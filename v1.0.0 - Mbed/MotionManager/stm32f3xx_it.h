@@ -50,11 +50,14 @@
 void SysTick_Handler(void);
 void EXTI1_IRQHandler(void);
 void EXTI4_IRQHandler(void);
+void DMA1_Channel3_IRQHandler(void);
+void DMA1_Channel7_IRQHandler(void);
 void EXTI9_5_IRQHandler(void);
 void TIM1_BRK_TIM15_IRQHandler(void);
 void TIM1_TRG_COM_TIM17_IRQHandler(void);
 void TIM3_IRQHandler(void);
 void EXTI15_10_IRQHandler(void);
+void TIM7_DAC2_IRQHandler(void);
 
 #ifdef __cplusplus
 }
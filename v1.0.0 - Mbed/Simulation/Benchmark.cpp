@@ -0,0 +1,303 @@
+#include "SimFirmware.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Step response benchmark of the firmware controller over a matrix of
+// setpoints, pump loads and encoder resolutions
+//
+// Every case runs in its own process so it starts from a fresh boot
+
+#ifndef SIM_SD_ROOT
+#define SIM_SD_ROOT NULL
+#endif
+
+#define MAX_VALUES          16
+#define MAX_SAMPLES         131072  // 2kHz loop for 60s
+
+#define STEP_TIME           0.5     // s after RPM Control is entered
+#define SETTLING_BAND       0.02    // of the setpoint
+#define RIPPLE_WINDOW       1.0     // s at the end of the run
+
+typedef struct Case
+{
+	double setpoint;
+	double pressure;
+	double encoderPulsePerRev;
+	double loopFrequency;
+} Case;
+
+typedef struct Result
+{
+	double riseTime;            // s, 10% to 90%, negative if not reached
+	double overshoot;           // % of the setpoint
+	double settlingTime;        // s after the step, negative if not settled
+	double steadyStateError;    // RPM, mean over the ripple window
+	double ripple;              // RPM peak to peak over the ripple window
+	double peakCurrent;         // A, motor current at any plant step
+	double controlNs;           // host ns per control interrupt
+} Result;
+
+static const char * controller = "pid";
+static bool fixedPoint = false;
+static const char * sdRoot = SIM_SD_ROOT;
+static double runTime = 4.0;    // s after the step
+
+static Case current;
+static int sampleCount = 0;
+static double sampleTime[MAX_SAMPLES];
+static double sampleRpm[MAX_SAMPLES];
+static double controlStart = 0.0;
+
+static void SampleControl(void){
+	if(sampleCount >= MAX_SAMPLES)
+		return;
+
+	sampleTime[sampleCount] = SimGetTime() - controlStart;
+	sampleRpm[sampleCount] = GetPlantRpm(SimGetPlant());
+	sampleCount++;
+}
+
+static void StepSlice(void){
+	refRpm = ((SimGetTime() - controlStart) >= STEP_TIME) ? current.setpoint : 0.0f;
+}
+
+static void Evaluate(Result * result){
+	double setpoint = current.setpoint;
+	double t10 = -1.0, t90 = -1.0, peak = 0.0;
+	double lastOutside = STEP_TIME;
+	double windowStart = sampleTime[sampleCount - 1] - RIPPLE_WINDOW;
+	double sum = 0.0, minimum = INFINITY, maximum = -INFINITY;
+	int windowCount = 0;
+
+	for(int i = 0; i < sampleCount; i++){
+		double t = sampleTime[i], rpm = sampleRpm[i];
+
+		if(t < STEP_TIME)
+			continue;
+
+		if((t10 < 0.0) && (rpm >= 0.1 * setpoint))
+			t10 = t;
+		if((t90 < 0.0) && (rpm >= 0.9 * setpoint))
+			t90 = t;
+		if(rpm > peak)
+			peak = rpm;
+		if(fabs(rpm - setpoint) > SETTLING_BAND * setpoint)
+			lastOutside = t;
+
+		if(t >= windowStart){
+			sum += rpm;
+			windowCount++;
+			if(rpm < minimum) minimum = rpm;
+			if(rpm > maximum) maximum = rpm;
+		}
+	}
+
+	result->riseTime = ((t10 >= 0.0) && (t90 >= 0.0)) ? (t90 - t10) : -1.0;
+	result->overshoot = (peak > setpoint) ? 100.0 * (peak - setpoint) / setpoint : 0.0;
+	result->settlingTime = (lastOutside < windowStart) ? (lastOutside - STEP_TIME) : -1.0;
+	result->steadyStateError = sum / windowCount - setpoint;
+	result->ripple = maximum - minimum;
+	result->peakCurrent = SimGetPlant()->peakCurrent;
+
+	uint64_t count, nanoseconds;
+	GetSimControlCost(&count, &nanoseconds);
+	result->controlNs = (count != 0) ? (double)nanoseconds / count : 0.0;
+}
+
+static void RunCase(Result * result){
+	SetSimSdRoot(sdRoot);
+	BootFirmware();
+	dataLogEnabled = false;    // No run logs
+
+	// After the SD card settings, overrides [encoder] and [controlLoop]
+	encoderPulsePerRev = (float)current.encoderPulsePerRev;
+	loopFrequency = (float)current.loopFrequency;
+	fixedPointControl = fixedPoint;
+	SimGetPlant()->encoderPulsePerRev = current.encoderPulsePerRev;
+	SimGetPlant()->pressure = current.pressure;
+
+	EnterRpmControl();
+
+	controlStart = SimGetTime();
+	SetSimControlHook(SampleControl);
+	RunFirmware(STEP_TIME + runTime, StepSlice);
+	SetSimControlHook(NULL);
+
+	Evaluate(result);
+}
+
+// Child process runs the case, the result comes back through a pipe
+static bool RunIsolated(Result * result){
+	int fds[2];
+	if(pipe(fds) != 0)
+		return false;
+
+	fflush(NULL);
+	pid_t pid = fork();
+	if(pid < 0)
+		return false;
+
+	if(pid == 0){
+		close(fds[0]);
+		RunCase(result);
+		ssize_t written = write(fds[1], result, sizeof(*result));
+		_exit((written == (ssize_t)sizeof(*result)) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ssize_t received = read(fds[0], result, sizeof(*result));
+	close(fds[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	return (received == (ssize_t)sizeof(*result)) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+static int ParseList(const char * text, double * values){
+	int count = 0;
+	char * end;
+
+	while((*text != '\0') && (count < MAX_VALUES)){
+		values[count++] = strtod(text, &end);
+		if(*end != ',')
+			break;
+		text = end + 1;
+	}
+	return count;
+}
+
+// Negative results mean "not reached", null in JSON
+static void WriteJsonNumber(FILE * fp, double value, bool optional){
+	if(optional && (value < 0.0))
+		fprintf(fp, "null");
+	else
+		fprintf(fp, "%.4f", value);
+}
+
+static void Usage(const char * name){
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  --rpm LIST       setpoints, default 1000,2500,5000,7500,9600\n"
+	        "  --pressure LIST  pump loads in bar, default 0,2,5\n"
+	        "  --ppr LIST       encoder pulses per rev, default 100,256,512\n"
+	        "  --loop LIST      control loop frequencies in Hz, default 100\n"
+	        "  --fixed          fixed point PI instead of the float PID\n"
+	        "  --time S         run time after the step, default 4\n"
+	        "  --sd DIR         directory used as the SD card (settings.txt), \"none\" for defaults\n"
+	        "  --csv FILE       CSV results, default stdout\n"
+	        "  --json FILE      JSON results\n",
+	        name);
+}
+
+int main(int argc, char ** argv){
+	double setpoints[MAX_VALUES] = { 1000, 2500, 5000, 7500, 9600 };
+	double pressures[MAX_VALUES] = { 0, 2, 5 };
+	double resolutions[MAX_VALUES] = { 100, 256, 512 };
+	double frequencies[MAX_VALUES] = { 100 };
+	int setpointCount = 5, pressureCount = 3, resolutionCount = 3, frequencyCount = 1;
+	const char * csvPath = NULL;
+	const char * jsonPath = NULL;
+
+	for(int i = 1; i < argc; i++){
+		bool hasValue = (i + 1 < argc);
+
+		if((strcmp(argv[i], "--rpm") == 0) && hasValue)
+			setpointCount = ParseList(argv[++i], setpoints);
+		else if((strcmp(argv[i], "--pressure") == 0) && hasValue)
+			pressureCount = ParseList(argv[++i], pressures);
+		else if((strcmp(argv[i], "--ppr") == 0) && hasValue)
+			resolutionCount = ParseList(argv[++i], resolutions);
+		else if((strcmp(argv[i], "--loop") == 0) && hasValue)
+			frequencyCount = ParseList(argv[++i], frequencies);
+		else if(strcmp(argv[i], "--fixed") == 0){
+			fixedPoint = true;
+			controller = "pi-q16";
+		}
+		else if((strcmp(argv[i], "--time") == 0) && hasValue)
+			runTime = atof(argv[++i]);
+		else if((strcmp(argv[i], "--sd") == 0) && hasValue){
+			sdRoot = argv[++i];
+			if(strcmp(sdRoot, "none") == 0)
+				sdRoot = NULL;
+		}
+		else if((strcmp(argv[i], "--csv") == 0) && hasValue)
+			csvPath = argv[++i];
+		else if((strcmp(argv[i], "--json") == 0) && hasValue)
+			jsonPath = argv[++i];
+		else{
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(runTime < 2.0 * RIPPLE_WINDOW){
+		fprintf(stderr, "--time must be at least %.1fs\n", 2.0 * RIPPLE_WINDOW);
+		return 2;
+	}
+
+	FILE * csv = (csvPath != NULL) ? fopen(csvPath, "w") : stdout;
+	FILE * json = (jsonPath != NULL) ? fopen(jsonPath, "w") : NULL;
+	if((csv == NULL) || ((jsonPath != NULL) && (json == NULL))){
+		fprintf(stderr, "can not open the result files\n");
+		return 1;
+	}
+
+	fprintf(csv, "controller,setpoint,pressure,encoderPulsePerRev,loopFrequency,riseTime,overshoot,settlingTime,steadyStateError,ripple,peakCurrent,controlNs\n");
+	if(json != NULL)
+		fprintf(json, "{\n  \"controller\": \"%s\",\n  \"results\": [", controller);
+
+	int failed = 0;
+	bool first = true;
+
+	for(int s = 0; s < setpointCount; s++)
+	for(int p = 0; p < pressureCount; p++)
+	for(int r = 0; r < resolutionCount; r++)
+	for(int f = 0; f < frequencyCount; f++){
+		current.setpoint = setpoints[s];
+		current.pressure = pressures[p];
+		current.encoderPulsePerRev = resolutions[r];
+		current.loopFrequency = frequencies[f];
+
+		if(current.setpoint <= 0.0)
+			continue;
+
+		Result result;
+		if(RunIsolated(&result) == false){
+			fprintf(stderr, "case %.0f rpm %.1f bar %.0f ppr %.0f Hz failed\n", current.setpoint, current.pressure, current.encoderPulsePerRev, current.loopFrequency);
+			failed++;
+			continue;
+		}
+
+		fprintf(csv, "%s,%.0f,%.2f,%.0f,%.0f,%.4f,%.2f,%.4f,%.2f,%.2f,%.3f,%.1f\n", controller,
+		        current.setpoint, current.pressure, current.encoderPulsePerRev, current.loopFrequency,
+		        result.riseTime, result.overshoot, result.settlingTime,
+		        result.steadyStateError, result.ripple, result.peakCurrent, result.controlNs);
+
+		if(json != NULL){
+			fprintf(json, "%s\n    {\"setpoint\": %.0f, \"pressure\": %.2f, \"encoderPulsePerRev\": %.0f, \"loopFrequency\": %.0f, \"riseTime\": ",
+			        first ? "" : ",", current.setpoint, current.pressure, current.encoderPulsePerRev, current.loopFrequency);
+			WriteJsonNumber(json, result.riseTime, true);
+			fprintf(json, ", \"overshoot\": ");
+			WriteJsonNumber(json, result.overshoot, false);
+			fprintf(json, ", \"settlingTime\": ");
+			WriteJsonNumber(json, result.settlingTime, true);
+			fprintf(json, ", \"steadyStateError\": %.4f, \"ripple\": %.4f, \"peakCurrent\": %.4f, \"controlNs\": %.1f}",
+			        result.steadyStateError, result.ripple, result.peakCurrent, result.controlNs);
+		}
+		first = false;
+	}
+
+	if(json != NULL){
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+	}
+	if(csv != stdout)
+		fclose(csv);
+
+	return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+#include "ColumnFile.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct ColumnType
+{
+	const char * name;
+	uint8_t type;
+	uint8_t size;
+} ColumnType;
+
+static const ColumnType columnTypes[COLUMN_COUNT] = {
+	{ "time", COLUMN_UINT64, 8 },
+	{ "counts", COLUMN_INT16, 2 },
+	{ "pwm", COLUMN_INT16, 2 },
+	{ "rpm", COLUMN_FLOAT, 4 },
+	{ "error", COLUMN_FLOAT, 4 },
+	{ "integral", COLUMN_FLOAT, 4 },
+	{ "reference", COLUMN_FLOAT, 4 },
+	{ "flowRate", COLUMN_FLOAT, 4 },
+};
+
+static uint64_t Align(uint64_t offset){
+	return (offset + COLUMN_ALIGN - 1) & ~(uint64_t)(COLUMN_ALIGN - 1);
+}
+
+static void SetPointers(struct ColumnFile * file){
+	file->header = (const ColumnHeader *)file->data;
+	file->columns = (const ColumnInfo *)(file->data + sizeof(ColumnHeader));
+	file->settings = (const DataLogSetting *)(file->columns + file->header->columnCount);
+
+	for(uint8_t i = 0; i < COLUMN_COUNT; i++)
+		file->values[i] = file->data + file->columns[i].offset;
+}
+
+// Closes fd, the mapping stays valid without it
+static bool Map(struct ColumnFile * file, int fd, uint64_t size, bool writable){
+	void * data = mmap(NULL, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return false;
+
+	// Columns are read front to back
+	if(writable == false)
+		madvise(data, size, MADV_SEQUENTIAL);
+
+	file->data = (uint8_t *)data;
+	file->size = size;
+	return true;
+}
+
+bool CreateColumnFile(struct ColumnFile * file, const char * path, uint64_t rows, float sampleFrequency,
+                      float timeFrequency, const DataLogSetting * settings, uint8_t settingCount){
+	if(settingCount > COLUMN_MAX_SETTINGS)
+		settingCount = COLUMN_MAX_SETTINGS;
+
+	uint64_t offsets[COLUMN_COUNT];
+	uint64_t size = sizeof(ColumnHeader) + COLUMN_COUNT * sizeof(ColumnInfo) + settingCount * sizeof(DataLogSetting);
+	for(uint8_t i = 0; i < COLUMN_COUNT; i++){
+		offsets[i] = Align(size);
+		size = offsets[i] + rows * columnTypes[i].size;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return false;
+	if(ftruncate(fd, (off_t)size) != 0){
+		close(fd);
+		return false;
+	}
+	if(Map(file, fd, size, true) == false)
+		return false;
+
+	// The file is zero filled, only the set fields are written
+	ColumnHeader * header = (ColumnHeader *)file->data;
+	memcpy(header->magic, "MMCL", 4);
+	header->version = COLUMN_VERSION;
+	header->columnCount = COLUMN_COUNT;
+	header->settingCount = settingCount;
+	header->rows = rows;
+	header->sampleFrequency = sampleFrequency;
+	header->timeFrequency = timeFrequency;
+
+	ColumnInfo * columns = (ColumnInfo *)(file->data + sizeof(ColumnHeader));
+	for(uint8_t i = 0; i < COLUMN_COUNT; i++){
+		strncpy(columns[i].name, columnTypes[i].name, COLUMN_NAME_SIZE - 1);
+		columns[i].type = columnTypes[i].type;
+		columns[i].size = columnTypes[i].size;
+		columns[i].offset = offsets[i];
+	}
+
+	memcpy(columns + COLUMN_COUNT, settings, settingCount * sizeof(DataLogSetting));
+
+	SetPointers(file);
+	return true;
+}
+
+void PutColumnRow(struct ColumnFile * file, uint64_t row, const struct ColumnRow * value){
+	((uint64_t *)file->values[COLUMN_TIME])[row] = value->time;
+	((int16_t *)file->values[COLUMN_ENCODER_DELTA])[row] = value->encoderDelta;
+	((int16_t *)file->values[COLUMN_PWM])[row] = value->pwm;
+	((float *)file->values[COLUMN_RPM])[row] = value->rpm;
+	((float *)file->values[COLUMN_ERROR])[row] = value->error;
+	((float *)file->values[COLUMN_INTEGRAL])[row] = value->integral;
+	((float *)file->values[COLUMN_REFERENCE])[row] = value->reference;
+	((float *)file->values[COLUMN_FLOW_RATE])[row] = value->flowRate;
+}
+
+void SetColumnDropped(struct ColumnFile * file, uint64_t dropped){
+	((ColumnHeader *)file->data)->dropped = dropped;
+}
+
+bool OpenColumnFile(struct ColumnFile * file, const char * path){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat status;
+	if((fstat(fd, &status) != 0) || ((uint64_t)status.st_size < sizeof(ColumnHeader))){
+		close(fd);
+		return false;
+	}
+	if(Map(file, fd, (uint64_t)status.st_size, false) == false)
+		return false;
+
+	const ColumnHeader * header = (const ColumnHeader *)file->data;
+	bool valid = (memcmp(header->magic, "MMCL", 4) == 0) && (header->version == COLUMN_VERSION)
+	             && (header->columnCount == COLUMN_COUNT) && (header->settingCount <= COLUMN_MAX_SETTINGS)
+	             && (sizeof(ColumnHeader) + COLUMN_COUNT * sizeof(ColumnInfo) + header->settingCount * sizeof(DataLogSetting) <= file->size);
+
+	// Same columns as written here, each inside the file
+	const ColumnInfo * columns = (const ColumnInfo *)(file->data + sizeof(ColumnHeader));
+	for(uint8_t i = 0; valid && (i < COLUMN_COUNT); i++){
+		valid = (strncmp(columns[i].name, columnTypes[i].name, COLUMN_NAME_SIZE) == 0)
+		        && (columns[i].type == columnTypes[i].type) && (columns[i].size == columnTypes[i].size)
+		        && (columns[i].offset % COLUMN_ALIGN == 0) && (columns[i].offset <= file->size)
+		        && (header->rows <= (file->size - columns[i].offset) / columns[i].size);
+	}
+
+	if(valid == false){
+		CloseColumnFile(file);
+		return false;
+	}
+
+	SetPointers(file);
+	return true;
+}
+
+void GetColumnRow(const struct ColumnFile * file, uint64_t row, struct ColumnRow * value){
+	value->time = ((const uint64_t *)file->values[COLUMN_TIME])[row];
+	value->encoderDelta = ((const int16_t *)file->values[COLUMN_ENCODER_DELTA])[row];
+	value->pwm = ((const int16_t *)file->values[COLUMN_PWM])[row];
+	value->rpm = ((const float *)file->values[COLUMN_RPM])[row];
+	value->error = ((const float *)file->values[COLUMN_ERROR])[row];
+	value->integral = ((const float *)file->values[COLUMN_INTEGRAL])[row];
+	value->reference = ((const float *)file->values[COLUMN_REFERENCE])[row];
+	value->flowRate = ((const float *)file->values[COLUMN_FLOW_RATE])[row];
+}
+
+void CloseColumnFile(struct ColumnFile * file){
+	if(file->data != NULL)
+		munmap(file->data, file->size);
+	file->data = NULL;
+	file->size = 0;
+}
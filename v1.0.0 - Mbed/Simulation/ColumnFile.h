@@ -0,0 +1,109 @@
+#ifndef COLUMNFILE_H
+#define COLUMNFILE_H
+
+#include "DataLog.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Columnar file of decoded telemetry samples
+// Every field is one contiguous array, so a run is mapped into memory and a
+// column read in place, without parsing and without a copy. The writer maps
+// the file too and stores each sample straight into its columns.
+//
+// File layout, little endian:
+//   Header   "MMCL", version, column and setting count, rows, dropped
+//            samples, sample frequency (Hz), time frequency (Hz of time)
+//   Columns  {name, type, size, data offset from the start of the file}
+//   Settings {name, float value}, the run log header snapshot if any
+//   Data     one array of rows values per column, COLUMN_ALIGN aligned
+
+#define COLUMN_VERSION              1
+#define COLUMN_ALIGN                64
+#define COLUMN_NAME_SIZE            DATALOG_NAME_SIZE
+#define COLUMN_MAX_SETTINGS         DATALOG_MAX_SETTINGS
+
+// Column types, the run log ones and a 64 bit time
+#define COLUMN_UINT32               DATALOG_UINT32
+#define COLUMN_INT16                DATALOG_INT16
+#define COLUMN_FLOAT                DATALOG_FLOAT
+#define COLUMN_UINT64               3
+
+// Columns in file order
+enum
+{
+	COLUMN_TIME,                // uint64, ticks of the time frequency, unwrapped
+	COLUMN_ENCODER_DELTA,       // int16, "counts" as in the run log
+	COLUMN_PWM,                 // int16
+	COLUMN_RPM,                 // float
+	COLUMN_ERROR,               // float
+	COLUMN_INTEGRAL,            // float
+	COLUMN_REFERENCE,           // float, rpm + error
+	COLUMN_FLOW_RATE,           // float, ml/min from the flow rate function
+	COLUMN_COUNT
+};
+
+typedef struct ColumnInfo
+{
+	char name[COLUMN_NAME_SIZE];
+	uint8_t type;
+	uint8_t size;
+	uint16_t reserved;
+	uint64_t offset;
+} ColumnInfo;
+
+typedef struct ColumnHeader
+{
+	char magic[4];              // "MMCL"
+	uint16_t version;
+	uint8_t columnCount;
+	uint8_t settingCount;
+	uint64_t rows;
+	uint64_t dropped;
+	float sampleFrequency;
+	float timeFrequency;
+} ColumnHeader;
+
+typedef struct ColumnFile
+{
+	uint8_t * data;             // Mapping of the whole file
+	uint64_t size;
+
+	const ColumnHeader * header;
+	const ColumnInfo * columns;
+	const DataLogSetting * settings;
+	void * values[COLUMN_COUNT];    // Start of each column
+} ColumnFile;
+
+// Decoded sample, the row of a column file
+typedef struct ColumnRow
+{
+	uint64_t time;
+	int16_t encoderDelta;
+	int16_t pwm;
+	float rpm;
+	float error;
+	float integral;
+	float reference;
+	float flowRate;
+} ColumnRow;
+
+// New file sized for rows, mapped for PutColumnRow()
+// False if it can not be created
+bool CreateColumnFile(struct ColumnFile * file, const char * path, uint64_t rows, float sampleFrequency,
+                      float timeFrequency, const DataLogSetting * settings, uint8_t settingCount);
+
+void PutColumnRow(struct ColumnFile * file, uint64_t row, const struct ColumnRow * value);
+
+// Header fields known only at the end
+void SetColumnDropped(struct ColumnFile * file, uint64_t dropped);
+
+// Existing file mapped read only, false if it is not a column file of this
+// version or its columns lie outside it
+bool OpenColumnFile(struct ColumnFile * file, const char * path);
+
+void GetColumnRow(const struct ColumnFile * file, uint64_t row, struct ColumnRow * value);
+
+// Unmaps, a created file is complete after this
+void CloseColumnFile(struct ColumnFile * file);
+
+#endif
@@ -0,0 +1,532 @@
+#include "ColumnFile.h"
+#include "RunStats.h"
+#include "Protocol.h"
+#include "Settings.h"
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Run logs, column files and serial telemetry streams to CSV, a column file
+// and a summary. Inputs are mapped and decoded in place, each sample passes
+// once through the statistics and the outputs.
+
+#define PWM_RESOLUTION          2048        // pwmResolution of the firmware
+#define TIME_FREQUENCY          1000000.0   // Hz, TelemetrySample time in us
+#define CSV_BUFFER_SIZE         (1 << 20)
+#define CSV_MAX_ROW             512
+
+static FlowFunction flow;
+static RunStats stats;
+static double settleTime = 0.5;
+
+static FILE * csvFile = NULL;
+static char csvBuffer[CSV_BUFFER_SIZE];
+static uint32_t csvLength = 0;
+
+static ColumnFile columnFile;
+static bool columnOutput = false;
+static uint64_t columnRow = 0;
+
+// 32 bit sample times extended
+static bool timeStarted = false;
+static uint32_t lastTime = 0;
+static uint64_t extendedTime = 0;
+
+// Serial stream, kept until the end as its length is not known before
+static ProtocolDecoder serialDecoder;
+static uint8_t serialBuffer[PROTOCOL_MAX_DATA + 1];
+static TelemetrySample * streamSamples = NULL;
+static uint64_t streamCount = 0;
+static uint64_t streamCapacity = 0;
+static bool streamStarted = false;
+static uint32_t firstDropped = 0;
+static uint32_t lastDropped = 0;
+
+static volatile sig_atomic_t stopped = 0;
+
+static void Stop(int signal){
+	(void)signal;
+	stopped = 1;
+}
+
+static void FlushCsv(void){
+	fwrite(csvBuffer, 1, csvLength, csvFile);
+	csvLength = 0;
+}
+
+static char * PutUnsigned(char * p, uint64_t value){
+	char digits[20];
+	int count = 0;
+	do{
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while(value != 0);
+
+	while(count != 0)
+		*p++ = digits[--count];
+	return p;
+}
+
+static char * PutSigned(char * p, int64_t value){
+	if(value < 0){
+		*p++ = '-';
+		return PutUnsigned(p, (uint64_t)-value);
+	}
+	return PutUnsigned(p, (uint64_t)value);
+}
+
+// As printf "%.2f": a float times 100 is exact in double, rint() rounds it
+// half to even like printf rounds the exact value
+static char * PutFixed(char * p, float value){
+	double hundredths = rint((double)value * 100.0);
+	if((fabs(hundredths) >= 1e18) || (hundredths != hundredths))
+		return p + snprintf(p, CSV_MAX_ROW / 8, "%.2f", (double)value);
+
+	// -0.00 for small negatives too
+	if(signbit(hundredths))
+		*p++ = '-';
+
+	uint64_t magnitude = (uint64_t)fabs(hundredths);
+	p = PutUnsigned(p, magnitude / 100);
+	*p++ = '.';
+	*p++ = (char)('0' + magnitude / 10 % 10);
+	*p++ = (char)('0' + magnitude % 10);
+	return p;
+}
+
+static void WriteCsvRow(const ColumnRow * row){
+	char * p = &csvBuffer[csvLength];
+	p = PutUnsigned(p, row->time);
+	*p++ = ',';
+	p = PutSigned(p, row->encoderDelta);
+	*p++ = ',';
+	p = PutSigned(p, row->pwm);
+	*p++ = ',';
+	p = PutFixed(p, row->rpm);
+	*p++ = ',';
+	p = PutFixed(p, row->error);
+	*p++ = ',';
+	p = PutFixed(p, row->integral);
+	*p++ = ',';
+	p = PutFixed(p, row->reference);
+	*p++ = ',';
+	p = PutFixed(p, row->flowRate);
+	*p++ = '\n';
+
+	csvLength = (uint32_t)(p - csvBuffer);
+	if(csvLength > CSV_BUFFER_SIZE - CSV_MAX_ROW)
+		FlushCsv();
+}
+
+static void AddRow(const ColumnRow * row){
+	AddRunSample(&stats, row);
+
+	if(csvFile != NULL)
+		WriteCsvRow(row);
+	if(columnOutput)
+		PutColumnRow(&columnFile, columnRow++, row);
+}
+
+static void AddSample(const TelemetrySample * sample){
+	if(timeStarted)
+		extendedTime += (uint32_t)(sample->time - lastTime);
+	else
+		extendedTime = sample->time;
+	timeStarted = true;
+	lastTime = sample->time;
+
+	ColumnRow row;
+	row.time = extendedTime;
+	row.encoderDelta = sample->encoderDelta;
+	row.pwm = sample->pwm;
+	row.rpm = sample->rpm;
+	row.error = sample->error;
+	row.integral = sample->integral;
+	row.reference = sample->rpm + sample->error;
+	row.flowRate = EstimateFlowRate(&flow, sample->rpm, sample->pwm);
+	AddRow(&row);
+}
+
+static bool OpenOutputs(const char * csvPath, const char * columnPath, uint64_t rows, float sampleFrequency,
+                        float timeFrequency, const DataLogSetting * settings, uint8_t settingCount){
+	if(csvPath != NULL){
+		csvFile = fopen(csvPath, "w");
+		if(csvFile == NULL){
+			fprintf(stderr, "can not open %s\n", csvPath);
+			return false;
+		}
+		fprintf(csvFile, "time,encoderDelta,pwm,rpm,error,integral,reference,flowRate\n");
+	}
+
+	if(columnPath != NULL){
+		columnOutput = CreateColumnFile(&columnFile, columnPath, rows, sampleFrequency, timeFrequency, settings, settingCount);
+		if(columnOutput == false){
+			fprintf(stderr, "can not create %s\n", columnPath);
+			return false;
+		}
+	}
+
+	InitRunStats(&stats, timeFrequency, settleTime);
+	return true;
+}
+
+static void CloseOutputs(void){
+	if(csvFile != NULL){
+		FlushCsv();
+		fclose(csvFile);
+	}
+
+	if(columnOutput){
+		SetColumnDropped(&columnFile, stats.dropped);
+		CloseColumnFile(&columnFile);
+	}
+}
+
+// Whole file mapped read only, NULL if it can not be
+static const uint8_t * MapFile(const char * path, uint64_t * size){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat status;
+	void * data = MAP_FAILED;
+	if((fstat(fd, &status) == 0) && (status.st_size > 0))
+		data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+
+	madvise(data, (size_t)status.st_size, MADV_SEQUENTIAL);
+	*size = (uint64_t)status.st_size;
+	return (const uint8_t *)data;
+}
+
+// Blocks in sequence up to the end of the file or the first that is not,
+// samples straight from the mapping
+static bool DecodeLog(const uint8_t * data, uint64_t size, const char * csvPath, const char * columnPath){
+	const DataLogHeader * header = (const DataLogHeader *)data;
+	if((size < DATALOG_SECTOR_SIZE) || (header->version != DATALOG_VERSION) || (header->sectorSize != DATALOG_SECTOR_SIZE)
+	   || (header->sampleSize != sizeof(TelemetrySample)) || (header->settingCount > DATALOG_MAX_SETTINGS)){
+		fprintf(stderr, "run log version or layout not supported\n");
+		return false;
+	}
+
+	if(SetFlowFunction(&flow, header->settings, header->settingCount) == false)
+		fprintf(stderr, "no flow rate function in the log, flow rates from --settings or 0\n");
+
+	uint64_t blocks = size / DATALOG_SECTOR_SIZE - 1;
+	uint64_t rows = 0;
+	for(uint64_t i = 0; i < blocks; i++){
+		const DataLogBlock * block = (const DataLogBlock *)(data + (i + 1) * DATALOG_SECTOR_SIZE);
+		if((block->sequence != i) || (block->count > DATALOG_SAMPLES_PER_SECTOR)){
+			fprintf(stderr, "block %llu out of sequence, the log ends before it\n", (unsigned long long)i);
+			blocks = i;
+			break;
+		}
+		rows += block->count;
+	}
+
+	if(OpenOutputs(csvPath, columnPath, rows, header->sampleFrequency, header->timeFrequency,
+	               header->settings, header->settingCount) == false)
+		return false;
+
+	for(uint64_t i = 0; i < blocks; i++){
+		const DataLogBlock * block = (const DataLogBlock *)(data + (i + 1) * DATALOG_SECTOR_SIZE);
+		for(uint16_t k = 0; k < block->count; k++)
+			AddSample(&block->samples[k]);
+		stats.dropped = block->dropped;
+	}
+
+	CloseOutputs();
+	return true;
+}
+
+static bool DecodeColumns(const char * path, const char * csvPath, const char * columnPath){
+	ColumnFile input;
+	if(OpenColumnFile(&input, path) == false){
+		fprintf(stderr, "column file %s version or layout not supported\n", path);
+		return false;
+	}
+
+	const ColumnHeader * header = input.header;
+	bool opened = OpenOutputs(csvPath, columnPath, header->rows, header->sampleFrequency, header->timeFrequency,
+	                          input.settings, header->settingCount);
+
+	for(uint64_t i = 0; opened && (i < header->rows); i++){
+		ColumnRow row;
+		GetColumnRow(&input, i, &row);
+		AddRow(&row);
+	}
+	stats.dropped = header->dropped;
+
+	if(opened)
+		CloseOutputs();
+	CloseColumnFile(&input);
+	return opened;
+}
+
+// Telemetry frames, anything else on the port is skipped
+static void ReceiveSerial(const uint8_t * data, uint64_t size){
+	for(uint64_t i = 0; i < size; i++){
+		if((DecodeProtocol(&serialDecoder, data[i]) == false) || (serialDecoder.type != PROTOCOL_TELEMETRY)
+		   || (serialDecoder.payloadLength < 4))
+			continue;
+
+		const uint8_t * payload = serialDecoder.payload;
+		uint16_t length = serialDecoder.payloadLength;
+
+		// Counted since boot, the stream starts at the first frame
+		memcpy(&lastDropped, payload, sizeof(lastDropped));
+		if(streamStarted == false)
+			firstDropped = lastDropped;
+		streamStarted = true;
+
+		for(uint16_t offset = 4; offset + sizeof(TelemetrySample) <= length; offset += sizeof(TelemetrySample)){
+			if(streamCount == streamCapacity){
+				streamCapacity = (streamCapacity != 0) ? (streamCapacity * 2) : 65536;
+				streamSamples = (TelemetrySample *)realloc(streamSamples, streamCapacity * sizeof(TelemetrySample));
+				if(streamSamples == NULL){
+					fprintf(stderr, "out of memory\n");
+					exit(1);
+				}
+			}
+			memcpy(&streamSamples[streamCount++], &payload[offset], sizeof(TelemetrySample));
+		}
+	}
+}
+
+static void SendCommand(int fd, uint8_t type, const void * payload, uint16_t length){
+	uint8_t frame[PROTOCOL_FRAME_SIZE(PROTOCOL_MAX_PAYLOAD)];
+	uint16_t size = EncodeProtocol(type, (const uint8_t *)payload, length, frame);
+	if(write(fd, frame, size) != size)
+		fprintf(stderr, "serial write failed\n");
+}
+
+static double Now(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+// Streaming on for duration seconds (< 0 until Ctrl-C), then off again
+static bool CaptureSerial(const char * path, double duration){
+	int fd = open(path, O_RDWR | O_NOCTTY);
+	if(fd < 0){
+		fprintf(stderr, "can not open %s\n", path);
+		return false;
+	}
+
+	// Raw bytes at the firmware's baud rate, reads return after 100ms
+	struct termios options;
+	if(tcgetattr(fd, &options) == 0){
+		cfmakeraw(&options);
+		cfsetispeed(&options, B460800);
+		cfsetospeed(&options, B460800);
+		options.c_cflag |= CLOCAL | CREAD;
+		options.c_cc[VMIN] = 0;
+		options.c_cc[VTIME] = 1;
+		tcsetattr(fd, TCSANOW, &options);
+		tcflush(fd, TCIOFLUSH);
+	}
+
+	signal(SIGINT, Stop);
+	uint8_t on = 1;
+	SendCommand(fd, PROTOCOL_STREAM, &on, sizeof(on));
+	fprintf(stderr, "streaming from %s, Ctrl-C to stop\n", path);
+
+	double start = Now();
+	uint8_t buffer[4096];
+	while((stopped == 0) && ((duration < 0.0) || (Now() - start < duration))){
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if(count > 0)
+			ReceiveSerial(buffer, (uint64_t)count);
+		else if((count < 0) && (stopped == 0)){
+			fprintf(stderr, "serial read failed\n");
+			break;
+		}
+	}
+
+	uint8_t off = 0;
+	SendCommand(fd, PROTOCOL_STREAM, &off, sizeof(off));
+	close(fd);
+	signal(SIGINT, SIG_DFL);
+	return true;
+}
+
+// Flow rate settings for a serial stream, as the firmware reads them
+typedef struct FlowSettings
+{
+	bool versusRpm;
+	float voltage[3];
+	float rpm[3];
+	float voltageMax;
+} FlowSettings;
+
+static void ReadSetting(void * context, const char * section, const char * key, const float * values, uint8_t count){
+	FlowSettings * settings = (FlowSettings *)context;
+	if((count != 1) || (key[0] == '\0'))
+		return;
+
+	int index = ((key[1] == '\0') && (key[0] >= 'A') && (key[0] <= 'C')) ? (key[0] - 'A') : -1;
+	if((strcmp(section, "flowRateVersusVoltage") == 0) && (index >= 0))
+		settings->voltage[index] = values[0];
+	else if((strcmp(section, "flowRateVersusRpm") == 0) && (index >= 0)){
+		settings->rpm[index] = values[0];
+		settings->versusRpm = true;
+	}
+	else if((strcmp(section, "voltage") == 0) && (strcmp(key, "voltageUpperThreshold") == 0))
+		settings->voltageMax = values[0];
+}
+
+// Settings as in a run log header, false if the file can not be read
+static bool LoadFlowSettings(const char * path, DataLogSetting * list, uint8_t * count){
+	FILE * fp = fopen(path, "r");
+	if(fp == NULL)
+		return false;
+
+	FlowSettings flowSettings = { false, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, 24.0f };
+	Settings settings;
+	InitSettings(&settings, ReadSetting, &flowSettings);
+
+	char chunk[512];
+	size_t size;
+	while((size = fread(chunk, 1, sizeof(chunk), fp)) != 0)
+		ParseSettings(&settings, chunk, (uint32_t)size);
+	FinishSettings(&settings);
+	fclose(fp);
+
+	const float * function = flowSettings.versusRpm ? flowSettings.rpm : flowSettings.voltage;
+	const char * names[6] = { "flowVsRpm", "flowA", "flowB", "flowC", "pwmMax", "voltageMax" };
+	float values[6] = { flowSettings.versusRpm ? 1.0f : 0.0f, function[0], function[1], function[2],
+	                    (float)PWM_RESOLUTION, flowSettings.voltageMax };
+
+	memset(list, 0, 6 * sizeof(DataLogSetting));
+	for(uint8_t i = 0; i < 6; i++){
+		strncpy(list[i].name, names[i], DATALOG_NAME_SIZE - 1);
+		list[i].value = values[i];
+	}
+	*count = 6;
+	return true;
+}
+
+static bool DecodeSerial(const char * csvPath, const char * columnPath, const DataLogSetting * settings, uint8_t settingCount){
+	fprintf(stderr, "serial frames %lu, bad %lu\n", (unsigned long)serialDecoder.frames, (unsigned long)serialDecoder.bad);
+
+	// Loop rate from the sample times, the stream does not carry it
+	uint64_t span = 0;
+	for(uint64_t i = 1; i < streamCount; i++)
+		span += (uint32_t)(streamSamples[i].time - streamSamples[i - 1].time);
+	float sampleFrequency = (span != 0) ? (float)((double)(streamCount - 1) * TIME_FREQUENCY / (double)span) : 0.0f;
+
+	if(OpenOutputs(csvPath, columnPath, streamCount, sampleFrequency, (float)TIME_FREQUENCY, settings, settingCount) == false)
+		return false;
+
+	for(uint64_t i = 0; i < streamCount; i++)
+		AddSample(&streamSamples[i]);
+	stats.dropped = lastDropped - firstDropped;
+
+	CloseOutputs();
+	free(streamSamples);
+	return true;
+}
+
+static void Usage(const char * name){
+	fprintf(stderr,
+	        "usage: %s [options] INPUT\n"
+	        "  INPUT            run log (logs/runNNNN.bin), column file, serial capture or serial device\n"
+	        "  --csv FILE       samples as CSV\n"
+	        "  --columns FILE   samples as a column file\n"
+	        "  --settings FILE  settings.txt with the flow rate function of a serial stream\n"
+	        "  --settle S       reference hold time before ripple counts (default 0.5s)\n"
+	        "  --duration S     capture time from a serial device (default until Ctrl-C)\n",
+	        name);
+}
+
+int main(int argc, char ** argv){
+	const char * inputPath = NULL;
+	const char * csvPath = NULL;
+	const char * columnPath = NULL;
+	const char * settingsPath = NULL;
+	double duration = -1.0;
+
+	for(int i = 1; i < argc; i++){
+		bool hasValue = (i + 1 < argc);
+
+		if((strcmp(argv[i], "--csv") == 0) && hasValue)
+			csvPath = argv[++i];
+		else if((strcmp(argv[i], "--columns") == 0) && hasValue)
+			columnPath = argv[++i];
+		else if((strcmp(argv[i], "--settings") == 0) && hasValue)
+			settingsPath = argv[++i];
+		else if((strcmp(argv[i], "--settle") == 0) && hasValue)
+			settleTime = atof(argv[++i]);
+		else if((strcmp(argv[i], "--duration") == 0) && hasValue)
+			duration = atof(argv[++i]);
+		else if((argv[i][0] != '-') && (inputPath == NULL))
+			inputPath = argv[i];
+		else{
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(inputPath == NULL){
+		Usage(argv[0]);
+		return 2;
+	}
+
+	// Flow rates of streams and logs without the function, 0 without either
+	DataLogSetting settings[6];
+	uint8_t settingCount = 0;
+	if((settingsPath != NULL) && (LoadFlowSettings(settingsPath, settings, &settingCount) == false)){
+		fprintf(stderr, "can not read %s\n", settingsPath);
+		return 1;
+	}
+	memset(&flow, 0, sizeof(flow));
+	SetFlowFunction(&flow, settings, settingCount);
+
+	InitProtocolDecoder(&serialDecoder, serialBuffer, sizeof(serialBuffer));
+
+	struct stat status;
+	if(stat(inputPath, &status) != 0){
+		fprintf(stderr, "can not open %s\n", inputPath);
+		return 1;
+	}
+
+	bool decoded;
+	if(S_ISCHR(status.st_mode))
+		decoded = CaptureSerial(inputPath, duration) && DecodeSerial(csvPath, columnPath, settings, settingCount);
+	else{
+		uint64_t size = 0;
+		const uint8_t * data = MapFile(inputPath, &size);
+		if(data == NULL){
+			fprintf(stderr, "can not read %s\n", inputPath);
+			return 1;
+		}
+
+		if((size >= 4) && (memcmp(data, "MMLG", 4) == 0))
+			decoded = DecodeLog(data, size, csvPath, columnPath);
+		else if((size >= 4) && (memcmp(data, "MMCL", 4) == 0))
+			decoded = DecodeColumns(inputPath, csvPath, columnPath);
+		else{
+			ReceiveSerial(data, size);
+			decoded = DecodeSerial(csvPath, columnPath, settings, settingCount);
+		}
+		munmap((void *)data, (size_t)size);
+	}
+
+	if(decoded == false)
+		return 1;
+
+	FinishRunStats(&stats);
+	PrintRunStats(&stats, stdout);
+	return 0;
+}
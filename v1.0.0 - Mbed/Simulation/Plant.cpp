@@ -0,0 +1,74 @@
+#include "Plant.h"
+#include <math.h>
+
+#define PI 3.14159265358979323846
+
+void InitPlant(struct Plant * plant){
+	plant->resistance = 8.0;
+	plant->inductance = 0.3e-3;
+	plant->torqueConstant = 0.03;
+	plant->inertia = 2.0e-6;
+	plant->viscousFriction = 1.0e-6;
+	plant->coulombFriction = 1.0e-3;
+
+	plant->displacement = 0.048;
+	plant->leakage = 0.5;
+
+	plant->encoderPulsePerRev = 100.0;
+
+	plant->voltage = 0.0;
+	plant->pressure = 0.0;
+
+	plant->current = 0.0;
+	plant->speed = 0.0;
+	plant->angle = 0.0;
+
+	plant->peakCurrent = 0.0;
+}
+
+void StepPlant(struct Plant * plant, double dt){
+	// Electrical, backward Euler
+	double backEmf = plant->torqueConstant * plant->speed;
+	plant->current = (plant->current + (dt / plant->inductance) * (plant->voltage - backEmf))
+	                 / (1.0 + dt * plant->resistance / plant->inductance);
+	if(fabs(plant->current) > plant->peakCurrent)
+		plant->peakCurrent = fabs(plant->current);
+
+	// Pressure torque, bar to Pa and ml to m^3
+	double hydraulicTorque = (plant->pressure * 1.0e5) * (plant->displacement * 1.0e-6) / (2.0 * PI);
+
+	double driveTorque = plant->torqueConstant * plant->current - hydraulicTorque - plant->viscousFriction * plant->speed;
+
+	// Stiction, stays still until the drive overcomes Coulomb friction
+	if((plant->speed == 0.0) && (fabs(driveTorque) <= plant->coulombFriction))
+		return;
+
+	double friction = plant->coulombFriction;
+	if((plant->speed < 0.0) || ((plant->speed == 0.0) && (driveTorque < 0.0)))
+		friction = -friction;
+
+	double speed = plant->speed + dt * (driveTorque - friction) / plant->inertia;
+
+	// Friction alone never reverses the rotation
+	if((plant->speed != 0.0) && ((speed > 0.0) != (plant->speed > 0.0)) && (fabs(driveTorque) <= plant->coulombFriction))
+		speed = 0.0;
+
+	plant->angle += 0.5 * (plant->speed + speed) * dt;
+	plant->speed = speed;
+}
+
+double GetPlantRpm(struct Plant * plant){
+	return plant->speed * 60.0 / (2.0 * PI);
+}
+
+double GetPlantEncoderPosition(struct Plant * plant){
+	return plant->angle / (2.0 * PI) * plant->encoderPulsePerRev * 4.0;
+}
+
+long GetPlantEncoderCount(struct Plant * plant){
+	return (long)floor(GetPlantEncoderPosition(plant));
+}
+
+double GetPlantFlowRate(struct Plant * plant){
+	return GetPlantRpm(plant) * plant->displacement - plant->leakage * plant->pressure;
+}
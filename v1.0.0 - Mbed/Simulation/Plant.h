@@ -0,0 +1,56 @@
+#ifndef PLANT_H
+#define PLANT_H
+
+// DC motor driving a micro annular gear pump (HNP MZR-7223)
+//
+//   L di/dt = V - R i - Ke w
+//   J dw/dt = Kt i - b w - Tc sgn(w) - p D / 2pi
+//
+// p is the pressure the pump works against, D its displacement per rev
+// Defaults are representative for a 24V coreless motor on the MZR-7223,
+// measure the real unit before trusting absolute numbers
+
+typedef struct Plant
+{
+	// Motor
+	double resistance;          // Ohm
+	double inductance;          // H
+	double torqueConstant;      // Nm/A, equal to the back EMF constant in V.s/rad
+	double inertia;             // kg.m^2, rotor, coupling and pump gears
+	double viscousFriction;     // Nm.s/rad
+	double coulombFriction;     // Nm
+
+	// Pump
+	double displacement;        // ml/rev
+	double leakage;             // ml/min per bar, slip back through the gears
+
+	// Encoder, on the motor shaft
+	double encoderPulsePerRev;
+
+	// Inputs
+	double voltage;             // V, average over the PWM period
+	double pressure;            // bar
+
+	// State
+	double current;             // A
+	double speed;               // rad/s
+	double angle;               // rad
+
+	double peakCurrent;         // A, largest |current| since InitPlant
+} Plant;
+
+void InitPlant(struct Plant * plant);
+
+// Integrate dt seconds, current implicit so steps well above L/R stay stable
+void StepPlant(struct Plant * plant, double dt);
+
+double GetPlantRpm(struct Plant * plant);
+
+// Quadrature counts (x4) since the start, the position between counts for edge timing
+double GetPlantEncoderPosition(struct Plant * plant);
+long GetPlantEncoderCount(struct Plant * plant);
+
+// ml/min delivered against the pressure
+double GetPlantFlowRate(struct Plant * plant);
+
+#endif
@@ -0,0 +1,52 @@
+#include "Replay.h"
+#include <stdio.h>
+
+bool LoadReplay(struct Replay * replay, const char * path){
+	FILE * fp = fopen(path, "r");
+	if(fp == NULL)
+		return false;
+
+	replay->count = 0;
+	replay->index = 0;
+
+	char line[256];
+	bool ordered = true;
+	while(fgets(line, sizeof(line), fp) != NULL){
+		ReplayPoint point;
+
+		if((line[0] == '#') || (sscanf(line, "%lf,%lf,%lf", &point.time, &point.refRpm, &point.pressure) != 3))
+			continue;
+
+		if(replay->count >= REPLAY_MAX_POINTS)
+			break;
+
+		if((replay->count > 0) && (point.time < replay->points[replay->count - 1].time))
+			ordered = false;
+
+		replay->points[replay->count++] = point;
+	}
+	fclose(fp);
+
+	return ordered && (replay->count > 0);
+}
+
+void DefaultReplay(struct Replay * replay, double refRpm){
+	ReplayPoint start = { 0.0, 0.0, 0.0 };
+	ReplayPoint step = { 0.5, refRpm, 0.0 };
+
+	replay->points[0] = start;
+	replay->points[1] = step;
+	replay->count = 2;
+	replay->index = 0;
+}
+
+const ReplayPoint * GetReplayPoint(struct Replay * replay, double time){
+	while((replay->index + 1 < replay->count) && (replay->points[replay->index + 1].time <= time))
+		replay->index++;
+
+	return &replay->points[replay->index];
+}
+
+double GetReplayEnd(struct Replay * replay){
+	return replay->points[replay->count - 1].time;
+}
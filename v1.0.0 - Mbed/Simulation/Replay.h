@@ -0,0 +1,38 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Setpoint and load profile, values hold until the next point
+//
+//   # comment
+//   time(s),refRpm,pressure(bar)
+//   0.0,0,0
+//   0.5,3000,0
+
+#define REPLAY_MAX_POINTS   4096
+
+typedef struct ReplayPoint
+{
+	double time;
+	double refRpm;
+	double pressure;
+} ReplayPoint;
+
+typedef struct Replay
+{
+	ReplayPoint points[REPLAY_MAX_POINTS];
+	int count;
+	int index;
+} Replay;
+
+// Returns false if the file can not be read or is not in time order
+bool LoadReplay(struct Replay * replay, const char * path);
+
+// Single step at 0.5s, used without a profile file
+void DefaultReplay(struct Replay * replay, double refRpm);
+
+// Point active at the given time, times only move forward
+const ReplayPoint * GetReplayPoint(struct Replay * replay, double time);
+
+double GetReplayEnd(struct Replay * replay);
+
+#endif
@@ -0,0 +1,132 @@
+#include "RunStats.h"
+#include <math.h>
+#include <string.h>
+
+// Reference changes smaller than this are rounding of rpm + error
+#define REFERENCE_TOLERANCE     1e-4
+
+static bool FindSetting(const DataLogSetting * settings, uint8_t count, const char * name, float * value){
+	for(uint8_t i = 0; i < count; i++){
+		if(strncmp(settings[i].name, name, DATALOG_NAME_SIZE) == 0){
+			*value = settings[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SetFlowFunction(struct FlowFunction * flow, const DataLogSetting * settings, uint8_t count){
+	float versusRpm, pwmMax, voltageMax;
+	if((FindSetting(settings, count, "flowVsRpm", &versusRpm) && FindSetting(settings, count, "flowA", &flow->a)
+	    && FindSetting(settings, count, "flowB", &flow->b) && FindSetting(settings, count, "flowC", &flow->c)
+	    && FindSetting(settings, count, "pwmMax", &pwmMax) && FindSetting(settings, count, "voltageMax", &voltageMax)) == false)
+		return false;
+
+	flow->versusRpm = (versusRpm != 0.0f);
+	flow->pwmToVolts = (pwmMax > 0.0f) ? (voltageMax / pwmMax) : 0.0f;
+	return true;
+}
+
+float EstimateFlowRate(const struct FlowFunction * flow, float rpm, int16_t pwm){
+	if(pwm == 0)
+		return 0.0f;
+
+	float x = flow->versusRpm ? fabsf(rpm) : (fabsf((float)pwm) * flow->pwmToVolts);
+	float flowRate = (flow->a * x + flow->b) * x + flow->c;
+	return (pwm < 0) ? -flowRate : flowRate;
+}
+
+void InitRunStats(struct RunStats * stats, double timeFrequency, double settleTime){
+	memset(stats, 0, sizeof(*stats));
+	stats->timeFrequency = timeFrequency;
+	stats->settleTime = settleTime;
+}
+
+static void FinishPart(struct RunStats * stats){
+	if(stats->partCount == 0)
+		return;
+
+	stats->steadySamples += stats->partCount;
+	stats->steadySquares += stats->partSquares;
+	stats->ripplePeakToPeak = fmax(stats->ripplePeakToPeak, stats->partMax - stats->partMin);
+	stats->partCount = 0;
+}
+
+void AddRunSample(struct RunStats * stats, const struct ColumnRow * row){
+	double rpm = row->rpm;
+	double error = row->error;
+
+	if(stats->samples == 0){
+		stats->startTime = row->time;
+		stats->rpmMin = rpm;
+		stats->rpmMax = rpm;
+		stats->reference = row->reference;
+		stats->referenceTime = row->time;
+	}
+	else{
+		// Flow rate held until this sample
+		double dt = (double)(row->time - stats->lastTime) / stats->timeFrequency;
+		stats->volume += stats->lastFlowRate * dt / 60.0;
+	}
+
+	stats->samples++;
+	stats->lastTime = row->time;
+	stats->lastFlowRate = row->flowRate;
+	stats->flowRateMax = fmax(stats->flowRateMax, row->flowRate);
+
+	stats->rpmSum += rpm;
+	stats->rpmMin = fmin(stats->rpmMin, rpm);
+	stats->rpmMax = fmax(stats->rpmMax, rpm);
+
+	stats->errorSum += error;
+	stats->errorSquares += error * error;
+	stats->errorMax = fmax(stats->errorMax, fabs(error));
+
+	// New reference, a new part once it has settled
+	if(fabs(row->reference - stats->reference) > REFERENCE_TOLERANCE * fmax(1.0, fabs(stats->reference))){
+		FinishPart(stats);
+		stats->reference = row->reference;
+		stats->referenceTime = row->time;
+	}
+
+	if((stats->reference == 0.0f) || ((double)(row->time - stats->referenceTime) < stats->settleTime * stats->timeFrequency))
+		return;
+
+	// Welford, the part's mean is not known before its end
+	if(stats->partCount++ == 0){
+		stats->partMean = rpm;
+		stats->partSquares = 0.0;
+		stats->partMin = rpm;
+		stats->partMax = rpm;
+		return;
+	}
+
+	double delta = rpm - stats->partMean;
+	stats->partMean += delta / (double)stats->partCount;
+	stats->partSquares += delta * (rpm - stats->partMean);
+	stats->partMin = fmin(stats->partMin, rpm);
+	stats->partMax = fmax(stats->partMax, rpm);
+}
+
+void FinishRunStats(struct RunStats * stats){
+	FinishPart(stats);
+}
+
+void PrintRunStats(struct RunStats * stats, FILE * fp){
+	double count = (stats->samples != 0) ? (double)stats->samples : 1.0;
+	double duration = (double)(stats->lastTime - stats->startTime) / stats->timeFrequency;
+	double steadyCount = (stats->steadySamples != 0) ? (double)stats->steadySamples : 1.0;
+
+	fprintf(fp, "samples         %llu\n", (unsigned long long)stats->samples);
+	fprintf(fp, "dropped         %llu\n", (unsigned long long)stats->dropped);
+	fprintf(fp, "duration        %.3f s\n", duration);
+	fprintf(fp, "sample rate     %.1f Hz\n", (duration > 0.0) ? ((double)(stats->samples - 1) / duration) : 0.0);
+	fprintf(fp, "rpm             mean %.2f, min %.2f, max %.2f\n", stats->rpmSum / count, stats->rpmMin, stats->rpmMax);
+	fprintf(fp, "tracking error  mean %.3f, rms %.3f, max %.3f RPM\n", stats->errorSum / count,
+	        sqrt(stats->errorSquares / count), stats->errorMax);
+	fprintf(fp, "ripple          rms %.3f, peak to peak %.3f RPM, over %.3f s steady\n",
+	        sqrt(stats->steadySquares / steadyCount), stats->ripplePeakToPeak,
+	        (stats->samples > 1) ? (duration * (double)stats->steadySamples / (double)(stats->samples - 1)) : 0.0);
+	fprintf(fp, "volume          %.3f ml, mean %.3f ml/min, max %.3f ml/min\n", stats->volume,
+	        (duration > 0.0) ? (stats->volume * 60.0 / duration) : 0.0, stats->flowRateMax);
+}
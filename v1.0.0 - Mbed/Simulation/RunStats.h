@@ -0,0 +1,69 @@
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+#include "ColumnFile.h"
+#include <stdio.h>
+
+// Summary of a run in one pass over its samples, nothing is kept per sample
+//
+// Tracking error is taken over all samples. Ripple only over the steady parts
+// of the run, where the reference (rpm + error) holds a value other than 0 for
+// longer than the settle time: the speed's deviation from the mean of its part,
+// pooled over all parts as an RMS, and the largest peak to peak of a part.
+// Volume is the flow rate integrated from each sample to the next, across
+// dropped samples too.
+
+// Flow rate in ml/min as the firmware estimates it, a quadratic of the RPM or
+// of the voltage (PWM * pwmToVolts). Backward (negative PWM) is negative, 0
+// without PWM.
+typedef struct FlowFunction
+{
+	bool versusRpm;
+	float a, b, c;
+	float pwmToVolts;
+} FlowFunction;
+
+typedef struct RunStats
+{
+	double timeFrequency;       // Hz of the time
+	double settleTime;          // s
+
+	uint64_t samples;
+	uint64_t dropped;           // Set by the reader
+	uint64_t startTime;
+	uint64_t lastTime;
+
+	double rpmSum, rpmMin, rpmMax;
+	double errorSum, errorSquares, errorMax;
+	double volume;              // ml
+	double flowRateMax;
+	float lastFlowRate;
+
+	// Steady part in progress
+	float reference;
+	uint64_t referenceTime;     // Since the reference holds
+	uint64_t partCount;
+	double partMean, partSquares, partMin, partMax;
+
+	// Steady parts done
+	uint64_t steadySamples;
+	double steadySquares;
+	double ripplePeakToPeak;
+} RunStats;
+
+// Flow rate function from the settings of a run log header (flowVsRpm, flowA,
+// flowB, flowC, pwmMax, voltageMax), false if they are not all there
+bool SetFlowFunction(struct FlowFunction * flow, const DataLogSetting * settings, uint8_t count);
+
+float EstimateFlowRate(const struct FlowFunction * flow, float rpm, int16_t pwm);
+
+void InitRunStats(struct RunStats * stats, double timeFrequency, double settleTime);
+
+void AddRunSample(struct RunStats * stats, const struct ColumnRow * row);
+
+// Steady part in progress to the totals, at the end
+void FinishRunStats(struct RunStats * stats);
+
+void PrintRunStats(struct RunStats * stats, FILE * fp);
+
+#endif
@@ -0,0 +1,85 @@
+#include "SimFirmware.h"
+#include "Protocol.h"
+#include <stdio.h>
+#include <string.h>
+
+// Serial protocol replies of the firmware, checked against the sizes in
+// Protocol.h. Boots without a card, each command is answered by the next 1ms
+// serial task. Exits with the number of failed checks.
+
+static ProtocolDecoder decoder;
+static uint8_t decoderBuffer[PROTOCOL_MAX_DATA + 1];
+static uint8_t replyType;
+static uint8_t reply[PROTOCOL_MAX_PAYLOAD];
+static uint16_t replyLength;
+static int failures = 0;
+
+// Last reply frame, telemetry is off
+static void ReceiveSerial(const uint8_t * data, uint16_t size){
+	for(uint16_t i = 0; i < size; i++){
+		if(DecodeProtocol(&decoder, data[i]) == false)
+			continue;
+		replyType = decoder.type;
+		replyLength = decoder.payloadLength;
+		memcpy(reply, decoder.payload, replyLength);
+	}
+}
+
+// Command and its reply, 0 type if none came
+static void Command(uint8_t type, const void * payload, uint16_t length){
+	uint8_t frame[PROTOCOL_FRAME_SIZE(PROTOCOL_MAX_PAYLOAD)];
+	replyType = 0;
+	replyLength = 0;
+	SimSerialInput(frame, EncodeProtocol(type, (const uint8_t *)payload, length, frame));
+	RunFirmware(0.002, NULL);
+}
+
+static void Check(const char * name, bool passed){
+	printf("%s %s\n", passed ? "ok  " : "FAIL", name);
+	if(passed == false)
+		failures++;
+}
+
+// Reply to type with an OK status and length values after it
+static void CheckReply(const char * name, uint8_t type, uint16_t length){
+	char text[64];
+	snprintf(text, sizeof(text), "%s reply, %u bytes", name, 1 + length);
+	Check(text, (replyType == (type | PROTOCOL_REPLY)) && (replyLength == 1 + length) && (reply[0] == PROTOCOL_OK));
+}
+
+int main(void){
+	InitProtocolDecoder(&decoder, decoderBuffer, sizeof(decoderBuffer));
+	SetSimSerialOutput(ReceiveSerial);
+	SetSimSdRoot(NULL);
+	BootFirmware();
+
+	// Mode, refRpm, rpm, refFlowRate, voltage, pwm
+	Command(PROTOCOL_STATUS, NULL, 0);
+	CheckReply("STATUS", PROTOCOL_STATUS, 1 + 4 * sizeof(float) + sizeof(int16_t));
+	Check("STATUS mode in the menu", reply[1] == PROTOCOL_NO_CONTROL);
+
+	uint8_t mode = PROTOCOL_RPM_CONTROL;
+	Command(PROTOCOL_START, &mode, sizeof(mode));
+	CheckReply("START", PROTOCOL_START, 0);
+
+	float rpm = 1500.0f;
+	Command(PROTOCOL_SET_RPM, &rpm, sizeof(rpm));
+	CheckReply("SET_RPM", PROTOCOL_SET_RPM, 0);
+
+	RunFirmware(0.5, NULL);
+	Command(PROTOCOL_STATUS, NULL, 0);
+	CheckReply("STATUS", PROTOCOL_STATUS, 1 + 4 * sizeof(float) + sizeof(int16_t));
+	float refRpmValue;
+	memcpy(&refRpmValue, &reply[2], sizeof(refRpmValue));
+	Check("STATUS mode and refRpm in RPM Control", (reply[1] == PROTOCOL_RPM_CONTROL) && (refRpmValue == rpm));
+
+	Command(PROTOCOL_STOP, NULL, 0);
+	CheckReply("STOP", PROTOCOL_STOP, 0);
+
+	// State, target, volume, coastVolume, time
+	Command(PROTOCOL_DOSE_STATUS, NULL, 0);
+	CheckReply("DOSE_STATUS", PROTOCOL_DOSE_STATUS, 1 + 4 * sizeof(float));
+
+	printf("%d failed\n", failures);
+	return failures;
+}
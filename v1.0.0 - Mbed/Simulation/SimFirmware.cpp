@@ -0,0 +1,88 @@
+#include "SimFirmware.h"
+#include <math.h>
+
+#define SIM_SETTLE_TIME     0.5     // s, longer than the button debounce
+
+static void RunMainLoop(void){
+	for(uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+		RunScheduler(&scheduler);
+}
+
+void BootFirmware(void){
+	initMotionManager();
+	RunFirmware(0.5, NULL);
+}
+
+void EnterRpmControl(void){
+	SimPressButton(GPIO_PIN_11);
+	RunMainLoop();
+}
+
+// Buttons are debounced against the last knob or button edge
+static void Settle(void){
+	RunMainLoop();
+	RunFirmware(SIM_SETTLE_TIME, NULL);
+}
+
+static void EnterMenuItem(int index){
+	SimTurnKnob(index);
+	Settle();
+	SimPressButton(GPIO_PIN_11);
+	RunMainLoop();
+}
+
+// Select the page's value, dial it and commit it
+// From the last value kept in flash, knob steps are queued in an int8_t, dial
+// in chunks
+static void DialValue(double value, volatile float * displayed, float resolution){
+	SimPressButton(GPIO_PIN_11);
+	Settle();
+	int steps = (int)lround((value - *displayed) / resolution);
+	while(steps != 0){
+		int chunk = (steps > 100) ? 100 : ((steps < -100) ? -100 : steps);
+		SimTurnKnob(chunk);
+		RunMainLoop();
+		steps -= chunk;
+	}
+	Settle();
+	SimPressButton(GPIO_PIN_11);
+	RunMainLoop();
+}
+
+void EnterFlowControl(double flowRate){
+	EnterMenuItem(1);
+	Settle();
+	DialValue(flowRate, &displayedRefFlowRate, refFlowRateResolution);
+}
+
+void EnterBatchDosing(double volume){
+	EnterMenuItem(3);
+	Settle();
+	DialValue(volume, &displayedRefVolume, refVolumeResolution);
+}
+
+void EnterAutotune(void){
+	EnterMenuItem(4);
+}
+
+void LeaveControl(void){
+	// Back first leaves a selected value, then the page
+	for(int i = 0; i < 2; i++){
+		Settle();
+		SimPressButton(GPIO_PIN_1);
+		RunMainLoop();
+	}
+}
+
+void RunFirmware(double seconds, void (*slice)(void)){
+	uint64_t end = SimGetCycles() + (uint64_t)(seconds * SIM_CORE_CLOCK);
+
+	while(SimGetCycles() < end){
+		if(slice != NULL)
+			slice();
+
+		uint64_t next = SimGetCycles() + SIM_SLICE_CYCLES;
+		SimRunUntil((next < end) ? next : end);
+		RunMainLoop();
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef SIMFIRMWARE_H
+#define SIMFIRMWARE_H
+
+#include "SimHal.h"
+#include "Scheduler.h"
+#include "Trajectory.h"
+#include "Autotune.h"
+#include "Dosing.h"
+#include "PlantEstimator.h"
+#include "Telemetry.h"
+#include "DataLog.h"
+
+// Firmware entry points and state, main.cpp
+void initMotionManager(void);
+extern Scheduler scheduler;
+extern volatile float refRpm;
+extern volatile float refFlowRate;
+extern volatile float displayedRefFlowRate;
+extern float refFlowRateResolution;
+extern volatile float averagedMotorRpm;
+extern float encoderPulsePerRev;
+extern float loopFrequency;
+extern bool fixedPointControl;
+extern int pwm;
+extern Trajectory rpmTrajectory;
+extern TrajectoryProgram rpmProgram;
+extern float Kp, Ki, Kd;
+extern Autotune autotune;
+extern const char * autotuneResult;
+extern Dosing dosing;
+extern volatile float displayedRefVolume;
+extern float refVolumeResolution;
+bool startDose(float ml);
+extern PlantEstimator plantEstimator;
+extern TelemetryRing telemetry;
+extern void (*telemetrySink)(const TelemetrySample * sample);
+extern DataLog dataLog;
+extern bool dataLogEnabled;
+extern uint16_t logRun;
+
+// Main loop slice between scheduler runs
+#define SIM_SLICE_CYCLES    (SIM_CORE_CLOCK / 1000)
+
+// Boot as on the board, logo and SD card settings, ends in the control selection menu
+void BootFirmware(void);
+
+// Select the first menu item
+void EnterRpmControl(void);
+
+// Select the second menu item and dial the flow rate with the knob, ml/min
+void EnterFlowControl(double flowRate);
+
+// Select Batch Dosing and dial the dose with the knob, ml, it starts at once
+void EnterBatchDosing(double volume);
+
+// Select PID Autotune, it adds the gains to settings.txt in the card directory when done
+void EnterAutotune(void);
+
+// Back to the control selection menu, stops the control loop and closes the run log
+void LeaveControl(void);
+
+// Run interrupts and main loop, slice is called before every 1ms main loop slice
+void RunFirmware(double seconds, void (*slice)(void));
+
+#endif
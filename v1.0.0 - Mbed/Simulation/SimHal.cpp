@@ -0,0 +1,921 @@
+#include "SimHal.h"
+#include "mbed.h"
+#include "SDFileSystem.h"
+#include "ff.h"
+#include "stm32f3xx_it.h"
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#undef fopen
+#undef mkdir
+
+/* Registers ******************************************************************/
+
+DWT_Type SimDWT;
+CoreDebug_Type SimCoreDebug;
+uint32_t SimPrimask = 0;
+uint32_t SystemCoreClock = SIM_CORE_CLOCK;
+
+GPIO_TypeDef SimGPIOA, SimGPIOB, SimGPIOF;
+DMA_Channel_TypeDef SimDMA1_Channel3;
+DMA_Channel_TypeDef SimDMA1_Channel6;
+DMA_Channel_TypeDef SimDMA1_Channel7;
+USART_TypeDef SimUSART2;
+SPI_TypeDef SimSPI1;
+TIM_TypeDef SimTIM1, SimTIM3, SimTIM7, SimTIM15, SimTIM16, SimTIM17;
+uint8_t SimFlash[SIM_FLASH_SIZE];
+
+/* Machine state **************************************************************/
+
+typedef struct SimTimer
+{
+	TIM_TypeDef * instance;
+	void (*irq)(void);
+	uint64_t nextUpdate;
+	uint64_t start;             // Cycle the counter was last 0 from, while running
+	uint64_t lastCompare;       // Cycle of the last CH2 compare interrupt
+} SimTimer;
+
+static SimTimer timers[] = {
+	{ TIM3, TIM3_IRQHandler, 0, 0, 0 },
+	{ TIM15, TIM1_BRK_TIM15_IRQHandler, 0, 0, 0 },
+	{ TIM17, TIM1_TRG_COM_TIM17_IRQHandler, 0, 0, 0 },
+	{ TIM7, TIM7_DAC2_IRQHandler, 0, 0, 0 }
+};
+
+#define SIM_TIMER_COUNT     (sizeof(timers) / sizeof(timers[0]))
+#define PLANT_PERIOD        (SIM_CORE_CLOCK / SIM_PLANT_RATE)
+
+static uint64_t now = 0;
+static uint64_t nextPlantStep = 0;
+static uint64_t plantTime = 0;
+
+static Plant plant;
+static bool plantInitialized = false;
+static long encoderCount = 0;
+static double encoderPosition = 0.0;
+static double supplyVoltage = 24.0;
+
+static void (*controlHook)(void) = NULL;
+static uint64_t controlCount = 0;
+static uint64_t controlNanoseconds = 0;
+
+static const char * sdRoot = NULL;
+static bool sdMounted = false;
+
+// ST7920 text layer
+static char screen[4][16];
+static uint8_t frame[3];
+static uint8_t frameIndex = 0;
+static bool extendedInstructions = false;
+static bool ddramSelected = true;
+static uint8_t ddramByte = 0;
+
+/* Time ***********************************************************************/
+
+static SimTimer * FindTimer(TIM_TypeDef * instance){
+	for(size_t i = 0; i < SIM_TIMER_COUNT; i++)
+		if(timers[i].instance == instance)
+			return &timers[i];
+	return NULL;
+}
+
+static uint64_t TimerPeriod(TIM_TypeDef * instance){
+	return (uint64_t)(instance->PSC + 1) * (uint64_t)(instance->ARR + 1);
+}
+
+static bool TimerInterruptRunning(TIM_TypeDef * instance){
+	return (instance->CR1 & TIM_CR1_CEN) && (instance->DIER & TIM_DIER_UIE);
+}
+
+static uint64_t HostNanoseconds(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Counter value at a cycle while the timer runs
+static uint32_t CountAt(SimTimer * timer, uint64_t cycles){
+	TIM_TypeDef * instance = timer->instance;
+
+	if(((instance->CR1 & TIM_CR1_CEN) == 0) || (cycles < timer->start))
+		return instance->CNT;
+
+	return (uint32_t)(((cycles - timer->start) / (instance->PSC + 1)) % ((uint64_t)instance->ARR + 1));
+}
+
+// Next cycle the counter matches CCR2, compares already raised are skipped
+static uint64_t NextCompare(SimTimer * timer){
+	TIM_TypeDef * instance = timer->instance;
+
+	if(((instance->CR1 & TIM_CR1_CEN) == 0) || ((instance->DIER & TIM_DIER_CC2IE) == 0))
+		return UINT64_MAX;
+
+	uint64_t tick = instance->PSC + 1;
+	uint64_t modulo = (uint64_t)instance->ARR + 1;
+	uint64_t ticks = (now - timer->start + tick - 1) / tick;
+
+	if((timer->lastCompare >= timer->start) && (timer->start + ticks * tick <= timer->lastCompare))
+		ticks = (timer->lastCompare - timer->start) / tick + 1;
+
+	uint64_t delta = ((instance->CCR2 % modulo) + modulo - (ticks % modulo)) % modulo;
+	return timer->start + (ticks + delta) * tick;
+}
+
+static void RaiseInterrupt(SimTimer * timer, uint32_t flag){
+	timer->instance->CNT = CountAt(timer, now);
+	timer->instance->SR |= flag;
+
+	if(timer->instance != TIM3){
+		timer->irq();
+		return;
+	}
+
+	uint64_t start = HostNanoseconds();
+	timer->irq();
+	controlNanoseconds += HostNanoseconds() - start;
+	controlCount++;
+
+	if(controlHook != NULL)
+		controlHook();
+}
+
+static Plant * GetPlant(void){
+	if(plantInitialized == false){
+		InitPlant(&plant);
+		plantInitialized = true;
+	}
+	return &plant;
+}
+
+// Rising edge of encoder channel A at the given TIM1 count and cycle
+// TIM1 latches CCR1, its TRGO (OC1) makes TIM3 capture CCR1 on TRC (ITR0)
+static void CaptureEncoderEdge(uint32_t count, uint64_t cycles){
+	if((TIM1->CCER & TIM_CCER_CC1E) == 0)
+		return;
+
+	TIM1->CCR1 = count;
+	TIM1->SR |= TIM_SR_CC1IF;
+
+	bool timestamped = ((TIM1->CR2 & TIM_CR2_MMS) == TIM_TRGO_OC1) &&
+	                   (TIM3->CR1 & TIM_CR1_CEN) && (TIM3->CCER & TIM_CCER_CC1E) &&
+	                   ((TIM3->CCMR1 & TIM_CCMR1_CC1S) == TIM_ICSELECTION_TRC) &&
+	                   ((TIM3->SMCR & TIM_SMCR_TS) == TIM_TS_ITR0);
+	if(timestamped){
+		TIM3->CCR1 = CountAt(FindTimer(TIM3), cycles);
+		TIM3->SR |= TIM_SR_CC1IF;
+	}
+}
+
+// Channel A is high in the quadrature states 1 and 2, rising when the count
+// enters 1 forward or 2 backward. Edges are placed linearly within the step.
+static void CaptureEncoderEdges(double from, double to, uint64_t stepStart, uint64_t stepCycles){
+	long first = (long)floor(from), last = (long)floor(to);
+
+	if(first == last)
+		return;
+
+	int direction = (last > first) ? 1 : -1;
+	for(long count = first + direction; count != last + direction; count += direction){
+		if((count & 3) != ((direction > 0) ? 1 : 2))
+			continue;
+
+		double boundary = (direction > 0) ? (double)count : (double)(count + 1);
+		uint64_t cycles = stepStart + (uint64_t)((boundary - from) / (to - from) * stepCycles);
+		CaptureEncoderEdge((TIM1->CNT + (uint32_t)(count - first)) & 0xFFFF, cycles);
+	}
+}
+
+// Integrate the plant up to now, at least every PLANT_PERIOD and before every
+// timer interrupt so captures are in place when the firmware reads them
+static void UpdatePlant(void){
+	if(now <= plantTime)
+		return;
+
+	uint64_t stepStart = plantTime;
+	uint64_t stepCycles = now - plantTime;
+	plantTime = now;
+
+	Plant * p = GetPlant();
+
+	// TIM16 CH1 duty cycle, DIR high is backward
+	double duty = 0.0;
+	if((TIM16->CR1 & TIM_CR1_CEN) && (TIM16->CCER & TIM_CCER_CC1E)){
+		uint32_t compare = TIM16->CCR1;
+		if(compare > TIM16->ARR + 1)
+			compare = TIM16->ARR + 1;
+		duty = (double)compare / (double)(TIM16->ARR + 1);
+	}
+	if((GPIOA->ODR & GPIO_PIN_10) && (duty != 0.0))
+		duty = -duty;
+
+	p->voltage = duty * supplyVoltage;
+	StepPlant(p, (double)stepCycles / SIM_CORE_CLOCK);
+
+	// TIM1 in encoder mode only counts while started
+	long count = GetPlantEncoderCount(p);
+	double position = GetPlantEncoderPosition(p);
+	if(TIM1->CR1 & TIM_CR1_CEN){
+		CaptureEncoderEdges(encoderPosition, position, stepStart, stepCycles);
+		TIM1->CNT = (TIM1->CNT + (uint32_t)(count - encoderCount)) & 0xFFFF;
+	}
+	encoderCount = count;
+	encoderPosition = position;
+}
+
+uint64_t SimGetCycles(void){
+	return now;
+}
+
+double SimGetTime(void){
+	return (double)now / SIM_CORE_CLOCK;
+}
+
+void SimRunUntil(uint64_t cycles){
+	while(1){
+		uint64_t next = nextPlantStep;
+		for(size_t i = 0; i < SIM_TIMER_COUNT; i++){
+			if(TimerInterruptRunning(timers[i].instance) && (timers[i].nextUpdate < next))
+				next = timers[i].nextUpdate;
+			uint64_t compare = NextCompare(&timers[i]);
+			if(compare < next)
+				next = compare;
+		}
+
+		if(next > cycles)
+			break;
+
+		now = next;
+		DWT->CYCCNT = (uint32_t)now;
+
+		UpdatePlant();
+		if(nextPlantStep <= now)
+			nextPlantStep += PLANT_PERIOD;
+
+		for(size_t i = 0; i < SIM_TIMER_COUNT; i++){
+			SimTimer * timer = &timers[i];
+			if(NextCompare(timer) <= now){
+				timer->lastCompare = now;
+				RaiseInterrupt(timer, TIM_SR_CC2IF);
+			}
+			if(TimerInterruptRunning(timer->instance) && (timer->nextUpdate <= now)){
+				timer->nextUpdate += TimerPeriod(timer->instance);
+				RaiseInterrupt(timer, TIM_SR_UIF);
+			}
+		}
+	}
+
+	now = cycles;
+	DWT->CYCCNT = (uint32_t)now;
+}
+
+struct Plant * SimGetPlant(void){
+	return GetPlant();
+}
+
+void SetSimSupplyVoltage(double voltage){
+	supplyVoltage = voltage;
+}
+
+void SetSimControlHook(void (*hook)(void)){
+	controlHook = hook;
+}
+
+void GetSimControlCost(uint64_t * count, uint64_t * nanoseconds){
+	*count = controlCount;
+	*nanoseconds = controlNanoseconds;
+}
+
+/* HAL ************************************************************************/
+
+HAL_StatusTypeDef HAL_Init(void){
+	return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void){
+	return (uint32_t)(now / (SIM_CORE_CLOCK / 1000));
+}
+
+void HAL_Delay(uint32_t Delay){
+	SimRunUntil(now + (uint64_t)Delay * (SIM_CORE_CLOCK / 1000));
+}
+
+void HAL_IncTick(void){
+}
+
+void HAL_SYSTICK_IRQHandler(void){
+}
+
+void wait(float s){
+	SimRunUntil(now + (uint64_t)(s * SIM_CORE_CLOCK));
+}
+
+void wait_ms(int ms){
+	HAL_Delay(ms);
+}
+
+void wait_us(int us){
+	SimRunUntil(now + (uint64_t)us * (SIM_CORE_CLOCK / 1000000));
+}
+
+/* GPIO ***********************************************************************/
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init){
+	// Pulled up inputs idle high
+	if((GPIO_Init->Mode != GPIO_MODE_OUTPUT_PP) && (GPIO_Init->Pull == GPIO_PULLUP))
+		GPIOx->IDR |= GPIO_Init->Pin;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin){
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState){
+	if(PinState == GPIO_PIN_SET)
+		GPIOx->ODR |= GPIO_Pin;
+	else
+		GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+}
+
+void HAL_GPIO_EXTI_IRQHandler(uint16_t GPIO_Pin){
+	HAL_GPIO_EXTI_Callback(GPIO_Pin);
+}
+
+void SimPressButton(uint16_t pin){
+	if(pin == GPIO_PIN_11)
+		EXTI15_10_IRQHandler();
+	else if(pin == GPIO_PIN_1)
+		EXTI1_IRQHandler();
+}
+
+// Knob sits at 11 (PB4 PB5 pulled up)
+// clockwise 11 -> 01 -> 00 -> 10 -> 11, counter clockwise the reverse
+void SimTurnKnob(int steps){
+	static const uint8_t clockwise[4] = { 1, 0, 2, 3 };
+	static const uint8_t counterClockwise[4] = { 2, 0, 1, 3 };
+
+	for(; steps != 0; steps += (steps > 0) ? -1 : 1){
+		const uint8_t * sequence = (steps > 0) ? clockwise : counterClockwise;
+
+		for(uint8_t i = 0; i < 4; i++){
+			uint32_t previous = GPIOB->IDR;
+			uint32_t state = ((sequence[i] & 0x02) ? GPIO_PIN_4 : 0) | ((sequence[i] & 0x01) ? GPIO_PIN_5 : 0);
+
+			GPIOB->IDR = (previous & ~(uint32_t)(GPIO_PIN_4 | GPIO_PIN_5)) | state;
+
+			if((previous ^ GPIOB->IDR) & GPIO_PIN_4)
+				EXTI4_IRQHandler();
+			if((previous ^ GPIOB->IDR) & GPIO_PIN_5)
+				EXTI9_5_IRQHandler();
+		}
+	}
+}
+
+/* DMA ************************************************************************/
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma){
+	(void)hdma;
+	return HAL_OK;
+}
+
+static void (*serialOutput)(const uint8_t * data, uint16_t size) = NULL;
+static uint32_t serialReceiveLength = 0;    // Circular reload of CNDTR
+
+// Peripheral to memory requests come from the peripheral, see SimSerialInput()
+HAL_StatusTypeDef HAL_DMA_Start(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uint32_t DataLength){
+	DMA_Channel_TypeDef * channel = hdma->Instance;
+	bool toPeripheral = (hdma->Init.Direction == DMA_MEMORY_TO_PERIPH);
+
+	channel->CPAR = toPeripheral ? DstAddress : SrcAddress;
+	channel->CMAR = toPeripheral ? SrcAddress : DstAddress;
+	channel->CNDTR = DataLength;
+	channel->CCR |= DMA_CCR_EN;
+	if(channel == DMA1_Channel6)
+		serialReceiveLength = DataLength;
+	return HAL_OK;
+}
+
+// USART2 transmit completes at once, its interrupt included
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uint32_t DataLength){
+	HAL_DMA_Start(hdma, SrcAddress, DstAddress, DataLength);
+
+	DMA_Channel_TypeDef * channel = hdma->Instance;
+	if((channel->CPAR == (uintptr_t)&USART2->TDR) && (USART2->CR3 & USART_CR3_DMAT)){
+		if(serialOutput != NULL)
+			serialOutput((const uint8_t *)channel->CMAR, (uint16_t)DataLength);
+		channel->CNDTR = 0;
+		channel->CCR &= ~DMA_CCR_EN;
+		if(channel == DMA1_Channel7)
+			DMA1_Channel7_IRQHandler();
+	}
+	return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma){
+	if((hdma->Instance->CNDTR == 0) && (hdma->XferCpltCallback != NULL))
+		hdma->XferCpltCallback(hdma);
+}
+
+/* SPI and ST7920 *************************************************************/
+
+static void ClearScreen(void){
+	memset(screen, ' ', sizeof(screen));
+	ddramByte = 0;
+}
+
+// DDRAM address order is row 0, row 2, row 1, row 3
+static void WriteScreen(uint8_t data){
+	uint8_t address = (ddramByte >> 1) & 0x1F;
+	uint8_t row = ((address >> 4) & 0x01) | ((address >> 2) & 0x02);
+	uint8_t column = ((address & 0x07) << 1) | (ddramByte & 0x01);
+
+	screen[row][column] = (data >= 0x20 && data < 0x7F) ? (char)data : '?';
+	ddramByte = (ddramByte + 1) & 0x3F;
+}
+
+static void ExecuteFrame(bool data, uint8_t value){
+	if(data){
+		if(ddramSelected)
+			WriteScreen(value);
+		return;
+	}
+
+	// Function set, RE selects the extended instructions
+	if((value & 0xE0) == 0x20)
+		extendedInstructions = (value & 0x04) != 0;
+	else if(value & 0x80){
+		// Basic: DDRAM address, extended: GDRAM address pair
+		ddramSelected = !extendedInstructions;
+		if(ddramSelected)
+			ddramByte = (value & 0x1F) << 1;
+	}
+	else if(extendedInstructions == false){
+		if(value == 0x01)
+			ClearScreen();
+		else if((value & 0xFE) == 0x02)
+			ddramByte = 0;
+	}
+}
+
+static void FeedLcd(const uint8_t * data, uint16_t size){
+	// RS pin is the chip select of the ST7920
+	if((GPIOA->ODR & GPIO_PIN_4) == 0)
+		return;
+
+	for(uint16_t i = 0; i < size; i++){
+		// Synchronizing bit string starts a frame
+		if((data[i] & 0xF8) == 0xF8)
+			frameIndex = 0;
+
+		if(frameIndex < 3)
+			frame[frameIndex++] = data[i];
+
+		if(frameIndex == 3){
+			ExecuteFrame((frame[0] & 0x02) != 0, (frame[1] & 0xF0) | (frame[2] >> 4));
+			frameIndex = 4;
+		}
+	}
+}
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi){
+	(void)hspi;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout){
+	(void)Timeout;
+	if(hspi->Instance == SPI1)
+		FeedLcd(pData, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size){
+	if(hspi->Instance == SPI1)
+		FeedLcd(pData, Size);
+	HAL_SPI_TxCpltCallback(hspi);
+	return HAL_OK;
+}
+
+void SimPrintScreen(FILE * fp){
+	fprintf(fp, "+----------------+\n");
+	for(uint8_t row = 0; row < 4; row++)
+		fprintf(fp, "|%.16s|\n", screen[row]);
+	fprintf(fp, "+----------------+\n");
+}
+
+/* TIM ************************************************************************/
+
+void SimTimerEnable(TIM_HandleTypeDef *htim){
+	TIM_TypeDef * instance = htim->Instance;
+	SimTimer * timer = FindTimer(instance);
+	bool running = (instance->CR1 & TIM_CR1_CEN) != 0;
+
+	instance->CR1 |= TIM_CR1_CEN;
+
+	if(timer == NULL)
+		return;
+
+	// One-pulse timers elapse right away, they only pace the LCD
+	if(instance->CR1 & TIM_CR1_OPM){
+		instance->CR1 &= ~TIM_CR1_CEN;
+		if(instance->DIER & TIM_DIER_UIE){
+			instance->CNT = 0;
+			instance->SR |= TIM_SR_UIF;
+			timer->irq();
+		}
+		return;
+	}
+
+	// Counting continues from CNT
+	if(running == false){
+		timer->start = now - (uint64_t)instance->CNT * (instance->PSC + 1);
+		timer->lastCompare = 0;
+	}
+	timer->nextUpdate = now + TimerPeriod(instance);
+}
+
+// Like the HAL, the counter only stops once no channel is enabled
+static void SimTimerDisable(TIM_HandleTypeDef *htim){
+	TIM_TypeDef * instance = htim->Instance;
+	SimTimer * timer = FindTimer(instance);
+
+	if(instance->CCER & TIM_CCER_CCxE_MASK)
+		return;
+
+	if(timer != NULL)
+		instance->CNT = CountAt(timer, now);
+	instance->CR1 &= ~TIM_CR1_CEN;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim){
+	htim->Instance->PSC = htim->Init.Prescaler;
+	htim->Instance->ARR = htim->Init.Period;
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim){
+	htim->Instance->DIER |= TIM_DIER_UIE;
+	SimTimerEnable(htim);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim){
+	htim->Instance->DIER &= ~TIM_DIER_UIE;
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_ConfigClockSource(TIM_HandleTypeDef *htim, TIM_ClockConfigTypeDef *sClockSourceConfig){
+	(void)htim; (void)sClockSourceConfig;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef *htim, TIM_MasterConfigTypeDef *sMasterConfig){
+	htim->Instance->CR2 = (htim->Instance->CR2 & ~TIM_CR2_MMS) | (sMasterConfig->MasterOutputTrigger & TIM_CR2_MMS);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_SlaveConfigSynchronization(TIM_HandleTypeDef *htim, TIM_SlaveConfigTypeDef *sSlaveConfig){
+	htim->Instance->SMCR = (sSlaveConfig->InputTrigger & TIM_SMCR_TS) | (sSlaveConfig->SlaveMode & TIM_SMCR_SMS);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef *htim, TIM_BreakDeadTimeConfigTypeDef *sBreakDeadTimeConfig){
+	(void)htim; (void)sBreakDeadTimeConfig;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Encoder_Init(TIM_HandleTypeDef *htim, TIM_Encoder_InitTypeDef *sConfig){
+	(void)sConfig;
+	return HAL_TIM_Base_Init(htim);
+}
+
+// Both channels capture in encoder mode
+HAL_StatusTypeDef HAL_TIM_Encoder_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	(void)Channel;
+	htim->Instance->CCER |= TIM_CCER_CC1E | TIM_CCER_CC2E;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Encoder_Stop(TIM_HandleTypeDef *htim, uint32_t Channel){
+	(void)Channel;
+	htim->Instance->CCER &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E);
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Init(TIM_HandleTypeDef *htim){
+	return HAL_TIM_Base_Init(htim);
+}
+
+// Channel 1 only
+HAL_StatusTypeDef HAL_TIM_IC_ConfigChannel(TIM_HandleTypeDef *htim, TIM_IC_InitTypeDef *sConfig, uint32_t Channel){
+	if(Channel != TIM_CHANNEL_1)
+		return HAL_ERROR;
+	htim->Instance->CCMR1 = (htim->Instance->CCMR1 & ~TIM_CCMR1_CC1S) | (sConfig->ICSelection & TIM_CCMR1_CC1S);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	htim->Instance->CCER |= (TIM_CCER_CC1E << Channel);
+	SimTimerEnable(htim);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Stop(TIM_HandleTypeDef *htim, uint32_t Channel){
+	htim->Instance->CCER &= ~(TIM_CCER_CC1E << Channel);
+	SimTimerDisable(htim);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_Init(TIM_HandleTypeDef *htim){
+	return HAL_TIM_Base_Init(htim);
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel){
+	__HAL_TIM_SET_COMPARE(htim, Channel, sConfig->Pulse);
+	return HAL_OK;
+}
+
+// Channel 2 only raises the compare interrupt
+HAL_StatusTypeDef HAL_TIM_OC_Start_IT(TIM_HandleTypeDef *htim, uint32_t Channel){
+	if(Channel == TIM_CHANNEL_2)
+		htim->Instance->DIER |= TIM_DIER_CC2IE;
+	htim->Instance->CCER |= (TIM_CCER_CC1E << Channel);
+	SimTimerEnable(htim);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_Stop_IT(TIM_HandleTypeDef *htim, uint32_t Channel){
+	if(Channel == TIM_CHANNEL_2)
+		htim->Instance->DIER &= ~TIM_DIER_CC2IE;
+	htim->Instance->CCER &= ~(TIM_CCER_CC1E << Channel);
+	SimTimerDisable(htim);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim){
+	return HAL_TIM_Base_Init(htim);
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel){
+	__HAL_TIM_SET_COMPARE(htim, Channel, sConfig->Pulse);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	htim->Instance->CCER |= (TIM_CCER_CC1E << Channel);
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef *htim, uint32_t Channel){
+	htim->Instance->CCER &= ~(TIM_CCER_CC1E << Channel);
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim){
+	TIM_TypeDef * instance = htim->Instance;
+
+	if((instance->SR & TIM_SR_CC2IF) && (instance->DIER & TIM_DIER_CC2IE)){
+		instance->SR &= ~TIM_SR_CC2IF;
+		HAL_TIM_OC_DelayElapsedCallback(htim);
+	}
+	if((instance->SR & TIM_SR_UIF) && (instance->DIER & TIM_DIER_UIE)){
+		instance->SR &= ~TIM_SR_UIF;
+		HAL_TIM_PeriodElapsedCallback(htim);
+	}
+}
+
+// Output pins only, nothing to simulate
+void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim){
+	(void)htim;
+}
+
+/* SD card ********************************************************************/
+
+SDFileSystem::SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name){
+	(void)mosi; (void)miso; (void)sclk; (void)cs; (void)name;
+	sdMounted = true;
+}
+
+SDFileSystem::~SDFileSystem(){
+	sdMounted = false;
+}
+
+int SDFileSystem::disk_initialize(){
+	return (sdMounted && (sdRoot != NULL)) ? 0 : 1;
+}
+
+void SetSimSdRoot(const char * root){
+	sdRoot = root;
+}
+
+int SDFileSystem::disk_resume(){
+	return disk_initialize();
+}
+
+int SDFileSystem::unmount(){
+	sdMounted = false;
+	return 0;
+}
+
+int SDFileSystem::mount(){
+	sdMounted = true;
+	return (sdRoot != NULL) ? 0 : -1;
+}
+
+FILE * SimOpen(const char * path, const char * mode){
+	if((sdMounted == false) || (sdRoot == NULL) || (strncmp(path, "/sd/", 4) != 0))
+		return NULL;
+
+	char hostPath[512];
+	snprintf(hostPath, sizeof(hostPath), "%s/%s", sdRoot, path + 4);
+	return fopen(hostPath, mode);
+}
+
+int SimMkdir(const char * path, mode_t mode){
+	if((sdMounted == false) || (sdRoot == NULL) || (strncmp(path, "/sd/", 4) != 0))
+		return -1;
+
+	char hostPath[512];
+	snprintf(hostPath, sizeof(hostPath), "%s/%s", sdRoot, path + 4);
+	return mkdir(hostPath, mode);
+}
+
+// FatFs on drive "0:", the card directory while mounted
+static bool FatFsPath(const TCHAR* path, char * hostPath, size_t size){
+	if((sdMounted == false) || (sdRoot == NULL))
+		return false;
+	if(strncmp(path, "0:/", 3) == 0)
+		path += 3;
+	snprintf(hostPath, size, "%s/%s", sdRoot, path);
+	return true;
+}
+
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode){
+	fp->file = NULL;
+	fp->fsize = 0;
+
+	char hostPath[512];
+	if(FatFsPath(path, hostPath, sizeof(hostPath)) == false)
+		return FR_NOT_READY;
+
+	if(mode & FA_WRITE){
+		fp->file = fopen(hostPath, (mode & FA_CREATE_ALWAYS) ? "w+b" : "r+b");
+		if((fp->file == NULL) && (mode & FA_OPEN_ALWAYS))
+			fp->file = fopen(hostPath, "w+b");
+	}
+	else
+		fp->file = fopen(hostPath, "rb");
+
+	if(fp->file == NULL)
+		return FR_NO_FILE;
+
+	fseek(fp->file, 0, SEEK_END);
+	fp->fsize = (DWORD)ftell(fp->file);
+	fseek(fp->file, 0, SEEK_SET);
+	return FR_OK;
+}
+
+FRESULT f_close(FIL* fp){
+	if(fp->file == NULL)
+		return FR_INT_ERR;
+	fclose(fp->file);
+	fp->file = NULL;
+	return FR_OK;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br){
+	*br = (UINT)fread(buff, 1, btr, fp->file);
+	return ferror(fp->file) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw){
+	*bw = (UINT)fwrite(buff, 1, btw, fp->file);
+	long end = ftell(fp->file);
+	if((end > 0) && ((DWORD)end > fp->fsize))
+		fp->fsize = (DWORD)end;
+	return (*bw == btw) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_lseek(FIL* fp, DWORD ofs){
+	return (fseek(fp->file, (long)ofs, SEEK_SET) == 0) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_unlink(const TCHAR* path){
+	char hostPath[512];
+	if(FatFsPath(path, hostPath, sizeof(hostPath)) == false)
+		return FR_NOT_READY;
+	return (remove(hostPath) == 0) ? FR_OK : FR_NO_FILE;
+}
+
+// As FatFs, the new name must not exist
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new){
+	char oldPath[512], newPath[512];
+	if((FatFsPath(path_old, oldPath, sizeof(oldPath)) == false) || (FatFsPath(path_new, newPath, sizeof(newPath)) == false))
+		return FR_NOT_READY;
+	if(access(newPath, F_OK) == 0)
+		return FR_EXIST;
+	return (rename(oldPath, newPath) == 0) ? FR_OK : FR_NO_FILE;
+}
+
+/* Flash **********************************************************************/
+
+static bool flashUnlocked = false;
+
+// Erased as a new part, before the firmware boots
+static struct SimFlashInit
+{
+	SimFlashInit(){ memset(SimFlash, 0xFF, sizeof(SimFlash)); }
+} simFlashInit;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void){
+	flashUnlocked = true;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void){
+	flashUnlocked = false;
+	return HAL_OK;
+}
+
+// As on the part, only an erased half word can be programmed
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uintptr_t Address, uint64_t Data){
+	if(!flashUnlocked || (TypeProgram != FLASH_TYPEPROGRAM_HALFWORD) || (Address & 1)
+	        || (Address < FLASH_BASE) || (Address + 2 > FLASH_BASE + SIM_FLASH_SIZE))
+		return HAL_ERROR;
+
+	uint16_t * halfWord = (uint16_t *)Address;
+	if(*halfWord != 0xFFFF)
+		return HAL_ERROR;
+
+	*halfWord = (uint16_t)Data;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError){
+	uintptr_t start = pEraseInit->PageAddress;
+	uintptr_t end = start + pEraseInit->NbPages * FLASH_PAGE_SIZE;
+	if(!flashUnlocked || ((start - FLASH_BASE) % FLASH_PAGE_SIZE) || (start < FLASH_BASE)
+	        || (end > FLASH_BASE + SIM_FLASH_SIZE)){
+		*PageError = (uint32_t)(start - FLASH_BASE);
+		return HAL_ERROR;
+	}
+
+	memset((void *)start, 0xFF, end - start);
+	*PageError = 0xFFFFFFFFU;
+	return HAL_OK;
+}
+
+bool SimLoadFlash(const char * path){
+	FILE * fp = fopen(path, "rb");
+	if(fp == NULL)
+		return false;
+	size_t size = fread(SimFlash, 1, sizeof(SimFlash), fp);
+	fclose(fp);
+	return size == sizeof(SimFlash);
+}
+
+bool SimSaveFlash(const char * path){
+	FILE * fp = fopen(path, "wb");
+	if(fp == NULL)
+		return false;
+	size_t size = fwrite(SimFlash, 1, sizeof(SimFlash), fp);
+	fclose(fp);
+	return size == sizeof(SimFlash);
+}
+
+/* Serial port ****************************************************************/
+
+RawSerial::RawSerial(PinName tx, PinName rx){
+	(void)tx; (void)rx;
+}
+
+void RawSerial::baud(int baudrate){
+	(void)baudrate;
+}
+
+// Through the circular receive DMA when it runs, lost otherwise
+void SimSerialInput(const uint8_t * data, uint16_t size){
+	DMA_Channel_TypeDef * channel = DMA1_Channel6;
+	if(((channel->CCR & DMA_CCR_EN) == 0) || ((USART2->CR3 & USART_CR3_DMAR) == 0) || (channel->CPAR != (uintptr_t)&USART2->RDR))
+		return;
+
+	// CNDTR counts down to 1 and reloads, the byte goes to length - CNDTR
+	uint8_t * buffer = (uint8_t *)channel->CMAR;
+	for(uint16_t i = 0; i < size; i++){
+		USART2->RDR = data[i];
+		buffer[serialReceiveLength - channel->CNDTR] = (uint8_t)USART2->RDR;
+		channel->CNDTR = (channel->CNDTR > 1) ? (channel->CNDTR - 1) : serialReceiveLength;
+	}
+}
+
+void SetSimSerialOutput(void (*output)(const uint8_t * data, uint16_t size)){
+	serialOutput = output;
+}
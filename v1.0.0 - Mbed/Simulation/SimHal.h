@@ -0,0 +1,57 @@
+#ifndef SIMHAL_H
+#define SIMHAL_H
+
+#include "stm32f3xx_hal.h"
+#include "Plant.h"
+#include <stdio.h>
+
+// Simulated STM32F303K8 around the firmware
+//
+// Time is counted in 64MHz core cycles and only moves in SimRunUntil(),
+// HAL_Delay() and wait(). Firmware code itself takes no simulated time.
+// TIM3, TIM15 and TIM17 raise their interrupts from PSC/ARR, TIM1 counts the
+// plant encoder, TIM16 CCR1 and DIR drive the plant voltage. LCD frames
+// complete as soon as they are sent and are decoded into a text screen, so do
+// the USART2 transmit DMAs.
+
+#define SIM_CORE_CLOCK          64000000UL
+#define SIM_PLANT_RATE          10000       // Plant integration steps per second
+
+uint64_t SimGetCycles(void);
+double SimGetTime(void);
+
+// Run plant and interrupts up to the given cycle
+void SimRunUntil(uint64_t cycles);
+
+struct Plant * SimGetPlant(void);
+void SetSimSupplyVoltage(double voltage);
+
+// Called after every TIM3 control interrupt
+void SetSimControlHook(void (*hook)(void));
+
+// Host time spent in TIM3 interrupts, the DWT profiler gives target cycles
+void GetSimControlCost(uint64_t * count, uint64_t * nanoseconds);
+
+// Host directory the firmware sees as "/sd/" while the card is mounted
+void SetSimSdRoot(const char * root);
+
+// Falling edge on a button, GPIO_PIN_11 select or GPIO_PIN_1 back
+void SimPressButton(uint16_t pin);
+
+// Quadrature steps on the knob, positive is clockwise
+void SimTurnKnob(int steps);
+
+// Flash contents from and to a host file, a missing file is an erased part
+bool SimLoadFlash(const char * path);
+bool SimSaveFlash(const char * path);
+
+// Bytes received on the serial port, they go to the USART2 receive DMA
+void SimSerialInput(const uint8_t * data, uint16_t size);
+
+// Called with the bytes of every USART2 transmit DMA
+void SetSimSerialOutput(void (*output)(const uint8_t * data, uint16_t size));
+
+// Text layer of the ST7920
+void SimPrintScreen(FILE * fp);
+
+#endif
@@ -0,0 +1,386 @@
+#include "SimFirmware.h"
+#include "Replay.h"
+#include "Protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef SIM_SD_ROOT
+#define SIM_SD_ROOT NULL
+#endif
+
+static Replay replay;
+static FILE * trace = NULL;
+static FILE * telemetryFile = NULL;
+static FILE * streamFile = NULL;
+static FILE * serialFile = NULL;
+static double controlStart = 0.0;
+static double replayRpm = 0.0;
+static bool flowControl = false;
+static bool autotuneMode = false;
+static double doseVolume = 0.0;
+static int doseBatches = 1;
+static int dosesDone = 0;
+static double plantVolume = 0.0;
+static bool dataLogMode = false;
+static double reloadTime = -1.0;
+static bool remoteControl = false;
+static ProtocolDecoder serialDecoder;
+static uint8_t serialBuffer[PROTOCOL_MAX_DATA + 1];
+
+// One row per control interrupt
+static void TraceControl(void){
+	Plant * plant = SimGetPlant();
+
+	// What the pump really delivered, leakage included
+	plantVolume += GetPlantFlowRate(plant) / (double)loopFrequency / 60.0;
+
+	fprintf(trace, "%.4f,%.1f,%.1f,%.2f,%.2f,%d,%.3f,%.4f,%.3f,%.3f\n",
+	        SimGetTime() - controlStart, (double)refRpm, (double)rpmTrajectory.position, (double)averagedMotorRpm, GetPlantRpm(plant),
+	        pwm, plant->voltage, plant->current, plant->pressure, GetPlantFlowRate(plant));
+}
+
+static void WriteSample(FILE * fp, const TelemetrySample * sample){
+	fprintf(fp, "%lu,%d,%d,%.2f,%.2f,%.2f\n", (unsigned long)sample->time, sample->encoderDelta,
+	        sample->pwm, (double)sample->rpm, (double)sample->error, (double)sample->integral);
+}
+
+// Firmware telemetry task output
+static void WriteTelemetry(const TelemetrySample * sample){
+	WriteSample(telemetryFile, sample);
+}
+
+// Command frame to the firmware's serial port, handled by its next serial task
+static void SendCommand(uint8_t type, const void * payload, uint16_t length){
+	uint8_t frame[PROTOCOL_FRAME_SIZE(PROTOCOL_MAX_PAYLOAD)];
+	SimSerialInput(frame, EncodeProtocol(type, (const uint8_t *)payload, length, frame));
+}
+
+static void SendValue(uint8_t type, float value){
+	SendCommand(type, &value, sizeof(value));
+}
+
+// Frames from the firmware, streamed telemetry to its file and replies to stderr
+// The raw bytes to the serial capture
+static void ReceiveSerial(const uint8_t * data, uint16_t size){
+	if(serialFile != NULL)
+		fwrite(data, 1, size, serialFile);
+
+	for(uint16_t i = 0; i < size; i++){
+		if(DecodeProtocol(&serialDecoder, data[i]) == false)
+			continue;
+
+		const uint8_t * payload = serialDecoder.payload;
+		uint16_t length = serialDecoder.payloadLength;
+
+		if(serialDecoder.type == PROTOCOL_TELEMETRY){
+			for(uint16_t offset = 4; (streamFile != NULL) && (offset + sizeof(TelemetrySample) <= length); offset += sizeof(TelemetrySample)){
+				TelemetrySample sample;
+				memcpy(&sample, &payload[offset], sizeof(sample));
+				WriteSample(streamFile, &sample);
+			}
+		}
+		else if(serialDecoder.type == (PROTOCOL_RELOAD | PROTOCOL_REPLY))
+			fprintf(stderr, "reload,%.*s\n", length - 1, (const char *)&payload[1]);
+		else if(payload[0] != PROTOCOL_OK)
+			fprintf(stderr, "command 0x%02x status %u\n", serialDecoder.type & ~PROTOCOL_REPLY, payload[0]);
+	}
+}
+
+// Profile values for the current main loop slice
+// A new setpoint is committed like the knob does, it stops an SD card program,
+// or sent over the serial port
+// In Flow Control, Batch Dosing and Autotune the firmware sets the RPM, only
+// the load is replayed
+static void ReplaySlice(void){
+	const ReplayPoint * point = GetReplayPoint(&replay, SimGetTime() - controlStart);
+	if((flowControl == false) && (autotuneMode == false) && (doseVolume == 0.0) && (point->refRpm != replayRpm)){
+		replayRpm = point->refRpm;
+		if(remoteControl)
+			SendValue(PROTOCOL_SET_RPM, (float)replayRpm);
+		else{
+			StopTrajectoryProgram(&rpmProgram);
+			refRpm = (float)replayRpm;
+		}
+	}
+	SimGetPlant()->pressure = point->pressure;
+}
+
+// Dose to start, like the select button does or over the serial port
+static void StartDose(void){
+	plantVolume = 0.0;
+	if(remoteControl)
+		SendValue(PROTOCOL_DOSE, (float)doseVolume);
+	else
+		startDose((float)doseVolume);
+}
+
+// Each dose once the pump stands, the next one started until all batches are done
+static void DoseSlice(void){
+	if((doseVolume == 0.0) || (dosesDone == doseBatches) || (dosing.state != DOSING_DONE))
+		return;
+
+	dosesDone++;
+	double volume = (double)GetDosedVolume(&dosing);
+	fprintf(stderr, "dose %d target %.3f ml, encoder %.4f ml (%+.2f%%), plant %.4f ml, coast %.4f ml, %.2fs\n",
+	        dosesDone, (double)dosing.target, volume, 100.0 * (volume - dosing.target) / dosing.target,
+	        plantVolume, (double)dosing.coastVolume, (double)dosing.time);
+
+	if(dosesDone < doseBatches)
+		StartDose();
+}
+
+// Replay, doses, and the serial reload command once its time has come
+static void ControlSlice(void){
+	ReplaySlice();
+	DoseSlice();
+
+	if((reloadTime >= 0.0) && (SimGetTime() - controlStart >= reloadTime)){
+		reloadTime = -1.0;
+		SendCommand(PROTOCOL_RELOAD, NULL, 0);
+	}
+}
+
+// Telemetry frames from now on
+static void StreamTelemetry(void){
+	uint8_t on = 1;
+	SendCommand(PROTOCOL_STREAM, &on, sizeof(on));
+	RunFirmware(0.002, NULL);
+}
+
+// Started from the control selection menu, the flow rate or dose is set at once
+static void EnterRemoteControl(bool flow, double flowRate){
+	uint8_t mode = (doseVolume > 0.0) ? PROTOCOL_BATCH_DOSING : (flow ? PROTOCOL_FLOW_CONTROL : PROTOCOL_RPM_CONTROL);
+	SendCommand(PROTOCOL_START, &mode, sizeof(mode));
+	RunFirmware(0.002, NULL);
+
+	if(doseVolume > 0.0)
+		StartDose();
+	else if(flow)
+		SendValue(PROTOCOL_SET_FLOW_RATE, (float)flowRate);
+}
+
+static void Usage(const char * name){
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  --profile FILE   setpoint/load profile, time(s),refRpm,pressure(bar)\n"
+	        "  --rpm RPM        step setpoint without a profile (default 3000)\n"
+	        "  --flow ML        Flow Control at ML ml/min instead of RPM Control\n"
+	        "  --autotune       PID Autotune instead, writes its gains to the --sd settings.txt\n"
+	        "  --dose ML        Batch Dosing of ML ml instead, each dose reported to stderr\n"
+	        "  --batches N      doses one after another (default 1)\n"
+	        "  --duration S     run time after control starts (default profile end + 2s,\n"
+	        "                   with --dose until the last one is done, 60s each at most)\n"
+	        "  --trace FILE     control trace CSV (default stdout)\n"
+	        "  --telemetry FILE firmware telemetry ring samples as CSV\n"
+	        "  --log            run log to logs/ in the --sd directory ([log])\n"
+	        "  --reload S       serial reload command S seconds after control starts\n"
+	        "  --remote         start and set RPM, Flow Control or doses over the serial port\n"
+	        "  --stream FILE    telemetry streamed over the serial port as CSV\n"
+	        "  --serial FILE    raw serial port output with streaming on, for motionManagerDecode\n"
+	        "  --sd DIR         directory used as the SD card, \"none\" for no card\n"
+	        "  --flash FILE     internal flash from and back to FILE, erased if missing\n"
+	        "  --screen         print the LCD text at the end\n",
+	        name);
+}
+
+int main(int argc, char ** argv){
+	const char * profilePath = NULL;
+	const char * tracePath = NULL;
+	const char * telemetryPath = NULL;
+	const char * streamPath = NULL;
+	const char * serialPath = NULL;
+	const char * sdRoot = SIM_SD_ROOT;
+	const char * flashPath = NULL;
+	double stepRpm = 3000.0;
+	double flowRate = 0.0;
+	double duration = -1.0;
+	bool printScreen = false;
+
+	for(int i = 1; i < argc; i++){
+		bool hasValue = (i + 1 < argc);
+
+		if((strcmp(argv[i], "--profile") == 0) && hasValue)
+			profilePath = argv[++i];
+		else if((strcmp(argv[i], "--rpm") == 0) && hasValue)
+			stepRpm = atof(argv[++i]);
+		else if((strcmp(argv[i], "--flow") == 0) && hasValue){
+			flowRate = atof(argv[++i]);
+			flowControl = true;
+		}
+		else if(strcmp(argv[i], "--autotune") == 0)
+			autotuneMode = true;
+		else if((strcmp(argv[i], "--dose") == 0) && hasValue)
+			doseVolume = atof(argv[++i]);
+		else if((strcmp(argv[i], "--batches") == 0) && hasValue)
+			doseBatches = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--log") == 0)
+			dataLogMode = true;
+		else if((strcmp(argv[i], "--reload") == 0) && hasValue)
+			reloadTime = atof(argv[++i]);
+		else if((strcmp(argv[i], "--duration") == 0) && hasValue)
+			duration = atof(argv[++i]);
+		else if((strcmp(argv[i], "--trace") == 0) && hasValue)
+			tracePath = argv[++i];
+		else if((strcmp(argv[i], "--telemetry") == 0) && hasValue)
+			telemetryPath = argv[++i];
+		else if(strcmp(argv[i], "--remote") == 0)
+			remoteControl = true;
+		else if((strcmp(argv[i], "--stream") == 0) && hasValue)
+			streamPath = argv[++i];
+		else if((strcmp(argv[i], "--serial") == 0) && hasValue)
+			serialPath = argv[++i];
+		else if((strcmp(argv[i], "--sd") == 0) && hasValue){
+			sdRoot = argv[++i];
+			if(strcmp(sdRoot, "none") == 0)
+				sdRoot = NULL;
+		}
+		else if((strcmp(argv[i], "--flash") == 0) && hasValue)
+			flashPath = argv[++i];
+		else if(strcmp(argv[i], "--screen") == 0)
+			printScreen = true;
+		else{
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(profilePath != NULL){
+		if(LoadReplay(&replay, profilePath) == false){
+			fprintf(stderr, "can not load profile %s\n", profilePath);
+			return 1;
+		}
+	}
+	else
+		DefaultReplay(&replay, stepRpm);
+
+	if((doseVolume < 0.0) || (doseBatches < 1)){
+		Usage(argv[0]);
+		return 2;
+	}
+
+	if((duration < 0.0) && autotuneMode)
+		duration = AUTOTUNE_TIMEOUT;
+	else if((duration < 0.0) && (doseVolume > 0.0))
+		duration = 60.0 * doseBatches;
+	else if(duration < 0.0)
+		duration = GetReplayEnd(&replay) + 2.0;
+
+	trace = (tracePath != NULL) ? fopen(tracePath, "w") : stdout;
+	if(trace == NULL){
+		fprintf(stderr, "can not open %s\n", tracePath);
+		return 1;
+	}
+
+	if(telemetryPath != NULL){
+		telemetryFile = fopen(telemetryPath, "w");
+		if(telemetryFile == NULL){
+			fprintf(stderr, "can not open %s\n", telemetryPath);
+			return 1;
+		}
+		fprintf(telemetryFile, "time,encoderDelta,pwm,rpm,error,integral\n");
+		telemetrySink = WriteTelemetry;
+	}
+
+	if(streamPath != NULL){
+		streamFile = fopen(streamPath, "w");
+		if(streamFile == NULL){
+			fprintf(stderr, "can not open %s\n", streamPath);
+			return 1;
+		}
+		fprintf(streamFile, "time,encoderDelta,pwm,rpm,error,integral\n");
+	}
+
+	if(serialPath != NULL){
+		serialFile = fopen(serialPath, "wb");
+		if(serialFile == NULL){
+			fprintf(stderr, "can not open %s\n", serialPath);
+			return 1;
+		}
+	}
+
+	InitProtocolDecoder(&serialDecoder, serialBuffer, sizeof(serialBuffer));
+	SetSimSerialOutput(ReceiveSerial);
+
+	clock_t hostStart = clock();
+
+	SetSimSdRoot(sdRoot);
+	if(flashPath != NULL)
+		SimLoadFlash(flashPath);
+
+	BootFirmware();
+
+	// A log of every simulation run would fill the card directory
+	if(dataLogMode == false)
+		dataLogEnabled = false;
+
+	if((streamFile != NULL) || (serialFile != NULL))
+		StreamTelemetry();
+
+	if(autotuneMode)
+		EnterAutotune();
+	else if(remoteControl)
+		EnterRemoteControl(flowControl, flowRate);
+	else if(doseVolume > 0.0)
+		EnterBatchDosing(doseVolume);
+	else if(flowControl)
+		EnterFlowControl(flowRate);
+	else
+		EnterRpmControl();
+
+	controlStart = SimGetTime();
+	fprintf(trace, "time,refRpm,reference,rpm,plantRpm,pwm,voltage,current,pressure,flowRate\n");
+	SetSimControlHook(TraceControl);
+
+	// Doses end the run once done
+	if(doseVolume > 0.0){
+		double end = SimGetTime() + duration;
+		while((dosesDone < doseBatches) && (SimGetTime() < end))
+			RunFirmware(0.01, ControlSlice);
+	}
+	else
+		RunFirmware(duration, ControlSlice);
+
+	SetSimControlHook(NULL);
+
+	// Writes the last sectors and closes the log
+	if(dataLogMode && dataLogEnabled){
+		LeaveControl();
+		fprintf(stderr, "log run%04u.bin %lu sectors, %lu samples dropped\n", logRun,
+		        (unsigned long)dataLog.written, (unsigned long)dataLog.dropped);
+	}
+
+	if((flashPath != NULL) && (SimSaveFlash(flashPath) == false))
+		fprintf(stderr, "can not write %s\n", flashPath);
+
+	if(trace != stdout)
+		fclose(trace);
+	if(streamFile != NULL)
+		fclose(streamFile);
+	if(serialFile != NULL)
+		fclose(serialFile);
+	if((streamFile != NULL) || (serialFile != NULL))
+		fprintf(stderr, "serial frames %lu, bad %lu\n", (unsigned long)serialDecoder.frames, (unsigned long)serialDecoder.bad);
+	if(telemetryFile != NULL){
+		fclose(telemetryFile);
+		fprintf(stderr, "telemetry dropped %lu samples\n", (unsigned long)telemetry.dropped);
+	}
+
+	if(printScreen)
+		SimPrintScreen(stderr);
+
+	if(plantEstimator.valid)
+		fprintf(stderr, "plant estimate %.4f RPM/PWM, time constant %.4fs\n",
+		        (double)plantEstimator.gain, (double)plantEstimator.timeConstant);
+
+	if(autotuneMode)
+		fprintf(stderr, "autotune Ku %.5f Tu %.4fs bias %.1f, [PID] Kp %.5f Ki %.6f Kd %.5f, %s\n",
+		        (double)autotune.ultimateGain, (double)autotune.ultimatePeriod, (double)autotune.bias,
+		        (double)Kp, (double)Ki, (double)Kd, autotuneResult);
+
+	double hostSeconds = (double)(clock() - hostStart) / CLOCKS_PER_SEC;
+	fprintf(stderr, "simulated %.1fs in %.3fs\n", SimGetTime(), hostSeconds);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SDFILESYSTEM_H
+#define SDFILESYSTEM_H
+
+#include "mbed.h"
+
+// Mounts the simulated card under "/<name>/", see SimSetSdRoot()
+class SDFileSystem {
+public:
+    SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name);
+    virtual ~SDFileSystem();
+
+    // 0 if the card answers, here if a card directory is set
+    int disk_initialize();
+    int disk_resume();
+    
+    int mount();
+    int unmount();
+};
+
+#endif
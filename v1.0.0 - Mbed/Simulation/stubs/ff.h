@@ -0,0 +1,48 @@
+#ifndef _FATFS
+#define _FATFS
+
+// Host stand-in for the parts of ChaN FatFs used by MotionManager
+// Paths are on drive "0:", the simulation maps them to the card directory
+// while the card is mounted, see SetSimSdRoot()
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef uint8_t BYTE;
+typedef uint32_t DWORD;
+typedef char TCHAR;
+
+typedef struct FIL
+{
+	FILE * file;
+	DWORD fsize;
+} FIL;
+
+typedef enum {
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_EXIST
+} FRESULT;
+
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode);
+FRESULT f_close(FIL* fp);
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw);
+FRESULT f_lseek(FIL* fp, DWORD ofs);
+FRESULT f_unlink(const TCHAR* path);
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new);
+
+#define f_size(fp) ((fp)->fsize)
+
+#define	FA_READ				0x01
+#define	FA_OPEN_EXISTING	0x00
+#define	FA_WRITE			0x02
+#define	FA_CREATE_NEW		0x04
+#define	FA_CREATE_ALWAYS	0x08
+#define	FA_OPEN_ALWAYS		0x10
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MBED_H
+#define MBED_H
+
+// Host stand-in for the parts of mbed 2 used by MotionManager
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "stm32f3xx_hal.h"
+
+typedef enum {
+    PA_3, PA_5, PA_6, PA_7, SERIAL_TX, SERIAL_RX
+} PinName;
+
+// Blocking wait, advances simulated time
+void wait(float s);
+void wait_ms(int ms);
+void wait_us(int us);
+
+// mbed maps "/sd/..." to the mounted SDFileSystem, the simulation maps it to
+// a host directory while the card object exists
+FILE * SimOpen(const char * path, const char * mode);
+#define fopen SimOpen
+int SimMkdir(const char * path, mode_t mode);
+#define mkdir SimMkdir
+
+// Serial port, the firmware moves its data by DMA, see SimSerialInput()
+class SerialBase {
+public:
+    enum IrqType { RxIrq = 0, TxIrq };
+};
+
+class RawSerial : public SerialBase {
+public:
+    RawSerial(PinName tx, PinName rx);
+    void baud(int baudrate);
+};
+
+#endif
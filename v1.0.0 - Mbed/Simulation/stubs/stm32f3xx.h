@@ -0,0 +1,6 @@
+#ifndef STM32F3XX_H
+#define STM32F3XX_H
+
+#include "stm32f3xx_hal.h"
+
+#endif
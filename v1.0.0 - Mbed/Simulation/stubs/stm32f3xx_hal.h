@@ -0,0 +1,548 @@
+#ifndef STM32F3XX_HAL_H
+#define STM32F3XX_HAL_H
+
+// Host stand-in for the STM32F3 HAL used by MotionManager
+// Registers are plain structs, SimHal.cpp moves time and raises the interrupts
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO                volatile
+#define __STATIC_INLINE     static inline
+
+typedef enum
+{
+  HAL_OK       = 0x00U,
+  HAL_ERROR    = 0x01U,
+  HAL_BUSY     = 0x02U,
+  HAL_TIMEOUT  = 0x03U
+} HAL_StatusTypeDef;
+
+#define HAL_MAX_DELAY       0xFFFFFFFFU
+
+/* Core ***********************************************************************/
+
+typedef struct
+{
+  __IO uint32_t CTRL;
+  __IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+  __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type SimDWT;
+extern CoreDebug_Type SimCoreDebug;
+extern uint32_t SimPrimask;
+extern uint32_t SystemCoreClock;
+
+#define DWT                           (&SimDWT)
+#define CoreDebug                     (&SimCoreDebug)
+#define DWT_CTRL_CYCCNTENA_Msk        (1U << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk    (1U << 24)
+
+__STATIC_INLINE uint32_t __get_PRIMASK(void) { return SimPrimask; }
+__STATIC_INLINE void __set_PRIMASK(uint32_t primask) { SimPrimask = primask; }
+__STATIC_INLINE void __disable_irq(void) { SimPrimask = 1; }
+__STATIC_INLINE void __enable_irq(void) { SimPrimask = 0; }
+__STATIC_INLINE void __NOP(void) { }
+__STATIC_INLINE void __DMB(void) { __sync_synchronize(); }
+__STATIC_INLINE uint32_t __CLZ(uint32_t value) { return (value == 0) ? 32 : (uint32_t)__builtin_clz(value); }
+
+typedef enum
+{
+  SysTick_IRQn            = -1,
+  EXTI1_IRQn              = 7,
+  EXTI4_IRQn              = 10,
+  DMA1_Channel3_IRQn      = 13,
+  DMA1_Channel7_IRQn      = 17,
+  EXTI9_5_IRQn            = 23,
+  TIM1_BRK_TIM15_IRQn     = 24,
+  TIM1_TRG_COM_TIM17_IRQn = 26,
+  TIM3_IRQn               = 29,
+  EXTI15_10_IRQn          = 40,
+  TIM7_DAC2_IRQn          = 55
+} IRQn_Type;
+
+__STATIC_INLINE void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) { (void)IRQn; (void)PreemptPriority; (void)SubPriority; }
+__STATIC_INLINE void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) { (void)IRQn; }
+__STATIC_INLINE void HAL_NVIC_DisableIRQ(IRQn_Type IRQn) { (void)IRQn; }
+
+/* RCC ************************************************************************/
+
+#define __HAL_RCC_GPIOA_CLK_ENABLE()  do { } while(0)
+#define __HAL_RCC_GPIOB_CLK_ENABLE()  do { } while(0)
+#define __HAL_RCC_GPIOF_CLK_ENABLE()  do { } while(0)
+#define __HAL_RCC_DMA1_CLK_ENABLE()   do { } while(0)
+
+/* GPIO ***********************************************************************/
+
+typedef struct
+{
+  __IO uint32_t IDR;
+  __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef SimGPIOA, SimGPIOB, SimGPIOF;
+
+#define GPIOA   (&SimGPIOA)
+#define GPIOB   (&SimGPIOB)
+#define GPIOF   (&SimGPIOF)
+
+typedef struct
+{
+  uint32_t Pin;
+  uint32_t Mode;
+  uint32_t Pull;
+  uint32_t Speed;
+  uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+typedef enum
+{
+  GPIO_PIN_RESET = 0U,
+  GPIO_PIN_SET
+} GPIO_PinState;
+
+#define GPIO_PIN_0                 ((uint16_t)0x0001U)
+#define GPIO_PIN_1                 ((uint16_t)0x0002U)
+#define GPIO_PIN_2                 ((uint16_t)0x0004U)
+#define GPIO_PIN_3                 ((uint16_t)0x0008U)
+#define GPIO_PIN_4                 ((uint16_t)0x0010U)
+#define GPIO_PIN_5                 ((uint16_t)0x0020U)
+#define GPIO_PIN_6                 ((uint16_t)0x0040U)
+#define GPIO_PIN_7                 ((uint16_t)0x0080U)
+#define GPIO_PIN_8                 ((uint16_t)0x0100U)
+#define GPIO_PIN_9                 ((uint16_t)0x0200U)
+#define GPIO_PIN_10                ((uint16_t)0x0400U)
+#define GPIO_PIN_11                ((uint16_t)0x0800U)
+#define GPIO_PIN_12                ((uint16_t)0x1000U)
+#define GPIO_PIN_13                ((uint16_t)0x2000U)
+#define GPIO_PIN_14                ((uint16_t)0x4000U)
+#define GPIO_PIN_15                ((uint16_t)0x8000U)
+
+#define GPIO_MODE_INPUT            0x00000000U
+#define GPIO_MODE_OUTPUT_PP        0x00000001U
+#define GPIO_MODE_AF_PP            0x00000002U
+#define GPIO_MODE_IT_RISING        0x10110000U
+#define GPIO_MODE_IT_FALLING       0x10210000U
+#define GPIO_MODE_IT_RISING_FALLING 0x10310000U
+
+#define GPIO_NOPULL                0x00000000U
+#define GPIO_PULLUP                0x00000001U
+#define GPIO_PULLDOWN              0x00000002U
+
+#define GPIO_SPEED_FREQ_LOW        0x00000000U
+#define GPIO_SPEED_FREQ_HIGH       0x00000003U
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+void HAL_GPIO_EXTI_IRQHandler(uint16_t GPIO_Pin);
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin);
+
+/* DMA ************************************************************************/
+
+// Addresses are host pointers, uintptr_t where the HAL has uint32_t
+typedef struct
+{
+  __IO uint32_t CCR;
+  __IO uint32_t CNDTR;
+  uintptr_t CPAR;
+  uintptr_t CMAR;
+} DMA_Channel_TypeDef;
+
+extern DMA_Channel_TypeDef SimDMA1_Channel3;
+extern DMA_Channel_TypeDef SimDMA1_Channel6;
+extern DMA_Channel_TypeDef SimDMA1_Channel7;
+
+#define DMA1_Channel3   (&SimDMA1_Channel3)
+#define DMA1_Channel6   (&SimDMA1_Channel6)
+#define DMA1_Channel7   (&SimDMA1_Channel7)
+
+#define DMA_CCR_EN      0x00000001U
+
+typedef struct
+{
+  uint32_t Direction;
+  uint32_t PeriphInc;
+  uint32_t MemInc;
+  uint32_t PeriphDataAlignment;
+  uint32_t MemDataAlignment;
+  uint32_t Mode;
+  uint32_t Priority;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef
+{
+  DMA_Channel_TypeDef *Instance;
+  DMA_InitTypeDef Init;
+  void *Parent;
+  void (*XferCpltCallback)(struct __DMA_HandleTypeDef *hdma);
+} DMA_HandleTypeDef;
+
+#define DMA_PERIPH_TO_MEMORY       0x00000000U
+#define DMA_MEMORY_TO_PERIPH       0x00000010U
+#define DMA_PINC_ENABLE            0x00000040U
+#define DMA_PINC_DISABLE           0x00000000U
+#define DMA_MINC_ENABLE            0x00000080U
+#define DMA_MINC_DISABLE           0x00000000U
+#define DMA_PDATAALIGN_BYTE        0x00000000U
+#define DMA_PDATAALIGN_HALFWORD    0x00000100U
+#define DMA_MDATAALIGN_BYTE        0x00000000U
+#define DMA_MDATAALIGN_HALFWORD    0x00000400U
+#define DMA_NORMAL                 0x00000000U
+#define DMA_CIRCULAR               0x00000020U
+#define DMA_PRIORITY_LOW           0x00000000U
+#define DMA_PRIORITY_MEDIUM        0x00001000U
+#define DMA_PRIORITY_HIGH          0x00002000U
+
+#define __HAL_LINKDMA(__HANDLE__, __PPP_DMA_FIELD__, __DMA_HANDLE__) \
+  do{ (__HANDLE__)->__PPP_DMA_FIELD__ = &(__DMA_HANDLE__); (__DMA_HANDLE__).Parent = (__HANDLE__); } while(0)
+
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) ((__HANDLE__)->Instance->CNDTR)
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+HAL_StatusTypeDef HAL_DMA_Start(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uint32_t DataLength);
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uint32_t DataLength);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+
+/* USART **********************************************************************/
+
+// Set up by mbed's RawSerial, only the DMA requests are the firmware's
+typedef struct
+{
+  __IO uint32_t CR3;
+  __IO uint32_t RDR;
+  __IO uint32_t TDR;
+} USART_TypeDef;
+
+extern USART_TypeDef SimUSART2;
+
+#define USART2          (&SimUSART2)
+
+#define USART_CR3_DMAR  0x00000040U
+#define USART_CR3_DMAT  0x00000080U
+
+/* SPI ************************************************************************/
+
+typedef struct
+{
+  __IO uint32_t CR1;
+} SPI_TypeDef;
+
+extern SPI_TypeDef SimSPI1;
+
+#define SPI1    (&SimSPI1)
+
+typedef struct
+{
+  uint32_t Mode;
+  uint32_t Direction;
+  uint32_t DataSize;
+  uint32_t CLKPolarity;
+  uint32_t CLKPhase;
+  uint32_t NSS;
+  uint32_t BaudRatePrescaler;
+  uint32_t FirstBit;
+  uint32_t TIMode;
+  uint32_t CRCCalculation;
+  uint32_t CRCPolynomial;
+  uint32_t CRCLength;
+  uint32_t NSSPMode;
+} SPI_InitTypeDef;
+
+typedef struct __SPI_HandleTypeDef
+{
+  SPI_TypeDef *Instance;
+  SPI_InitTypeDef Init;
+  DMA_HandleTypeDef *hdmatx;
+  DMA_HandleTypeDef *hdmarx;
+} SPI_HandleTypeDef;
+
+#define SPI_MODE_MASTER             0x00000104U
+#define SPI_DIRECTION_2LINES        0x00000000U
+#define SPI_DIRECTION_1LINE         0x00008000U
+#define SPI_DATASIZE_8BIT           0x00000700U
+#define SPI_POLARITY_LOW            0x00000000U
+#define SPI_PHASE_1EDGE             0x00000000U
+#define SPI_NSS_SOFT                0x00000200U
+#define SPI_BAUDRATEPRESCALER_2     0x00000000U
+#define SPI_BAUDRATEPRESCALER_4     0x00000008U
+#define SPI_BAUDRATEPRESCALER_8     0x00000010U
+#define SPI_BAUDRATEPRESCALER_16    0x00000018U
+#define SPI_BAUDRATEPRESCALER_32    0x00000020U
+#define SPI_BAUDRATEPRESCALER_64    0x00000028U
+#define SPI_BAUDRATEPRESCALER_128   0x00000030U
+#define SPI_BAUDRATEPRESCALER_256   0x00000038U
+#define SPI_FIRSTBIT_MSB            0x00000000U
+#define SPI_TIMODE_DISABLE          0x00000000U
+#define SPI_CRCCALCULATION_DISABLE  0x00000000U
+#define SPI_CRC_LENGTH_DATASIZE     0x00000000U
+#define SPI_NSS_PULSE_ENABLE        0x00000008U
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+
+/* TIM ************************************************************************/
+
+typedef struct
+{
+  __IO uint32_t CR1;
+  __IO uint32_t CR2;
+  __IO uint32_t SMCR;
+  __IO uint32_t DIER;
+  __IO uint32_t SR;
+  __IO uint32_t EGR;
+  __IO uint32_t CCMR1;
+  __IO uint32_t CCMR2;
+  __IO uint32_t CCER;
+  __IO uint32_t CNT;
+  __IO uint32_t PSC;
+  __IO uint32_t ARR;
+  __IO uint32_t RCR;
+  __IO uint32_t CCR1;
+  __IO uint32_t CCR2;
+  __IO uint32_t CCR3;
+  __IO uint32_t CCR4;
+} TIM_TypeDef;
+
+extern TIM_TypeDef SimTIM1, SimTIM3, SimTIM7, SimTIM15, SimTIM16, SimTIM17;
+
+#define TIM1    (&SimTIM1)
+#define TIM3    (&SimTIM3)
+#define TIM7    (&SimTIM7)
+#define TIM15   (&SimTIM15)
+#define TIM16   (&SimTIM16)
+#define TIM17   (&SimTIM17)
+
+#define TIM_CR1_CEN                 (1U << 0)
+#define TIM_CR1_OPM                 (1U << 3)
+#define TIM_DIER_UIE                (1U << 0)
+#define TIM_DIER_CC2IE              (1U << 2)
+#define TIM_SR_UIF                  (1U << 0)
+#define TIM_SR_CC1IF                (1U << 1)
+#define TIM_SR_CC2IF                (1U << 2)
+#define TIM_CCER_CC1E               (1U << 0)
+#define TIM_CCER_CC2E               (1U << 4)
+#define TIM_CCER_CCxE_MASK          0x00001111U
+#define TIM_CR2_MMS                 (7U << 4)
+#define TIM_SMCR_SMS                (7U << 0)
+#define TIM_SMCR_TS                 (7U << 4)
+#define TIM_CCMR1_CC1S              (3U << 0)
+
+typedef struct
+{
+  uint32_t Prescaler;
+  uint32_t CounterMode;
+  uint32_t Period;
+  uint32_t ClockDivision;
+  uint32_t RepetitionCounter;
+  uint32_t AutoReloadPreload;
+} TIM_Base_InitTypeDef;
+
+typedef struct
+{
+  TIM_TypeDef *Instance;
+  TIM_Base_InitTypeDef Init;
+} TIM_HandleTypeDef;
+
+typedef struct
+{
+  uint32_t ClockSource;
+  uint32_t ClockPolarity;
+  uint32_t ClockPrescaler;
+  uint32_t ClockFilter;
+} TIM_ClockConfigTypeDef;
+
+typedef struct
+{
+  uint32_t MasterOutputTrigger;
+  uint32_t MasterOutputTrigger2;
+  uint32_t MasterSlaveMode;
+} TIM_MasterConfigTypeDef;
+
+typedef struct
+{
+  uint32_t EncoderMode;
+  uint32_t IC1Polarity;
+  uint32_t IC1Selection;
+  uint32_t IC1Prescaler;
+  uint32_t IC1Filter;
+  uint32_t IC2Polarity;
+  uint32_t IC2Selection;
+  uint32_t IC2Prescaler;
+  uint32_t IC2Filter;
+} TIM_Encoder_InitTypeDef;
+
+typedef struct
+{
+  uint32_t ICPolarity;
+  uint32_t ICSelection;
+  uint32_t ICPrescaler;
+  uint32_t ICFilter;
+} TIM_IC_InitTypeDef;
+
+typedef struct
+{
+  uint32_t SlaveMode;
+  uint32_t InputTrigger;
+  uint32_t TriggerPolarity;
+  uint32_t TriggerPrescaler;
+  uint32_t TriggerFilter;
+} TIM_SlaveConfigTypeDef;
+
+typedef struct
+{
+  uint32_t OCMode;
+  uint32_t Pulse;
+  uint32_t OCPolarity;
+  uint32_t OCNPolarity;
+  uint32_t OCFastMode;
+  uint32_t OCIdleState;
+  uint32_t OCNIdleState;
+} TIM_OC_InitTypeDef;
+
+typedef struct
+{
+  uint32_t OffStateRunMode;
+  uint32_t OffStateIDLEMode;
+  uint32_t LockLevel;
+  uint32_t DeadTime;
+  uint32_t BreakState;
+  uint32_t BreakPolarity;
+  uint32_t BreakFilter;
+  uint32_t AutomaticOutput;
+} TIM_BreakDeadTimeConfigTypeDef;
+
+#define TIM_COUNTERMODE_UP              0x00000000U
+#define TIM_CLOCKDIVISION_DIV1          0x00000000U
+#define TIM_AUTORELOAD_PRELOAD_DISABLE  0x00000000U
+#define TIM_CLOCKSOURCE_INTERNAL        0x00001000U
+#define TIM_TRGO_RESET                  0x00000000U
+#define TIM_TRGO_OC1                    0x00000030U
+#define TIM_TRGO2_RESET                 0x00000000U
+#define TIM_MASTERSLAVEMODE_DISABLE     0x00000000U
+#define TIM_ENCODERMODE_TI12            0x00000003U
+#define TIM_ICPOLARITY_RISING           0x00000000U
+#define TIM_ICSELECTION_DIRECTTI        0x00000001U
+#define TIM_ICSELECTION_TRC             0x00000003U
+#define TIM_SLAVEMODE_DISABLE           0x00000000U
+#define TIM_TS_ITR0                     0x00000000U
+#define TIM_ICPSC_DIV1                  0x00000000U
+#define TIM_OCMODE_TIMING               0x00000000U
+#define TIM_OCMODE_PWM1                 0x00000060U
+#define TIM_OCPOLARITY_HIGH             0x00000000U
+#define TIM_OCNPOLARITY_HIGH            0x00000000U
+#define TIM_OCFAST_DISABLE              0x00000000U
+#define TIM_OCIDLESTATE_RESET           0x00000000U
+#define TIM_OCNIDLESTATE_RESET          0x00000000U
+#define TIM_OSSR_DISABLE                0x00000000U
+#define TIM_OSSI_DISABLE                0x00000000U
+#define TIM_LOCKLEVEL_OFF               0x00000000U
+#define TIM_BREAK_DISABLE               0x00000000U
+#define TIM_BREAKPOLARITY_HIGH          0x00002000U
+#define TIM_AUTOMATICOUTPUT_DISABLE     0x00000000U
+
+#define TIM_CHANNEL_1                   0x00000000U
+#define TIM_CHANNEL_2                   0x00000004U
+#define TIM_CHANNEL_3                   0x00000008U
+#define TIM_CHANNEL_4                   0x0000000CU
+#define TIM_CHANNEL_ALL                 0x0000003CU
+
+#define TIM_IT_UPDATE                   TIM_DIER_UIE
+#define TIM_IT_CC2                      TIM_DIER_CC2IE
+#define TIM_FLAG_UPDATE                 TIM_SR_UIF
+#define TIM_FLAG_CC1                    TIM_SR_CC1IF
+
+// Enabling a counter goes through the simulation, one-pulse timers elapse there
+void SimTimerEnable(TIM_HandleTypeDef *htim);
+
+#define __HAL_TIM_ENABLE(__HANDLE__)                  SimTimerEnable(__HANDLE__)
+#define __HAL_TIM_DISABLE(__HANDLE__)                 ((__HANDLE__)->Instance->CR1 &= ~(TIM_CR1_CEN))
+#define __HAL_TIM_ENABLE_IT(__HANDLE__, __IT__)       ((__HANDLE__)->Instance->DIER |= (__IT__))
+#define __HAL_TIM_DISABLE_IT(__HANDLE__, __IT__)      ((__HANDLE__)->Instance->DIER &= ~(__IT__))
+// SR bits are rc_w0 on the chip, plain memory here
+#define __HAL_TIM_GET_FLAG(__HANDLE__, __FLAG__)      (((__HANDLE__)->Instance->SR & (__FLAG__)) == (__FLAG__))
+#define __HAL_TIM_CLEAR_FLAG(__HANDLE__, __FLAG__)    ((__HANDLE__)->Instance->SR &= ~(__FLAG__))
+#define __HAL_TIM_SET_COUNTER(__HANDLE__, __COUNTER__) ((__HANDLE__)->Instance->CNT = (__COUNTER__))
+#define __HAL_TIM_GET_COUNTER(__HANDLE__)             ((__HANDLE__)->Instance->CNT)
+#define __HAL_TIM_SET_AUTORELOAD(__HANDLE__, __AUTORELOAD__) \
+  do{ (__HANDLE__)->Instance->ARR = (__AUTORELOAD__); (__HANDLE__)->Init.Period = (__AUTORELOAD__); } while(0)
+#define __HAL_TIM_SET_COMPARE(__HANDLE__, __CHANNEL__, __COMPARE__) \
+  (*(&((__HANDLE__)->Instance->CCR1) + ((__CHANNEL__) >> 2U)) = (__COMPARE__))
+#define __HAL_TIM_GET_COMPARE(__HANDLE__, __CHANNEL__) \
+  (*(&((__HANDLE__)->Instance->CCR1) + ((__CHANNEL__) >> 2U)))
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_ConfigClockSource(TIM_HandleTypeDef *htim, TIM_ClockConfigTypeDef *sClockSourceConfig);
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef *htim, TIM_MasterConfigTypeDef *sMasterConfig);
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef *htim, TIM_BreakDeadTimeConfigTypeDef *sBreakDeadTimeConfig);
+HAL_StatusTypeDef HAL_TIM_Encoder_Init(TIM_HandleTypeDef *htim, TIM_Encoder_InitTypeDef *sConfig);
+HAL_StatusTypeDef HAL_TIM_Encoder_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_Encoder_Stop(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_IC_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_IC_ConfigChannel(TIM_HandleTypeDef *htim, TIM_IC_InitTypeDef *sConfig, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_IC_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_IC_Stop(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_SlaveConfigSynchronization(TIM_HandleTypeDef *htim, TIM_SlaveConfigTypeDef *sSlaveConfig);
+HAL_StatusTypeDef HAL_TIM_OC_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_OC_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_OC_Start_IT(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_OC_Stop_IT(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef *htim, uint32_t Channel);
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim);
+void HAL_TIM_OC_DelayElapsedCallback(TIM_HandleTypeDef *htim);
+
+/* Flash **********************************************************************/
+
+// 64kB of host memory, erased at start, addresses are host pointers
+#define SIM_FLASH_SIZE                0x10000U
+
+extern uint8_t SimFlash[SIM_FLASH_SIZE];
+
+#define FLASH_BASE                    ((uintptr_t)SimFlash)
+#define FLASH_PAGE_SIZE               0x800U
+#define FLASH_TYPEPROGRAM_HALFWORD    0x01U
+#define FLASH_TYPEERASE_PAGES         0x00U
+
+typedef struct
+{
+  uint32_t TypeErase;
+  uintptr_t PageAddress;
+  uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uintptr_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+
+/* HAL ************************************************************************/
+
+HAL_StatusTypeDef HAL_Init(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+void HAL_IncTick(void);
+void HAL_SYSTICK_IRQHandler(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif